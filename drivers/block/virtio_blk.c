@@ -11,15 +11,38 @@
 
 #define PART_BITS 4
 
+static bool use_bio;
+module_param(use_bio, bool, S_IRUGO);
+MODULE_PARM_DESC(use_bio, "Submit bios directly, bypassing the I/O scheduler");
+
 static int major, index;
 struct workqueue_struct *virtblk_wq;
 
+struct virtio_blk_vq
+{
+	struct virtqueue *vq;
+
+	/* Serializes adding buffers against reaping them: the request
+	 * queue lock is not held on completion. */
+	spinlock_t lock;
+
+	char name[20];
+
+	/* Bio path: one preallocated request per ring slot, and tasks
+	 * waiting for a request or for room in the ring. */
+	struct list_head free_reqs;
+	wait_queue_head_t wait;
+} ____cacheline_aligned_in_smp;
+
 struct virtio_blk
 {
 	spinlock_t lock;
 
 	struct virtio_device *vdev;
-	struct virtqueue *vq;
+
+	/* Request virtqueues: each CPU submits on vqs[cpu % num_vqs]. */
+	struct virtio_blk_vq *vqs;
+	unsigned int num_vqs;
 
 	/* The disk structure for the kernel. */
 	struct gendisk *disk;
@@ -35,66 +58,167 @@ struct virtio_blk
 	/* What host tells us, plus 2 for header & tailer. */
 	unsigned int sg_elems;
 
+	/* Command that REQ_DISCARD requests map to, if the host has one. */
+	u32 discard_type;
+
 	/* Scatterlist: can be too big for stack. */
 	struct scatterlist sg[/*sg_elems*/];
 };
 
+/* Bio path: what is left to do for a bio, see virtblk_bio_done(). */
+#define VBLK_REQ_DATA	(1 << 0)	/* send the data */
+#define VBLK_REQ_FUA	(1 << 1)	/* flush the cache once written */
+
 struct virtblk_req
 {
 	struct list_head list;
 	struct request *req;
 	struct virtio_blk_outhdr out_hdr;
 	struct virtio_scsi_inhdr in_hdr;
+	struct virtio_blk_discard_write_zeroes range;
 	u8 status;
+
+	/* Bio path only: the mempool requests of the request path have
+	 * bio == NULL and no scatterlist. */
+	struct bio *bio;
+	struct virtio_blk_vq *bvq;
+	unsigned int flags;
+	struct work_struct work;
+	struct scatterlist sg[];
 };
 
-static void blk_done(struct virtqueue *vq)
+static void virtblk_put_req(struct virtio_blk_vq *bvq, struct virtblk_req *vbr)
 {
-	struct virtio_blk *vblk = vq->vdev->priv;
-	struct virtblk_req *vbr;
-	unsigned int len;
-	unsigned long flags;
+	vbr->bio = NULL;
+	list_add(&vbr->list, &bvq->free_reqs);
+}
 
-	spin_lock_irqsave(&vblk->lock, flags);
-	while ((vbr = virtqueue_get_buf(vblk->vq, &len)) != NULL) {
-		int error;
+/* Called with bvq->lock held. */
+static void virtblk_bio_done(struct virtio_blk *vblk, struct virtblk_req *vbr)
+{
+	struct bio *bio = vbr->bio;
+	int error = 0;
+
+	switch (vbr->status) {
+	case VIRTIO_BLK_S_OK:
+		break;
+	case VIRTIO_BLK_S_UNSUPP:
+		error = -ENOTTY;
+		break;
+	default:
+		error = -EIO;
+		break;
+	}
 
-		switch (vbr->status) {
-		case VIRTIO_BLK_S_OK:
-			error = 0;
-			break;
-		case VIRTIO_BLK_S_UNSUPP:
-			error = -ENOTTY;
-			break;
-		default:
-			error = -EIO;
-			break;
-		}
+	/* The next step of a flush sequence may have to wait for room in
+	 * the ring, so it is sent from process context. */
+	if (!error && (vbr->flags & (VBLK_REQ_DATA | VBLK_REQ_FUA))) {
+		queue_work(virtblk_wq, &vbr->work);
+		return;
+	}
 
-		switch (vbr->req->cmd_type) {
-		case REQ_TYPE_BLOCK_PC:
-			vbr->req->resid_len = vbr->in_hdr.residual;
-			vbr->req->sense_len = vbr->in_hdr.sense_len;
-			vbr->req->errors = vbr->in_hdr.errors;
-			break;
-		case REQ_TYPE_SPECIAL:
-			vbr->req->errors = (error != 0);
-			break;
-		default:
+	virtblk_put_req(vbr->bvq, vbr);
+	bio_endio(bio, error);
+}
+
+static struct virtio_blk_vq *virtblk_vq(struct virtio_blk *vblk,
+					struct virtqueue *vq)
+{
+	unsigned int i;
+
+	for (i = 0; i < vblk->num_vqs; i++)
+		if (vblk->vqs[i].vq == vq)
 			break;
-		}
+	BUG_ON(i == vblk->num_vqs);
 
-		__blk_end_request_all(vbr->req, error);
-		list_del(&vbr->list);
-		mempool_free(vbr, vblk->pool);
+	return &vblk->vqs[i];
+}
+
+/*
+ * Runs in softirq context on the CPU that submitted the request (the
+ * queue has QUEUE_FLAG_SAME_COMP set), whichever vq it went through.
+ */
+static void virtblk_softirq_done(struct request *req)
+{
+	struct request_queue *q = req->q;
+	struct virtio_blk *vblk = q->queuedata;
+	struct virtblk_req *vbr = req->completion_data;
+	unsigned long flags;
+	int error;
+
+	switch (vbr->status) {
+	case VIRTIO_BLK_S_OK:
+		error = 0;
+		break;
+	case VIRTIO_BLK_S_UNSUPP:
+		error = -ENOTTY;
+		break;
+	default:
+		error = -EIO;
+		break;
+	}
+
+	switch (req->cmd_type) {
+	case REQ_TYPE_BLOCK_PC:
+		req->resid_len = vbr->in_hdr.residual;
+		req->sense_len = vbr->in_hdr.sense_len;
+		req->errors = vbr->in_hdr.errors;
+		break;
+	case REQ_TYPE_SPECIAL:
+		req->errors = (error != 0);
+		break;
+	default:
+		break;
 	}
+
+	spin_lock_irqsave(&vblk->lock, flags);
+	__blk_end_request_all(req, error);
+	list_del(&vbr->list);
+	mempool_free(vbr, vblk->pool);
 	/* In case queue is stopped waiting for more buffers. */
-	blk_start_queue(vblk->disk->queue);
+	blk_start_queue(q);
 	spin_unlock_irqrestore(&vblk->lock, flags);
 }
 
+static void blk_done(struct virtqueue *vq)
+{
+	struct virtio_blk *vblk = vq->vdev->priv;
+	struct virtio_blk_vq *bvq = virtblk_vq(vblk, vq);
+	struct virtblk_req *vbr;
+	unsigned int len;
+	unsigned long flags;
+
+	/* Only reap the ring here: the request queue lock is taken on the
+	 * submitting CPU, by virtblk_softirq_done(). */
+	spin_lock_irqsave(&bvq->lock, flags);
+	while ((vbr = virtqueue_get_buf(vq, &len)) != NULL) {
+		if (vbr->bio)
+			virtblk_bio_done(vblk, vbr);
+		else
+			blk_complete_request(vbr->req);
+	}
+	/* Bio submitters may be waiting for room in the ring. */
+	if (use_bio)
+		wake_up(&bvq->wait);
+	spin_unlock_irqrestore(&bvq->lock, flags);
+}
+
+static void virtblk_setup_discard(struct virtio_blk *vblk,
+				  struct virtblk_req *vbr,
+				  sector_t sector, unsigned int nr_sectors)
+{
+	vbr->out_hdr.type = vblk->discard_type;
+	vbr->out_hdr.sector = 0;
+
+	vbr->range.sector = sector;
+	vbr->range.num_sectors = nr_sectors;
+	vbr->range.flags = 0;
+	if (vblk->discard_type == VIRTIO_BLK_T_WRITE_ZEROES)
+		vbr->range.flags = VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP;
+}
+
 static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
-		   struct request *req)
+		   struct virtio_blk_vq *bvq, struct request *req)
 {
 	unsigned long num, out = 0, in = 0;
 	struct virtblk_req *vbr;
@@ -105,6 +229,8 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 		return false;
 
 	vbr->req = req;
+	vbr->bio = NULL;
+	req->completion_data = vbr;
 
 	if (req->cmd_flags & REQ_FLUSH) {
 		vbr->out_hdr.type = VIRTIO_BLK_T_FLUSH;
@@ -113,6 +239,12 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 	} else {
 		switch (req->cmd_type) {
 		case REQ_TYPE_FS:
+			if (req->cmd_flags & REQ_DISCARD) {
+				virtblk_setup_discard(vblk, vbr, blk_rq_pos(req),
+						      blk_rq_sectors(req));
+				vbr->out_hdr.ioprio = req_get_ioprio(vbr->req);
+				break;
+			}
 			vbr->out_hdr.type = 0;
 			vbr->out_hdr.sector = blk_rq_pos(vbr->req);
 			vbr->out_hdr.ioprio = req_get_ioprio(vbr->req);
@@ -144,7 +276,12 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 	if (vbr->req->cmd_type == REQ_TYPE_BLOCK_PC)
 		sg_set_buf(&vblk->sg[out++], vbr->req->cmd, vbr->req->cmd_len);
 
-	num = blk_rq_map_sg(q, vbr->req, vblk->sg + out);
+	/* Discards carry a range descriptor instead of data. */
+	if (req->cmd_flags & REQ_DISCARD) {
+		sg_set_buf(&vblk->sg[out++], &vbr->range, sizeof(vbr->range));
+		num = 0;
+	} else
+		num = blk_rq_map_sg(q, vbr->req, vblk->sg + out);
 
 	if (vbr->req->cmd_type == REQ_TYPE_BLOCK_PC) {
 		sg_set_buf(&vblk->sg[num + out + in++], vbr->req->sense, SCSI_SENSE_BUFFERSIZE);
@@ -165,7 +302,7 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 		}
 	}
 
-	if (virtqueue_add_buf(vblk->vq, vblk->sg, out, in, vbr) < 0) {
+	if (virtqueue_add_buf(bvq->vq, vblk->sg, out, in, vbr) < 0) {
 		mempool_free(vbr, vblk->pool);
 		return false;
 	}
@@ -177,15 +314,20 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 static void do_virtblk_request(struct request_queue *q)
 {
 	struct virtio_blk *vblk = q->queuedata;
+	struct virtio_blk_vq *bvq;
 	struct request *req;
 	unsigned int issued = 0;
 
+	/* We are called with the queue lock held and interrupts disabled. */
+	bvq = &vblk->vqs[smp_processor_id() % vblk->num_vqs];
+
+	spin_lock(&bvq->lock);
 	while ((req = blk_peek_request(q)) != NULL) {
 		BUG_ON(req->nr_phys_segments + 2 > vblk->sg_elems);
 
 		/* If this request fails, stop queue and wait for something to
 		   finish to restart it. */
-		if (!do_req(q, vblk, req)) {
+		if (!do_req(q, vblk, bvq, req)) {
 			blk_stop_queue(q);
 			break;
 		}
@@ -194,7 +336,276 @@ static void do_virtblk_request(struct request_queue *q)
 	}
 
 	if (issued)
-		virtqueue_kick(vblk->vq);
+		virtqueue_kick(bvq->vq);
+	spin_unlock(&bvq->lock);
+}
+
+/* Get a free preallocated request on @bvq, sleeping until one is. */
+static struct virtblk_req *virtblk_get_req(struct virtio_blk_vq *bvq)
+{
+	struct virtblk_req *vbr;
+	DEFINE_WAIT(wait);
+
+	spin_lock_irq(&bvq->lock);
+	while (list_empty(&bvq->free_reqs)) {
+		prepare_to_wait(&bvq->wait, &wait, TASK_UNINTERRUPTIBLE);
+		spin_unlock_irq(&bvq->lock);
+		io_schedule();
+		spin_lock_irq(&bvq->lock);
+		finish_wait(&bvq->wait, &wait);
+	}
+	vbr = list_first_entry(&bvq->free_reqs, struct virtblk_req, list);
+	list_del(&vbr->list);
+	spin_unlock_irq(&bvq->lock);
+
+	return vbr;
+}
+
+static void virtblk_add_req(struct virtblk_req *vbr,
+			    unsigned int out, unsigned int in)
+{
+	struct virtio_blk_vq *bvq = vbr->bvq;
+	DEFINE_WAIT(wait);
+
+	spin_lock_irq(&bvq->lock);
+	while (virtqueue_add_buf(bvq->vq, vbr->sg, out, in, vbr) < 0) {
+		prepare_to_wait(&bvq->wait, &wait, TASK_UNINTERRUPTIBLE);
+		spin_unlock_irq(&bvq->lock);
+		io_schedule();
+		spin_lock_irq(&bvq->lock);
+		finish_wait(&bvq->wait, &wait);
+	}
+	virtqueue_kick(bvq->vq);
+	spin_unlock_irq(&bvq->lock);
+}
+
+static void virtblk_bio_send_flush(struct virtblk_req *vbr)
+{
+	vbr->out_hdr.type = VIRTIO_BLK_T_FLUSH;
+	vbr->out_hdr.sector = 0;
+	vbr->out_hdr.ioprio = bio_prio(vbr->bio);
+
+	sg_set_buf(&vbr->sg[0], &vbr->out_hdr, sizeof(vbr->out_hdr));
+	sg_set_buf(&vbr->sg[1], &vbr->status, sizeof(vbr->status));
+
+	virtblk_add_req(vbr, 1, 1);
+}
+
+static void virtblk_bio_send_data(struct request_queue *q,
+				  struct virtblk_req *vbr)
+{
+	struct bio *bio = vbr->bio;
+	struct bio_vec *bvec, *bvprv = NULL;
+	unsigned int num = 0;
+	int i;
+
+	vbr->flags &= ~VBLK_REQ_DATA;
+	vbr->out_hdr.type = 0;
+	vbr->out_hdr.sector = bio->bi_sector;
+	vbr->out_hdr.ioprio = bio_prio(bio);
+
+	sg_set_buf(&vbr->sg[0], &vbr->out_hdr, sizeof(vbr->out_hdr));
+
+	/* Merge segments the way blk_rq_map_sg() would, so that we never
+	 * need more than the bio_phys_segments() checked on entry. */
+	bio_for_each_segment(bvec, bio, i) {
+		if (bvprv &&
+		    vbr->sg[num].length + bvec->bv_len <= queue_max_segment_size(q) &&
+		    BIOVEC_PHYS_MERGEABLE(bvprv, bvec) &&
+		    BIOVEC_SEG_BOUNDARY(q, bvprv, bvec))
+			vbr->sg[num].length += bvec->bv_len;
+		else
+			sg_set_page(&vbr->sg[++num], bvec->bv_page,
+				    bvec->bv_len, bvec->bv_offset);
+		bvprv = bvec;
+	}
+
+	sg_set_buf(&vbr->sg[num + 1], &vbr->status, sizeof(vbr->status));
+
+	if (bio_data_dir(bio) == WRITE) {
+		vbr->out_hdr.type |= VIRTIO_BLK_T_OUT;
+		virtblk_add_req(vbr, 1 + num, 1);
+	} else {
+		vbr->out_hdr.type |= VIRTIO_BLK_T_IN;
+		virtblk_add_req(vbr, 1, num + 1);
+	}
+}
+
+static void virtblk_bio_send_discard(struct virtio_blk *vblk,
+				     struct virtblk_req *vbr)
+{
+	struct bio *bio = vbr->bio;
+
+	virtblk_setup_discard(vblk, vbr, bio->bi_sector, bio_sectors(bio));
+	vbr->out_hdr.ioprio = bio_prio(bio);
+
+	sg_set_buf(&vbr->sg[0], &vbr->out_hdr, sizeof(vbr->out_hdr));
+	sg_set_buf(&vbr->sg[1], &vbr->range, sizeof(vbr->range));
+	sg_set_buf(&vbr->sg[2], &vbr->status, sizeof(vbr->status));
+
+	virtblk_add_req(vbr, 2, 1);
+}
+
+static void virtblk_bio_work(struct work_struct *work)
+{
+	struct virtblk_req *vbr = container_of(work, struct virtblk_req, work);
+	struct virtio_blk *vblk = vbr->bio->bi_bdev->bd_disk->private_data;
+
+	if (vbr->flags & VBLK_REQ_DATA) {
+		virtblk_bio_send_data(vblk->disk->queue, vbr);
+	} else {
+		vbr->flags &= ~VBLK_REQ_FUA;
+		virtblk_bio_send_flush(vbr);
+	}
+}
+
+/*
+ * Bio path: map each bio straight onto a virtqueue chain, skipping the
+ * elevator. Cache flushes are sequenced by hand: a pre-flush is sent
+ * before the data and a FUA write is followed by a flush.
+ */
+static int virtblk_make_request(struct request_queue *q, struct bio *bio)
+{
+	struct virtio_blk *vblk = q->queuedata;
+	struct virtblk_req *vbr;
+	bool flush = virtio_has_feature(vblk->vdev, VIRTIO_BLK_F_FLUSH);
+
+	/* generic_make_request() only lets discards through if we set
+	 * QUEUE_FLAG_DISCARD. */
+	if (bio->bi_rw & REQ_DISCARD) {
+		vbr = virtblk_get_req(&vblk->vqs[raw_smp_processor_id() %
+						 vblk->num_vqs]);
+		vbr->bio = bio;
+		vbr->flags = 0;
+		virtblk_bio_send_discard(vblk, vbr);
+		return 0;
+	}
+
+	if (!bio->bi_size && !(flush && (bio->bi_rw & REQ_FLUSH))) {
+		bio_endio(bio, 0);
+		return 0;
+	}
+
+	BUG_ON(bio_phys_segments(q, bio) + 2 > vblk->sg_elems);
+
+	vbr = virtblk_get_req(&vblk->vqs[raw_smp_processor_id() %
+					 vblk->num_vqs]);
+	vbr->bio = bio;
+	vbr->flags = 0;
+	if (bio->bi_size)
+		vbr->flags |= VBLK_REQ_DATA;
+	if (flush && bio->bi_size && (bio->bi_rw & REQ_FUA))
+		vbr->flags |= VBLK_REQ_FUA;
+
+	if (flush && (bio->bi_rw & REQ_FLUSH))
+		virtblk_bio_send_flush(vbr);
+	else
+		virtblk_bio_send_data(q, vbr);
+
+	return 0;
+}
+
+static void virtblk_free_reqs(struct virtio_blk *vblk)
+{
+	struct virtblk_req *vbr, *tmp;
+	unsigned int i;
+
+	for (i = 0; i < vblk->num_vqs; i++)
+		list_for_each_entry_safe(vbr, tmp, &vblk->vqs[i].free_reqs, list)
+			kfree(vbr);
+}
+
+/* Bio path: preallocate a request, with its scatterlist, per ring slot. */
+static int virtblk_alloc_reqs(struct virtio_blk *vblk)
+{
+	struct virtio_blk_vq *bvq;
+	struct virtblk_req *vbr;
+	unsigned int i, j;
+
+	for (i = 0; i < vblk->num_vqs; i++) {
+		bvq = &vblk->vqs[i];
+
+		for (j = 0; j < virtqueue_get_vring_size(bvq->vq); j++) {
+			vbr = kzalloc(sizeof(*vbr) +
+				      sizeof(vbr->sg[0]) * vblk->sg_elems,
+				      GFP_KERNEL);
+			if (!vbr) {
+				virtblk_free_reqs(vblk);
+				return -ENOMEM;
+			}
+
+			vbr->bvq = bvq;
+			INIT_WORK(&vbr->work, virtblk_bio_work);
+			sg_init_table(vbr->sg, vblk->sg_elems);
+			list_add(&vbr->list, &bvq->free_reqs);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Complete requests on the CPUs that submit to each queue: with
+ * QUEUE_FLAG_SAME_COMP the completion then needs no IPI at all.
+ */
+static void virtblk_set_affinity(struct virtio_blk *vblk)
+{
+	cpumask_var_t mask;
+	unsigned int i, cpu;
+
+	if (vblk->num_vqs == 1 || !alloc_cpumask_var(&mask, GFP_KERNEL))
+		return;
+
+	for (i = 0; i < vblk->num_vqs; i++) {
+		cpumask_clear(mask);
+		for_each_possible_cpu(cpu)
+			if (cpu % vblk->num_vqs == i)
+				cpumask_set_cpu(cpu, mask);
+		virtqueue_set_affinity(vblk->vqs[i].vq, mask);
+	}
+
+	free_cpumask_var(mask);
+}
+
+static int virtblk_init_vqs(struct virtio_blk *vblk)
+{
+	struct virtio_device *vdev = vblk->vdev;
+	struct virtqueue **vqs;
+	vq_callback_t **callbacks;
+	const char **names;
+	unsigned int i;
+	int err = -ENOMEM;
+
+	vqs = kmalloc(vblk->num_vqs * sizeof(*vqs), GFP_KERNEL);
+	callbacks = kmalloc(vblk->num_vqs * sizeof(*callbacks), GFP_KERNEL);
+	names = kmalloc(vblk->num_vqs * sizeof(*names), GFP_KERNEL);
+	if (!vqs || !callbacks || !names)
+		goto out;
+
+	for (i = 0; i < vblk->num_vqs; i++) {
+		spin_lock_init(&vblk->vqs[i].lock);
+		INIT_LIST_HEAD(&vblk->vqs[i].free_reqs);
+		init_waitqueue_head(&vblk->vqs[i].wait);
+		snprintf(vblk->vqs[i].name, sizeof(vblk->vqs[i].name),
+			 "requests.%u", i);
+		callbacks[i] = blk_done;
+		names[i] = vblk->vqs[i].name;
+	}
+
+	err = vdev->config->find_vqs(vdev, vblk->num_vqs, vqs, callbacks, names);
+	if (err)
+		goto out;
+
+	for (i = 0; i < vblk->num_vqs; i++)
+		vblk->vqs[i].vq = vqs[i];
+
+	virtblk_set_affinity(vblk);
+
+out:
+	kfree(names);
+	kfree(callbacks);
+	kfree(vqs);
+	return err;
 }
 
 /* return id (s/n) string for *disk to *id_str
@@ -344,8 +755,8 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 	int err;
 	u64 cap;
 	u32 v, blk_size, sg_elems, opt_io_size;
-	u16 min_io_size;
-	u8 physical_block_exp, alignment_offset;
+	u16 min_io_size, num_vqs;
+	u8 physical_block_exp, alignment_offset, may_unmap;
 
 	if (index_to_minor(index) >= 1 << MINORBITS)
 		return -ENOSPC;
@@ -372,20 +783,38 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 	spin_lock_init(&vblk->lock);
 	vblk->vdev = vdev;
 	vblk->sg_elems = sg_elems;
+	vblk->discard_type = 0;
 	sg_init_table(vblk->sg, vblk->sg_elems);
 	INIT_WORK(&vblk->config_work, virtblk_config_changed_work);
 
-	/* We expect one virtqueue, for output. */
-	vblk->vq = virtio_find_single_vq(vdev, blk_done, "requests");
-	if (IS_ERR(vblk->vq)) {
-		err = PTR_ERR(vblk->vq);
+	/* One request virtqueue per CPU, as far as the host allows. */
+	err = virtio_config_val(vdev, VIRTIO_BLK_F_MQ,
+				offsetof(struct virtio_blk_config, num_queues),
+				&num_vqs);
+	if (err || !num_vqs)
+		num_vqs = 1;
+	vblk->num_vqs = min_t(unsigned int, num_vqs, nr_cpu_ids);
+
+	vblk->vqs = kzalloc(vblk->num_vqs * sizeof(*vblk->vqs), GFP_KERNEL);
+	if (!vblk->vqs) {
+		err = -ENOMEM;
 		goto out_free_vblk;
 	}
 
+	err = virtblk_init_vqs(vblk);
+	if (err)
+		goto out_free_vqs;
+
+	if (use_bio) {
+		err = virtblk_alloc_reqs(vblk);
+		if (err)
+			goto out_free_vq;
+	}
+
 	vblk->pool = mempool_create_kmalloc_pool(1,sizeof(struct virtblk_req));
 	if (!vblk->pool) {
 		err = -ENOMEM;
-		goto out_free_vq;
+		goto out_free_reqs;
 	}
 
 	/* FIXME: How many partitions?  How long is a piece of string? */
@@ -402,6 +831,11 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 	}
 
 	q->queuedata = vblk;
+	blk_queue_softirq_done(q, virtblk_softirq_done);
+
+	/* The request function still serves SCSI and GET_ID requests. */
+	if (use_bio)
+		blk_queue_make_request(q, virtblk_make_request);
 
 	if (index < 26) {
 		sprintf(vblk->disk->disk_name, "vd%c", 'a' + index % 26);
@@ -497,6 +931,39 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 	if (!err && opt_io_size)
 		blk_queue_io_opt(q, blk_size * opt_io_size);
 
+	/*
+	 * Prefer WRITE ZEROES with unmap allowed over DISCARD to implement
+	 * discards: the blocks then read back as zeroes, which the block
+	 * layer can advertise with discard_zeroes_data.
+	 */
+	v = 0;
+	err = virtio_config_val(vdev, VIRTIO_BLK_F_WRITE_ZEROES,
+			offsetof(struct virtio_blk_config, write_zeroes_may_unmap),
+			&may_unmap);
+	if (!err && may_unmap) {
+		vblk->discard_type = VIRTIO_BLK_T_WRITE_ZEROES;
+		q->limits.discard_zeroes_data = 1;
+		virtio_config_val(vdev, VIRTIO_BLK_F_WRITE_ZEROES,
+			offsetof(struct virtio_blk_config, max_write_zeroes_sectors),
+			&v);
+	} else if (virtio_has_feature(vdev, VIRTIO_BLK_F_DISCARD)) {
+		vblk->discard_type = VIRTIO_BLK_T_DISCARD;
+		virtio_config_val(vdev, VIRTIO_BLK_F_DISCARD,
+			offsetof(struct virtio_blk_config, max_discard_sectors),
+			&v);
+	}
+
+	if (vblk->discard_type) {
+		queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, q);
+		blk_queue_max_discard_sectors(q, v ? v : UINT_MAX);
+
+		err = virtio_config_val(vdev, VIRTIO_BLK_F_DISCARD,
+			offsetof(struct virtio_blk_config, discard_sector_alignment),
+			&v);
+		if (!err && v)
+			q->limits.discard_granularity = v << 9;
+	}
+
 
 	add_disk(vblk->disk);
 	err = device_create_file(disk_to_dev(vblk->disk), &dev_attr_serial);
@@ -512,8 +979,12 @@ out_put_disk:
 	put_disk(vblk->disk);
 out_mempool:
 	mempool_destroy(vblk->pool);
+out_free_reqs:
+	virtblk_free_reqs(vblk);
 out_free_vq:
 	vdev->config->del_vqs(vdev);
+out_free_vqs:
+	kfree(vblk->vqs);
 out_free_vblk:
 	kfree(vblk);
 out:
@@ -536,7 +1007,9 @@ static void __devexit virtblk_remove(struct virtio_device *vdev)
 	blk_cleanup_queue(vblk->disk->queue);
 	put_disk(vblk->disk);
 	mempool_destroy(vblk->pool);
+	virtblk_free_reqs(vblk);
 	vdev->config->del_vqs(vdev);
+	kfree(vblk->vqs);
 	kfree(vblk);
 }
 
@@ -548,7 +1021,8 @@ static const struct virtio_device_id id_table[] = {
 static unsigned int features[] = {
 	VIRTIO_BLK_F_SEG_MAX, VIRTIO_BLK_F_SIZE_MAX, VIRTIO_BLK_F_GEOMETRY,
 	VIRTIO_BLK_F_RO, VIRTIO_BLK_F_BLK_SIZE, VIRTIO_BLK_F_SCSI,
-	VIRTIO_BLK_F_FLUSH, VIRTIO_BLK_F_TOPOLOGY
+	VIRTIO_BLK_F_FLUSH, VIRTIO_BLK_F_TOPOLOGY, VIRTIO_BLK_F_MQ,
+	VIRTIO_BLK_F_DISCARD, VIRTIO_BLK_F_WRITE_ZEROES
 };
 
 /*
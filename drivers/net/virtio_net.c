@@ -26,6 +26,8 @@
 #include <linux/scatterlist.h>
 #include <linux/if_vlan.h>
 #include <linux/slab.h>
+#include <linux/average.h>
+#include <net/busy_poll.h>
 
 static int napi_weight = 128;
 module_param(napi_weight, int, 0444);
@@ -38,6 +40,21 @@ module_param(gso, bool, 0444);
 #define MAX_PACKET_LEN (ETH_HLEN + VLAN_HLEN + ETH_DATA_LEN)
 #define GOOD_COPY_LEN	128
 
+/* Weight of the moving average of received packet lengths, which sizes
+ * mergeable receive buffers. */
+#define RECEIVE_AVG_WEIGHT 64
+
+/*
+ * Mergeable receive buffers are carved out of 32K pages, in multiples of
+ * MERGEABLE_BUFFER_ALIGN, so that the low bits of the buffer address are
+ * free to store its truesize in the virtqueue token.
+ */
+#define MERGEABLE_BUFFER_ALIGN	256
+#define MERGEABLE_PAGE_ORDER	get_order(32768)
+
+/* Pages of the receive page pool, see virtnet_pool_next(). */
+#define VIRTNET_POOL_SIZE	32
+
 #define VIRTNET_SEND_COMMAND_SG_MAX    2
 
 struct virtnet_info {
@@ -62,6 +79,19 @@ struct virtnet_info {
 	/* Chain pages by the private ptr. */
 	struct page *pages;
 
+	/* Page pool for mergeable buffers: we hold a reference to each page
+	 * and reuse it once the stack has freed every buffer carved from it.
+	 * Buffers are carved from pool[pool_next], at frag_offset. */
+	struct page *pool[VIRTNET_POOL_SIZE];
+	unsigned int pool_next;
+	unsigned int frag_offset, frag_size;
+
+	/* Average packet length for mergeable receive buffers. */
+	struct ewma mrg_avg_pkt_len;
+
+	/* Interrupt coalescing last set on the host. */
+	struct virtio_net_ctrl_coalesce rx_coalesce, tx_coalesce;
+
 	/* fragments + linear part + virtio header */
 	struct scatterlist rx_sg[MAX_SKB_FRAGS + 2];
 	struct scatterlist tx_sg[MAX_SKB_FRAGS + 2];
@@ -117,6 +147,27 @@ static struct page *get_a_page(struct virtnet_info *vi, gfp_t gfp_mask)
 	return p;
 }
 
+static unsigned long mergeable_buf_to_ctx(void *buf, unsigned int truesize)
+{
+	return (unsigned long)buf | (truesize / MERGEABLE_BUFFER_ALIGN - 1);
+}
+
+static void *mergeable_ctx_to_buf_address(unsigned long mrg_ctx)
+{
+	return (void *)(mrg_ctx & -MERGEABLE_BUFFER_ALIGN);
+}
+
+static unsigned int mergeable_ctx_to_buf_truesize(unsigned long mrg_ctx)
+{
+	return ((mrg_ctx & (MERGEABLE_BUFFER_ALIGN - 1)) + 1) *
+		MERGEABLE_BUFFER_ALIGN;
+}
+
+static void put_mergeable_buf(unsigned long mrg_ctx)
+{
+	put_page(virt_to_head_page(mergeable_ctx_to_buf_address(mrg_ctx)));
+}
+
 static void skb_xmit_done(struct virtqueue *svq)
 {
 	struct virtnet_info *vi = svq->vdev->priv;
@@ -145,15 +196,40 @@ static void set_skb_frag(struct sk_buff *skb, struct page *page,
 	*len -= f->size;
 }
 
+/* Add a mergeable buffer, merging it with the previous one if it follows
+ * it in the same page. Consumes the buffer's page reference. */
+static void add_mergeable_frag(struct sk_buff *skb, struct page *page,
+			       unsigned int offset, unsigned int len,
+			       unsigned int truesize)
+{
+	int i = skb_shinfo(skb)->nr_frags;
+	skb_frag_t *f;
+
+	if (i) {
+		f = &skb_shinfo(skb)->frags[i - 1];
+		if (f->page == page && f->page_offset + f->size == offset) {
+			f->size += len;
+			put_page(page);
+			goto out;
+		}
+	}
+	skb_fill_page_desc(skb, i, page, offset, len);
+out:
+	skb->data_len += len;
+	skb->len += len;
+	skb->truesize += truesize;
+}
+
 static struct sk_buff *page_to_skb(struct virtnet_info *vi,
-				   struct page *page, unsigned int len)
+				   struct page *page, unsigned int offset,
+				   unsigned int len, unsigned int truesize)
 {
 	struct sk_buff *skb;
 	struct skb_vnet_hdr *hdr;
-	unsigned int copy, hdr_len, offset;
+	unsigned int copy, hdr_len, hdr_padded_len;
 	char *p;
 
-	p = page_address(page);
+	p = page_address(page) + offset;
 
 	/* copy small packet so we can reuse these pages for small data */
 	skb = netdev_alloc_skb_ip_align(vi->dev, GOOD_COPY_LEN);
@@ -164,16 +240,17 @@ static struct sk_buff *page_to_skb(struct virtnet_info *vi,
 
 	if (vi->mergeable_rx_bufs) {
 		hdr_len = sizeof hdr->mhdr;
-		offset = hdr_len;
+		hdr_padded_len = hdr_len;
 	} else {
 		hdr_len = sizeof hdr->hdr;
-		offset = sizeof(struct padded_vnet_hdr);
+		hdr_padded_len = sizeof(struct padded_vnet_hdr);
 	}
 
 	memcpy(hdr, p, hdr_len);
 
 	len -= hdr_len;
-	p += offset;
+	offset += hdr_padded_len;
+	p += hdr_padded_len;
 
 	copy = len;
 	if (copy > skb_tailroom(skb))
@@ -183,6 +260,15 @@ static struct sk_buff *page_to_skb(struct virtnet_info *vi,
 	len -= copy;
 	offset += copy;
 
+	/* A mergeable buffer is a single piece of a (compound) page. */
+	if (vi->mergeable_rx_bufs) {
+		if (len)
+			add_mergeable_frag(skb, page, offset, len, truesize);
+		else
+			put_page(page);
+		return skb;
+	}
+
 	while (len) {
 		set_skb_frag(skb, page, offset, &len);
 		page = (struct page *)page->private;
@@ -192,39 +278,72 @@ static struct sk_buff *page_to_skb(struct virtnet_info *vi,
 	if (page)
 		give_pages(vi, page);
 
+	skb->truesize += skb->data_len;
 	return skb;
 }
 
-static int receive_mergeable(struct virtnet_info *vi, struct sk_buff *skb)
+static struct sk_buff *receive_mergeable(struct virtnet_info *vi,
+					 unsigned long mrg_ctx,
+					 unsigned int len)
 {
-	struct skb_vnet_hdr *hdr = skb_vnet_hdr(skb);
-	struct page *page;
-	int num_buf, i, len;
+	void *buf = mergeable_ctx_to_buf_address(mrg_ctx);
+	struct page *page = virt_to_head_page(buf);
+	unsigned int truesize = mergeable_ctx_to_buf_truesize(mrg_ctx);
+	struct virtio_net_hdr_mrg_rxbuf *mhdr = buf;
+	int num_buf = mhdr->num_buffers;
+	struct sk_buff *skb;
+
+	if (len > truesize)
+		len = truesize;
+	skb = page_to_skb(vi, page, buf - page_address(page), len, truesize);
+	if (unlikely(!skb)) {
+		put_page(page);
+		vi->dev->stats.rx_dropped++;
+		goto err;
+	}
 
-	num_buf = hdr->mhdr.num_buffers;
 	while (--num_buf) {
-		i = skb_shinfo(skb)->nr_frags;
-		if (i >= MAX_SKB_FRAGS) {
-			pr_debug("%s: packet too long\n", skb->dev->name);
+		mrg_ctx = (unsigned long)virtqueue_get_buf(vi->rvq, &len);
+		if (!mrg_ctx) {
+			pr_debug("%s: rx error: %d buffers missing\n",
+				 skb->dev->name, skb_vnet_hdr(skb)->mhdr.num_buffers);
 			skb->dev->stats.rx_length_errors++;
-			return -EINVAL;
+			goto err;
 		}
+		--vi->num;
 
-		page = virtqueue_get_buf(vi->rvq, &len);
-		if (!page) {
-			pr_debug("%s: rx error: %d buffers missing\n",
-				 skb->dev->name, hdr->mhdr.num_buffers);
+		buf = mergeable_ctx_to_buf_address(mrg_ctx);
+		page = virt_to_head_page(buf);
+		truesize = mergeable_ctx_to_buf_truesize(mrg_ctx);
+		if (len > truesize)
+			len = truesize;
+
+		if (skb_shinfo(skb)->nr_frags >= MAX_SKB_FRAGS) {
+			pr_debug("%s: packet too long\n", skb->dev->name);
 			skb->dev->stats.rx_length_errors++;
-			return -EINVAL;
+			put_page(page);
+			goto err;
 		}
-		if (len > PAGE_SIZE)
-			len = PAGE_SIZE;
 
-		set_skb_frag(skb, page, 0, &len);
+		add_mergeable_frag(skb, page, buf - page_address(page), len,
+				   truesize);
+	}
+
+	ewma_add(&vi->mrg_avg_pkt_len, skb->len);
+	return skb;
 
+err:
+	/* Drop the rest of the packet's buffers. */
+	while (--num_buf > 0) {
+		mrg_ctx = (unsigned long)virtqueue_get_buf(vi->rvq, &len);
+		if (!mrg_ctx)
+			break;
 		--vi->num;
+		put_mergeable_buf(mrg_ctx);
 	}
-	return 0;
+	if (skb)
+		dev_kfree_skb(skb);
+	return NULL;
 }
 
 static void receive_buf(struct net_device *dev, void *buf, unsigned int len)
@@ -237,7 +356,9 @@ static void receive_buf(struct net_device *dev, void *buf, unsigned int len)
 	if (unlikely(len < sizeof(struct virtio_net_hdr) + ETH_HLEN)) {
 		pr_debug("%s: short packet %i\n", dev->name, len);
 		dev->stats.rx_length_errors++;
-		if (vi->mergeable_rx_bufs || vi->big_packets)
+		if (vi->mergeable_rx_bufs)
+			put_mergeable_buf((unsigned long)buf);
+		else if (vi->big_packets)
 			give_pages(vi, buf);
 		else
 			dev_kfree_skb(buf);
@@ -248,23 +369,21 @@ static void receive_buf(struct net_device *dev, void *buf, unsigned int len)
 		skb = buf;
 		len -= sizeof(struct virtio_net_hdr);
 		skb_trim(skb, len);
+	} else if (vi->mergeable_rx_bufs) {
+		skb = receive_mergeable(vi, (unsigned long)buf, len);
+		if (unlikely(!skb))
+			return;
 	} else {
 		page = buf;
-		skb = page_to_skb(vi, page, len);
+		skb = page_to_skb(vi, page, 0, len, PAGE_SIZE);
 		if (unlikely(!skb)) {
 			dev->stats.rx_dropped++;
 			give_pages(vi, page);
 			return;
 		}
-		if (vi->mergeable_rx_bufs)
-			if (receive_mergeable(vi, skb)) {
-				dev_kfree_skb(skb);
-				return;
-			}
 	}
 
 	hdr = skb_vnet_hdr(skb);
-	skb->truesize += skb->data_len;
 	dev->stats.rx_bytes += skb->len;
 	dev->stats.rx_packets++;
 
@@ -315,6 +434,7 @@ static void receive_buf(struct net_device *dev, void *buf, unsigned int len)
 		skb_shinfo(skb)->gso_segs = 0;
 	}
 
+	skb_mark_napi_id(skb, &vi->napi);
 	netif_receive_skb(skb);
 	return;
 
@@ -393,20 +513,77 @@ static int add_recvbuf_big(struct virtnet_info *vi, gfp_t gfp)
 	return err;
 }
 
+static unsigned int get_mergeable_buf_len(struct virtnet_info *vi)
+{
+	const unsigned int hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+	unsigned int len;
+
+	len = hdr_len + clamp_t(unsigned int, ewma_read(&vi->mrg_avg_pkt_len),
+				MAX_PACKET_LEN, PAGE_SIZE - hdr_len);
+	return ALIGN(len, MERGEABLE_BUFFER_ALIGN);
+}
+
+/*
+ * Move on to the next page of the pool. A page is only reused once ours is
+ * the last reference to it, otherwise it is left to the stack and replaced.
+ */
+static struct page *virtnet_pool_next(struct virtnet_info *vi, gfp_t gfp)
+{
+	struct page *page;
+
+	vi->pool_next = (vi->pool_next + 1) % VIRTNET_POOL_SIZE;
+	page = vi->pool[vi->pool_next];
+	if (page && page_count(page) == 1)
+		goto reuse;
+
+	if (page)
+		put_page(page);
+	page = alloc_pages(gfp | __GFP_COMP | __GFP_NOWARN | __GFP_NORETRY,
+			   MERGEABLE_PAGE_ORDER);
+	if (!page)
+		page = alloc_page(gfp);
+	vi->pool[vi->pool_next] = page;
+	if (!page)
+		return NULL;
+
+reuse:
+	vi->frag_offset = 0;
+	vi->frag_size = PAGE_SIZE << compound_order(page);
+	return page;
+}
+
 static int add_recvbuf_mergeable(struct virtnet_info *vi, gfp_t gfp)
 {
+	unsigned int len = get_mergeable_buf_len(vi);
+	unsigned int hole;
 	struct page *page;
+	char *buf;
 	int err;
 
-	page = get_a_page(vi, gfp);
-	if (!page)
-		return -ENOMEM;
+	page = vi->pool[vi->pool_next];
+	if (!page || vi->frag_offset + len > vi->frag_size) {
+		page = virtnet_pool_next(vi, gfp);
+		if (!page)
+			return -ENOMEM;
+	}
+
+	buf = (char *)page_address(page) + vi->frag_offset;
+	get_page(page);
+	vi->frag_offset += len;
+
+	/* Too small for another buffer: give this one the rest. */
+	hole = vi->frag_size - vi->frag_offset;
+	if (hole < len) {
+		len += hole;
+		vi->frag_offset += hole;
+	}
 
-	sg_init_one(vi->rx_sg, page_address(page), PAGE_SIZE);
+	sg_init_one(vi->rx_sg, buf, len);
 
-	err = virtqueue_add_buf_gfp(vi->rvq, vi->rx_sg, 0, 1, page, gfp);
+	err = virtqueue_add_buf_gfp(vi->rvq, vi->rx_sg, 0, 1,
+				    (void *)mergeable_buf_to_ctx(buf, len), gfp);
 	if (err < 0)
-		give_pages(vi, page);
+		put_page(page);
 
 	return err;
 }
@@ -476,13 +653,11 @@ static void refill_work(struct work_struct *work)
 		schedule_delayed_work(&vi->refill, HZ/2);
 }
 
-static int virtnet_poll(struct napi_struct *napi, int budget)
+static unsigned int virtnet_receive(struct virtnet_info *vi, int budget)
 {
-	struct virtnet_info *vi = container_of(napi, struct virtnet_info, napi);
 	void *buf;
 	unsigned int len, received = 0;
 
-again:
 	while (received < budget &&
 	       (buf = virtqueue_get_buf(vi->rvq, &len)) != NULL) {
 		receive_buf(vi->dev, buf, len);
@@ -495,6 +670,17 @@ again:
 			schedule_delayed_work(&vi->refill, 0);
 	}
 
+	return received;
+}
+
+static int virtnet_poll(struct napi_struct *napi, int budget)
+{
+	struct virtnet_info *vi = container_of(napi, struct virtnet_info, napi);
+	unsigned int received = 0;
+
+again:
+	received += virtnet_receive(vi, budget - received);
+
 	/* Out of packets? */
 	if (received < budget) {
 		napi_complete(napi);
@@ -648,6 +834,61 @@ static void virtnet_netpoll(struct net_device *dev)
 }
 #endif
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+/* Packets delivered per call, between checks of the socket queue. */
+#define VIRTNET_BUSY_POLL_BUDGET	4
+
+/*
+ * A socket spins for data: take the receive queue from NAPI, the same way
+ * skb_recv_done() would, and reap it directly with its interrupt disabled.
+ * If NAPI already has it, the packets are on their way anyway.
+ */
+static int virtnet_busy_poll(struct napi_struct *napi)
+{
+	struct virtnet_info *vi = container_of(napi, struct virtnet_info, napi);
+	unsigned int received;
+
+	if (!(vi->status & VIRTIO_NET_S_LINK_UP))
+		return -1;
+
+	if (!napi_schedule_prep(napi))
+		return 0;
+
+	virtqueue_disable_cb(vi->rvq);
+	received = virtnet_receive(vi, VIRTNET_BUSY_POLL_BUDGET);
+
+	/* As at the end of virtnet_poll(), but we are not on a poll list. */
+	smp_mb__before_clear_bit();
+	clear_bit(NAPI_STATE_SCHED, &napi->state);
+	if (unlikely(!virtqueue_enable_cb(vi->rvq)) &&
+	    napi_schedule_prep(napi)) {
+		virtqueue_disable_cb(vi->rvq);
+		__napi_schedule(napi);
+	}
+
+	return received;
+}
+#endif
+
+/*
+ * We have a single queue pair, so there is no submitting CPU to follow:
+ * keep its receive and transmit interrupts together, for TX completions
+ * to find the cache as NAPI left it, and spread devices over the CPUs.
+ */
+static void virtnet_set_affinity(struct virtnet_info *vi)
+{
+	unsigned int cpu, n = vi->vdev->index % num_online_cpus();
+
+	for_each_online_cpu(cpu)
+		if (!n--)
+			break;
+	if (cpu >= nr_cpu_ids)
+		return;
+
+	virtqueue_set_affinity(vi->rvq, cpumask_of(cpu));
+	virtqueue_set_affinity(vi->svq, cpumask_of(cpu));
+}
+
 static int virtnet_open(struct net_device *dev)
 {
 	struct virtnet_info *vi = netdev_priv(dev);
@@ -810,8 +1051,69 @@ static void virtnet_vlan_rx_kill_vid(struct net_device *dev, u16 vid)
 		dev_warn(&dev->dev, "Failed to kill VLAN ID %d.\n", vid);
 }
 
+static int virtnet_get_coalesce(struct net_device *dev,
+				struct ethtool_coalesce *ec)
+{
+	struct virtnet_info *vi = netdev_priv(dev);
+
+	if (!virtio_has_feature(vi->vdev, VIRTIO_NET_F_CTRL_COALESCE))
+		return -EOPNOTSUPP;
+
+	memset(ec, 0, sizeof(*ec));
+	ec->rx_coalesce_usecs = vi->rx_coalesce.usecs;
+	ec->rx_max_coalesced_frames = vi->rx_coalesce.max_packets;
+	ec->tx_coalesce_usecs = vi->tx_coalesce.usecs;
+	ec->tx_max_coalesced_frames = vi->tx_coalesce.max_packets;
+	return 0;
+}
+
+static int virtnet_set_coalesce(struct net_device *dev,
+				struct ethtool_coalesce *ec)
+{
+	struct virtnet_info *vi = netdev_priv(dev);
+	struct virtio_net_ctrl_coalesce rx = {
+		.usecs = ec->rx_coalesce_usecs,
+		.max_packets = ec->rx_max_coalesced_frames,
+	};
+	struct virtio_net_ctrl_coalesce tx = {
+		.usecs = ec->tx_coalesce_usecs,
+		.max_packets = ec->tx_max_coalesced_frames,
+	};
+	/* Everything but what the device can hold back is left alone */
+	struct ethtool_coalesce ec_supported = {
+		.cmd = ETHTOOL_SCOALESCE,
+		.rx_coalesce_usecs = ec->rx_coalesce_usecs,
+		.rx_max_coalesced_frames = ec->rx_max_coalesced_frames,
+		.tx_coalesce_usecs = ec->tx_coalesce_usecs,
+		.tx_max_coalesced_frames = ec->tx_max_coalesced_frames,
+	};
+	struct scatterlist sg;
+
+	if (!virtio_has_feature(vi->vdev, VIRTIO_NET_F_CTRL_COALESCE))
+		return -EOPNOTSUPP;
+
+	if (memcmp(ec, &ec_supported, sizeof(ec_supported)))
+		return -EOPNOTSUPP;
+
+	sg_init_one(&sg, &rx, sizeof(rx));
+	if (!virtnet_send_command(vi, VIRTIO_NET_CTRL_COALESCE,
+				  VIRTIO_NET_CTRL_COALESCE_RX_SET, &sg, 1, 0))
+		return -EINVAL;
+	vi->rx_coalesce = rx;
+
+	sg_init_one(&sg, &tx, sizeof(tx));
+	if (!virtnet_send_command(vi, VIRTIO_NET_CTRL_COALESCE,
+				  VIRTIO_NET_CTRL_COALESCE_TX_SET, &sg, 1, 0))
+		return -EINVAL;
+	vi->tx_coalesce = tx;
+
+	return 0;
+}
+
 static const struct ethtool_ops virtnet_ethtool_ops = {
 	.get_link = ethtool_op_get_link,
+	.get_coalesce = virtnet_get_coalesce,
+	.set_coalesce = virtnet_set_coalesce,
 };
 
 #define MIN_MTU 68
@@ -838,6 +1140,9 @@ static const struct net_device_ops virtnet_netdev = {
 #ifdef CONFIG_NET_POLL_CONTROLLER
 	.ndo_poll_controller = virtnet_netpoll,
 #endif
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	.ndo_busy_poll	     = virtnet_busy_poll,
+#endif
 };
 
 static void virtnet_update_status(struct virtnet_info *vi)
@@ -933,10 +1238,12 @@ static int virtnet_probe(struct virtio_device *vdev)
 	/* Set up our device-specific information */
 	vi = netdev_priv(dev);
 	netif_napi_add(dev, &vi->napi, virtnet_poll, napi_weight);
+	napi_hash_add(&vi->napi);
 	vi->dev = dev;
 	vi->vdev = vdev;
 	vdev->priv = vi;
 	vi->pages = NULL;
+	ewma_init(&vi->mrg_avg_pkt_len, 1, RECEIVE_AVG_WEIGHT);
 	INIT_DELAYED_WORK(&vi->refill, refill_work);
 	sg_init_table(vi->rx_sg, ARRAY_SIZE(vi->rx_sg));
 	sg_init_table(vi->tx_sg, ARRAY_SIZE(vi->tx_sg));
@@ -960,6 +1267,7 @@ static int virtnet_probe(struct virtio_device *vdev)
 
 	vi->rvq = vqs[0];
 	vi->svq = vqs[1];
+	virtnet_set_affinity(vi);
 
 	if (virtio_has_feature(vi->vdev, VIRTIO_NET_F_CTRL_VQ)) {
 		vi->cvq = vqs[2];
@@ -1019,7 +1327,9 @@ static void free_unused_bufs(struct virtnet_info *vi)
 		buf = virtqueue_detach_unused_buf(vi->rvq);
 		if (!buf)
 			break;
-		if (vi->mergeable_rx_bufs || vi->big_packets)
+		if (vi->mergeable_rx_bufs)
+			put_mergeable_buf((unsigned long)buf);
+		else if (vi->big_packets)
 			give_pages(vi, buf);
 		else
 			dev_kfree_skb(buf);
@@ -1031,11 +1341,14 @@ static void free_unused_bufs(struct virtnet_info *vi)
 static void __devexit virtnet_remove(struct virtio_device *vdev)
 {
 	struct virtnet_info *vi = vdev->priv;
+	int i;
 
 	/* Stop all the virtqueues. */
 	vdev->config->reset(vdev);
 
-
+	/* Busy polling sockets are gone after unregister_netdev()'s
+	 * grace period. */
+	napi_hash_del(&vi->napi);
 	unregister_netdev(vi->dev);
 	cancel_delayed_work_sync(&vi->refill);
 
@@ -1047,6 +1360,10 @@ static void __devexit virtnet_remove(struct virtio_device *vdev)
 	while (vi->pages)
 		__free_pages(get_a_page(vi, GFP_KERNEL), 0);
 
+	for (i = 0; i < VIRTNET_POOL_SIZE; i++)
+		if (vi->pool[i])
+			put_page(vi->pool[i]);
+
 	free_netdev(vi->dev);
 }
 
@@ -1063,6 +1380,7 @@ static unsigned int features[] = {
 	VIRTIO_NET_F_GUEST_ECN, VIRTIO_NET_F_GUEST_UFO,
 	VIRTIO_NET_F_MRG_RXBUF, VIRTIO_NET_F_STATUS, VIRTIO_NET_F_CTRL_VQ,
 	VIRTIO_NET_F_CTRL_RX, VIRTIO_NET_F_CTRL_VLAN,
+	VIRTIO_NET_F_CTRL_COALESCE,
 };
 
 static struct virtio_driver virtio_net_driver = {
@@ -32,6 +32,10 @@
  * Using this limit prevents one virtqueue from starving others. */
 #define VHOST_NET_WEIGHT 0x80000
 
+/* Max number of used buffers held back before they are published to the
+ * guest with a single used index update and signal. */
+#define VHOST_NET_BATCH 64
+
 enum {
 	VHOST_NET_VQ_RX = 0,
 	VHOST_NET_VQ_TX = 1,
@@ -52,6 +56,9 @@ struct vhost_net {
 	 * We only do this when socket buffer fills up.
 	 * Protected by tx vq lock. */
 	enum vhost_net_poll_state tx_poll_state;
+	/* Scratch iovec for sockets that take the first part of the
+	 * header vhost strips.  Only used from the worker. */
+	struct iovec sock_iov[UIO_MAXIOV + 1];
 };
 
 /* Pop first len bytes from iovec. Return number of segments used. */
@@ -92,6 +99,30 @@ static void copy_iovec_hdr(const struct iovec *from, struct iovec *to,
 	}
 }
 
+/* Build the iovec for a socket that handles the first sock_hlen bytes of
+ * the header stripped into hdr, followed by the payload.  Segments of the
+ * payload emptied by move_iovec_hdr are dropped, so the result needs at
+ * most one entry more than the payload. Return number of segments used. */
+static int sock_iovec(struct iovec *to, const struct iovec *hdr, int hdrcount,
+		      size_t sock_hlen, const struct iovec *from, int iovcount)
+{
+	int seg = 0;
+	size_t size;
+
+	while (sock_hlen && hdrcount--) {
+		size = min(hdr->iov_len, sock_hlen);
+		to[seg].iov_base = hdr->iov_base;
+		to[seg].iov_len = size;
+		sock_hlen -= size;
+		++hdr;
+		++seg;
+	}
+	for (; iovcount; --iovcount, ++from)
+		if (from->iov_len)
+			to[seg++] = *from;
+	return seg;
+}
+
 /* Caller must have TX VQ lock */
 static void tx_poll_stop(struct vhost_net *net)
 {
@@ -127,8 +158,9 @@ static void handle_tx(struct vhost_net *net)
 	};
 	size_t len, total_len = 0;
 	int err, wmem;
-	size_t hdr_size;
+	size_t hdr_size, sock_hlen;
 	struct socket *sock;
+	unsigned nheads = 0;
 
 	/* TODO: check that we are running from vhost_worker? */
 	sock = rcu_dereference_check(vq->private_data, 1);
@@ -144,11 +176,13 @@ static void handle_tx(struct vhost_net *net)
 	}
 
 	mutex_lock(&vq->mutex);
+	vq->stats.wakeups++;
 	vhost_disable_notify(&net->dev, vq);
 
 	if (wmem < sock->sk->sk_sndbuf / 2)
 		tx_poll_stop(net);
 	hdr_size = vq->vhost_hlen;
+	sock_hlen = vq->sock_hlen;
 
 	for (;;) {
 		head = vhost_get_vq_desc(&net->dev, vq, vq->iov,
@@ -177,8 +211,9 @@ static void handle_tx(struct vhost_net *net)
 			       "out %d, int %d\n", out, in);
 			break;
 		}
-		/* Skip header. TODO: support TSO. */
+		/* Skip header. */
 		s = move_iovec_hdr(vq->iov, vq->hdr, hdr_size, out);
+		msg.msg_iov = vq->iov;
 		msg.msg_iovlen = out;
 		len = iov_length(vq->iov, out);
 		/* Sanity check */
@@ -188,6 +223,13 @@ static void handle_tx(struct vhost_net *net)
 			       iov_length(vq->hdr, s), hdr_size);
 			break;
 		}
+		/* Pass on the offload fields if the socket takes them. */
+		if (unlikely(hdr_size) && sock_hlen) {
+			msg.msg_iov = net->sock_iov;
+			msg.msg_iovlen = sock_iovec(net->sock_iov, vq->hdr, s,
+						    sock_hlen, vq->iov, out);
+			len += sock_hlen;
+		}
 		/* TODO: Check specific error and bomb out unless ENOBUFS? */
 		err = sock->ops->sendmsg(NULL, sock, &msg, len);
 		if (unlikely(err < 0)) {
@@ -198,14 +240,23 @@ static void handle_tx(struct vhost_net *net)
 		if (err != len)
 			pr_debug("Truncated TX packet: "
 				 " len %d != %zd\n", err, len);
-		vhost_add_used_and_signal(&net->dev, vq, head, 0);
+		vq->heads[nheads].id = head;
+		vq->heads[nheads].len = 0;
+		if (++nheads == VHOST_NET_BATCH) {
+			vhost_add_used_and_signal_n(&net->dev, vq, vq->heads,
+						    nheads);
+			nheads = 0;
+		}
 		total_len += len;
 		if (unlikely(total_len >= VHOST_NET_WEIGHT)) {
+			vq->stats.requeues++;
 			vhost_poll_queue(&vq->poll);
 			break;
 		}
 	}
 
+	if (nheads)
+		vhost_add_used_and_signal_n(&net->dev, vq, vq->heads, nheads);
 	mutex_unlock(&vq->mutex);
 }
 
@@ -306,8 +357,10 @@ static void handle_rx(struct vhost_net *net)
 	};
 	size_t total_len = 0;
 	int err, headcount, mergeable;
+	unsigned nheads = 0;
 	size_t vhost_hlen, sock_hlen;
 	size_t vhost_len, sock_len;
+	int s = 0;
 	/* TODO: check that we are running from vhost_worker? */
 	struct socket *sock = rcu_dereference_check(vq->private_data, 1);
 
@@ -315,6 +368,7 @@ static void handle_rx(struct vhost_net *net)
 		return;
 
 	mutex_lock(&vq->mutex);
+	vq->stats.wakeups++;
 	vhost_disable_notify(&net->dev, vq);
 	vhost_hlen = vq->vhost_hlen;
 	sock_hlen = vq->sock_hlen;
@@ -324,11 +378,14 @@ static void handle_rx(struct vhost_net *net)
 	mergeable = vhost_has_feature(&net->dev, VIRTIO_NET_F_MRG_RXBUF);
 
 	while ((sock_len = peek_head_len(sock->sk))) {
+		/* If both are set, the socket fills in the start of the
+		 * header vhost provides. */
+		vhost_len = sock_len + (vhost_hlen ?: sock_hlen);
 		sock_len += sock_hlen;
-		vhost_len = sock_len + vhost_hlen;
-		headcount = get_rx_bufs(vq, vq->heads, vhost_len,
+		headcount = get_rx_bufs(vq, vq->heads + nheads, vhost_len,
 					&in, vq_log, &log,
-					likely(mergeable) ? UIO_MAXIOV : 1);
+					likely(mergeable) ?
+					UIO_MAXIOV - nheads : 1);
 		/* On error, stop handling until the next kick. */
 		if (unlikely(headcount < 0))
 			break;
@@ -346,13 +403,20 @@ static void handle_rx(struct vhost_net *net)
 		}
 		/* We don't need to be notified again. */
 		if (unlikely((vhost_hlen)))
-			/* Skip header. TODO: support TSO. */
-			move_iovec_hdr(vq->iov, vq->hdr, vhost_hlen, in);
+			/* Skip header. */
+			s = move_iovec_hdr(vq->iov, vq->hdr, vhost_hlen, in);
 		else
 			/* Copy the header for use in VIRTIO_NET_F_MRG_RXBUF:
 			 * needed because recvmsg can modify msg_iov. */
 			copy_iovec_hdr(vq->iov, vq->hdr, sock_hlen, in);
+		msg.msg_iov = vq->iov;
 		msg.msg_iovlen = in;
+		/* Let the socket fill in the offload fields. */
+		if (unlikely(vhost_hlen) && sock_hlen) {
+			msg.msg_iov = net->sock_iov;
+			msg.msg_iovlen = sock_iovec(net->sock_iov, vq->hdr, s,
+						    sock_hlen, vq->iov, in);
+		}
 		err = sock->ops->recvmsg(NULL, sock, &msg,
 					 sock_len, MSG_DONTWAIT | MSG_TRUNC);
 		/* Userspace might have consumed the packet meanwhile:
@@ -364,7 +428,7 @@ static void handle_rx(struct vhost_net *net)
 			vhost_discard_vq_desc(vq, headcount);
 			continue;
 		}
-		if (unlikely(vhost_hlen) &&
+		if (unlikely(vhost_hlen) && !sock_hlen &&
 		    memcpy_toiovecend(vq->hdr, (unsigned char *)&hdr, 0,
 				      vhost_hlen)) {
 			vq_err(vq, "Unable to write vnet_hdr at addr %p\n",
@@ -380,17 +444,24 @@ static void handle_rx(struct vhost_net *net)
 			vhost_discard_vq_desc(vq, headcount);
 			break;
 		}
-		vhost_add_used_and_signal_n(&net->dev, vq, vq->heads,
-					    headcount);
 		if (unlikely(vq_log))
 			vhost_log_write(vq, vq_log, log, vhost_len);
+		nheads += headcount;
+		if (nheads >= VHOST_NET_BATCH) {
+			vhost_add_used_and_signal_n(&net->dev, vq, vq->heads,
+						    nheads);
+			nheads = 0;
+		}
 		total_len += vhost_len;
 		if (unlikely(total_len >= VHOST_NET_WEIGHT)) {
+			vq->stats.requeues++;
 			vhost_poll_queue(&vq->poll);
 			break;
 		}
 	}
 
+	if (nheads)
+		vhost_add_used_and_signal_n(&net->dev, vq, vq->heads, nheads);
 	mutex_unlock(&vq->mutex);
 }
 
@@ -534,6 +605,49 @@ static int vhost_net_release(struct inode *inode, struct file *f)
 	return 0;
 }
 
+/* Find whether a raw packet socket takes and produces a virtio_net_hdr,
+ * which keeps GSO and checksum offload information from and to the guest.
+ * That is for userspace to set up with PACKET_VNET_HDR: the socket is
+ * theirs, and we leave its options alone.  Returns the header length the
+ * socket handles, or 0. */
+static size_t get_sock_hlen(struct socket *sock)
+{
+	int val = 0, len = sizeof val;
+
+	if (!sock || sock->sk->sk_family != PF_PACKET ||
+	    sock->sk->sk_type != SOCK_RAW)
+		return 0;
+	if (kernel_getsockopt(sock, SOL_PACKET, PACKET_VNET_HDR,
+			      (char *)&val, &len) || !val)
+		return 0;
+	return sizeof(struct virtio_net_hdr);
+}
+
+/* Caller must have VQ lock */
+static void vhost_net_vq_set_hlen(struct vhost_virtqueue *vq, u64 features)
+{
+	struct socket *sock;
+	size_t hdr_len;
+
+	sock = rcu_dereference_protected(vq->private_data,
+					 lockdep_is_held(&vq->mutex));
+	hdr_len = (features & (1 << VIRTIO_NET_F_MRG_RXBUF)) ?
+			sizeof(struct virtio_net_hdr_mrg_rxbuf) :
+			sizeof(struct virtio_net_hdr);
+	if (features & (1 << VHOST_NET_F_VIRTIO_NET_HDR)) {
+		/* vhost provides vnet_hdr, but hands the part of it carrying
+		 * offload information to sockets that can take it. */
+		vq->vhost_hlen = hdr_len;
+		vq->sock_hlen = get_sock_hlen(sock);
+		if (vq->sock_hlen == hdr_len)
+			vq->vhost_hlen = 0;
+	} else {
+		/* socket provides vnet_hdr */
+		vq->vhost_hlen = 0;
+		vq->sock_hlen = hdr_len;
+	}
+}
+
 static struct socket *get_raw_socket(int fd)
 {
 	struct {
@@ -634,6 +748,7 @@ static long vhost_net_set_backend(struct vhost_net *n, unsigned index, int fd)
 	if (sock != oldsock) {
 		vhost_net_disable_vq(n, vq);
 		rcu_assign_pointer(vq->private_data, sock);
+		vhost_net_vq_set_hlen(vq, n->dev.acked_features);
 		vhost_net_enable_vq(n, vq);
 	}
 
@@ -678,21 +793,8 @@ done:
 
 static int vhost_net_set_features(struct vhost_net *n, u64 features)
 {
-	size_t vhost_hlen, sock_hlen, hdr_len;
 	int i;
 
-	hdr_len = (features & (1 << VIRTIO_NET_F_MRG_RXBUF)) ?
-			sizeof(struct virtio_net_hdr_mrg_rxbuf) :
-			sizeof(struct virtio_net_hdr);
-	if (features & (1 << VHOST_NET_F_VIRTIO_NET_HDR)) {
-		/* vhost provides vnet_hdr */
-		vhost_hlen = hdr_len;
-		sock_hlen = 0;
-	} else {
-		/* socket provides vnet_hdr */
-		vhost_hlen = 0;
-		sock_hlen = hdr_len;
-	}
 	mutex_lock(&n->dev.mutex);
 	if ((features & (1 << VHOST_F_LOG_ALL)) &&
 	    !vhost_log_access_ok(&n->dev)) {
@@ -703,8 +805,7 @@ static int vhost_net_set_features(struct vhost_net *n, u64 features)
 	smp_wmb();
 	for (i = 0; i < VHOST_NET_VQ_MAX; ++i) {
 		mutex_lock(&n->vqs[i].mutex);
-		n->vqs[i].vhost_hlen = vhost_hlen;
-		n->vqs[i].sock_hlen = sock_hlen;
+		vhost_net_vq_set_hlen(n->vqs + i, features);
 		mutex_unlock(&n->vqs[i].mutex);
 	}
 	vhost_net_flush(n);
@@ -776,13 +877,20 @@ static struct miscdevice vhost_net_misc = {
 
 static int vhost_net_init(void)
 {
-	return misc_register(&vhost_net_misc);
+	int r;
+
+	vhost_debugfs_init("vhost-net");
+	r = misc_register(&vhost_net_misc);
+	if (r)
+		vhost_debugfs_exit();
+	return r;
 }
 module_init(vhost_net_init);
 
 static void vhost_net_exit(void)
 {
 	misc_deregister(&vhost_net_misc);
+	vhost_debugfs_exit();
 }
 module_exit(vhost_net_exit);
 
@@ -25,6 +25,9 @@
 #include <linux/slab.h>
 #include <linux/kthread.h>
 #include <linux/cgroup.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 
 #include <linux/net.h>
 #include <linux/if_packet.h>
@@ -40,6 +43,26 @@ enum {
 #define vhost_used_event(vq) ((u16 __user *)&vq->avail->ring[vq->num])
 #define vhost_avail_event(vq) ((u16 __user *)&vq->used->ring[vq->num])
 
+/* With the packed layout, desc points to the descriptor ring, and avail and
+ * used to the driver and device event suppression structures. */
+#define vhost_packed_desc(vq) ((struct vring_packed_desc __user *)(vq)->desc)
+#define vhost_driver_event(vq) \
+	((struct vring_packed_desc_event __user *)(vq)->avail)
+#define vhost_device_event(vq) \
+	((struct vring_packed_desc_event __user *)(vq)->used)
+
+/* Packed layout heads returned by vhost_get_vq_desc carry the buffer id in
+ * the low 16 bits and the number of descriptors it took, minus one, above.
+ * This keeps single descriptor heads equal to the id, and never equal to
+ * vq->num. */
+#define VHOST_PACKED_HEAD(id, n) ((id) | ((n) - 1) << 16)
+#define VHOST_PACKED_ID(head) ((head) & 0xffff)
+#define VHOST_PACKED_NDESCS(head) (((head) >> 16) + 1)
+
+static struct dentry *vhost_debugfs_root;
+/* Keeps a stats file's virtqueue from going away while it is opened. */
+static DEFINE_MUTEX(vhost_debugfs_mutex);
+
 static void vhost_poll_func(struct file *file, wait_queue_head_t *wqh,
 			    poll_table *pt)
 {
@@ -62,6 +85,24 @@ static int vhost_poll_wakeup(wait_queue_t *wait, unsigned mode, int sync,
 	return 0;
 }
 
+/* Wakeup for the guest kick eventfd: same as vhost_poll_wakeup, but also
+ * accounts the kick to the virtqueue. */
+static int vhost_vq_kick_wakeup(wait_queue_t *wait, unsigned mode, int sync,
+				void *key)
+{
+	struct vhost_virtqueue *vq = container_of(wait, struct vhost_virtqueue,
+						  poll.wait);
+
+	if (!((unsigned long)key & vq->poll.mask))
+		return 0;
+
+	vq->stats.kicks++;
+	if (!vq->kick_ns)
+		vq->kick_ns = ktime_to_ns(ktime_get());
+	vhost_poll_queue(&vq->poll);
+	return 0;
+}
+
 static void vhost_work_init(struct vhost_work *work, vhost_work_fn_t fn)
 {
 	INIT_LIST_HEAD(&work->node);
@@ -163,6 +204,9 @@ static void vhost_vq_reset(struct vhost_dev *dev,
 	vq->used = NULL;
 	vq->last_avail_idx = 0;
 	vq->avail_idx = 0;
+	vq->avail_cache_idx = 0;
+	vq->avail_cache_num = 0;
+	vq->packed_fetched = 0;
 	vq->last_used_idx = 0;
 	vq->signalled_used = 0;
 	vq->signalled_used_valid = false;
@@ -179,6 +223,11 @@ static void vhost_vq_reset(struct vhost_dev *dev,
 	vq->call_ctx = NULL;
 	vq->call = NULL;
 	vq->log_ctx = NULL;
+	memset(&vq->stats, 0, sizeof vq->stats);
+	vq->kick_ns = 0;
+	vq->coalesce_usecs = 0;
+	vq->coalesce_max_packets = 0;
+	vq->coalesce_pending = 0;
 }
 
 static int vhost_worker(void *data)
@@ -237,9 +286,12 @@ static long vhost_dev_alloc_iovecs(struct vhost_dev *dev)
 					  GFP_KERNEL);
 		dev->vqs[i].heads = kmalloc(sizeof *dev->vqs[i].heads *
 					    UIO_MAXIOV, GFP_KERNEL);
+		dev->vqs[i].packed_ndescs = kmalloc(sizeof
+					*dev->vqs[i].packed_ndescs *
+					UIO_MAXIOV, GFP_KERNEL);
 
 		if (!dev->vqs[i].indirect || !dev->vqs[i].log ||
-			!dev->vqs[i].heads)
+			!dev->vqs[i].heads || !dev->vqs[i].packed_ndescs)
 			goto err_nomem;
 	}
 	return 0;
@@ -249,6 +301,7 @@ err_nomem:
 		kfree(dev->vqs[i].indirect);
 		kfree(dev->vqs[i].log);
 		kfree(dev->vqs[i].heads);
+		kfree(dev->vqs[i].packed_ndescs);
 	}
 	return -ENOMEM;
 }
@@ -264,9 +317,37 @@ static void vhost_dev_free_iovecs(struct vhost_dev *dev)
 		dev->vqs[i].log = NULL;
 		kfree(dev->vqs[i].heads);
 		dev->vqs[i].heads = NULL;
+		kfree(dev->vqs[i].packed_ndescs);
+		dev->vqs[i].packed_ndescs = NULL;
 	}
 }
 
+static void __vhost_signal(struct vhost_dev *dev, struct vhost_virtqueue *vq);
+
+static enum hrtimer_restart vhost_coalesce_timer(struct hrtimer *timer)
+{
+	struct vhost_virtqueue *vq = container_of(timer, struct vhost_virtqueue,
+						  coalesce_timer);
+
+	vhost_work_queue(vq->dev, &vq->coalesce_work);
+	return HRTIMER_NORESTART;
+}
+
+/* Deliver the interrupt the coalescing timer held back. */
+static void vhost_coalesce_work(struct vhost_work *work)
+{
+	struct vhost_virtqueue *vq = container_of(work, struct vhost_virtqueue,
+						  coalesce_work);
+
+	mutex_lock(&vq->mutex);
+	/* The call fd may have gone since the timer was started. */
+	if (vq->call_ctx && vq->coalesce_pending) {
+		vq->coalesce_pending = 0;
+		__vhost_signal(vq->dev, vq);
+	}
+	mutex_unlock(&vq->mutex);
+}
+
 long vhost_dev_init(struct vhost_dev *dev,
 		    struct vhost_virtqueue *vqs, int nvqs)
 {
@@ -282,17 +363,27 @@ long vhost_dev_init(struct vhost_dev *dev,
 	spin_lock_init(&dev->work_lock);
 	INIT_LIST_HEAD(&dev->work_list);
 	dev->worker = NULL;
+	dev->debugfs = NULL;
 
 	for (i = 0; i < dev->nvqs; ++i) {
 		dev->vqs[i].log = NULL;
 		dev->vqs[i].indirect = NULL;
 		dev->vqs[i].heads = NULL;
+		dev->vqs[i].packed_ndescs = NULL;
+		dev->vqs[i].stats_dentry = NULL;
 		dev->vqs[i].dev = dev;
 		mutex_init(&dev->vqs[i].mutex);
+		hrtimer_init(&dev->vqs[i].coalesce_timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL);
+		dev->vqs[i].coalesce_timer.function = vhost_coalesce_timer;
+		vhost_work_init(&dev->vqs[i].coalesce_work, vhost_coalesce_work);
 		vhost_vq_reset(dev, dev->vqs + i);
-		if (dev->vqs[i].handle_kick)
+		if (dev->vqs[i].handle_kick) {
 			vhost_poll_init(&dev->vqs[i].poll,
 					dev->vqs[i].handle_kick, POLLIN, dev);
+			init_waitqueue_func_entry(&dev->vqs[i].poll.wait,
+						  vhost_vq_kick_wakeup);
+		}
 	}
 
 	return 0;
@@ -330,6 +421,125 @@ static int vhost_attach_cgroups(struct vhost_dev *dev)
 	return attach.ret;
 }
 
+static int vhost_vq_stats_show(struct seq_file *m, void *v)
+{
+	struct vhost_vq_stats *stats = m->private;
+	int i;
+
+	seq_printf(m, "kicks %llu\n", stats->kicks);
+	seq_printf(m, "wakeups %llu\n", stats->wakeups);
+	seq_printf(m, "used %llu\n", stats->used);
+	seq_printf(m, "signals %llu\n", stats->signals);
+	seq_printf(m, "signals_suppressed %llu\n", stats->signals_suppressed);
+	seq_printf(m, "requeues %llu\n", stats->requeues);
+	for (i = 0; i < VHOST_LATENCY_BUCKETS - 1; ++i)
+		seq_printf(m, "latency_us_lt_%u %llu\n", 1U << i,
+			   stats->latency[i]);
+	seq_printf(m, "latency_us_ge_%u %llu\n", 1U << (i - 1),
+		   stats->latency[i]);
+	return 0;
+}
+
+/* An open stats file shows a copy of the counters, taken at open time: it
+ * can outlive the virtqueue, which vhost_dev_debugfs_cleanup() detaches
+ * from the file before it goes away. */
+static int vhost_vq_stats_open(struct inode *inode, struct file *file)
+{
+	struct vhost_virtqueue *vq;
+	struct vhost_vq_stats *stats;
+	int r;
+
+	stats = kmalloc(sizeof *stats, GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+	mutex_lock(&vhost_debugfs_mutex);
+	vq = inode->i_private;
+	if (vq)
+		*stats = vq->stats;
+	mutex_unlock(&vhost_debugfs_mutex);
+	if (!vq) {
+		kfree(stats);
+		return -ENOENT;
+	}
+	r = single_open(file, vhost_vq_stats_show, stats);
+	if (r)
+		kfree(stats);
+	return r;
+}
+
+static int vhost_vq_stats_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *m = file->private_data;
+
+	kfree(m->private);
+	return single_release(inode, file);
+}
+
+static const struct file_operations vhost_vq_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= vhost_vq_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= vhost_vq_stats_release,
+};
+
+/* Create a debugfs directory named after the worker, with a stats file
+ * for each virtqueue.  Failure is not fatal: we just go without. */
+static void vhost_dev_debugfs_init(struct vhost_dev *dev)
+{
+	char name[32];
+	int i;
+
+	if (IS_ERR_OR_NULL(vhost_debugfs_root))
+		return;
+	snprintf(name, sizeof name, "%d", task_pid_nr(dev->worker));
+	dev->debugfs = debugfs_create_dir(name, vhost_debugfs_root);
+	if (IS_ERR_OR_NULL(dev->debugfs)) {
+		dev->debugfs = NULL;
+		return;
+	}
+	for (i = 0; i < dev->nvqs; ++i) {
+		struct dentry *d;
+
+		snprintf(name, sizeof name, "vq%d", i);
+		d = debugfs_create_file(name, 0444, dev->debugfs, dev->vqs + i,
+					&vhost_vq_stats_fops);
+		if (!IS_ERR_OR_NULL(d))
+			dev->vqs[i].stats_dentry = d;
+	}
+}
+
+/* Detach the stats files from the virtqueues, which opens in progress are
+ * done with once we hold the mutex, and remove them. */
+static void vhost_dev_debugfs_cleanup(struct vhost_dev *dev)
+{
+	int i;
+
+	if (!dev->debugfs)
+		return;
+	mutex_lock(&vhost_debugfs_mutex);
+	for (i = 0; i < dev->nvqs; ++i) {
+		if (dev->vqs[i].stats_dentry)
+			dev->vqs[i].stats_dentry->d_inode->i_private = NULL;
+		dev->vqs[i].stats_dentry = NULL;
+	}
+	mutex_unlock(&vhost_debugfs_mutex);
+	debugfs_remove_recursive(dev->debugfs);
+	dev->debugfs = NULL;
+}
+
+void vhost_debugfs_init(const char *name)
+{
+	vhost_debugfs_root = debugfs_create_dir(name, NULL);
+}
+
+void vhost_debugfs_exit(void)
+{
+	if (!IS_ERR_OR_NULL(vhost_debugfs_root))
+		debugfs_remove_recursive(vhost_debugfs_root);
+	vhost_debugfs_root = NULL;
+}
+
 /* Caller should have device mutex */
 static long vhost_dev_set_owner(struct vhost_dev *dev)
 {
@@ -361,6 +571,7 @@ static long vhost_dev_set_owner(struct vhost_dev *dev)
 	if (err)
 		goto err_cgroup;
 
+	vhost_dev_debugfs_init(dev);
 	return 0;
 err_cgroup:
 	kthread_stop(worker);
@@ -395,11 +606,15 @@ void vhost_dev_cleanup(struct vhost_dev *dev)
 {
 	int i;
 
+	/* Before anything the stats files could look at goes. */
+	vhost_dev_debugfs_cleanup(dev);
 	for (i = 0; i < dev->nvqs; ++i) {
 		if (dev->vqs[i].kick && dev->vqs[i].handle_kick) {
 			vhost_poll_stop(&dev->vqs[i].poll);
 			vhost_poll_flush(&dev->vqs[i].poll);
 		}
+		hrtimer_cancel(&dev->vqs[i].coalesce_timer);
+		vhost_work_flush(dev, &dev->vqs[i].coalesce_work);
 		if (dev->vqs[i].error_ctx)
 			eventfd_ctx_put(dev->vqs[i].error_ctx);
 		if (dev->vqs[i].error)
@@ -500,6 +715,15 @@ static int vq_access_ok(struct vhost_dev *d, unsigned int num,
 			struct vring_used __user *used)
 {
 	size_t s = vhost_has_feature(d, VIRTIO_RING_F_EVENT_IDX) ? 2 : 0;
+
+	/* Used buffers are written back into the packed descriptor ring. */
+	if (vhost_has_feature(d, VIRTIO_RING_F_PACKED))
+		return access_ok(VERIFY_WRITE, desc,
+				 num * sizeof(struct vring_packed_desc)) &&
+		       access_ok(VERIFY_READ, avail,
+				 sizeof(struct vring_packed_desc_event)) &&
+		       access_ok(VERIFY_WRITE, used,
+				 sizeof(struct vring_packed_desc_event));
 	return access_ok(VERIFY_READ, desc, num * sizeof *desc) &&
 	       access_ok(VERIFY_READ, avail,
 			 sizeof *avail + num * sizeof *avail->ring + s) &&
@@ -518,21 +742,32 @@ int vhost_log_access_ok(struct vhost_dev *dev)
 	return memory_access_ok(dev, mp, 1);
 }
 
+/* Size of the guest memory we write to and log: the used ring, or the
+ * whole ring with the packed layout, where log_addr is that of the
+ * descriptors. */
+static size_t vq_log_size(struct vhost_dev *d, unsigned int num)
+{
+	size_t s = vhost_has_feature(d, VIRTIO_RING_F_EVENT_IDX) ? 2 : 0;
+
+	if (vhost_has_feature(d, VIRTIO_RING_F_PACKED))
+		return vring_packed_size(num);
+	return sizeof(struct vring_used) +
+		num * sizeof(struct vring_used_elem) + s;
+}
+
 /* Verify access for write logging. */
 /* Caller should have vq mutex and device mutex */
 static int vq_log_access_ok(struct vhost_dev *d, struct vhost_virtqueue *vq,
 			    void __user *log_base)
 {
 	struct vhost_memory *mp;
-	size_t s = vhost_has_feature(d, VIRTIO_RING_F_EVENT_IDX) ? 2 : 0;
 
 	mp = rcu_dereference_protected(vq->dev->memory,
 				       lockdep_is_held(&vq->mutex));
 	return vq_memory_access_ok(log_base, mp,
 			    vhost_has_feature(vq->dev, VHOST_F_LOG_ALL)) &&
 		(!vq->log_used || log_access_ok(log_base, vq->log_addr,
-					sizeof *vq->used +
-					vq->num * sizeof *vq->used->ring + s));
+						vq_log_size(d, vq->num)));
 }
 
 /* Can we start vq? */
@@ -581,7 +816,22 @@ static long vhost_set_memory(struct vhost_dev *d, struct vhost_memory __user *m)
 static int init_used(struct vhost_virtqueue *vq,
 		     struct vring_used __user *used)
 {
-	int r = put_user(vq->used_flags, &used->flags);
+	int r;
+
+	/* There is no used index to pick up with the packed layout: the ring
+	 * is idle while being set up, so we start using where the guest
+	 * last made buffers available. */
+	if (vhost_has_feature(vq->dev, VIRTIO_RING_F_PACKED)) {
+		struct vring_packed_desc_event __user *event = (void __user *)used;
+
+		vq->last_used_idx = vq->last_avail_idx;
+		vq->signalled_used_valid = false;
+		return put_user(vq->used_flags & VRING_USED_F_NO_NOTIFY ?
+				VRING_PACKED_EVENT_FLAG_DISABLE :
+				VRING_PACKED_EVENT_FLAG_ENABLE, &event->flags);
+	}
+
+	r = put_user(vq->used_flags, &used->flags);
 
 	if (r)
 		return r;
@@ -599,6 +849,8 @@ static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 	struct vhost_vring_state s;
 	struct vhost_vring_file f;
 	struct vhost_vring_addr a;
+	struct vhost_vring_coalesce c;
+	bool callchange = false;
 	u32 idx;
 	long r;
 
@@ -629,6 +881,7 @@ static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 			break;
 		}
 		vq->num = s.num;
+		vq->avail_cache_num = 0;
 		break;
 	case VHOST_SET_VRING_BASE:
 		/* Moving base with an active backend?
@@ -646,8 +899,11 @@ static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 			break;
 		}
 		vq->last_avail_idx = s.num;
+		if (vhost_has_feature(d, VIRTIO_RING_F_PACKED))
+			vq->last_used_idx = s.num;
 		/* Forget the cached index value. */
 		vq->avail_idx = vq->last_avail_idx;
+		vq->avail_cache_num = 0;
 		break;
 	case VHOST_GET_VRING_BASE:
 		s.index = idx;
@@ -673,7 +929,10 @@ static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 			break;
 		}
 		if ((a.avail_user_addr & (sizeof *vq->avail->ring - 1)) ||
-		    (a.used_user_addr & (sizeof *vq->used->ring - 1)) ||
+		    (a.used_user_addr & (vhost_has_feature(d,
+						VIRTIO_RING_F_PACKED) ?
+			sizeof(struct vring_packed_desc_event) - 1 :
+			sizeof *vq->used->ring - 1)) ||
 		    (a.log_guest_addr & (sizeof *vq->used->ring - 1))) {
 			r = -EINVAL;
 			break;
@@ -694,8 +953,7 @@ static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 			/* Also validate log access for used ring if enabled. */
 			if ((a.flags & (0x1 << VHOST_VRING_F_LOG)) &&
 			    !log_access_ok(vq->log_base, a.log_guest_addr,
-					   sizeof *vq->used +
-					   vq->num * sizeof *vq->used->ring)) {
+					   vq_log_size(d, vq->num))) {
 				r = -EINVAL;
 				break;
 			}
@@ -706,11 +964,24 @@ static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 		if (r)
 			break;
 		vq->log_used = !!(a.flags & (0x1 << VHOST_VRING_F_LOG));
+		vq->avail_cache_num = 0;
 		vq->desc = (void __user *)(unsigned long)a.desc_user_addr;
 		vq->avail = (void __user *)(unsigned long)a.avail_user_addr;
 		vq->log_addr = a.log_guest_addr;
 		vq->used = (void __user *)(unsigned long)a.used_user_addr;
 		break;
+	case VHOST_SET_VRING_COALESCE:
+		if (copy_from_user(&c, argp, sizeof c)) {
+			r = -EFAULT;
+			break;
+		}
+		if (c.usecs > USEC_PER_SEC) {
+			r = -EINVAL;
+			break;
+		}
+		vq->coalesce_usecs = c.usecs;
+		vq->coalesce_max_packets = c.max_packets;
+		break;
 	case VHOST_SET_VRING_KICK:
 		if (copy_from_user(&f, argp, sizeof f)) {
 			r = -EFAULT;
@@ -743,6 +1014,10 @@ static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 			vq->call = eventfp;
 			vq->call_ctx = eventfp ?
 				eventfd_ctx_fileget(eventfp) : NULL;
+			/* A signal held back was meant for the old fd. */
+			hrtimer_cancel(&vq->coalesce_timer);
+			vq->coalesce_pending = 0;
+			callchange = true;
 		} else
 			filep = eventfp;
 		break;
@@ -784,6 +1059,9 @@ static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 
 	if (pollstop && vq->handle_kick)
 		vhost_poll_flush(&vq->poll);
+	/* The work takes the vq mutex: wait for it with that dropped. */
+	if (callchange)
+		vhost_work_flush(d, &vq->coalesce_work);
 	return r;
 }
 
@@ -1105,6 +1383,165 @@ static int get_indirect(struct vhost_dev *dev, struct vhost_virtqueue *vq,
 	return 0;
 }
 
+/* Look up the available ring entry at index idx.  Entries between
+ * last_avail_idx and avail_idx belong to us until we consume them, so we
+ * copy as many of them as fit in the cache with a single access and serve
+ * the following calls from there.  Caller must have read avail_idx and
+ * issued the read barrier. */
+static int get_avail_head(struct vhost_virtqueue *vq, u16 idx,
+			  unsigned int *head)
+{
+	unsigned int start, n;
+
+	if ((u16)(idx - vq->avail_cache_idx) >= vq->avail_cache_num) {
+		start = idx % vq->num;
+		/* Don't wrap around the end of the ring. */
+		n = min_t(unsigned int, (u16)(vq->avail_idx - idx),
+			  vq->num - start);
+		n = min_t(unsigned int, n, VHOST_AVAIL_BATCH);
+		vq->avail_cache_num = 0;
+		if (unlikely(__copy_from_user(vq->avail_cache,
+					      &vq->avail->ring[start],
+					      n * sizeof *vq->avail_cache)))
+			return -EFAULT;
+		vq->avail_cache_idx = idx;
+		vq->avail_cache_num = n;
+	}
+	*head = vq->avail_cache[(u16)(idx - vq->avail_cache_idx)];
+	return 0;
+}
+
+/* Packed layout ring indexes are free running 16 bit counts of descriptors.
+ * As the ring size is a power of two, the position in the ring is the count
+ * modulo the size, and the next bit the inverse of the wrap counter. */
+static inline bool vhost_packed_wrap(struct vhost_virtqueue *vq, u16 idx)
+{
+	return !(idx & vq->num);
+}
+
+static inline u16 vhost_packed_off_wrap(struct vhost_virtqueue *vq, u16 idx)
+{
+	return (idx & (vq->num - 1)) |
+		vhost_packed_wrap(vq, idx) << VRING_PACKED_EVENT_F_WRAP_CTR;
+}
+
+/* Turn a position and wrap counter written by the guest into the count
+ * closest to idx that matches them: they repeat every 2 * num. */
+static u16 vhost_packed_event_idx(struct vhost_virtqueue *vq, u16 off_wrap,
+				  u16 idx)
+{
+	u16 event = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	unsigned int d;
+
+	if (!(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR))
+		event += vq->num;
+	d = (u16)(event - idx) & (2 * vq->num - 1);
+	return d <= vq->num ? idx + d : idx + d - 2 * vq->num;
+}
+
+/* vhost_get_vq_desc for the packed layout.  The guest makes buffers
+ * available in place, so we walk the descriptor ring from last_avail_idx
+ * for as long as the descriptors chain.  The head returned is built by
+ * VHOST_PACKED_HEAD from the id in the last descriptor. */
+static int vhost_get_vq_desc_packed(struct vhost_dev *dev,
+				    struct vhost_virtqueue *vq,
+				    struct iovec iov[], unsigned int iov_size,
+				    unsigned int *out_num, unsigned int *in_num,
+				    struct vhost_log *log,
+				    unsigned int *log_num)
+{
+	struct vring_packed_desc __user *ring = vhost_packed_desc(vq);
+	struct vring_packed_desc desc;
+	unsigned int i, found = 0;
+	u16 flags;
+	int ret;
+
+	i = vq->last_avail_idx & (vq->num - 1);
+	if (unlikely(__get_user(flags, &ring[i].flags))) {
+		vq_err(vq, "Failed to access descriptor flags at %p\n",
+		       &ring[i].flags);
+		return -EFAULT;
+	}
+
+	/* If there's nothing new since last we looked, return invalid. */
+	if (!vring_packed_desc_avail(flags,
+				     vhost_packed_wrap(vq, vq->last_avail_idx)))
+		return vq->num;
+
+	/* Only get the descriptors after they have been exposed by guest. */
+	smp_rmb();
+
+	/* When we start there are none of either input nor output. */
+	*out_num = *in_num = 0;
+	if (unlikely(log))
+		*log_num = 0;
+
+	do {
+		unsigned iov_count = *in_num + *out_num;
+		if (unlikely(++found > vq->num)) {
+			vq_err(vq, "Loop detected: last one at %u "
+			       "vq size %u\n", i, vq->num);
+			return -EINVAL;
+		}
+		ret = __copy_from_user(&desc, ring + i, sizeof desc);
+		if (unlikely(ret)) {
+			vq_err(vq, "Failed to get descriptor: idx %d addr %p\n",
+			       i, ring + i);
+			return -EFAULT;
+		}
+		if (unlikely(desc.flags & VRING_DESC_F_INDIRECT)) {
+			vq_err(vq, "Indirect descriptor in packed ring: "
+			       "idx %d\n", i);
+			return -EINVAL;
+		}
+
+		ret = translate_desc(dev, desc.addr, desc.len, iov + iov_count,
+				     iov_size - iov_count);
+		if (unlikely(ret < 0)) {
+			vq_err(vq, "Translation failure %d descriptor idx %d\n",
+			       ret, i);
+			return ret;
+		}
+		if (desc.flags & VRING_DESC_F_WRITE) {
+			/* If this is an input descriptor,
+			 * increment that count. */
+			*in_num += ret;
+			if (unlikely(log)) {
+				log[*log_num].addr = desc.addr;
+				log[*log_num].len = desc.len;
+				++*log_num;
+			}
+		} else {
+			/* If it's an output descriptor, they're all supposed
+			 * to come before any input descriptors. */
+			if (unlikely(*in_num)) {
+				vq_err(vq, "Descriptor has out after in: "
+				       "idx %d\n", i);
+				return -EINVAL;
+			}
+			*out_num += ret;
+		}
+		i = (i + 1) & (vq->num - 1);
+	} while (desc.flags & VRING_DESC_F_NEXT);
+
+	/* If their number is silly, that's an error. */
+	if (unlikely(desc.id >= vq->num)) {
+		vq_err(vq, "Guest says buffer id %u > %u is available",
+		       desc.id, vq->num);
+		return -EINVAL;
+	}
+
+	/* On success, move past the descriptors, remembering how many there
+	 * were in case the buffer gets discarded. */
+	vq->last_avail_idx += found;
+	vq->packed_ndescs[vq->packed_fetched++ % UIO_MAXIOV] = found;
+
+	/* Assume notifications from guest are disabled at this point,
+	 * if they aren't we would need to update the device event. */
+	BUG_ON(!(vq->used_flags & VRING_USED_F_NO_NOTIFY));
+	return VHOST_PACKED_HEAD(desc.id, found);
+}
+
 /* This looks in the virtqueue and for the first available buffer, and converts
  * it to an iovec for convenient access.  Since descriptors consist of some
  * number of output then some number of input descriptors, it's actually two
@@ -1123,6 +1560,10 @@ int vhost_get_vq_desc(struct vhost_dev *dev, struct vhost_virtqueue *vq,
 	u16 last_avail_idx;
 	int ret;
 
+	if (vhost_has_feature(dev, VIRTIO_RING_F_PACKED))
+		return vhost_get_vq_desc_packed(dev, vq, iov, iov_size,
+						out_num, in_num, log, log_num);
+
 	/* Check it isn't doing very strange things with descriptor numbers. */
 	last_avail_idx = vq->last_avail_idx;
 	if (unlikely(__get_user(vq->avail_idx, &vq->avail->idx))) {
@@ -1146,8 +1587,7 @@ int vhost_get_vq_desc(struct vhost_dev *dev, struct vhost_virtqueue *vq,
 
 	/* Grab the next descriptor number they're advertising, and increment
 	 * the index we've seen. */
-	if (unlikely(__get_user(head,
-				&vq->avail->ring[last_avail_idx % vq->num]))) {
+	if (unlikely(get_avail_head(vq, last_avail_idx, &head))) {
 		vq_err(vq, "Failed to read head: idx %d address %p\n",
 		       last_avail_idx,
 		       &vq->avail->ring[last_avail_idx % vq->num]);
@@ -1238,7 +1678,90 @@ int vhost_get_vq_desc(struct vhost_dev *dev, struct vhost_virtqueue *vq,
 /* Reverse the effect of vhost_get_vq_desc. Useful for error handling. */
 void vhost_discard_vq_desc(struct vhost_virtqueue *vq, int n)
 {
-	vq->last_avail_idx -= n;
+	if (!vhost_has_feature(vq->dev, VIRTIO_RING_F_PACKED)) {
+		vq->last_avail_idx -= n;
+		return;
+	}
+	while (n--)
+		vq->last_avail_idx -=
+			vq->packed_ndescs[--vq->packed_fetched % UIO_MAXIOV];
+}
+
+/* Account count buffers returned to the guest, and the time since the
+ * kick that made them available if this is the first completion since. */
+static void vhost_vq_account_used(struct vhost_virtqueue *vq, unsigned count)
+{
+	u64 kick_ns = vq->kick_ns;
+	int bucket;
+
+	/* Nothing to hold back without a call fd to signal. */
+	if (vq->call_ctx)
+		vq->coalesce_pending += count;
+	vq->stats.used += count;
+	if (!kick_ns)
+		return;
+	vq->kick_ns = 0;
+	bucket = fls64(div_u64(ktime_to_ns(ktime_get()) - kick_ns,
+			       NSEC_PER_USEC));
+	vq->stats.latency[min(bucket, VHOST_LATENCY_BUCKETS - 1)]++;
+}
+
+/* vhost_add_used_n for the packed layout: each buffer is returned by
+ * overwriting the first of its descriptors with its id and length, and
+ * flipping the flags to used. */
+static int vhost_add_used_n_packed(struct vhost_virtqueue *vq,
+				   struct vring_used_elem *heads,
+				   unsigned count)
+{
+	struct vring_packed_desc __user *used;
+	unsigned int i;
+	u16 old, new, idx, flags;
+
+	/* Write all ids and lengths first, so that a single barrier is
+	 * enough to order them before the flags. */
+	idx = vq->last_used_idx;
+	for (i = 0; i < count; ++i) {
+		used = vhost_packed_desc(vq) + (idx & (vq->num - 1));
+		if (__put_user(VHOST_PACKED_ID(heads[i].id), &used->id) ||
+		    __put_user(heads[i].len, &used->len)) {
+			vq_err(vq, "Failed to write used");
+			return -EFAULT;
+		}
+		idx += VHOST_PACKED_NDESCS(heads[i].id);
+	}
+	/* Make sure buffer is written before we update flags. */
+	smp_wmb();
+	idx = vq->last_used_idx;
+	for (i = 0; i < count; ++i) {
+		used = vhost_packed_desc(vq) + (idx & (vq->num - 1));
+		flags = vhost_packed_wrap(vq, idx) ?
+			VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED : 0;
+		if (__put_user(flags, &used->flags)) {
+			vq_err(vq, "Failed to write used flags");
+			return -EFAULT;
+		}
+		idx += VHOST_PACKED_NDESCS(heads[i].id);
+	}
+	if (unlikely(vq->log_used)) {
+		/* Make sure data is seen before log. */
+		smp_wmb();
+		idx = vq->last_used_idx;
+		for (i = 0; i < count; ++i) {
+			log_write(vq->log_base, vq->log_addr +
+				  (idx & (vq->num - 1)) * sizeof *used,
+				  sizeof *used);
+			idx += VHOST_PACKED_NDESCS(heads[i].id);
+		}
+		if (vq->log_ctx)
+			eventfd_signal(vq->log_ctx, 1);
+	}
+	old = vq->last_used_idx;
+	new = vq->last_used_idx = idx;
+	vhost_vq_account_used(vq, count);
+	/* See __vhost_add_used_n. */
+	if (unlikely((u16)(new - vq->signalled_used) < (u16)(new - old)))
+		vq->signalled_used_valid = false;
+	return 0;
 }
 
 /* After we've used one of their buffers, we tell them about it.  We'll then
@@ -1247,6 +1770,12 @@ int vhost_add_used(struct vhost_virtqueue *vq, unsigned int head, int len)
 {
 	struct vring_used_elem __user *used;
 
+	if (vhost_has_feature(vq->dev, VIRTIO_RING_F_PACKED)) {
+		struct vring_used_elem elem = { .id = head, .len = len };
+
+		return vhost_add_used_n_packed(vq, &elem, 1);
+	}
+
 	/* The virtqueue contains a ring of used buffers.  Get a pointer to the
 	 * next entry in that used ring. */
 	used = &vq->used->ring[vq->last_used_idx % vq->num];
@@ -1280,6 +1809,7 @@ int vhost_add_used(struct vhost_virtqueue *vq, unsigned int head, int len)
 			eventfd_signal(vq->log_ctx, 1);
 	}
 	vq->last_used_idx++;
+	vhost_vq_account_used(vq, 1);
 	/* If the driver never bothers to signal in a very long while,
 	 * used index might wrap around. If that happens, invalidate
 	 * signalled_used index we stored. TODO: make sure driver
@@ -1314,6 +1844,7 @@ static int __vhost_add_used_n(struct vhost_virtqueue *vq,
 	}
 	old = vq->last_used_idx;
 	new = (vq->last_used_idx += count);
+	vhost_vq_account_used(vq, count);
 	/* If the driver never bothers to signal in a very long while,
 	 * used index might wrap around. If that happens, invalidate
 	 * signalled_used index we stored. TODO: make sure driver
@@ -1330,6 +1861,9 @@ int vhost_add_used_n(struct vhost_virtqueue *vq, struct vring_used_elem *heads,
 {
 	int start, n, r;
 
+	if (vhost_has_feature(vq->dev, VIRTIO_RING_F_PACKED))
+		return vhost_add_used_n_packed(vq, heads, count);
+
 	start = vq->last_used_idx % vq->num;
 	n = vq->num - start;
 	if (n < count) {
@@ -1358,6 +1892,40 @@ int vhost_add_used_n(struct vhost_virtqueue *vq, struct vring_used_elem *heads,
 	return r;
 }
 
+/* vhost_notify for the packed layout.  The guest asks for interrupts through
+ * the driver event structure.  We can't cheaply tell whether the ring is
+ * empty, so VIRTIO_F_NOTIFY_ON_EMPTY is not honoured. */
+static bool vhost_notify_packed(struct vhost_dev *dev,
+				struct vhost_virtqueue *vq)
+{
+	struct vring_packed_desc_event event;
+	__u16 old, new;
+	bool v;
+
+	if (!vhost_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
+		if (__get_user(event.flags, &vhost_driver_event(vq)->flags)) {
+			vq_err(vq, "Failed to get driver event flags");
+			return true;
+		}
+		return event.flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+	}
+	old = vq->signalled_used;
+	v = vq->signalled_used_valid;
+	new = vq->signalled_used = vq->last_used_idx;
+	vq->signalled_used_valid = true;
+
+	if (__copy_from_user(&event, vhost_driver_event(vq), sizeof event)) {
+		vq_err(vq, "Failed to get driver event");
+		return true;
+	}
+	if (event.flags != VRING_PACKED_EVENT_FLAG_DESC)
+		return event.flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+	if (unlikely(!v))
+		return true;
+	return vring_need_event(vhost_packed_event_idx(vq, event.off_wrap, new),
+				new, old);
+}
+
 static bool vhost_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 {
 	__u16 old, new, event;
@@ -1367,6 +1935,9 @@ static bool vhost_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 	 * interrupts. */
 	smp_mb();
 
+	if (vhost_has_feature(dev, VIRTIO_RING_F_PACKED))
+		return vhost_notify_packed(dev, vq);
+
 	if (vhost_has_feature(dev, VIRTIO_F_NOTIFY_ON_EMPTY) &&
 	    unlikely(vq->avail_idx == vq->last_avail_idx))
 		return true;
@@ -1394,12 +1965,37 @@ static bool vhost_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 	return vring_need_event(event, new, old);
 }
 
-/* This actually signals the guest, using eventfd. */
+static void __vhost_signal(struct vhost_dev *dev, struct vhost_virtqueue *vq)
+{
+	if (vhost_notify(dev, vq)) {
+		eventfd_signal(vq->call_ctx, 1);
+		vq->stats.signals++;
+	} else
+		vq->stats.signals_suppressed++;
+}
+
+/* This actually signals the guest, using eventfd.  With coalescing enabled,
+ * the signal is held back until coalesce_max_packets buffers are used or
+ * the timer expires, whichever comes first. */
 void vhost_signal(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 {
 	/* Signal the Guest tell them we used something up. */
-	if (vq->call_ctx && vhost_notify(dev, vq))
-		eventfd_signal(vq->call_ctx, 1);
+	if (!vq->call_ctx)
+		return;
+	if (vq->coalesce_usecs) {
+		if (!vq->coalesce_max_packets ||
+		    vq->coalesce_pending < vq->coalesce_max_packets) {
+			if (!hrtimer_active(&vq->coalesce_timer))
+				hrtimer_start(&vq->coalesce_timer,
+					      ns_to_ktime(vq->coalesce_usecs *
+							  NSEC_PER_USEC),
+					      HRTIMER_MODE_REL);
+			return;
+		}
+		hrtimer_try_to_cancel(&vq->coalesce_timer);
+	}
+	vq->coalesce_pending = 0;
+	__vhost_signal(dev, vq);
 }
 
 /* And here's the combo meal deal.  Supersize me! */
@@ -1420,6 +2016,57 @@ void vhost_add_used_and_signal_n(struct vhost_dev *dev,
 	vhost_signal(dev, vq);
 }
 
+/* vhost_enable_notify for the packed layout: ask for a kick through the
+ * device event structure, at the next position we'll look at if we have
+ * event indexes. */
+static bool vhost_enable_notify_packed(struct vhost_dev *dev,
+				       struct vhost_virtqueue *vq)
+{
+	struct vring_packed_desc_event __user *event = vhost_device_event(vq);
+	u16 flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+	int r;
+
+	if (vhost_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
+		r = put_user(vhost_packed_off_wrap(vq, vq->last_avail_idx),
+			     &event->off_wrap);
+		if (r) {
+			vq_err(vq, "Failed to update device event at %p: %d\n",
+			       &event->off_wrap, r);
+			return false;
+		}
+		/* Event position needs to be set before the flags. */
+		smp_wmb();
+		flags = VRING_PACKED_EVENT_FLAG_DESC;
+	}
+	r = put_user(flags, &event->flags);
+	if (r) {
+		vq_err(vq, "Failed to enable notification at %p: %d\n",
+		       &event->flags, r);
+		return false;
+	}
+	if (unlikely(vq->log_used)) {
+		/* Make sure data is seen before log. */
+		smp_wmb();
+		log_write(vq->log_base, vq->log_addr +
+			  vring_packed_size(vq->num) - sizeof *event,
+			  sizeof *event);
+		if (vq->log_ctx)
+			eventfd_signal(vq->log_ctx, 1);
+	}
+	/* They could have slipped one in as we were doing that: make
+	 * sure it's written, then check again. */
+	smp_mb();
+	r = __get_user(flags, &vhost_packed_desc(vq)[vq->last_avail_idx &
+						     (vq->num - 1)].flags);
+	if (r) {
+		vq_err(vq, "Failed to check descriptor flags: %d\n", r);
+		return false;
+	}
+
+	return vring_packed_desc_avail(flags,
+				       vhost_packed_wrap(vq, vq->last_avail_idx));
+}
+
 /* OK, now we need to know about added descriptors. */
 bool vhost_enable_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 {
@@ -1429,6 +2076,8 @@ bool vhost_enable_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 	if (!(vq->used_flags & VRING_USED_F_NO_NOTIFY))
 		return false;
 	vq->used_flags &= ~VRING_USED_F_NO_NOTIFY;
+	if (vhost_has_feature(dev, VIRTIO_RING_F_PACKED))
+		return vhost_enable_notify_packed(dev, vq);
 	if (!vhost_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
 		r = put_user(vq->used_flags, &vq->used->flags);
 		if (r) {
@@ -1479,6 +2128,18 @@ void vhost_disable_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 	if (vq->used_flags & VRING_USED_F_NO_NOTIFY)
 		return;
 	vq->used_flags |= VRING_USED_F_NO_NOTIFY;
+	if (vhost_has_feature(dev, VIRTIO_RING_F_PACKED)) {
+		/* With event indexes, the guest won't kick again once past
+		 * the position we last asked for. */
+		if (vhost_has_feature(dev, VIRTIO_RING_F_EVENT_IDX))
+			return;
+		r = put_user(VRING_PACKED_EVENT_FLAG_DISABLE,
+			     &vhost_device_event(vq)->flags);
+		if (r)
+			vq_err(vq, "Failed to disable notification at %p: %d\n",
+			       &vhost_device_event(vq)->flags, r);
+		return;
+	}
 	if (!vhost_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
 		r = put_user(vq->used_flags, &vq->used->flags);
 		if (r)
@@ -7,6 +7,7 @@
 #include <linux/mutex.h>
 #include <linux/poll.h>
 #include <linux/file.h>
+#include <linux/hrtimer.h>
 #include <linux/skbuff.h>
 #include <linux/uio.h>
 #include <linux/virtio_config.h>
@@ -50,6 +51,24 @@ struct vhost_log {
 	u64 len;
 };
 
+/* Max number of available ring entries fetched from the guest at once. */
+#define VHOST_AVAIL_BATCH 64
+
+/* Kick to completion latency histogram: bucket n counts completions that
+ * took less than 2^n usec, the last one everything slower. */
+#define VHOST_LATENCY_BUCKETS 16
+
+/* Per virtqueue counters, exported through debugfs. */
+struct vhost_vq_stats {
+	u64 kicks;		/* notifications received from the guest */
+	u64 wakeups;		/* runs of the virtqueue handler */
+	u64 used;		/* buffers returned to the guest */
+	u64 signals;		/* interrupts sent to the guest */
+	u64 signals_suppressed;	/* interrupts the guest did not want */
+	u64 requeues;		/* handler runs cut short by the weight limit */
+	u64 latency[VHOST_LATENCY_BUCKETS];
+};
+
 /* The virtqueue structure describes a queue attached to a device. */
 struct vhost_virtqueue {
 	struct vhost_dev *dev;
@@ -78,6 +97,12 @@ struct vhost_virtqueue {
 	/* Caches available index value from user. */
 	u16 avail_idx;
 
+	/* Caches avail_cache_num available ring entries, starting at
+	 * avail ring index avail_cache_idx. */
+	u16 avail_cache[VHOST_AVAIL_BATCH];
+	u16 avail_cache_idx;
+	u16 avail_cache_num;
+
 	/* Last index we used. */
 	u16 last_used_idx;
 
@@ -103,6 +128,10 @@ struct vhost_virtqueue {
 	size_t vhost_hlen;
 	size_t sock_hlen;
 	struct vring_used_elem *heads;
+	/* Packed layout: descriptors taken by each of the last UIO_MAXIOV
+	 * buffers we fetched, so that they can be discarded. */
+	u16 *packed_ndescs;
+	unsigned packed_fetched;
 	/* We use a kind of RCU to access private pointer.
 	 * All readers access it from worker, which makes it possible to
 	 * flush the vhost_work instead of synchronize_rcu. Therefore readers do
@@ -114,6 +143,21 @@ struct vhost_virtqueue {
 	/* Log write descriptors */
 	void __user *log_base;
 	struct vhost_log *log;
+
+	struct vhost_vq_stats stats;
+	/* The debugfs file showing them, if any. */
+	struct dentry *stats_dentry;
+	/* Time of the oldest kick not yet followed by a completion, in ns. */
+	u64 kick_ns;
+
+	/* Interrupt coalescing, see VHOST_SET_VRING_COALESCE. */
+	u32 coalesce_usecs;
+	u32 coalesce_max_packets;
+	/* Buffers used since we last signalled. */
+	u32 coalesce_pending;
+	struct hrtimer coalesce_timer;
+	/* The timer runs in interrupt context: it defers to the worker. */
+	struct vhost_work coalesce_work;
 };
 
 struct vhost_dev {
@@ -131,8 +175,12 @@ struct vhost_dev {
 	spinlock_t work_lock;
 	struct list_head work_list;
 	struct task_struct *worker;
+	struct dentry *debugfs;
 };
 
+void vhost_debugfs_init(const char *name);
+void vhost_debugfs_exit(void);
+
 long vhost_dev_init(struct vhost_dev *, struct vhost_virtqueue *vqs, int nvqs);
 long vhost_dev_check_owner(struct vhost_dev *);
 long vhost_dev_reset_owner(struct vhost_dev *);
@@ -171,6 +219,7 @@ enum {
 	VHOST_FEATURES = (1ULL << VIRTIO_F_NOTIFY_ON_EMPTY) |
 			 (1ULL << VIRTIO_RING_F_INDIRECT_DESC) |
 			 (1ULL << VIRTIO_RING_F_EVENT_IDX) |
+			 (1ULL << VIRTIO_RING_F_PACKED) |
 			 (1ULL << VHOST_F_LOG_ALL) |
 			 (1ULL << VHOST_NET_F_VIRTIO_NET_HDR) |
 			 (1ULL << VIRTIO_NET_F_MRG_RXBUF),
@@ -183,7 +232,7 @@ static inline int vhost_has_feature(struct vhost_dev *dev, int bit)
 	/* TODO: check that we are running from vhost_worker or dev mutex is
 	 * held? */
 	acked_features = rcu_dereference_index_check(dev->acked_features, 1);
-	return acked_features & (1 << bit);
+	return !!(acked_features & (1U << bit));
 }
 
 #endif
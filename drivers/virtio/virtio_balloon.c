@@ -25,11 +25,52 @@
 #include <linux/freezer.h>
 #include <linux/delay.h>
 #include <linux/slab.h>
+#include <linux/module.h>
+#include <linux/workqueue.h>
+
+/*
+ * With VIRTIO_BALLOON_F_CHUNKS we balloon 2MB blocks whenever we can, which
+ * saves the host from splitting its huge pages and us from allocating and
+ * reporting pages one by one.
+ */
+#define VIRTIO_BALLOON_CHUNK_ORDER	(21 - PAGE_SHIFT)
+#define VIRTIO_BALLOON_MAX_CHUNKS	256
+
+/* Free page reporting: how often, and how much memory to keep free. */
+#define VIRTIO_BALLOON_REPORT_INTERVAL_MAX	3600
+
+static unsigned int report_interval = 5;
+
+/* A report takes free memory away for a while: not back to back. */
+static int report_interval_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned int n;
+	int err;
+
+	err = kstrtouint(val, 0, &n);
+	if (err)
+		return err;
+	if (n < 1 || n > VIRTIO_BALLOON_REPORT_INTERVAL_MAX)
+		return -EINVAL;
+	*(unsigned int *)kp->arg = n;
+	return 0;
+}
+
+static struct kernel_param_ops report_interval_ops = {
+	.set = report_interval_set,
+	.get = param_get_uint,
+};
+module_param_cb(report_interval, &report_interval_ops, &report_interval, 0644);
+MODULE_PARM_DESC(report_interval, "Seconds between free page reports (1-3600)");
+
+#define VIRTIO_BALLOON_REPORT_GFP	(__GFP_HIGHMEM | __GFP_MOVABLE |     \
+					 __GFP_NORETRY | __GFP_NOWARN |	     \
+					 __GFP_NOMEMALLOC | __GFP_NO_KSWAPD)
 
 struct virtio_balloon
 {
 	struct virtio_device *vdev;
-	struct virtqueue *inflate_vq, *deflate_vq, *stats_vq;
+	struct virtqueue *inflate_vq, *deflate_vq, *stats_vq, *report_vq;
 
 	/* Where the ballooning thread waits for config to change. */
 	wait_queue_head_t config_change;
@@ -37,17 +78,23 @@ struct virtio_balloon
 	/* The thread servicing the balloon. */
 	struct task_struct *thread;
 
-	/* Waiting for host to ack the pages we released. */
-	struct completion acked;
-
-	/* The pages we've told the Host we're not using. */
+	/* The pages we've told the Host we're not using. Higher order
+	 * blocks keep their order in page_private(). */
 	unsigned int num_pages;
 	struct list_head pages;
 
-	/* The array of pfns we tell the Host about. */
+	/* The array of pfns we tell the Host about... */
 	unsigned int num_pfns;
 	u32 pfns[256];
 
+	/* ... or of page ranges, with VIRTIO_BALLOON_F_CHUNKS. */
+	bool use_chunks;
+	struct virtio_balloon_chunk chunks[VIRTIO_BALLOON_MAX_CHUNKS];
+
+	/* Free page reporting */
+	struct delayed_work report_work;
+	struct virtio_balloon_chunk report[VIRTIO_BALLOON_MAX_CHUNKS];
+
 	/* Memory statistics */
 	int need_stats_update;
 	struct virtio_balloon_stat stats[VIRTIO_BALLOON_S_NR];
@@ -69,39 +116,83 @@ static u32 page_to_balloon_pfn(struct page *page)
 
 static void balloon_ack(struct virtqueue *vq)
 {
-	struct virtio_balloon *vb;
+	struct completion *acked;
 	unsigned int len;
 
-	vb = virtqueue_get_buf(vq, &len);
-	if (vb)
-		complete(&vb->acked);
+	acked = virtqueue_get_buf(vq, &len);
+	if (acked)
+		complete(acked);
 }
 
-static void tell_host(struct virtio_balloon *vb, struct virtqueue *vq)
+static void tell_host(struct virtqueue *vq, void *buf, unsigned int len)
 {
+	DECLARE_COMPLETION_ONSTACK(acked);
 	struct scatterlist sg;
 
-	sg_init_one(&sg, vb->pfns, sizeof(vb->pfns[0]) * vb->num_pfns);
-
-	init_completion(&vb->acked);
+	sg_init_one(&sg, buf, len);
 
 	/* We should always be able to add one buffer to an empty queue. */
-	if (virtqueue_add_buf(vq, &sg, 1, 0, vb) < 0)
+	if (virtqueue_add_buf(vq, &sg, 1, 0, &acked) < 0)
 		BUG();
 	virtqueue_kick(vq);
 
 	/* When host has read buffer, this completes via balloon_ack */
-	wait_for_completion(&vb->acked);
+	wait_for_completion(&acked);
+}
+
+/* Queue a block of 2^order pages for the next tell_balloon_host(). */
+static void balloon_add_page(struct virtio_balloon *vb, struct page *page,
+			     unsigned int order)
+{
+	struct virtio_balloon_chunk *chunk;
+
+	if (!vb->use_chunks) {
+		BUG_ON(order);
+		vb->pfns[vb->num_pfns++] = page_to_balloon_pfn(page);
+		return;
+	}
+
+	chunk = &vb->chunks[vb->num_pfns++];
+	chunk->pfn = page_to_balloon_pfn(page);
+	chunk->nr_pages = 1ULL << (order + PAGE_SHIFT - VIRTIO_BALLOON_PFN_SHIFT);
+}
+
+static bool balloon_batch_full(struct virtio_balloon *vb)
+{
+	if (vb->use_chunks)
+		return vb->num_pfns == ARRAY_SIZE(vb->chunks);
+
+	return vb->num_pfns == ARRAY_SIZE(vb->pfns);
+}
+
+static void tell_balloon_host(struct virtio_balloon *vb, struct virtqueue *vq)
+{
+	if (vb->use_chunks)
+		tell_host(vq, vb->chunks, sizeof(vb->chunks[0]) * vb->num_pfns);
+	else
+		tell_host(vq, vb->pfns, sizeof(vb->pfns[0]) * vb->num_pfns);
 }
 
 static void fill_balloon(struct virtio_balloon *vb, size_t num)
 {
-	/* We can only do one array worth at a time. */
-	num = min(num, ARRAY_SIZE(vb->pfns));
+	unsigned int order;
+	struct page *page;
 
-	for (vb->num_pfns = 0; vb->num_pfns < num; vb->num_pfns++) {
-		struct page *page = alloc_page(GFP_HIGHUSER | __GFP_NORETRY |
-					__GFP_NOMEMALLOC | __GFP_NOWARN);
+	/* We can only do one array worth at a time. */
+	for (vb->num_pfns = 0; num && !balloon_batch_full(vb); ) {
+		order = 0;
+		page = NULL;
+		if (vb->use_chunks && num >= (1 << VIRTIO_BALLOON_CHUNK_ORDER)) {
+			order = VIRTIO_BALLOON_CHUNK_ORDER;
+			page = alloc_pages(GFP_HIGHUSER | __GFP_NORETRY |
+					   __GFP_NOMEMALLOC | __GFP_NOWARN,
+					   order);
+			if (!page)
+				order = 0;
+		}
+		if (!page)
+			page = alloc_page(GFP_HIGHUSER | __GFP_NORETRY |
+					  __GFP_NOMEMALLOC | __GFP_NOWARN);
 		if (!page) {
 			if (printk_ratelimit())
 				dev_printk(KERN_INFO, &vb->vdev->dev,
@@ -111,9 +202,11 @@ static void fill_balloon(struct virtio_balloon *vb, size_t num)
 			msleep(200);
 			break;
 		}
-		vb->pfns[vb->num_pfns] = page_to_balloon_pfn(page);
-		totalram_pages--;
-		vb->num_pages++;
+		balloon_add_page(vb, page, order);
+		set_page_private(page, order);
+		totalram_pages -= 1 << order;
+		vb->num_pages += 1 << order;
+		num -= 1 << order;
 		list_add(&page->lru, &vb->pages);
 	}
 
@@ -121,41 +214,94 @@ static void fill_balloon(struct virtio_balloon *vb, size_t num)
 	if (vb->num_pfns == 0)
 		return;
 
-	tell_host(vb, vb->inflate_vq);
-}
-
-static void release_pages_by_pfn(const u32 pfns[], unsigned int num)
-{
-	unsigned int i;
-
-	for (i = 0; i < num; i++) {
-		__free_page(pfn_to_page(pfns[i]));
-		totalram_pages++;
-	}
+	tell_balloon_host(vb, vb->inflate_vq);
 }
 
+/*
+ * A 2MB block is given back whole, even if we were asked for less: the
+ * balloon thread then inflates the difference again with single pages.
+ */
 static void leak_balloon(struct virtio_balloon *vb, size_t num)
 {
-	struct page *page;
+	LIST_HEAD(pages);
+	struct page *page, *next;
+	unsigned int order;
 
 	/* We can only do one array worth at a time. */
-	num = min(num, ARRAY_SIZE(vb->pfns));
-
-	for (vb->num_pfns = 0; vb->num_pfns < num; vb->num_pfns++) {
+	for (vb->num_pfns = 0; num && !balloon_batch_full(vb); ) {
 		page = list_first_entry(&vb->pages, struct page, lru);
-		list_del(&page->lru);
-		vb->pfns[vb->num_pfns] = page_to_balloon_pfn(page);
-		vb->num_pages--;
+		order = page_private(page);
+		list_move(&page->lru, &pages);
+		balloon_add_page(vb, page, order);
+		vb->num_pages -= 1 << order;
+		num -= min_t(size_t, num, 1 << order);
 	}
 
-
 	/*
 	 * Note that if
 	 * virtio_has_feature(vdev, VIRTIO_BALLOON_F_MUST_TELL_HOST);
 	 * is true, we *have* to do it in this order
 	 */
-	tell_host(vb, vb->deflate_vq);
-	release_pages_by_pfn(vb->pfns, vb->num_pfns);
+	tell_balloon_host(vb, vb->deflate_vq);
+
+	list_for_each_entry_safe(page, next, &pages, lru) {
+		order = page_private(page);
+		set_page_private(page, 0);
+		list_del(&page->lru);
+		__free_pages(page, order);
+		totalram_pages += 1 << order;
+	}
+}
+
+/*
+ * Free page reporting: take free 2MB blocks off the buddy allocator, let
+ * the host discard their backing memory, and give them back. The guest
+ * keeps the memory, the host faults it back in when it is used again.
+ *
+ * The blocks are all held until the end of a run, so that we do not get
+ * the same ones over and over, but we stop while a quarter of the memory
+ * is still free for everybody else. Allocations that would need reclaim
+ * or wake kswapd fail instead.
+ */
+static void report_free_pages(struct work_struct *work)
+{
+	struct virtio_balloon *vb = container_of(to_delayed_work(work),
+						 struct virtio_balloon,
+						 report_work);
+	unsigned long reserve = totalram_pages / 4;
+	struct page *page, *next;
+	LIST_HEAD(reported);
+	unsigned int n;
+
+	do {
+		for (n = 0; n < ARRAY_SIZE(vb->report); n++) {
+			if (global_page_state(NR_FREE_PAGES) <
+			    reserve + (1 << VIRTIO_BALLOON_CHUNK_ORDER))
+				break;
+
+			page = alloc_pages(VIRTIO_BALLOON_REPORT_GFP,
+					   VIRTIO_BALLOON_CHUNK_ORDER);
+			if (!page)
+				break;
+
+			list_add(&page->lru, &reported);
+			vb->report[n].pfn = page_to_balloon_pfn(page);
+			vb->report[n].nr_pages = 1ULL << (VIRTIO_BALLOON_CHUNK_ORDER +
+					PAGE_SHIFT - VIRTIO_BALLOON_PFN_SHIFT);
+		}
+
+		if (n)
+			tell_host(vb->report_vq, vb->report,
+				  sizeof(vb->report[0]) * n);
+	} while (n == ARRAY_SIZE(vb->report));
+
+	list_for_each_entry_safe(page, next, &reported, lru) {
+		list_del(&page->lru);
+		__free_pages(page, VIRTIO_BALLOON_CHUNK_ORDER);
+	}
+
+	queue_delayed_work(system_freezable_wq, &vb->report_work,
+			   report_interval * HZ);
 }
 
 static inline void update_stat(struct virtio_balloon *vb, int idx,
@@ -277,10 +423,10 @@ static int balloon(void *_vballoon)
 static int virtballoon_probe(struct virtio_device *vdev)
 {
 	struct virtio_balloon *vb;
-	struct virtqueue *vqs[3];
-	vq_callback_t *callbacks[] = { balloon_ack, balloon_ack, stats_request };
-	const char *names[] = { "inflate", "deflate", "stats" };
-	int err, nvqs;
+	struct virtqueue *vqs[4];
+	vq_callback_t *callbacks[4] = { balloon_ack, balloon_ack };
+	const char *names[4] = { "inflate", "deflate" };
+	int err, nvqs, stats_idx = -1, report_idx = -1;
 
 	vdev->priv = vb = kmalloc(sizeof(*vb), GFP_KERNEL);
 	if (!vb) {
@@ -293,19 +439,32 @@ static int virtballoon_probe(struct virtio_device *vdev)
 	init_waitqueue_head(&vb->config_change);
 	vb->vdev = vdev;
 	vb->need_stats_update = 0;
+	vb->use_chunks = virtio_has_feature(vdev, VIRTIO_BALLOON_F_CHUNKS);
+	vb->stats_vq = vb->report_vq = NULL;
+	INIT_DELAYED_WORK(&vb->report_work, report_free_pages);
 
 	/* We expect two virtqueues: inflate and deflate,
-	 * and optionally stat. */
-	nvqs = virtio_has_feature(vb->vdev, VIRTIO_BALLOON_F_STATS_VQ) ? 3 : 2;
+	 * and optionally stat and free page reporting, in that order. */
+	nvqs = 2;
+	if (virtio_has_feature(vb->vdev, VIRTIO_BALLOON_F_STATS_VQ)) {
+		stats_idx = nvqs++;
+		callbacks[stats_idx] = stats_request;
+		names[stats_idx] = "stats";
+	}
+	if (virtio_has_feature(vb->vdev, VIRTIO_BALLOON_F_REPORTING)) {
+		report_idx = nvqs++;
+		callbacks[report_idx] = balloon_ack;
+		names[report_idx] = "reporting";
+	}
 	err = vdev->config->find_vqs(vdev, nvqs, vqs, callbacks, names);
 	if (err)
 		goto out_free_vb;
 
 	vb->inflate_vq = vqs[0];
 	vb->deflate_vq = vqs[1];
-	if (virtio_has_feature(vb->vdev, VIRTIO_BALLOON_F_STATS_VQ)) {
+	if (stats_idx >= 0) {
 		struct scatterlist sg;
-		vb->stats_vq = vqs[2];
+		vb->stats_vq = vqs[stats_idx];
 
 		/*
 		 * Prime this virtqueue with one buffer so the hypervisor can
@@ -323,6 +482,12 @@ static int virtballoon_probe(struct virtio_device *vdev)
 		goto out_del_vqs;
 	}
 
+	if (report_idx >= 0) {
+		vb->report_vq = vqs[report_idx];
+		queue_delayed_work(system_freezable_wq, &vb->report_work,
+				   report_interval * HZ);
+	}
+
 	return 0;
 
 out_del_vqs:
@@ -337,6 +502,8 @@ static void __devexit virtballoon_remove(struct virtio_device *vdev)
 {
 	struct virtio_balloon *vb = vdev->priv;
 
+	if (vb->report_vq)
+		cancel_delayed_work_sync(&vb->report_work);
 	kthread_stop(vb->thread);
 
 	/* There might be pages left in the balloon: free them. */
@@ -353,6 +520,8 @@ static void __devexit virtballoon_remove(struct virtio_device *vdev)
 static unsigned int features[] = {
 	VIRTIO_BALLOON_F_MUST_TELL_HOST,
 	VIRTIO_BALLOON_F_STATS_VQ,
+	VIRTIO_BALLOON_F_REPORTING,
+	VIRTIO_BALLOON_F_CHUNKS,
 };
 
 static struct virtio_driver virtio_balloon_driver = {
@@ -86,6 +86,9 @@ struct virtio_pci_vq_info
 
 	/* MSI-X vector (or none) */
 	unsigned msix_vector;
+
+	/* CPUs to deliver the vector to, see vp_set_vq_affinity() */
+	cpumask_var_t affinity;
 };
 
 /* Qumranet donated their vendor ID for devices 0x1000 thru 0x10FF. */
@@ -384,11 +387,16 @@ static struct virtqueue *setup_vq(struct virtio_device *vdev, unsigned index,
 	info->num = num;
 	info->msix_vector = msix_vec;
 
+	if (!zalloc_cpumask_var(&info->affinity, GFP_KERNEL)) {
+		err = -ENOMEM;
+		goto out_info;
+	}
+
 	size = PAGE_ALIGN(vring_size(num, VIRTIO_PCI_VRING_ALIGN));
 	info->queue = alloc_pages_exact(size, GFP_KERNEL|__GFP_ZERO);
 	if (info->queue == NULL) {
 		err = -ENOMEM;
-		goto out_info;
+		goto out_affinity;
 	}
 
 	/* activate the queue */
@@ -426,6 +434,8 @@ out_assign:
 out_activate_queue:
 	iowrite32(0, vp_dev->ioaddr + VIRTIO_PCI_QUEUE_PFN);
 	free_pages_exact(info->queue, size);
+out_affinity:
+	free_cpumask_var(info->affinity);
 out_info:
 	kfree(info);
 	return ERR_PTR(err);
@@ -457,6 +467,7 @@ static void vp_del_vq(struct virtqueue *vq)
 
 	size = PAGE_ALIGN(vring_size(info->num, VIRTIO_PCI_VRING_ALIGN));
 	free_pages_exact(info->queue, size);
+	free_cpumask_var(info->affinity);
 	kfree(info);
 }
 
@@ -470,9 +481,12 @@ static void vp_del_vqs(struct virtio_device *vdev)
 	list_for_each_entry_safe(vq, n, &vdev->vqs, list) {
 		info = vq->priv;
 		if (vp_dev->per_vq_vectors &&
-			info->msix_vector != VIRTIO_MSI_NO_VECTOR)
+			info->msix_vector != VIRTIO_MSI_NO_VECTOR) {
+			irq_set_affinity_hint(vp_dev->msix_entries[info->msix_vector].vector,
+					      NULL);
 			free_irq(vp_dev->msix_entries[info->msix_vector].vector,
 				 vq);
+		}
 		vp_del_vq(vq);
 	}
 	vp_dev->per_vq_vectors = false;
@@ -576,6 +590,29 @@ static int vp_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 				  false, false);
 }
 
+/*
+ * The config->set_vq_affinity() implementation: steer the interrupt of a
+ * virtqueue with its own MSI-X vector to the CPUs in mask, which is copied.
+ * Shared vectors are left alone.
+ */
+static int vp_set_vq_affinity(struct virtqueue *vq, const struct cpumask *mask)
+{
+	struct virtio_pci_device *vp_dev = to_vp_device(vq->vdev);
+	struct virtio_pci_vq_info *info = vq->priv;
+	unsigned int irq;
+
+	if (!vp_dev->per_vq_vectors ||
+	    info->msix_vector == VIRTIO_MSI_NO_VECTOR)
+		return 0;
+
+	irq = vp_dev->msix_entries[info->msix_vector].vector;
+	if (!mask)
+		return irq_set_affinity_hint(irq, NULL);
+
+	cpumask_copy(info->affinity, mask);
+	return irq_set_affinity_hint(irq, info->affinity);
+}
+
 static struct virtio_config_ops virtio_pci_config_ops = {
 	.get		= vp_get,
 	.set		= vp_set,
@@ -586,6 +623,7 @@ static struct virtio_config_ops virtio_pci_config_ops = {
 	.del_vqs	= vp_del_vqs,
 	.get_features	= vp_get_features,
 	.finalize_features = vp_finalize_features,
+	.set_vq_affinity = vp_set_vq_affinity,
 };
 
 static void virtio_pci_release_dev(struct device *_d)
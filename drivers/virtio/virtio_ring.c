@@ -76,9 +76,15 @@ struct vring_virtqueue
 	/* Actual memory layout for this queue */
 	struct vring vring;
 
+	/* ... or that, if we use the packed layout. */
+	struct vring_packed vring_packed;
+
 	/* Other side has made a mess, don't try any more. */
 	bool broken;
 
+	/* Host and we use the packed layout */
+	bool packed;
+
 	/* Host supports indirect buffers */
 	bool indirect;
 
@@ -95,6 +101,19 @@ struct vring_virtqueue
 	/* Last used index we've seen. */
 	u16 last_used_idx;
 
+	/* Packed layout: next position we make available and the wrap
+	 * counters for it and for last_used_idx, which is also a position. */
+	u16 next_avail_idx;
+	bool avail_wrap_counter;
+	bool used_wrap_counter;
+
+	/* Packed layout: per buffer id, free id list and descriptor count.
+	 * Buffer ids take the place of the split layout's head indexes. */
+	struct vring_packed_state {
+		u16 next;
+		u16 num;
+	} *packed_state;
+
 	/* How to notify other side. FIXME: commonalize hcalls! */
 	void (*notify)(struct virtqueue *vq);
 
@@ -159,6 +178,81 @@ static int vring_add_indirect(struct vring_virtqueue *vq,
 	return head;
 }
 
+static int virtqueue_add_buf_packed(struct vring_virtqueue *vq,
+				    struct scatterlist sg[],
+				    unsigned int out,
+				    unsigned int in,
+				    void *data)
+{
+	struct vring_packed_desc *desc = vq->vring_packed.desc;
+	unsigned int i, n = out + in, head, pos, id;
+	u16 flags, uninitialized_var(head_flags), avail;
+	bool wrap;
+
+	START_USE(vq);
+
+	BUG_ON(data == NULL);
+	BUG_ON(n > vq->vring_packed.num);
+	BUG_ON(n == 0);
+
+	if (vq->num_free < n) {
+		pr_debug("Can't add buf len %i - avail = %i\n",
+			 n, vq->num_free);
+		/* Same as for the split layout: notify if there are outgoing
+		 * parts to the buffer. */
+		if (out)
+			vq->notify(&vq->vq);
+		END_USE(vq);
+		return -ENOSPC;
+	}
+
+	/* We're about to use some descriptors and a buffer id. */
+	vq->num_free -= n;
+	id = vq->free_head;
+	vq->free_head = vq->packed_state[id].next;
+	vq->packed_state[id].num = n;
+
+	head = pos = vq->next_avail_idx;
+	wrap = vq->avail_wrap_counter;
+	avail = wrap ? VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED;
+	for (i = 0; i < n; i++, sg++) {
+		flags = avail;
+		if (i >= out)
+			flags |= VRING_DESC_F_WRITE;
+		if (i + 1 < n)
+			flags |= VRING_DESC_F_NEXT;
+		desc[pos].addr = sg_phys(sg);
+		desc[pos].len = sg->length;
+		desc[pos].id = id;
+		/* The head is made available last, below. */
+		if (pos == head)
+			head_flags = flags;
+		else
+			desc[pos].flags = flags;
+		if (++pos == vq->vring_packed.num) {
+			pos = 0;
+			wrap = !wrap;
+			avail = wrap ? VRING_PACKED_DESC_F_AVAIL :
+				VRING_PACKED_DESC_F_USED;
+		}
+	}
+	vq->next_avail_idx = pos;
+	vq->avail_wrap_counter = wrap;
+	vq->num_added += n;
+
+	/* Set token. */
+	vq->data[id] = data;
+
+	/* The rest of the chain needs to be set before we expose the head. */
+	virtio_wmb();
+	desc[head].flags = head_flags;
+
+	pr_debug("Added buffer id %i to %p\n", id, vq);
+	END_USE(vq);
+
+	return vq->num_free;
+}
+
 int virtqueue_add_buf_gfp(struct virtqueue *_vq,
 			  struct scatterlist sg[],
 			  unsigned int out,
@@ -170,6 +264,9 @@ int virtqueue_add_buf_gfp(struct virtqueue *_vq,
 	unsigned int i, avail, uninitialized_var(prev);
 	int head;
 
+	if (vq->packed)
+		return virtqueue_add_buf_packed(vq, sg, out, in, data);
+
 	START_USE(vq);
 
 	BUG_ON(data == NULL);
@@ -237,10 +334,53 @@ add_head:
 }
 EXPORT_SYMBOL_GPL(virtqueue_add_buf_gfp);
 
+static void virtqueue_kick_packed(struct vring_virtqueue *vq)
+{
+	struct vring_packed_desc_event *event = vq->vring_packed.device;
+	u16 new, old, off_wrap, event_idx;
+	bool needs_kick;
+
+	START_USE(vq);
+	/* Need to expose the descriptors before checking if we should
+	 * notify. */
+	virtio_mb();
+
+	new = vq->next_avail_idx;
+	old = new - vq->num_added;
+	vq->num_added = 0;
+
+	off_wrap = event->off_wrap;
+	switch (event->flags) {
+	case VRING_PACKED_EVENT_FLAG_DESC:
+		/* Express the event position relative to our wrap counter. */
+		event_idx = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+		if (!!(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) !=
+		    vq->avail_wrap_counter)
+			event_idx -= vq->vring_packed.num;
+		needs_kick = !vq->event ||
+			vring_need_event(event_idx, new, old);
+		break;
+	case VRING_PACKED_EVENT_FLAG_DISABLE:
+		needs_kick = false;
+		break;
+	default:
+		needs_kick = true;
+	}
+	if (needs_kick)
+		/* Prod other side to tell it about changes. */
+		vq->notify(&vq->vq);
+
+	END_USE(vq);
+}
+
 void virtqueue_kick(struct virtqueue *_vq)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
 	u16 new, old;
+
+	if (vq->packed)
+		return virtqueue_kick_packed(vq);
+
 	START_USE(vq);
 	/* Descriptors and available array need to be set before we expose the
 	 * new available array entries. */
@@ -288,17 +428,111 @@ static void detach_buf(struct vring_virtqueue *vq, unsigned int head)
 	vq->num_free++;
 }
 
+static void detach_buf_packed(struct vring_virtqueue *vq, unsigned int id)
+{
+	/* Clear data ptr. */
+	vq->data[id] = NULL;
+
+	/* Give back the descriptors and put the id on the free list. */
+	vq->num_free += vq->packed_state[id].num;
+	vq->packed_state[id].next = vq->free_head;
+	vq->free_head = id;
+}
+
 static inline bool more_used(const struct vring_virtqueue *vq)
 {
+	if (vq->packed)
+		return vring_packed_desc_used(
+			vq->vring_packed.desc[vq->last_used_idx].flags,
+			vq->used_wrap_counter);
 	return vq->last_used_idx != vq->vring.used->idx;
 }
 
+/* Ask for an interrupt once the Host has used the descriptor at position
+ * pos, or for every buffer if we don't have event indexes. */
+static void packed_enable_event(struct vring_virtqueue *vq, u16 pos, bool wrap)
+{
+	struct vring_packed_desc_event *event = vq->vring_packed.driver;
+
+	if (vq->event) {
+		event->off_wrap = pos | (wrap << VRING_PACKED_EVENT_F_WRAP_CTR);
+		/* Event position needs to be set before the flags. */
+		virtio_wmb();
+		event->flags = VRING_PACKED_EVENT_FLAG_DESC;
+	} else
+		event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+}
+
+static void *virtqueue_get_buf_packed(struct vring_virtqueue *vq,
+				      unsigned int *len)
+{
+	struct vring_packed_desc *desc;
+	unsigned int id;
+	void *ret;
+
+	START_USE(vq);
+
+	if (unlikely(vq->broken)) {
+		END_USE(vq);
+		return NULL;
+	}
+
+	if (!more_used(vq)) {
+		pr_debug("No more buffers in queue\n");
+		END_USE(vq);
+		return NULL;
+	}
+
+	/* Only get the rest of the descriptor after the flags say it has been
+	 * used by host. */
+	virtio_rmb();
+
+	desc = &vq->vring_packed.desc[vq->last_used_idx];
+	id = desc->id;
+	*len = desc->len;
+
+	if (unlikely(id >= vq->vring_packed.num)) {
+		BAD_RING(vq, "id %u out of range\n", id);
+		return NULL;
+	}
+	if (unlikely(!vq->data[id])) {
+		BAD_RING(vq, "id %u is not a head!\n", id);
+		return NULL;
+	}
+
+	/* Skip all the descriptors the buffer took up. */
+	vq->last_used_idx += vq->packed_state[id].num;
+	if (vq->last_used_idx >= vq->vring_packed.num) {
+		vq->last_used_idx -= vq->vring_packed.num;
+		vq->used_wrap_counter = !vq->used_wrap_counter;
+	}
+
+	/* detach_buf_packed clears data, so grab it now. */
+	ret = vq->data[id];
+	detach_buf_packed(vq, id);
+	/* If we expect an interrupt for the next entry, tell host
+	 * by writing event index and flush out the write before
+	 * the read in the next get_buf call. */
+	if (vq->event && vq->vring_packed.driver->flags !=
+	    VRING_PACKED_EVENT_FLAG_DISABLE) {
+		packed_enable_event(vq, vq->last_used_idx,
+				    vq->used_wrap_counter);
+		virtio_mb();
+	}
+
+	END_USE(vq);
+	return ret;
+}
+
 void *virtqueue_get_buf(struct virtqueue *_vq, unsigned int *len)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
 	void *ret;
 	unsigned int i;
 
+	if (vq->packed)
+		return virtqueue_get_buf_packed(vq, len);
+
 	START_USE(vq);
 
 	if (unlikely(vq->broken)) {
@@ -348,7 +582,11 @@ void virtqueue_disable_cb(struct virtqueue *_vq)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
 
-	vq->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+	if (vq->packed)
+		vq->vring_packed.driver->flags =
+			VRING_PACKED_EVENT_FLAG_DISABLE;
+	else
+		vq->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
 }
 EXPORT_SYMBOL_GPL(virtqueue_disable_cb);
 
@@ -360,12 +598,19 @@ bool virtqueue_enable_cb(struct virtqueue *_vq)
 
 	/* We optimistically turn back on interrupts, then check if there was
 	 * more to do. */
+	if (vq->packed) {
+		packed_enable_event(vq, vq->last_used_idx,
+				    vq->used_wrap_counter);
+		virtio_mb();
+		goto check;
+	}
 	/* Depending on the VIRTIO_RING_F_EVENT_IDX feature, we need to
 	 * either clear the flags bit or point the event index at the next
 	 * entry. Always do both to keep code simple. */
 	vq->vring.avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
 	vring_used_event(&vq->vring) = vq->last_used_idx;
 	virtio_mb();
+check:
 	if (unlikely(more_used(vq))) {
 		END_USE(vq);
 		return false;
@@ -379,10 +624,32 @@ EXPORT_SYMBOL_GPL(virtqueue_enable_cb);
 bool virtqueue_enable_cb_delayed(struct virtqueue *_vq)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
-	u16 bufs;
+	u16 bufs, pos;
+	bool wrap;
 
 	START_USE(vq);
 
+	if (vq->packed) {
+		/* Ask for an interrupt once 3/4 of the descriptors in flight
+		 * are used.  We only check for the next one below, which may
+		 * give us some extra callbacks, but never a missed one. */
+		bufs = (vq->vring_packed.num - vq->num_free) * 3 / 4;
+		pos = vq->last_used_idx + bufs;
+		wrap = vq->used_wrap_counter;
+		if (pos >= vq->vring_packed.num) {
+			pos -= vq->vring_packed.num;
+			wrap = !wrap;
+		}
+		packed_enable_event(vq, pos, wrap);
+		virtio_mb();
+		if (unlikely(more_used(vq))) {
+			END_USE(vq);
+			return false;
+		}
+		END_USE(vq);
+		return true;
+	}
+
 	/* We optimistically turn back on interrupts, then check if there was
 	 * more to do. */
 	/* Depending on the VIRTIO_RING_F_USED_EVENT_IDX feature, we need to
@@ -416,8 +683,12 @@ void *virtqueue_detach_unused_buf(struct virtqueue *_vq)
 			continue;
 		/* detach_buf clears data, so grab it now. */
 		buf = vq->data[i];
-		detach_buf(vq, i);
-		vq->vring.avail->idx--;
+		if (vq->packed) {
+			detach_buf_packed(vq, i);
+		} else {
+			detach_buf(vq, i);
+			vq->vring.avail->idx--;
+		}
 		END_USE(vq);
 		return buf;
 	}
@@ -429,6 +700,14 @@ void *virtqueue_detach_unused_buf(struct virtqueue *_vq)
 }
 EXPORT_SYMBOL_GPL(virtqueue_detach_unused_buf);
 
+unsigned int virtqueue_get_vring_size(struct virtqueue *_vq)
+{
+	struct vring_virtqueue *vq = to_vvq(_vq);
+
+	return vq->vring.num;
+}
+EXPORT_SYMBOL_GPL(virtqueue_get_vring_size);
+
 irqreturn_t vring_interrupt(int irq, void *_vq)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
@@ -459,6 +738,7 @@ struct virtqueue *vring_new_virtqueue(unsigned int num,
 {
 	struct vring_virtqueue *vq;
 	unsigned int i;
+	bool packed = virtio_has_feature(vdev, VIRTIO_RING_F_PACKED);
 
 	/* We assume num is a power of 2. */
 	if (num & (num - 1)) {
@@ -466,11 +746,24 @@ struct virtqueue *vring_new_virtqueue(unsigned int num,
 		return NULL;
 	}
 
-	vq = kmalloc(sizeof(*vq) + sizeof(void *)*num, GFP_KERNEL);
+	vq = kmalloc(sizeof(*vq) + sizeof(void *)*num +
+		     (packed ? sizeof(*vq->packed_state) * num : 0),
+		     GFP_KERNEL);
 	if (!vq)
 		return NULL;
 
+	/* The split layout is never smaller than the packed one, so callers
+	 * can keep sizing the ring with vring_size(). num is kept in vring
+	 * for both, it's used by the common code. */
 	vring_init(&vq->vring, num, pages, vring_align);
+	vq->packed = packed;
+	if (packed) {
+		vring_packed_init(&vq->vring_packed, num, pages);
+		vq->packed_state = (void *)&vq->data[num];
+	}
+	vq->next_avail_idx = 0;
+	vq->avail_wrap_counter = true;
+	vq->used_wrap_counter = true;
 	vq->vq.callback = callback;
 	vq->vq.vdev = vdev;
 	vq->vq.name = name;
@@ -483,18 +776,27 @@ struct virtqueue *vring_new_virtqueue(unsigned int num,
 	vq->in_use = false;
 #endif
 
-	vq->indirect = virtio_has_feature(vdev, VIRTIO_RING_F_INDIRECT_DESC);
+	vq->indirect = virtio_has_feature(vdev, VIRTIO_RING_F_INDIRECT_DESC) &&
+		!packed;
 	vq->event = virtio_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
 
 	/* No callback?  Tell other side not to bother us. */
-	if (!callback)
-		vq->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+	if (!callback) {
+		if (packed)
+			vq->vring_packed.driver->flags =
+				VRING_PACKED_EVENT_FLAG_DISABLE;
+		else
+			vq->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+	}
 
 	/* Put everything in free lists. */
 	vq->num_free = num;
 	vq->free_head = 0;
 	for (i = 0; i < num-1; i++) {
-		vq->vring.desc[i].next = i+1;
+		if (packed)
+			vq->packed_state[i].next = i+1;
+		else
+			vq->vring.desc[i].next = i+1;
 		vq->data[i] = NULL;
 	}
 	vq->data[i] = NULL;
@@ -521,6 +823,8 @@ void vring_transport_features(struct virtio_device *vdev)
 			break;
 		case VIRTIO_RING_F_EVENT_IDX:
 			break;
+		case VIRTIO_RING_F_PACKED:
+			break;
 		default:
 			/* We don't understand this bit. */
 			clear_bit(i, vdev->features);
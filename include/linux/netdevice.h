@@ -373,12 +373,18 @@ struct napi_struct {
 	struct list_head	dev_list;
 	struct sk_buff		*gro_list;
 	struct sk_buff		*skb;
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	/* Lookup key for busy polling sockets, see napi_hash_add() */
+	unsigned int		napi_id;
+	struct hlist_node	napi_hash_node;
+#endif
 };
 
 enum {
 	NAPI_STATE_SCHED,	/* Poll is scheduled */
 	NAPI_STATE_DISABLE,	/* Disable pending */
 	NAPI_STATE_NPSVC,	/* Netpoll - don't dequeue from poll_list */
+	NAPI_STATE_HASHED,	/* In NAPI hash, for busy polling */
 };
 
 enum gro_result {
@@ -810,6 +816,11 @@ struct netdev_tc_txq {
  *
  * void (*ndo_poll_controller)(struct net_device *dev);
  *
+ * int (*ndo_busy_poll)(struct napi_struct *napi);
+ *	Called from a process waiting for data on a socket, to poll the
+ *	receive queue behind napi directly. Returns the number of packets
+ *	received, or a negative value if the queue could not be polled.
+ *
  *	SR-IOV management functions.
  * int (*ndo_set_vf_mac)(struct net_device *dev, int vf, u8* mac);
  * int (*ndo_set_vf_vlan)(struct net_device *dev, int vf, u16 vlan, u8 qos);
@@ -930,6 +941,9 @@ struct net_device_ops {
 	int			(*ndo_netpoll_setup)(struct net_device *dev,
 						     struct netpoll_info *info);
 	void			(*ndo_netpoll_cleanup)(struct net_device *dev);
+#endif
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	int			(*ndo_busy_poll)(struct napi_struct *napi);
 #endif
 	int			(*ndo_set_vf_mac)(struct net_device *dev,
 						  int queue, u8 *mac);
@@ -1521,6 +1535,35 @@ void netif_napi_add(struct net_device *dev, struct napi_struct *napi,
  */
 void netif_napi_del(struct napi_struct *napi);
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+/**
+ *  napi_hash_add - make a napi context available to busy polling sockets
+ *  @napi: napi context
+ *
+ *  Gives @napi an id that is recorded in the packets it receives, so that
+ *  sockets can find it again, see include/net/busy_poll.h.
+ */
+void napi_hash_add(struct napi_struct *napi);
+
+/**
+ *  napi_hash_del - remove a napi context from the busy polling hash
+ *  @napi: napi context
+ *
+ *  Readers use RCU: the napi context must not be freed before a grace
+ *  period has elapsed, which unregister_netdev() takes care of.
+ */
+void napi_hash_del(struct napi_struct *napi);
+struct napi_struct *napi_by_id(unsigned int napi_id);
+#else
+static inline void napi_hash_add(struct napi_struct *napi)
+{
+}
+
+static inline void napi_hash_del(struct napi_struct *napi)
+{
+}
+#endif
+
 struct napi_gro_cb {
 	/* Virtual address of skb_shinfo(skb)->frags[0].page + offset. */
 	void *frag0;
@@ -47,6 +47,14 @@ struct vhost_vring_addr {
 	__u64 log_guest_addr;
 };
 
+struct vhost_vring_coalesce {
+	unsigned int index;
+	/* Delay interrupts by up to usecs microseconds. 0 disables coalescing. */
+	unsigned int usecs;
+	/* But interrupt as soon as max_packets buffers are used, if non 0. */
+	unsigned int max_packets;
+};
+
 struct vhost_memory_region {
 	__u64 guest_phys_addr;
 	__u64 memory_size; /* bytes */
@@ -98,10 +106,15 @@ struct vhost_memory {
 #define VHOST_SET_VRING_NUM _IOW(VHOST_VIRTIO, 0x10, struct vhost_vring_state)
 /* Set addresses for the ring. */
 #define VHOST_SET_VRING_ADDR _IOW(VHOST_VIRTIO, 0x11, struct vhost_vring_addr)
-/* Base value where queue looks for available descriptors */
+/* Base value where queue looks for available descriptors.  With
+ * VIRTIO_RING_F_PACKED this counts descriptors rather than buffers, modulo
+ * 2^16: the ring position is the value modulo the ring size, and the next
+ * bit is set when the wrap counter is 0. */
 #define VHOST_SET_VRING_BASE _IOW(VHOST_VIRTIO, 0x12, struct vhost_vring_state)
 /* Get accessor: reads index, writes value in num */
 #define VHOST_GET_VRING_BASE _IOWR(VHOST_VIRTIO, 0x12, struct vhost_vring_state)
+/* Interrupt coalescing parameters */
+#define VHOST_SET_VRING_COALESCE _IOW(VHOST_VIRTIO, 0x13, struct vhost_vring_coalesce)
 
 /* The following ioctls use eventfd file descriptors to signal and poll
  * for events. */
@@ -118,7 +131,10 @@ struct vhost_memory {
 /* Attach virtio net ring to a raw socket, or tap device.
  * The socket must be already bound to an ethernet device, this device will be
  * used for transmit.  Pass fd -1 to unbind from the socket and the transmit
- * device.  This can be used to stop the ring (e.g. for migration). */
+ * device.  This can be used to stop the ring (e.g. for migration).
+ * With VHOST_NET_F_VIRTIO_NET_HDR, a raw socket that has PACKET_VNET_HDR set
+ * is handed the offload part of the header rather than having it stripped;
+ * vhost does not set the option itself. */
 #define VHOST_NET_SET_BACKEND _IOW(VHOST_VIRTIO, 0x30, struct vhost_vring_file)
 
 /* Feature bits */
@@ -31,6 +31,13 @@
 /* The feature bitmap for virtio balloon */
 #define VIRTIO_BALLOON_F_MUST_TELL_HOST	0 /* Tell before reclaiming pages */
 #define VIRTIO_BALLOON_F_STATS_VQ	1 /* Memory Stats virtqueue */
+/*
+ * Neither of these is the virtio spec's: its free page reporting (bit 5)
+ * has another format. They are kept at the top of the device range, well
+ * clear of the bits the spec assigns.
+ */
+#define VIRTIO_BALLOON_F_REPORTING	22 /* Free page reporting virtqueue */
+#define VIRTIO_BALLOON_F_CHUNKS		23 /* Inflate/deflate page ranges */
 
 /* Size of a PFN in the balloon interface. */
 #define VIRTIO_BALLOON_PFN_SHIFT 12
@@ -43,6 +50,16 @@ struct virtio_balloon_config
 	__le32 actual;
 };
 
+/*
+ * A range of pages, in VIRTIO_BALLOON_PFN_SHIFT units. With
+ * VIRTIO_BALLOON_F_CHUNKS, inflate and deflate buffers are arrays of these
+ * instead of arrays of 32-bit pfns. Free page reports always use them.
+ */
+struct virtio_balloon_chunk {
+	__u64 pfn;
+	__u64 nr_pages;
+};
+
 #define VIRTIO_BALLOON_S_SWAP_IN  0   /* Amount of memory swapped in */
 #define VIRTIO_BALLOON_S_SWAP_OUT 1   /* Amount of memory swapped out */
 #define VIRTIO_BALLOON_S_MAJFLT   2   /* Number of major faults */
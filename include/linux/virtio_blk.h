@@ -39,6 +39,9 @@
 #define VIRTIO_BLK_F_SCSI	7	/* Supports scsi command passthru */
 #define VIRTIO_BLK_F_FLUSH	9	/* Cache flush command support */
 #define VIRTIO_BLK_F_TOPOLOGY	10	/* Topology information is available */
+#define VIRTIO_BLK_F_MQ		12	/* Support more than one request vq */
+#define VIRTIO_BLK_F_DISCARD	13	/* DISCARD is supported */
+#define VIRTIO_BLK_F_WRITE_ZEROES	14	/* WRITE ZEROES is supported */
 
 #define VIRTIO_BLK_ID_BYTES	20	/* ID string length */
 
@@ -69,6 +72,29 @@ struct virtio_blk_config {
 	/* optimal sustained I/O size in logical blocks. */
 	__u32 opt_io_size;
 
+	/* writeback mode (if VIRTIO_BLK_F_CONFIG_WCE) */
+	__u8 wce;
+	__u8 unused0[1];
+
+	/* number of request virtqueues (if VIRTIO_BLK_F_MQ) */
+	__u16 num_queues;
+
+	/* the next 3 entries are guarded by VIRTIO_BLK_F_DISCARD */
+	/* maximum discard sectors for one segment. */
+	__u32 max_discard_sectors;
+	/* maximum number of discard segments in a command. */
+	__u32 max_discard_seg;
+	/* discard commands must be aligned to this number of sectors. */
+	__u32 discard_sector_alignment;
+
+	/* the next 3 entries are guarded by VIRTIO_BLK_F_WRITE_ZEROES */
+	/* maximum write zeroes sectors for one segment. */
+	__u32 max_write_zeroes_sectors;
+	/* maximum number of write zeroes segments in a command. */
+	__u32 max_write_zeroes_seg;
+	/* the device may unmap the range of a write zeroes command. */
+	__u8 write_zeroes_may_unmap;
+	__u8 unused1[3];
 } __attribute__((packed));
 
 /*
@@ -95,6 +121,12 @@ struct virtio_blk_config {
 /* Get device ID command */
 #define VIRTIO_BLK_T_GET_ID    8
 
+/* Discard command */
+#define VIRTIO_BLK_T_DISCARD	11
+
+/* Write zeroes command */
+#define VIRTIO_BLK_T_WRITE_ZEROES	13
+
 /* Barrier before this op. */
 #define VIRTIO_BLK_T_BARRIER	0x80000000
 
@@ -108,6 +140,19 @@ struct virtio_blk_outhdr {
 	__u64 sector;
 };
 
+/* Unmap this range (only valid for write zeroes command) */
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP	0x00000001
+
+/* Discard/write zeroes range, the out data of those commands. */
+struct virtio_blk_discard_write_zeroes {
+	/* Sector (ie. 512 byte offset) */
+	__u64 sector;
+	/* Number of sectors */
+	__u32 num_sectors;
+	/* VIRTIO_BLK_WRITE_ZEROES_FLAG_* */
+	__u32 flags;
+};
+
 struct virtio_scsi_inhdr {
 	__u32 errors;
 	__u32 data_len;
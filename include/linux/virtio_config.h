@@ -100,6 +100,10 @@
  *	vdev: the virtio_device
  *	This gives the final feature bits for the device: it can change
  *	the dev->feature bits if it wants.
+ * @set_vq_affinity: set the CPUs a virtqueue's interrupt should go to.
+ *	vq: the virtqueue
+ *	mask: the CPUs, or NULL to let the system decide again.
+ *	Optional; transports without per-virtqueue interrupts ignore it.
  */
 typedef void vq_callback_t(struct virtqueue *);
 struct virtio_config_ops {
@@ -117,6 +121,8 @@ struct virtio_config_ops {
 	void (*del_vqs)(struct virtio_device *);
 	u32 (*get_features)(struct virtio_device *vdev);
 	void (*finalize_features)(struct virtio_device *vdev);
+	int (*set_vq_affinity)(struct virtqueue *vq,
+			       const struct cpumask *mask);
 };
 
 /* If driver didn't advertise the feature, it will never appear. */
@@ -167,6 +173,24 @@ static inline int virtio_config_buf(struct virtio_device *vdev,
 	return 0;
 }
 
+/**
+ * virtqueue_set_affinity - route a virtqueue's interrupt to some CPUs
+ * @vq: the virtqueue
+ * @mask: the CPUs, typically those submitting to @vq, or NULL to reset
+ *
+ * Multiqueue drivers use this so that completions are handled where the
+ * requests came from, not wherever irqbalance put the interrupt.
+ */
+static inline int virtqueue_set_affinity(struct virtqueue *vq,
+					 const struct cpumask *mask)
+{
+	struct virtio_device *vdev = vq->vdev;
+
+	if (vdev->config->set_vq_affinity)
+		return vdev->config->set_vq_affinity(vq, mask);
+	return 0;
+}
+
 static inline
 struct virtqueue *virtio_find_single_vq(struct virtio_device *vdev,
 					vq_callback_t *c, const char *n)
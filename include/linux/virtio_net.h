@@ -33,6 +33,7 @@
 /* The feature bitmap for virtio net */
 #define VIRTIO_NET_F_CSUM	0	/* Host handles pkts w/ partial csum */
 #define VIRTIO_NET_F_GUEST_CSUM	1	/* Guest handles pkts w/ partial csum */
+#define VIRTIO_NET_F_CTRL_COALESCE 4	/* Interrupt coalescing control */
 #define VIRTIO_NET_F_MAC	5	/* Host has given MAC address. */
 #define VIRTIO_NET_F_GSO	6	/* Host handles pkts w/ any GSO type */
 #define VIRTIO_NET_F_GUEST_TSO4	7	/* Guest can handle TSOv4 in. */
@@ -49,6 +50,7 @@
 #define VIRTIO_NET_F_CTRL_RX	18	/* Control channel RX mode support */
 #define VIRTIO_NET_F_CTRL_VLAN	19	/* Control channel VLAN filtering */
 #define VIRTIO_NET_F_CTRL_RX_EXTRA 20	/* Extra RX mode control support */
+#define VIRTIO_NET_F_MQ		22	/* Device supports multiqueue */
 
 #define VIRTIO_NET_S_LINK_UP	1	/* Link is up */
 
@@ -57,6 +59,9 @@ struct virtio_net_config {
 	__u8 mac[6];
 	/* See VIRTIO_NET_F_STATUS and VIRTIO_NET_S_* above */
 	__u16 status;
+	/* Maximum number of each of transmit and receive queues;
+	 * see VIRTIO_NET_F_MQ and VIRTIO_NET_CTRL_MQ. */
+	__u16 max_virtqueue_pairs;
 } __attribute__((packed));
 
 /* This is the first element of the scatter-gather list.  If you don't
@@ -151,4 +156,43 @@ struct virtio_net_ctrl_mac {
  #define VIRTIO_NET_CTRL_VLAN_ADD             0
  #define VIRTIO_NET_CTRL_VLAN_DEL             1
 
+/*
+ * Control interrupt coalescing
+ *
+ * The host holds back the interrupt for used buffers by up to usecs
+ * microseconds, or until max_packets buffers were used if non zero.
+ * A usecs of zero interrupts right away.  Both commands expect an out
+ * entry containing a struct virtio_net_ctrl_coalesce.  Coalescing
+ * control is available with the VIRTIO_NET_F_CTRL_COALESCE feature bit.
+ * Neither the class nor the feature bit are the spec's, they stay clear of
+ * the values it allocates.
+ */
+struct virtio_net_ctrl_coalesce {
+	__u32 usecs;
+	__u32 max_packets;
+};
+
+#define VIRTIO_NET_CTRL_COALESCE   64
+ #define VIRTIO_NET_CTRL_COALESCE_RX_SET      0
+ #define VIRTIO_NET_CTRL_COALESCE_TX_SET      1
+
+/*
+ * Control multiqueue
+ *
+ * The driver tells the device how many queue pairs it uses, between
+ * VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN and max_virtqueue_pairs from the config
+ * space, with an out entry containing a struct virtio_net_ctrl_mq.  Pair
+ * n is made of receive queue 2n and transmit queue 2n + 1, the control
+ * queue then follows the last pair.  Multiqueue is available with the
+ * VIRTIO_NET_F_MQ feature bit.
+ */
+struct virtio_net_ctrl_mq {
+	__u16 virtqueue_pairs;
+};
+
+#define VIRTIO_NET_CTRL_MQ   4
+ #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET        0
+ #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN        1
+ #define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX        0x8000
+
 #endif /* _LINUX_VIRTIO_NET_H */
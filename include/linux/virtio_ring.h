@@ -58,6 +58,11 @@
  * at the end of the used ring. Guest should ignore the used->flags field. */
 #define VIRTIO_RING_F_EVENT_IDX		29
 
+/* The Guest and Host use the packed layout described below: a single ring
+ * of descriptors made available and used in place.  Indirect descriptors
+ * are not used with this layout. */
+#define VIRTIO_RING_F_PACKED		31
+
 /* Virtio ring descriptors: 16 bytes.  These can chain together via "next". */
 struct vring_desc {
 	/* Address (guest-physical). */
@@ -124,6 +129,96 @@ struct vring {
  *	__u16 avail_event_idx;
  * };
  */
+/* The packed layout replaces all of the above with one ring of descriptors.
+ * The Guest writes a buffer's descriptors at consecutive positions and makes
+ * them available by setting the AVAIL flag to its wrap counter and the USED
+ * flag to the inverse, writing the flags of the first descriptor last.  The
+ * Host returns a buffer by writing a single descriptor, with the buffer id
+ * and the length written, at its own used position and setting both flags
+ * to its wrap counter, then skips as many positions as the buffer had
+ * descriptors.  Wrap counters start at 1 and flip each time a position
+ * wraps around to 0.  The buffer id is that of the last descriptor.
+ *
+ * struct vring_packed
+ * {
+ *	// The descriptor ring (16 bytes each)
+ *	struct vring_packed_desc desc[num];
+ *
+ *	// Written by the Guest: when to interrupt it.
+ *	struct vring_packed_desc_event driver;
+ *
+ *	// Written by the Host: when to kick it.
+ *	struct vring_packed_desc_event device;
+ * };
+ */
+#define VRING_PACKED_DESC_F_AVAIL	(1 << 7)
+#define VRING_PACKED_DESC_F_USED	(1 << 15)
+
+/* Event suppression: notify always, never, or once the ring position and
+ * wrap counter in off_wrap have been reached. The last one is only used
+ * with VIRTIO_RING_F_EVENT_IDX. */
+#define VRING_PACKED_EVENT_FLAG_ENABLE	0
+#define VRING_PACKED_EVENT_FLAG_DISABLE	1
+#define VRING_PACKED_EVENT_FLAG_DESC	2
+#define VRING_PACKED_EVENT_F_WRAP_CTR	15
+
+struct vring_packed_desc {
+	/* Address (guest-physical). */
+	__u64 addr;
+	/* Length. */
+	__u32 len;
+	/* Buffer id. */
+	__u16 id;
+	/* The flags as indicated above. */
+	__u16 flags;
+};
+
+struct vring_packed_desc_event {
+	/* Ring position (bits 0-14) and wrap counter (bit 15). */
+	__u16 off_wrap;
+	/* VRING_PACKED_EVENT_FLAG_* */
+	__u16 flags;
+};
+
+struct vring_packed {
+	unsigned int num;
+
+	struct vring_packed_desc *desc;
+
+	struct vring_packed_desc_event *driver;
+
+	struct vring_packed_desc_event *device;
+};
+
+static inline void vring_packed_init(struct vring_packed *vr, unsigned int num,
+				     void *p)
+{
+	vr->num = num;
+	vr->desc = p;
+	vr->driver = p + num * sizeof(struct vring_packed_desc);
+	vr->device = vr->driver + 1;
+}
+
+static inline unsigned vring_packed_size(unsigned int num)
+{
+	return sizeof(struct vring_packed_desc) * num +
+		sizeof(struct vring_packed_desc_event) * 2;
+}
+
+/* Is the descriptor with these flags available to a Host whose wrap counter
+ * is wrap?  Is it used, for a Guest whose wrap counter is wrap? */
+static inline int vring_packed_desc_avail(__u16 flags, int wrap)
+{
+	return !!(flags & VRING_PACKED_DESC_F_AVAIL) == wrap &&
+	       !!(flags & VRING_PACKED_DESC_F_USED) != wrap;
+}
+
+static inline int vring_packed_desc_used(__u16 flags, int wrap)
+{
+	return !!(flags & VRING_PACKED_DESC_F_AVAIL) == wrap &&
+	       !!(flags & VRING_PACKED_DESC_F_USED) == wrap;
+}
+
 /* We publish the used event index at the end of the available ring, and vice
  * versa. They are at the end for backwards compatibility. */
 #define vring_used_event(vr) ((vr)->avail->ring[(vr)->num])
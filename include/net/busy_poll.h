@@ -0,0 +1,72 @@
+/*
+ * Busy polling of network devices from sockets waiting for data.
+ *
+ * A process blocked in recvmsg() on a socket can poll the receive queue
+ * that feeds the socket instead of sleeping until the interrupt, softirq
+ * and wakeup have run, trading CPU time for latency. Drivers opt in by
+ * implementing ndo_busy_poll() and calling napi_hash_add(). Packets carry
+ * the id of the NAPI context that received them to the socket.
+ *
+ * net.core.busy_read sets how many microseconds to spin, 0 disables it.
+ */
+#ifndef _LINUX_NET_BUSY_POLL_H
+#define _LINUX_NET_BUSY_POLL_H
+
+#include <linux/netdevice.h>
+#include <linux/sched.h>
+#include <net/sock.h>
+
+#ifdef CONFIG_NET_RX_BUSY_POLL
+
+extern unsigned int sysctl_net_busy_read __read_mostly;
+
+/* a cheap, roughly microsecond resolution clock */
+static inline u64 busy_loop_us_clock(void)
+{
+	return local_clock() >> 10;
+}
+
+static inline bool sk_can_busy_loop(struct sock *sk)
+{
+	return ACCESS_ONCE(sysctl_net_busy_read) && sk->sk_napi_id &&
+	       !need_resched() && !signal_pending(current);
+}
+
+bool sk_busy_loop(struct sock *sk, int nonblock);
+
+/* used in the NIC receive handler to mark the skb */
+static inline void skb_mark_napi_id(struct sk_buff *skb,
+				    struct napi_struct *napi)
+{
+	skb->napi_id = napi->napi_id;
+}
+
+/* used in the protocol handler to propagate the napi_id to the socket */
+static inline void sk_mark_napi_id(struct sock *sk, struct sk_buff *skb)
+{
+	sk->sk_napi_id = skb->napi_id;
+}
+
+#else /* CONFIG_NET_RX_BUSY_POLL */
+
+static inline bool sk_can_busy_loop(struct sock *sk)
+{
+	return false;
+}
+
+static inline bool sk_busy_loop(struct sock *sk, int nonblock)
+{
+	return false;
+}
+
+static inline void skb_mark_napi_id(struct sk_buff *skb,
+				    struct napi_struct *napi)
+{
+}
+
+static inline void sk_mark_napi_id(struct sock *sk, struct sk_buff *skb)
+{
+}
+
+#endif /* CONFIG_NET_RX_BUSY_POLL */
+#endif /* _LINUX_NET_BUSY_POLL_H */
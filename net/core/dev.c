@@ -133,6 +133,7 @@
 #include <linux/pci.h>
 #include <linux/inetdevice.h>
 #include <linux/cpu_rmap.h>
+#include <net/busy_poll.h>
 
 #include "net-sysfs.h"
 
@@ -3747,6 +3748,7 @@ void netif_napi_del(struct napi_struct *napi)
 {
 	struct sk_buff *skb, *next;
 
+	napi_hash_del(napi);
 	list_del_init(&napi->dev_list);
 	napi_free_frags(napi);
 
@@ -3761,6 +3763,102 @@ void netif_napi_del(struct napi_struct *napi)
 }
 EXPORT_SYMBOL(netif_napi_del);
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+#define NAPI_HASH_BITS	8
+
+static DEFINE_SPINLOCK(napi_hash_lock);
+static struct hlist_head napi_hash[1 << NAPI_HASH_BITS];
+static unsigned int napi_gen_id;
+
+unsigned int sysctl_net_busy_read __read_mostly;
+
+/* must be called under rcu_read_lock(), as we dont take a reference */
+struct napi_struct *napi_by_id(unsigned int napi_id)
+{
+	struct hlist_head *head = &napi_hash[hash_32(napi_id, NAPI_HASH_BITS)];
+	struct hlist_node *node;
+	struct napi_struct *napi;
+
+	hlist_for_each_entry_rcu(napi, node, head, napi_hash_node)
+		if (napi->napi_id == napi_id)
+			return napi;
+
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(napi_by_id);
+
+void napi_hash_add(struct napi_struct *napi)
+{
+	if (test_and_set_bit(NAPI_STATE_HASHED, &napi->state))
+		return;
+
+	spin_lock(&napi_hash_lock);
+
+	/* 0 is not a valid id, skip it and ids still in use */
+	do {
+		if (unlikely(!++napi_gen_id))
+			napi_gen_id = 1;
+	} while (napi_by_id(napi_gen_id));
+
+	napi->napi_id = napi_gen_id;
+	hlist_add_head_rcu(&napi->napi_hash_node,
+			   &napi_hash[hash_32(napi->napi_id, NAPI_HASH_BITS)]);
+
+	spin_unlock(&napi_hash_lock);
+}
+EXPORT_SYMBOL_GPL(napi_hash_add);
+
+void napi_hash_del(struct napi_struct *napi)
+{
+	spin_lock(&napi_hash_lock);
+
+	if (test_and_clear_bit(NAPI_STATE_HASHED, &napi->state))
+		hlist_del_rcu(&napi->napi_hash_node);
+
+	spin_unlock(&napi_hash_lock);
+}
+EXPORT_SYMBOL_GPL(napi_hash_del);
+
+/**
+ *	sk_busy_loop - poll the device a socket receives from
+ *	@sk: socket waiting for data
+ *	@nonblock: poll once instead of spinning
+ *
+ *	Calls the ndo_busy_poll() of the NAPI context that last delivered a
+ *	packet to @sk until data shows up in its receive queue, for at most
+ *	sysctl_net_busy_read microseconds. Returns true if there is data.
+ */
+bool sk_busy_loop(struct sock *sk, int nonblock)
+{
+	u64 end_time = busy_loop_us_clock() + ACCESS_ONCE(sysctl_net_busy_read);
+	const struct net_device_ops *ops;
+	struct napi_struct *napi;
+	bool rc = false;
+
+	rcu_read_lock_bh();
+
+	napi = napi_by_id(sk->sk_napi_id);
+	if (!napi)
+		goto out;
+
+	ops = napi->dev->netdev_ops;
+	if (!ops->ndo_busy_poll)
+		goto out;
+
+	do {
+		ops->ndo_busy_poll(napi);
+		cpu_relax();
+	} while (!nonblock && skb_queue_empty(&sk->sk_receive_queue) &&
+		 !need_resched() && busy_loop_us_clock() < end_time);
+
+	rc = !skb_queue_empty(&sk->sk_receive_queue);
+out:
+	rcu_read_unlock_bh();
+	return rc;
+}
+EXPORT_SYMBOL(sk_busy_loop);
+#endif /* CONFIG_NET_RX_BUSY_POLL */
+
 static void net_rx_action(struct softirq_action *h)
 {
 	struct softnet_data *sd = &__get_cpu_var(softnet_data);
@@ -75,7 +75,7 @@ static const char *kernel_cmdline;
 static const char *kernel_filename;
 static const char *vmlinux_filename;
 static const char *initrd_filename;
-static const char *image_filename[MAX_DISK_IMAGES];
+static struct disk_image_params disk_image[MAX_DISK_IMAGES];
 static const char *console;
 static const char *dev;
 static const char *network;
@@ -90,7 +90,6 @@ static const char *hugetlbfs_path;
 static const char *custom_rootfs_name = "default";
 static struct virtio_net_params *net_params;
 static bool single_step;
-static bool readonly_image[MAX_DISK_IMAGES];
 static bool vnc;
 static bool sdl;
 static bool balloon;
@@ -123,9 +122,63 @@ void kvm_run_set_wrapper_sandbox(void)
 	kvm_run_wrapper = KVM_RUN_SANDBOX;
 }
 
+static u64 parse_disk_cache_size(const char *arg)
+{
+	char *end;
+	u64 size;
+
+	if (strcmp(arg, "all") == 0)
+		return DISK_IMAGE_CACHE_ALL;
+
+	size = strtoull(arg, &end, 10);
+	if (end == arg)
+		die("Invalid disk cache size '%s'", arg);
+
+	switch (*end) {
+	case 'K':
+	case 'k':
+		size <<= KB_SHIFT;
+		end++;
+		break;
+	case 'M':
+	case 'm':
+		size <<= MB_SHIFT;
+		end++;
+		break;
+	case 'G':
+	case 'g':
+		size <<= GB_SHIFT;
+		end++;
+		break;
+	}
+
+	if (*end)
+		die("Invalid disk cache size '%s'", arg);
+
+	return size;
+}
+
+static void set_disk_param(struct disk_image_params *p, const char *param)
+{
+	if (strcmp(param, "ro") == 0)
+		p->readonly = true;
+	else if (strncmp(param, "cache=", 6) == 0)
+		p->cache_size = parse_disk_cache_size(param + 6);
+	else if (strncmp(param, "readahead=", 10) == 0)
+		p->readahead = strtoul(param + 10, NULL, 10);
+	else if (strcmp(param, "iothread") == 0)
+		p->iothread = true;
+	else if (strcmp(param, "direct") == 0)
+		p->direct = true;
+	else if (strcmp(param, "map") == 0)
+		p->map = true;
+	else
+		die("Unknown disk image parameter '%s'", param);
+}
+
 static int img_name_parser(const struct option *opt, const char *arg, int unset)
 {
-	char *sep;
+	char *sep, *param;
 	struct stat st;
 	char path[PATH_MAX];
 
@@ -166,14 +219,24 @@ static int img_name_parser(const struct option *opt, const char *arg, int unset)
 	if (image_count >= MAX_DISK_IMAGES)
 		die("Currently only 4 images are supported");
 
-	image_filename[image_count] = arg;
-	sep = strstr(arg, ",");
-	if (sep) {
-		if (strcmp(sep + 1, "ro") == 0)
-			readonly_image[image_count] = 1;
-		*sep = 0;
+	disk_image[image_count].filename = arg;
+	sep = strchr(arg, ',');
+	if (sep)
+		*sep++ = 0;
+
+	/* image[,ro][,cache=<size>|all][,readahead=<tables>][,iothread][,direct][,map] */
+	while (sep) {
+		param = sep;
+		sep = strchr(param, ',');
+		if (sep)
+			*sep++ = 0;
+		set_disk_param(&disk_image[image_count], param);
 	}
 
+	if (disk_image[image_count].map &&
+	    (!disk_image[image_count].readonly || disk_image[image_count].direct))
+		die("'map' needs a read-only image, not opened with 'direct'");
+
 	image_count++;
 
 	return 0;
@@ -579,6 +642,8 @@ static void handle_debug(int fd, u32 type, u32 len, u8 *msg)
 			mb();
 	}
 
+	thread_pool__dump_stats(fd);
+
 	close(fd);
 
 	serial8250__inject_sysrq(kvm);
@@ -1046,7 +1111,7 @@ int kvm_cmd_run(int argc, const char **argv, const char *prefix)
 	if (kernel_cmdline)
 		strlcat(real_cmdline, kernel_cmdline, sizeof(real_cmdline));
 
-	if (!using_rootfs && !image_filename[0] && !initrd_filename) {
+	if (!using_rootfs && !disk_image[0].filename && !initrd_filename) {
 		char tmp[PATH_MAX];
 
 		kvm_setup_create_new(custom_rootfs_name);
@@ -1078,7 +1143,7 @@ int kvm_cmd_run(int argc, const char **argv, const char *prefix)
 
 	if (image_count) {
 		kvm->nr_disks = image_count;
-		kvm->disks    = disk_image__open_all(image_filename, readonly_image, image_count);
+		kvm->disks    = disk_image__open_all(disk_image, image_count);
 		if (!kvm->disks)
 			die("Unable to load all disk images.");
 
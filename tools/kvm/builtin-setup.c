@@ -3,6 +3,8 @@
 #include <kvm/builtin-setup.h>
 #include <kvm/kvm.h>
 #include <kvm/parse-options.h>
+#include <kvm/qcow.h>
+#include <kvm/disk-image.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -20,13 +22,26 @@
 #include <fcntl.h>
 
 static const char *instance_name;
+static const char *qcow2_image;
+static u64 image_size;
+static bool preallocate;
+static const char *backing_file;
 
 static const char * const setup_usage[] = {
 	"lkvm setup [name]",
+	"lkvm setup --qcow2 <image> --size <MiB> [--preallocate]",
+	"lkvm setup --qcow2 <image> --backing <image> [--size <MiB>]",
 	NULL
 };
 
 static const struct option setup_options[] = {
+	OPT_STRING('\0', "qcow2", &qcow2_image, "image",
+			"Create a QCOW2 disk image instead of a rootfs"),
+	OPT_U64('s', "size", &image_size, "Size of the disk image in MiB"),
+	OPT_BOOLEAN('\0', "preallocate", &preallocate,
+			"Allocate all of the image's metadata up front"),
+	OPT_STRING('b', "backing", &backing_file, "image",
+			"Read what the QCOW2 image doesn't have from this image"),
 	OPT_END()
 };
 
@@ -35,10 +50,11 @@ static void parse_setup_options(int argc, const char **argv)
 	while (argc != 0) {
 		argc = parse_options(argc, argv, setup_options, setup_usage,
 				PARSE_OPT_STOP_AT_NON_OPTION);
-		if (argc != 0 && instance_name)
+		if (argc == 0)
+			break;
+		if (instance_name)
 			kvm_setup_help();
-		else
-			instance_name = argv[0];
+		instance_name = argv[0];
 		argv++;
 		argc--;
 	}
@@ -47,8 +63,9 @@ static void parse_setup_options(int argc, const char **argv)
 void kvm_setup_help(void)
 {
 	printf("\n%s setup creates a new rootfs under %s.\n"
-		"This can be used later by the '-d' parameter of '%s run'.\n",
-		kvm__get_dir(), KVM_BINARY_NAME, KVM_BINARY_NAME);
+		"This can be used later by the '-d' parameter of '%s run'.\n"
+		"With --qcow2, it creates a disk image for the '-d' parameter instead.\n",
+		KVM_BINARY_NAME, kvm__get_dir(), KVM_BINARY_NAME);
 	usage_with_options(setup_usage, setup_options);
 }
 
@@ -208,12 +225,66 @@ int kvm_setup_create_new(const char *guestfs_name)
 	return do_setup(guestfs_name);
 }
 
+/*
+ * The size of the image a QCOW2 image is backed by. A relative name is
+ * relative to the directory of the QCOW2 image, as when it is opened.
+ */
+static u64 backing_image_size(const char *image, const char *backing)
+{
+	struct disk_image_params params = { .readonly = true };
+	struct disk_image *disk;
+	char path[PATH_MAX];
+	const char *slash;
+	u64 size;
+
+	slash = strrchr(image, '/');
+	if (backing[0] != '/' && slash)
+		snprintf(path, sizeof(path), "%.*s/%s",
+			(int)(slash - image), image, backing);
+	else
+		snprintf(path, sizeof(path), "%s", backing);
+
+	params.filename = path;
+	disk = disk_image__open(&params);
+	if (!disk)
+		die("Unable to open backing image '%s'", path);
+
+	size = disk->size;
+	disk_image__close(disk);
+
+	return size;
+}
+
 int kvm_cmd_setup(int argc, const char **argv, const char *prefix)
 {
+	u64 size;
 	int r;
 
 	parse_setup_options(argc, argv);
 
+	if (qcow2_image) {
+		if ((!image_size && !backing_file) || instance_name ||
+		    (backing_file && preallocate))
+			kvm_setup_help();
+
+		size = image_size << 20;
+		if (!size)
+			size = backing_image_size(qcow2_image, backing_file);
+
+		r = qcow2_create(qcow2_image, size, preallocate, backing_file);
+		if (r == 0 && backing_file)
+			printf("A new QCOW2 image backed by '%s' has been created in '%s'.\n",
+				backing_file, qcow2_image);
+		else if (r == 0)
+			printf("A new %llu MiB QCOW2 image has been created in '%s'.\n",
+				image_size, qcow2_image);
+		else
+			printf("Unable to create QCOW2 image '%s': %s\n",
+				qcow2_image, strerror(errno));
+
+		return r;
+	}
+
 	if (instance_name == NULL)
 		kvm_setup_help();
 
@@ -4,6 +4,7 @@
 #include <kvm/kvm.h>
 #include <kvm/parse-options.h>
 #include <kvm/kvm-ipc.h>
+#include <kvm/disk-image.h>
 
 #include <sys/select.h>
 #include <stdio.h>
@@ -13,6 +14,7 @@
 #include <linux/virtio_balloon.h>
 
 static bool mem;
+static bool disk;
 static bool all;
 static const char *instance_name;
 
@@ -24,6 +26,7 @@ static const char * const stat_usage[] = {
 static const struct option stat_options[] = {
 	OPT_GROUP("Commands options:"),
 	OPT_BOOLEAN('m', "memory", &mem, "Display memory statistics"),
+	OPT_BOOLEAN('d', "disk", &disk, "Display disk image cache statistics"),
 	OPT_GROUP("Instance options:"),
 	OPT_BOOLEAN('a', "all", &all, "All instances"),
 	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
@@ -97,6 +100,79 @@ static int do_memstat(const char *name, int sock)
 	return 0;
 }
 
+static double hit_rate(u64 hits, u64 misses)
+{
+	if (!hits && !misses)
+		return 0;
+
+	return 100.0 * hits / (hits + misses);
+}
+
+static int do_diskstat(const char *name, int sock)
+{
+	struct disk_image_cache_stats stats[MAX_DISK_IMAGES];
+	fd_set fdset;
+	struct timeval t = { .tv_sec = 1 };
+	u32 nr, i;
+	int r;
+
+	FD_ZERO(&fdset);
+	FD_SET(sock, &fdset);
+	r = kvm_ipc__send(sock, KVM_IPC_DISK_STAT);
+	if (r < 0)
+		return r;
+
+	r = select(sock + 1, &fdset, NULL, NULL, &t);
+	if (r <= 0) {
+		pr_err("Could not retrieve disk stats from %s", name);
+		return -1;
+	}
+
+	if (read_in_full(sock, &nr, sizeof(nr)) != sizeof(nr) ||
+	    nr > MAX_DISK_IMAGES ||
+	    read_in_full(sock, stats, nr * sizeof(stats[0])) !=
+	    (ssize_t)(nr * sizeof(stats[0]))) {
+		pr_err("Could not retrieve disk stats from %s", name);
+		return -1;
+	}
+
+	printf("\n\n\t*** Disk image cache statistics of %s ***\n\n", name);
+	for (i = 0; i < nr; i++) {
+		struct disk_image_cache_stats *s = &stats[i];
+
+		printf("Disk %u:", i);
+		if (!s->l2_max) {
+			printf(" no metadata cache\n");
+			continue;
+		}
+
+		printf("\n  L2 tables: %u/%u cached, %llu hits, %llu misses (%.1f%% hit rate), %llu evictions\n",
+			s->l2_cached, s->l2_max, s->l2_hits, s->l2_misses,
+			hit_rate(s->l2_hits, s->l2_misses), s->l2_evictions);
+		printf("  L2 read-ahead: %llu tables read, %llu used\n",
+			s->l2_readahead_reads, s->l2_readahead_hits);
+		printf("  Refcount blocks: %u/%u cached, %llu hits, %llu misses (%.1f%% hit rate), %llu evictions\n",
+			s->refcount_cached, s->refcount_max, s->refcount_hits,
+			s->refcount_misses, hit_rate(s->refcount_hits, s->refcount_misses),
+			s->refcount_evictions);
+	}
+	printf("\n");
+
+	return 0;
+}
+
+static int do_stat(const char *name, int sock)
+{
+	int r = 0;
+
+	if (mem)
+		r = do_memstat(name, sock);
+	if (r == 0 && disk)
+		r = do_diskstat(name, sock);
+
+	return r;
+}
+
 int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 {
 	int instance;
@@ -104,11 +180,11 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 
 	parse_stat_options(argc, argv);
 
-	if (!mem)
+	if (!mem && !disk)
 		usage_with_options(stat_usage, stat_options);
 
-	if (mem && all)
-		return kvm__enumerate_instances(do_memstat);
+	if (all)
+		return kvm__enumerate_instances(do_stat);
 
 	if (instance_name == NULL)
 		kvm_stat_help();
@@ -118,8 +194,7 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 	if (instance <= 0)
 		die("Failed locating instance");
 
-	if (mem)
-		r = do_memstat(instance_name, instance);
+	r = do_stat(instance_name, instance);
 
 	close(instance);
 
@@ -1,14 +1,19 @@
 #include "kvm/disk-image.h"
 #include "kvm/qcow.h"
 #include "kvm/virtio-blk.h"
+#include "kvm/kvm-ipc.h"
 
 #include <sys/eventfd.h>
 #include <sys/poll.h>
+#include <sched.h>
 
 #define AIO_MAX 32
 
 int debug_iodelay;
 
+static struct disk_image **stat_disks;
+static int stat_nr_disks;
+
 #ifdef CONFIG_HAS_AIO
 static void *disk_image__thread(void *param)
 {
@@ -19,9 +24,16 @@ static void *disk_image__thread(void *param)
 	u64 dummy;
 
 	while (read(disk->evt, &dummy, sizeof(dummy)) > 0) {
-		nr = io_getevents(disk->ctx, 1, ARRAY_SIZE(event), event, &notime);
-		for (i = 0; i < nr; i++)
-			disk->disk_req_cb(event[i].data, event[i].res);
+		/* One wakeup can stand for more completions than we reap at once */
+		do {
+			nr = io_getevents(disk->ctx, 0, ARRAY_SIZE(event), event, &notime);
+			for (i = 0; i < nr; i++) {
+				if (disk->ops->aio_complete)
+					disk->ops->aio_complete(disk, event[i].data, event[i].res);
+				else
+					disk->disk_req_cb(event[i].data, event[i].res);
+			}
+		} while (nr == ARRAY_SIZE(event));
 	}
 
 	return NULL;
@@ -39,6 +51,12 @@ struct disk_image *disk_image__new(int fd, u64 size, struct disk_image_operation
 	disk->fd	= fd;
 	disk->size	= size;
 	disk->ops	= ops;
+	disk->iothread	= false;
+	disk->direct_fd	= -1;
+	disk->map_written = NULL;
+	disk->map_nr	= 0;
+	disk->async	= false;
+	disk->evt	= -1;
 
 	if (use_mmap == DISK_IMAGE_MMAP) {
 		/*
@@ -51,46 +69,61 @@ struct disk_image *disk_image__new(int fd, u64 size, struct disk_image_operation
 		}
 	}
 
+	return disk;
+}
+
+/*
+ * Set up aio for a disk the guest uses, with room for nr_events in flight:
+ * images opened only to back others, or to be looked at, are read
+ * synchronously and don't need it.
+ */
+int disk_image__start_aio(struct disk_image *disk, int nr_events)
+{
 #ifdef CONFIG_HAS_AIO
-	if (disk) {
-		pthread_t thread;
+	pthread_t thread;
 
-		disk->evt = eventfd(0, 0);
-		io_setup(AIO_MAX, &disk->ctx);
-		if (pthread_create(&thread, NULL, disk_image__thread, disk) != 0)
-			die("Failed starting IO thread");
-	}
+	if (!disk->async)
+		return 0;
+
+	disk->evt = eventfd(0, 0);
+	if (disk->evt < 0)
+		return -1;
+
+	memset(&disk->ctx, 0, sizeof(disk->ctx));
+	if (io_setup(nr_events, &disk->ctx) < 0)
+		return -1;
+
+	if (pthread_create(&thread, NULL, disk_image__thread, disk) != 0)
+		die("Failed starting IO thread");
 #endif
-	return disk;
+	return 0;
 }
 
-struct disk_image *disk_image__open(const char *filename, bool readonly)
+struct disk_image *disk_image__open(struct disk_image_params *params)
 {
 	struct disk_image *disk;
 	struct stat st;
 	int fd;
 
-	if (stat(filename, &st) < 0)
+	if (stat(params->filename, &st) < 0)
 		return NULL;
 
 	/* blk device ?*/
-	disk		= blkdev__probe(filename, &st);
+	disk		= blkdev__probe(params->filename, &st);
 	if (disk)
 		return disk;
 
-	fd		= open(filename, readonly ? O_RDONLY : O_RDWR);
+	fd		= open(params->filename, params->readonly ? O_RDONLY : O_RDWR);
 	if (fd < 0)
 		return NULL;
 
 	/* qcow image ?*/
-	disk		= qcow_probe(fd, true);
-	if (disk) {
-		pr_warning("Forcing read-only support for QCOW");
+	disk		= qcow_probe(fd, params);
+	if (disk)
 		return disk;
-	}
 
 	/* raw image ?*/
-	disk		= raw_image__probe(fd, &st, readonly);
+	disk		= raw_image__probe(fd, &st, params);
 	if (disk)
 		return disk;
 
@@ -100,7 +133,33 @@ struct disk_image *disk_image__open(const char *filename, bool readonly)
 	return NULL;
 }
 
-struct disk_image **disk_image__open_all(const char **filenames, bool *readonly, int count)
+/*
+ * Reply to 'kvm stat --disk' with the number of disks, followed by the
+ * cache statistics of each.
+ */
+static void disk_image__print_stats(int fd, u32 type, u32 len, u8 *msg)
+{
+	struct disk_image_cache_stats stats[MAX_DISK_IMAGES];
+	struct disk_image *disk;
+	u32 nr = stat_nr_disks;
+	int i;
+
+	if (WARN_ON(type != KVM_IPC_DISK_STAT || len))
+		return;
+
+	memset(stats, 0, sizeof(stats));
+	for (i = 0; i < stat_nr_disks; i++) {
+		disk = stat_disks[i];
+		if (disk && disk->ops->cache_stats)
+			disk->ops->cache_stats(disk, &stats[i]);
+	}
+
+	if (write_in_full(fd, &nr, sizeof(nr)) < 0 ||
+	    write_in_full(fd, stats, nr * sizeof(stats[0])) < 0)
+		pr_warning("Failed sending disk stats");
+}
+
+struct disk_image **disk_image__open_all(struct disk_image_params *params, int count)
 {
 	struct disk_image **disks;
 	int i;
@@ -113,16 +172,21 @@ struct disk_image **disk_image__open_all(const char **filenames, bool *readonly,
 		return NULL;
 
 	for (i = 0; i < count; i++) {
-		if (!filenames[i])
+		if (!params[i].filename)
 			continue;
 
-		disks[i] = disk_image__open(filenames[i], readonly[i]);
+		disks[i] = disk_image__open(&params[i]);
 		if (!disks[i]) {
-			pr_err("Loading disk image '%s' failed", filenames[i]);
+			pr_err("Loading disk image '%s' failed", params[i].filename);
 			goto error;
 		}
+		disks[i]->iothread = params[i].iothread;
 	}
 
+	stat_disks	= disks;
+	stat_nr_disks	= count;
+	kvm_ipc__register_handler(KVM_IPC_DISK_STAT, disk_image__print_stats);
+
 	return disks;
 error:
 	for (i = 0; i < count; i++)
@@ -146,6 +210,9 @@ int disk_image__close(struct disk_image *disk)
 	if (!disk)
 		return 0;
 
+	if (disk->direct_fd >= 0)
+		close(disk->direct_fd);
+
 	if (disk->ops->close)
 		return disk->ops->close(disk);
 
@@ -159,6 +226,9 @@ int disk_image__close(struct disk_image *disk)
 
 void disk_image__close_all(struct disk_image **disks, int count)
 {
+	if (disks == stat_disks)
+		stat_nr_disks = 0;
+
 	while (count)
 		disk_image__close(disks[--count]);
 
@@ -216,7 +286,10 @@ ssize_t disk_image__write(struct disk_image *disk, u64 sector, const struct iove
 			return -1;
 		}
 	} else {
-		/* Do nothing */
+		/* A read-only disk: fail the write, async or not */
+		if (disk->disk_req_cb)
+			disk->disk_req_cb(param, -1);
+		return -1;
 	}
 
 	if (!disk->async && disk->disk_req_cb)
@@ -225,6 +298,110 @@ ssize_t disk_image__write(struct disk_image *disk, u64 sector, const struct iove
 	return total;
 }
 
+void disk_image__batch_init(struct disk_image_batch *batch, struct disk_image *disk)
+{
+	batch->disk	= disk;
+	batch->nr	= 0;
+}
+
+static int disk_image__batch_rw(struct disk_image_batch *batch, bool write,
+				u64 sector, const struct iovec *iov,
+				int iovcount, void *param)
+{
+	struct disk_image *disk = batch->disk;
+
+	if (debug_iodelay)
+		msleep(debug_iodelay);
+
+	if (batch->nr == DISK_IMAGE_BATCH_MAX)
+		disk_image__batch_submit(batch);
+
+	if (disk->ops->queue_sector(disk, batch, write, sector, iov,
+				    iovcount, param) < 0) {
+		pr_info("disk_image__batch_rw error\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Queue a read in the batch if the disk can, or do it now. Either way,
+ * it completes through disk_req_cb.
+ */
+int disk_image__batch_read(struct disk_image_batch *batch, u64 sector,
+				const struct iovec *iov, int iovcount, void *param)
+{
+	struct disk_image *disk = batch->disk;
+
+	if (!disk->async || !disk->ops->queue_sector)
+		return disk_image__read(disk, sector, iov, iovcount, param) < 0 ? -1 : 0;
+
+	return disk_image__batch_rw(batch, false, sector, iov, iovcount, param);
+}
+
+int disk_image__batch_write(struct disk_image_batch *batch, u64 sector,
+				const struct iovec *iov, int iovcount, void *param)
+{
+	struct disk_image *disk = batch->disk;
+
+	if (!disk->async || !disk->ops->queue_sector || !disk->ops->write_sector)
+		return disk_image__write(disk, sector, iov, iovcount, param) < 0 ? -1 : 0;
+
+	return disk_image__batch_rw(batch, true, sector, iov, iovcount, param);
+}
+
+/*
+ * Submit what the batch has queued, with one io_submit() unless some
+ * don't make it: those complete with an error. The disk's thread is
+ * reaping meanwhile, so a full aio context is waited out.
+ */
+int disk_image__batch_submit(struct disk_image_batch *batch)
+{
+	int ret = 0;
+#ifdef CONFIG_HAS_AIO
+	struct disk_image *disk = batch->disk;
+	int i = 0, r;
+
+	while (i < batch->nr) {
+		r = io_submit(disk->ctx, batch->nr - i, batch->ios + i);
+		if (r == -EAGAIN) {
+			sched_yield();
+			continue;
+		}
+
+		if (r <= 0) {
+			pr_info("disk_image__batch_submit error: %d\n", r);
+			disk->disk_req_cb(batch->ios[i]->data, -1);
+			ret = -1;
+			i++;
+			continue;
+		}
+
+		i += r;
+	}
+#endif
+	batch->nr = 0;
+
+	return ret;
+}
+
+int disk_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors)
+{
+	if (!disk->ops->discard)
+		return -1;
+
+	return disk->ops->discard(disk, sector, nr_sectors);
+}
+
+int disk_image__write_zeroes(struct disk_image *disk, u64 sector, u64 nr_sectors, bool unmap)
+{
+	if (!disk->ops->write_zeroes)
+		return -1;
+
+	return disk->ops->write_zeroes(disk, sector, nr_sectors, unmap);
+}
+
 ssize_t disk_image__get_serial(struct disk_image *disk, void *buffer, ssize_t *len)
 {
 	struct stat st;
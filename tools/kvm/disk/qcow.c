@@ -24,6 +24,7 @@
 
 static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append);
 static int qcow_write_refcount_table(struct qcow *q);
+static int qcow_write_refcount_blocks(struct qcow *q);
 static u64 qcow_alloc_clusters(struct qcow *q, u64 size, int update_ref);
 static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size);
 
@@ -107,6 +108,10 @@ static void l1_table_free_cache(struct qcow_l1_table *l1t)
 	}
 }
 
+/*
+ * Write back a dirty L2 table. This does not wait for the write to reach
+ * the disk: see qcow_write_metadata() for the ordering.
+ */
 static int qcow_l2_cache_write(struct qcow *q, struct qcow_l2_table *c)
 {
 	struct qcow_header *header = q->header;
@@ -117,7 +122,7 @@ static int qcow_l2_cache_write(struct qcow *q, struct qcow_l2_table *c)
 
 	size = 1 << header->l2_bits;
 
-	if (qcow_pwrite_sync(q->fd, c->table,
+	if (pwrite_in_full(q->fd, c->table,
 		size * sizeof(u64), c->offset) < 0)
 		return -1;
 
@@ -132,17 +137,30 @@ static int cache_table(struct qcow *q, struct qcow_l2_table *c)
 	struct rb_root *r = &l1t->root;
 	struct qcow_l2_table *lru;
 
-	if (l1t->nr_cached == MAX_CACHE_NODES) {
+	if (l1t->nr_cached >= l1t->max_cached) {
 		/*
 		 * The node at the head of the list is least recently used
 		 * node. Remove it from the list and replaced with a new node.
 		 */
 		lru = list_first_entry(&l1t->lru_list, struct qcow_l2_table, list);
 
+		/*
+		 * Write it back first if needed, after the refcounts of the
+		 * clusters it points to.
+		 */
+		if (lru->dirty) {
+			if (qcow_write_refcount_blocks(q) < 0)
+				goto error;
+
+			if (qcow_l2_cache_write(q, lru) < 0 || fdatasync(q->fd) < 0)
+				goto error;
+		}
+
 		/* Remove the node from the cache */
 		rb_erase(&lru->node, r);
 		list_del_init(&lru->list);
 		l1t->nr_cached--;
+		l1t->evictions++;
 
 		/* Free the LRUed node */
 		free(lru);
@@ -218,35 +236,97 @@ static inline u64 get_cluster_offset(struct qcow *q, u64 offset)
 	return offset & ((1 << header->cluster_bits)-1);
 }
 
-static struct qcow_l2_table *qcow_read_l2_table(struct qcow *q, u64 offset)
+/*
+ * How many of the L2 tables following the one at l1_idx to read along with
+ * it: those next to it in the image file as well as in the L1 table, which
+ * one read gets all of, and that aren't cached yet.
+ */
+static u32 qcow_l2_readahead(struct qcow *q, u64 l1_idx, u64 offset)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	u64 l2t_bytes = sizeof(u64) << q->header->l2_bits;
+	u64 next;
+	u32 n;
+
+	for (n = 0; n < l1t->readahead && l1_idx + n + 1 < l1t->table_size; n++) {
+		next = be64_to_cpu(l1t->l1_table[l1_idx + n + 1]);
+		if (q->version == QCOW2_VERSION)
+			next &= ~QCOW2_OFLAG_COPIED;
+
+		if (next != offset + (n + 1) * l2t_bytes ||
+		    l2_table_lookup(&l1t->root, next))
+			break;
+	}
+
+	return n;
+}
+
+/*
+ * Look up the L2 table at offset, which the L1 entry at l1_idx points to,
+ * reading it and the tables qcow_l2_readahead() picks on a miss.
+ */
+static struct qcow_l2_table *qcow_read_l2_table(struct qcow *q, u64 l1_idx, u64 offset)
 {
 	struct qcow_header *header = q->header;
-	struct qcow_l2_table *l2t;
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_l2_table *l2t[1 + QCOW_MAX_READAHEAD];
+	struct iovec iov[1 + QCOW_MAX_READAHEAD];
 	u64 size;
+	u32 i, n, nr_new = 0;
 
 	size = 1 << header->l2_bits;
 
 	/* search an entry for offset in cache */
-	l2t = l2_table_search(q, offset);
-	if (l2t)
-		return l2t;
+	l2t[0] = l2_table_search(q, offset);
+	if (l2t[0]) {
+		l1t->hits++;
+		if (l2t[0]->readahead) {
+			l2t[0]->readahead = 0;
+			l1t->readahead_hits++;
+		}
+		return l2t[0];
+	}
 
-	/* allocate new node for caching l2 table */
-	l2t = new_cache_table(q, offset);
-	if (!l2t)
-		goto error;
+	l1t->misses++;
+
+	n = 1 + qcow_l2_readahead(q, l1_idx, offset);
 
-	/* table not cached: read from the disk */
-	if (pread_in_full(q->fd, l2t->table, size * sizeof(u64), offset) < 0)
+	/* allocate new nodes for caching l2 tables */
+	i = 0;
+	do {
+		l2t[i] = new_cache_table(q, offset + i * size * sizeof(u64));
+		if (!l2t[i])
+			goto error;
+		nr_new++;
+
+		iov[i].iov_base = l2t[i]->table;
+		iov[i].iov_len	= size * sizeof(u64);
+	} while (++i < n);
+
+	/* tables not cached: read from the disk */
+	if (preadv_in_full(q->fd, iov, n, offset) < 0)
 		goto error;
 
-	/* cache the table */
-	if (cache_table(q, l2t) < 0)
+	/*
+	 * cache the tables, the one asked for last so that it is the most
+	 * recently used: there is room for all of them
+	 */
+	for (i = n - 1; i > 0; i--) {
+		l2t[i]->readahead = 1;
+		if (cache_table(q, l2t[i]) < 0)
+			goto error;
+		nr_new--;
+		l1t->readahead_reads++;
+	}
+
+	if (cache_table(q, l2t[0]) < 0)
 		goto error;
 
-	return l2t;
+	return l2t[0];
 error:
-	free(l2t);
+	/* free the tables that didn't make it into the cache */
+	while (nr_new--)
+		free(l2t[nr_new]);
 	return NULL;
 }
 
@@ -283,116 +363,303 @@ static int qcow_decompress_buffer(u8 *out_buf, int out_buf_size,
 #endif
 }
 
-static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
-	void *dst, u32 dst_len)
+/*
+ * A guest request in flight. Its data is transferred cluster by cluster,
+ * with aio for allocated clusters, and it completes when the last of
+ * those does: pending counts them, plus one for the submitter while it is
+ * still splitting up the request.
+ */
+struct qcow_aio_req {
+	struct disk_image		*disk;
+	void				*param;
+	/* Bytes asked for so far, and bytes transferred */
+	long				total;
+	long				done;
+	int				pending;
+	bool				error;
+};
+
+static struct qcow_aio_req *qcow_aio_req_new(struct disk_image *disk, void *param)
+{
+	struct qcow_aio_req *req;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return NULL;
+
+	req->disk	= disk;
+	req->param	= param;
+	req->pending	= 1;
+
+	return req;
+}
+
+static void qcow_aio_req_put(struct qcow_aio_req *req)
+{
+	struct disk_image *disk = req->disk;
+	long len;
+
+	if (__sync_sub_and_fetch(&req->pending, 1))
+		return;
+
+	len = (req->error || req->done != req->total) ? -1 : req->total;
+	if (disk->async && disk->disk_req_cb)
+		disk->disk_req_cb(req->param, len);
+
+	free(req);
+}
+
+/*
+ * Data transfers are counted from the lookup of their cluster, under
+ * q->mutex, to their completion. Clusters are freed under q->mutex too,
+ * once the count is down to zero, so none can go while still in use.
+ */
+static void qcow_data_io_get(struct qcow *q)
+{
+	mutex_lock(&q->data_io_mutex);
+	q->data_io++;
+	mutex_unlock(&q->data_io_mutex);
+}
+
+static void qcow_data_io_put(struct qcow *q)
+{
+	mutex_lock(&q->data_io_mutex);
+	if (!--q->data_io)
+		pthread_cond_broadcast(&q->data_io_cond);
+	mutex_unlock(&q->data_io_mutex);
+}
+
+/* Called with q->mutex held, which keeps new transfers from starting */
+static void qcow_data_io_wait(struct qcow *q)
+{
+	mutex_lock(&q->data_io_mutex);
+	while (q->data_io)
+		pthread_cond_wait(&q->data_io_cond, &q->data_io_mutex);
+	mutex_unlock(&q->data_io_mutex);
+}
+
+static void qcow_aio_complete(struct disk_image *disk, void *param, long len)
+{
+	struct qcow_aio_req *req = param;
+
+	qcow_data_io_put(disk->priv);
+
+	if (len < 0)
+		req->error = true;
+	else
+		__sync_add_and_fetch(&req->done, len);
+
+	qcow_aio_req_put(req);
+}
+
+/*
+ * Transfer cluster data at a host offset as part of req. This is done
+ * without q->mutex: once the guest offset has been looked up, nothing in
+ * the metadata needs to stay put for the transfer, and the cluster itself
+ * is held by the qcow_data_io_get() done with the lookup. It is
+ * synchronous unless the disk is async and its aio context has room.
+ */
+static int qcow_data_io(struct qcow_aio_req *req, bool write, void *buf,
+			size_t len, u64 offset)
+{
+	struct disk_image *disk = req->disk;
+	struct iovec iov = {
+		.iov_base	= buf,
+		.iov_len	= len,
+	};
+	ssize_t ret;
+
+#ifdef CONFIG_HAS_AIO
+	if (disk->async) {
+		struct iocb iocb;
+
+		__sync_add_and_fetch(&req->pending, 1);
+
+		if (write)
+			ret = aio_pwritev(disk->ctx, &iocb, disk->fd, &iov, 1,
+					offset, disk->evt, req);
+		else
+			ret = aio_preadv(disk->ctx, &iocb, disk->fd, &iov, 1,
+					offset, disk->evt, req);
+		if (ret == 1)
+			return 0;
+
+		__sync_sub_and_fetch(&req->pending, 1);
+		/*
+		 * A request can take an aio per cluster, more than the context
+		 * is sized for: do what doesn't fit in it synchronously.
+		 */
+		if (ret != -EAGAIN) {
+			qcow_data_io_put(disk->priv);
+			return -1;
+		}
+	}
+#endif
+	if (write)
+		ret = pwritev_in_full(disk->fd, &iov, 1, offset);
+	else
+		ret = preadv_in_full(disk->fd, &iov, 1, offset);
+	qcow_data_io_put(disk->priv);
+	if (ret < 0)
+		return -1;
+
+	__sync_add_and_fetch(&req->done, len);
+
+	return 0;
+}
+
+/*
+ * Look up the L2 entry for a guest offset, which is 0 if no L2 table
+ * covers it. Called with q->mutex held.
+ */
+static int qcow_get_l2_entry(struct qcow *q, u64 offset, u64 *entry)
 {
-	struct qcow_header *header = q->header;
 	struct qcow_l1_table *l1t = &q->table;
 	struct qcow_l2_table *l2t;
-	u64 clust_offset;
-	u64 clust_start;
 	u64 l2t_offset;
-	size_t length;
-	u64 l2t_size;
 	u64 l1_idx;
-	u64 l2_idx;
-	int coffset;
-	int csize;
 
 	l1_idx = get_l1_index(q, offset);
 	if (l1_idx >= l1t->table_size)
 		return -1;
 
-	clust_offset = get_cluster_offset(q, offset);
-	if (clust_offset >= q->cluster_size)
+	l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]);
+	if (q->version == QCOW2_VERSION)
+		l2t_offset &= ~QCOW2_OFLAG_COPIED;
+
+	if (!l2t_offset) {
+		*entry = 0;
+		return 0;
+	}
+
+	/* read and cache level 2 table */
+	l2t = qcow_read_l2_table(q, l1_idx, l2t_offset);
+	if (!l2t)
 		return -1;
 
-	length = q->cluster_size - clust_offset;
-	if (length > dst_len)
-		length = dst_len;
+	*entry = be64_to_cpu(l2t->table[get_l2_index(q, offset)]);
 
-	mutex_lock(&q->mutex);
+	return 0;
+}
 
-	l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]);
-	if (!l2t_offset)
-		goto zero_cluster;
+/* Decompress the cluster a compressed L2 entry points to into dst. */
+static int qcow1_decompress_cluster(struct qcow *q, u64 clust_start, void *dst)
+{
+	u64 coffset;
+	int csize;
 
-	l2t_size = 1 << header->l2_bits;
+	coffset = clust_start & q->cluster_offset_mask;
+	csize = clust_start >> (63 - q->header->cluster_bits);
+	csize &= (q->cluster_size - 1);
 
-	/* read and cache level 2 table */
-	l2t = qcow_read_l2_table(q, l2t_offset);
-	if (!l2t)
-		goto out_error;
+	if (pread_in_full(q->fd, q->cluster_data, csize, coffset) < 0)
+		return -1;
 
-	l2_idx = get_l2_index(q, offset);
-	if (l2_idx >= l2t_size)
-		goto out_error;
+	return qcow_decompress_buffer(dst, q->cluster_size,
+				q->cluster_data, csize);
+}
 
-	clust_start = be64_to_cpu(l2t->table[l2_idx]);
-	if (clust_start & QCOW1_OFLAG_COMPRESSED) {
-		coffset = clust_start & q->cluster_offset_mask;
-		csize = clust_start >> (63 - q->header->cluster_bits);
-		csize &= (q->cluster_size - 1);
+static int qcow2_decompress_cluster(struct qcow *q, u64 clust_start, void *dst)
+{
+	int sector_offset;
+	int nb_csectors;
+	u64 coffset;
+	int csize;
 
-		if (pread_in_full(q->fd, q->cluster_data, csize,
-				  coffset) < 0)
-			goto out_error;
+	coffset = clust_start & q->cluster_offset_mask;
+	nb_csectors = ((clust_start >> q->csize_shift)
+		& q->csize_mask) + 1;
+	sector_offset = coffset & (SECTOR_SIZE - 1);
+	csize = nb_csectors * SECTOR_SIZE - sector_offset;
 
-		if (qcow_decompress_buffer(q->cluster_cache, q->cluster_size,
-					q->cluster_data, csize) < 0)
-			goto out_error;
+	if (pread_in_full(q->fd, q->cluster_data,
+			  nb_csectors * SECTOR_SIZE,
+			  coffset & ~(SECTOR_SIZE - 1)) < 0)
+		return -1;
 
-		memcpy(dst, q->cluster_cache + clust_offset, length);
-		mutex_unlock(&q->mutex);
+	return qcow_decompress_buffer(dst, q->cluster_size,
+				q->cluster_data + sector_offset, csize);
+}
+
+/*
+ * Find the data for a guest offset: *clust_start is set to the host offset
+ * of its cluster, or 0 if the image doesn't have it. Compressed clusters
+ * are instead decompressed into q->cluster_cache, and flagged in
+ * *compressed. Called with q->mutex held.
+ */
+static int qcow_map_cluster(struct qcow *q, u64 offset, u64 *clust_start,
+			bool *compressed)
+{
+	u64 entry;
+
+	if (qcow_get_l2_entry(q, offset, &entry) < 0)
+		return -1;
+
+	*compressed = false;
+	*clust_start = 0;
+
+	if (q->version == QCOW1_VERSION) {
+		if (entry & QCOW1_OFLAG_COMPRESSED) {
+			*compressed = true;
+			return qcow1_decompress_cluster(q, entry, q->cluster_cache);
+		}
 	} else {
-		if (!clust_start)
-			goto zero_cluster;
+		if (entry & QCOW2_OFLAG_COMPRESSED) {
+			*compressed = true;
+			return qcow2_decompress_cluster(q, entry, q->cluster_cache);
+		}
+		entry &= QCOW2_OFFSET_MASK;
+	}
 
-		mutex_unlock(&q->mutex);
+	*clust_start = entry;
 
-		if (pread_in_full(q->fd, dst, length,
-				  clust_start + clust_offset) < 0)
+	return 0;
+}
+
+/*
+ * Read guest data the image doesn't have from its backing image, which is
+ * opened synchronous. Past the end of the backing image reads as zeroes.
+ */
+static int qcow_read_backing(struct qcow *q, u64 offset, void *dst, u32 len)
+{
+	struct disk_image *backing = q->backing;
+	struct iovec iov;
+	u32 n = 0;
+
+	if (offset < backing->size)
+		n = min((u64)len, backing->size - offset);
+
+	if (n) {
+		iov = (struct iovec) {
+			.iov_base	= dst,
+			.iov_len	= n,
+		};
+
+		if (disk_image__read(backing, offset >> SECTOR_SHIFT,
+				     &iov, 1, NULL) != n)
 			return -1;
 	}
 
-	return length;
-
-zero_cluster:
-	mutex_unlock(&q->mutex);
-	memset(dst, 0, length);
-	return length;
+	memset(dst + n, 0, len - n);
 
-out_error:
-	mutex_unlock(&q->mutex);
-	length = -1;
-	return -1;
+	return 0;
 }
 
-static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
-	void *dst, u32 dst_len)
+/*
+ * Read up to the end of the cluster holding offset. Only the lookup is
+ * done under q->mutex, so reads of allocated clusters run concurrently,
+ * and so do those of the backing image.
+ */
+static ssize_t qcow_read_cluster(struct qcow *q, struct qcow_aio_req *req,
+				u64 offset, void *dst, u32 dst_len)
 {
-	struct qcow_header *header = q->header;
-	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
 	u64 clust_offset;
 	u64 clust_start;
-	u64 l2t_offset;
+	bool compressed;
 	size_t length;
-	u64 l2t_size;
-	u64 l1_idx;
-	u64 l2_idx;
-	int coffset;
-	int sector_offset;
-	int nb_csectors;
-	int csize;
-
-	l1_idx = get_l1_index(q, offset);
-	if (l1_idx >= l1t->table_size)
-		return -1;
+	int ret;
 
 	clust_offset = get_cluster_offset(q, offset);
-	if (clust_offset >= q->cluster_size)
-		return -1;
 
 	length = q->cluster_size - clust_offset;
 	if (length > dst_len)
@@ -400,79 +667,45 @@ static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
 
 	mutex_lock(&q->mutex);
 
-	l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]);
-
-	l2t_offset &= ~QCOW2_OFLAG_COPIED;
-	if (!l2t_offset)
-		goto zero_cluster;
-
-	l2t_size = 1 << header->l2_bits;
+	ret = qcow_map_cluster(q, offset, &clust_start, &compressed);
+	if (!ret && compressed)
+		memcpy(dst, q->cluster_cache + clust_offset, length);
+	else if (!ret && clust_start)
+		qcow_data_io_get(q);
 
-	/* read and cache level 2 table */
-	l2t = qcow_read_l2_table(q, l2t_offset);
-	if (!l2t)
-		goto out_error;
-
-	l2_idx = get_l2_index(q, offset);
-	if (l2_idx >= l2t_size)
-		goto out_error;
-
-	clust_start = be64_to_cpu(l2t->table[l2_idx]);
-	if (clust_start & QCOW2_OFLAG_COMPRESSED) {
-		coffset = clust_start & q->cluster_offset_mask;
-		nb_csectors = ((clust_start >> q->csize_shift)
-			& q->csize_mask) + 1;
-		sector_offset = coffset & (SECTOR_SIZE - 1);
-		csize = nb_csectors * SECTOR_SIZE - sector_offset;
-
-		if (pread_in_full(q->fd, q->cluster_data,
-				  nb_csectors * SECTOR_SIZE,
-				  coffset & ~(SECTOR_SIZE - 1)) < 0) {
-			goto out_error;
-		}
+	mutex_unlock(&q->mutex);
 
-		if (qcow_decompress_buffer(q->cluster_cache, q->cluster_size,
-					q->cluster_data + sector_offset,
-					csize) < 0) {
-			goto out_error;
-		}
+	if (ret < 0)
+		return -1;
 
-		memcpy(dst, q->cluster_cache + clust_offset, length);
-		mutex_unlock(&q->mutex);
-	} else {
-		clust_start &= QCOW2_OFFSET_MASK;
-		if (!clust_start)
-			goto zero_cluster;
+	if (!compressed && clust_start) {
+		if (qcow_data_io(req, false, dst, length,
+				 clust_start + clust_offset) < 0)
+			return -1;
 
-		mutex_unlock(&q->mutex);
+		return length;
+	}
 
-		if (pread_in_full(q->fd, dst, length,
-				  clust_start + clust_offset) < 0)
+	if (!compressed) {
+		if (!q->backing)
+			memset(dst, 0, length);
+		else if (qcow_read_backing(q, offset, dst, length) < 0)
 			return -1;
 	}
 
-	return length;
+	__sync_add_and_fetch(&req->done, length);
 
-zero_cluster:
-	mutex_unlock(&q->mutex);
-	memset(dst, 0, length);
 	return length;
-
-out_error:
-	mutex_unlock(&q->mutex);
-	length = -1;
-	return -1;
 }
 
-static ssize_t qcow_read_sector_single(struct disk_image *disk, u64 sector,
-	void *dst, u32 dst_len)
+static ssize_t qcow_read_sector_single(struct qcow *q, struct qcow_aio_req *req,
+				u64 sector, void *dst, u32 dst_len)
 {
-	struct qcow *q = disk->priv;
 	struct qcow_header *header = q->header;
 	u32 nr_read;
 	u64 offset;
 	char *buf;
-	u32 nr;
+	ssize_t nr;
 
 	buf = dst;
 	nr_read = 0;
@@ -482,13 +715,7 @@ static ssize_t qcow_read_sector_single(struct disk_image *disk, u64 sector,
 		if (offset >= header->size)
 			return -1;
 
-		if (q->version == QCOW1_VERSION)
-			nr = qcow1_read_cluster(q, offset, buf,
-				dst_len - nr_read);
-		else
-			nr = qcow2_read_cluster(q, offset, buf,
-				dst_len - nr_read);
-
+		nr = qcow_read_cluster(q, req, offset, buf, dst_len - nr_read);
 		if (nr <= 0)
 			return -1;
 
@@ -500,16 +727,30 @@ static ssize_t qcow_read_sector_single(struct disk_image *disk, u64 sector,
 	return dst_len;
 }
 
+/*
+ * With aio, the request completes through disk_req_cb once all of its
+ * clusters have been read, whether or not this fails half way.
+ */
 static ssize_t qcow_read_sector(struct disk_image *disk, u64 sector,
 				const struct iovec *iov, int iovcount, void *param)
 {
+	struct qcow *q = disk->priv;
+	struct qcow_aio_req *req;
 	ssize_t nr, total = 0;
 
+	req = qcow_aio_req_new(disk, param);
+	if (!req)
+		return -1;
+
 	while (iovcount--) {
-		nr = qcow_read_sector_single(disk, sector, iov->iov_base, iov->iov_len);
+		req->total += iov->iov_len;
+
+		nr = qcow_read_sector_single(q, req, sector, iov->iov_base, iov->iov_len);
 		if (nr != (ssize_t)iov->iov_len) {
 			pr_info("qcow_read_sector error: nr=%ld iov_len=%ld\n", (long)nr, (long)iov->iov_len);
-			return -1;
+			req->error = true;
+			total = -1;
+			break;
 		}
 
 		sector += iov->iov_len >> SECTOR_SHIFT;
@@ -517,6 +758,8 @@ static ssize_t qcow_read_sector(struct disk_image *disk, u64 sector,
 		iov++;
 	}
 
+	qcow_aio_req_put(req);
+
 	return total;
 }
 
@@ -567,12 +810,13 @@ error:
 	return -1;
 }
 
+/* Like qcow_l2_cache_write(), for a refcount block */
 static int write_refcount_block(struct qcow *q, struct qcow_refcount_block *rfb)
 {
 	if (!rfb->dirty)
 		return 0;
 
-	if (qcow_pwrite_sync(q->fd, rfb->entries,
+	if (pwrite_in_full(q->fd, rfb->entries,
 		rfb->size * sizeof(u16), rfb->offset) < 0)
 		return -1;
 
@@ -587,12 +831,18 @@ static int cache_refcount_block(struct qcow *q, struct qcow_refcount_block *c)
 	struct rb_root *r = &rft->root;
 	struct qcow_refcount_block *lru;
 
-	if (rft->nr_cached == MAX_CACHE_NODES) {
+	if (rft->nr_cached >= rft->max_cached) {
 		lru = list_first_entry(&rft->lru_list, struct qcow_refcount_block, list);
 
+		if (lru->dirty) {
+			if (write_refcount_block(q, lru) < 0 || fdatasync(q->fd) < 0)
+				goto error;
+		}
+
 		rb_erase(&lru->node, r);
 		list_del_init(&lru->list);
 		rft->nr_cached--;
+		rft->evictions++;
 
 		free(lru);
 	}
@@ -689,8 +939,8 @@ static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
 	memset(rfb->entries, 0x00, q->cluster_size);
 	rfb->dirty = 1;
 
-	/* write refcount block */
-	if (write_refcount_block(q, rfb) < 0)
+	/* write refcount block, before the refcount table points to it */
+	if (write_refcount_block(q, rfb) < 0 || fdatasync(q->fd) < 0)
 		goto free_rfb;
 
 	if (cache_refcount_block(q, rfb) < 0)
@@ -730,8 +980,12 @@ static struct qcow_refcount_block *qcow_read_refcount_block(struct qcow *q, u64
 		return ERR_PTR(-ENOSPC);
 
 	rfb = refcount_block_search(q, rfb_offset);
-	if (rfb)
+	if (rfb) {
+		rft->hits++;
 		return rfb;
+	}
+
+	rft->misses++;
 
 	rfb = new_refcount_block(q, rfb_offset);
 	if (!rfb)
@@ -806,12 +1060,6 @@ static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append)
 	rfb->entries[rfb_idx] = cpu_to_be16(refcount);
 	rfb->dirty = 1;
 
-	/* write refcount block */
-	if (write_refcount_block(q, rfb) < 0) {
-		pr_warning("refcount block index out of bounds");
-		return -1;
-	}
-
 	/* update free_clust_idx since refcount becomes zero */
 	if (!refcount && clust_idx < q->free_clust_idx)
 		q->free_clust_idx = clust_idx;
@@ -819,15 +1067,146 @@ static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append)
 	return 0;
 }
 
+static int qcow_write_l1_table(struct qcow *q)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_header *header = q->header;
+
+	if (!l1t->dirty)
+		return 0;
+
+	if (qcow_pwrite_sync(q->fd, l1t->l1_table,
+		l1t->table_size * sizeof(u64),
+		header->l1_table_offset) < 0)
+		return -1;
+
+	l1t->dirty = 0;
+
+	return 0;
+}
+
+static int qcow_write_refcount_blocks(struct qcow *q)
+{
+	struct qcow_refcount_table *rft = &q->refcount_table;
+	struct qcow_refcount_block *c;
+	bool written = false;
+
+	list_for_each_entry(c, &rft->lru_list, list) {
+		if (!c->dirty)
+			continue;
+
+		if (write_refcount_block(q, c) < 0)
+			return -1;
+		written = true;
+	}
+
+	if (written)
+		return fdatasync(q->fd);
+
+	return 0;
+}
+
+static int qcow_write_l2_tables(struct qcow *q)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_l2_table *c;
+	bool written = false;
+
+	list_for_each_entry(c, &l1t->lru_list, list) {
+		if (!c->dirty)
+			continue;
+
+		if (!written && qcow_write_refcount_blocks(q) < 0)
+			return -1;
+
+		if (qcow_l2_cache_write(q, c) < 0)
+			return -1;
+		written = true;
+	}
+
+	if (written)
+		return fdatasync(q->fd);
+
+	return 0;
+}
+
+/*
+ * Metadata changes are kept in the caches and written back in batches,
+ * by a guest flush or when they are evicted. The image stays consistent
+ * whenever it is interrupted, as long as each level reaches the disk
+ * before whatever points to it: the refcounts of new clusters before the
+ * L2 tables using them, and new L2 tables before the L1 table. Clusters
+ * are only freed once nothing on disk uses them, see qcow_free_clusters().
+ * Called with q->mutex held.
+ */
+static int qcow_write_metadata(struct qcow *q)
+{
+	if (qcow_write_refcount_blocks(q) < 0)
+		return -1;
+
+	if (qcow_write_l2_tables(q) < 0)
+		return -1;
+
+	return qcow_write_l1_table(q);
+}
+
+static bool qcow_l2_tables_dirty(struct qcow *q)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_l2_table *c;
+
+	if (l1t->dirty)
+		return true;
+
+	list_for_each_entry(c, &l1t->lru_list, list)
+		if (c->dirty)
+			return true;
+
+	return false;
+}
+
 static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size)
 {
 	struct qcow_header *header = q->header;
 	u64 start, end, offset;
 
-	start = clust_start & ~(q->cluster_size - 1);
-	end = (clust_start + size - 1) & ~(q->cluster_size - 1);
-	for (offset = start; offset <= end; offset += q->cluster_size)
-		update_cluster_refcount(q, offset >> header->cluster_bits, -1);
+	/*
+	 * The tables that no longer point to the clusters must be on disk
+	 * before they can be reused.
+	 */
+	if (qcow_l2_tables_dirty(q) && qcow_write_metadata(q) < 0) {
+		pr_warning("error writing metadata, leaking clusters");
+		return;
+	}
+
+	start = clust_start & ~(q->cluster_size - 1);
+	end = (clust_start + size - 1) & ~(q->cluster_size - 1);
+	for (offset = start; offset <= end; offset += q->cluster_size)
+		update_cluster_refcount(q, offset >> header->cluster_bits, -1);
+}
+
+/*
+ * Refcount blocks are grown as allocations reach them, taking the next
+ * free cluster, which would cut a run of data clusters in two. Grow the
+ * block covering the clusters a little past the last allocation ahead of
+ * time instead.
+ */
+static void qcow_prealloc_refcount_block(struct qcow *q, u64 clust_idx)
+{
+	struct qcow_header *header = q->header;
+	struct qcow_refcount_table *rft = &q->refcount_table;
+	u64 rfb_entries;
+	u64 rft_idx;
+
+	rfb_entries = 1ULL << (header->cluster_bits - QCOW_REFCOUNT_BLOCK_SHIFT);
+	clust_idx += rfb_entries / QCOW_REFCOUNT_PREALLOC_RATIO;
+
+	rft_idx = clust_idx >> (header->cluster_bits - QCOW_REFCOUNT_BLOCK_SHIFT);
+	if (rft_idx >= rft->rf_size || rft->rf_table[rft_idx])
+		return;
+
+	if (!qcow_grow_refcount_block(q, clust_idx))
+		pr_warning("error preallocating refcount block");
 }
 
 /*
@@ -856,26 +1235,16 @@ again:
 
 	clust_idx++;
 
-	if (update_ref)
+	if (update_ref) {
 		for (i = 0; i < clust_num; i++)
 			if (update_cluster_refcount(q,
 				clust_idx - clust_num + i, 1))
 				return -1;
 
-	return (clust_idx - clust_num) << header->cluster_bits;
-}
-
-static int qcow_write_l1_table(struct qcow *q)
-{
-	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_header *header = q->header;
-
-	if (qcow_pwrite_sync(q->fd, l1t->l1_table,
-		l1t->table_size * sizeof(u64),
-		header->l1_table_offset) < 0)
-		return -1;
+		qcow_prealloc_refcount_block(q, clust_idx);
+	}
 
-	return 0;
+	return (clust_idx - clust_num) << header->cluster_bits;
 }
 
 /*
@@ -888,7 +1257,7 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 {
 	struct qcow_header *header = q->header;
 	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
+	struct qcow_l2_table *l2t, *old_l2t;
 	u64 l1t_idx;
 	u64 l2t_offset;
 	u64 l2t_idx;
@@ -908,14 +1277,14 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 	l2t_offset = be64_to_cpu(l1t->l1_table[l1t_idx]);
 	if (l2t_offset & QCOW2_OFLAG_COPIED) {
 		l2t_offset &= ~QCOW2_OFLAG_COPIED;
-		l2t = qcow_read_l2_table(q, l2t_offset);
+		l2t = qcow_read_l2_table(q, l1t_idx, l2t_offset);
 		if (!l2t)
 			goto error;
 	} else {
 		l2t_new_offset = qcow_alloc_clusters(q,
 			l2t_size*sizeof(u64), 1);
 
-		if (l2t_new_offset < 0)
+		if (l2t_new_offset == (u64)-1)
 			goto error;
 
 		l2t = new_cache_table(q, l2t_new_offset);
@@ -923,31 +1292,26 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 			goto free_cluster;
 
 		if (l2t_offset) {
-			l2t = qcow_read_l2_table(q, l2t_offset);
-			if (!l2t)
+			old_l2t = qcow_read_l2_table(q, l1t_idx, l2t_offset);
+			if (!old_l2t)
 				goto free_cache;
+			memcpy(l2t->table, old_l2t->table, l2t_size * sizeof(u64));
 		} else
 			memset(l2t->table, 0x00, l2t_size * sizeof(u64));
 
-		/* write l2 table */
+		/* cache l2 table, to be written back later */
 		l2t->dirty = 1;
-		if (qcow_l2_cache_write(q, l2t) < 0)
-			goto free_cache;
-
-		/* cache l2 table */
 		if (cache_table(q, l2t))
 			goto free_cache;
 
 		/* update the l1 talble */
 		l1t->l1_table[l1t_idx] = cpu_to_be64(l2t_new_offset
 			| QCOW2_OFLAG_COPIED);
-		if (qcow_write_l1_table(q)) {
-			pr_warning("Update l1 table error");
-			goto free_cache;
-		}
+		l1t->dirty = 1;
 
-		/* free old cluster */
-		qcow_free_clusters(q, l2t_offset, q->cluster_size);
+		/* free old cluster, if there was one */
+		if (l2t_offset)
+			qcow_free_clusters(q, l2t_offset, q->cluster_size);
 	}
 
 	*result_l2t = l2t;
@@ -966,19 +1330,114 @@ error:
 }
 
 /*
- * If the cluster has been copied, write data directly. If not,
- * read the original data and write it to the new cluster with
- * modification.
+ * Drop the reference an L2 table entry holds on its cluster(s). Called
+ * with q->mutex held.
+ */
+static void qcow2_free_l2_entry(struct qcow *q, u64 entry)
+{
+	u64 clust_start = entry & QCOW2_OFFSET_MASK;
+	int size;
+
+	if (entry & QCOW2_OFLAG_COMPRESSED) {
+		size = ((clust_start >> q->csize_shift) &
+			q->csize_mask) + 1;
+		size *= 512;
+		clust_start &= q->cluster_offset_mask;
+		clust_start &= ~511;
+
+		qcow_free_clusters(q, clust_start, size);
+	} else if (clust_start) {
+		/*
+		 * Data may still be on its way to or from a cluster we are
+		 * about to free. Compressed ones are only read under q->mutex.
+		 */
+		if (qcow_get_refcount(q, clust_start >> q->header->cluster_bits) == 1)
+			qcow_data_io_wait(q);
+
+		qcow_free_clusters(q, clust_start, q->cluster_size);
+	}
+}
+
+/*
+ * Write to a run of clusters that were never allocated: as many as the
+ * write covers up to the first allocated one, or the end of the L2 table.
+ * They are allocated as one contiguous extent, and written in one go.
+ * Called with q->mutex held.
+ */
+static ssize_t qcow_write_new_clusters(struct qcow *q, struct qcow_l2_table *l2t,
+		u64 l2t_idx, u64 clust_off, void *buf, u32 src_len)
+{
+	struct qcow_header *header = q->header;
+	u64 clust_new_start;
+	struct iovec iov[3];
+	u64 l2t_size;
+	u64 nr, i;
+	u64 len;
+
+	l2t_size = 1 << header->l2_bits;
+
+	for (nr = 1; l2t_idx + nr < l2t_size; nr++) {
+		if (nr * q->cluster_size >= clust_off + src_len)
+			break;
+		if (l2t->table[l2t_idx + nr])
+			break;
+	}
+
+	len = nr * q->cluster_size - clust_off;
+	if (len > src_len)
+		len = src_len;
+
+	clust_new_start = qcow_alloc_clusters(q, nr * q->cluster_size, 1);
+	if (clust_new_start == (u64)-1) {
+		pr_warning("Cluster alloc error");
+		return -1;
+	}
+
+	/* The clusters may have been used before: zero what we don't write */
+	iov[0] = (struct iovec) {
+		.iov_base	= q->zero_buff,
+		.iov_len	= clust_off,
+	};
+	iov[1] = (struct iovec) {
+		.iov_base	= buf,
+		.iov_len	= len,
+	};
+	iov[2] = (struct iovec) {
+		.iov_base	= q->zero_buff,
+		.iov_len	= nr * q->cluster_size - clust_off - len,
+	};
+
+	if (pwritev_in_full(q->fd, iov, 3, clust_new_start) < 0) {
+		qcow_free_clusters(q, clust_new_start, nr * q->cluster_size);
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++)
+		l2t->table[l2t_idx + i] = cpu_to_be64((clust_new_start +
+			i * q->cluster_size) | QCOW2_OFLAG_COPIED);
+	l2t->dirty = 1;
+
+	return len;
+}
+
+/*
+ * If the cluster has been copied, write data directly, outside q->mutex
+ * like reads. If not, read the original data, from this image or the
+ * backing one, and write it to the new cluster with modification: that is
+ * done synchronously and under the lock, as the data must be in place
+ * before the L2 table points to it.
  */
-static ssize_t qcow_write_cluster(struct qcow *q, u64 offset,
-		void *buf, u32 src_len)
+static ssize_t qcow_write_cluster(struct qcow *q, struct qcow_aio_req *req,
+		u64 offset, void *buf, u32 src_len)
 {
 	struct qcow_l2_table *l2t;
+	u32 new_len;
 	u64 clust_new_start;
 	u64 clust_start;
 	u64 clust_flags;
 	u64 clust_off;
 	u64 l2t_idx;
+	ssize_t ret;
 	u64 len;
 
 	l2t = NULL;
@@ -1002,64 +1461,85 @@ static ssize_t qcow_write_cluster(struct qcow *q, u64 offset,
 	clust_flags = clust_start & QCOW2_OFLAGS_MASK;
 
 	clust_start &= QCOW2_OFFSET_MASK;
-	if (!(clust_flags & QCOW2_OFLAG_COPIED)) {
-		clust_new_start	= qcow_alloc_clusters(q, q->cluster_size, 1);
-		if (clust_new_start < 0) {
-			pr_warning("Cluster alloc error");
-			goto error;
-		}
+	if (clust_flags & QCOW2_OFLAG_COPIED) {
+		qcow_data_io_get(q);
+		mutex_unlock(&q->mutex);
 
-		offset &= ~(q->cluster_size - 1);
+		/* Write actual data */
+		if (qcow_data_io(req, true, buf, len, clust_start + clust_off) < 0)
+			return -1;
 
-		/* if clust_start is not zero, read the original data*/
-		if (clust_start) {
-			mutex_unlock(&q->mutex);
-			if (qcow2_read_cluster(q, offset, q->copy_buff,
-				q->cluster_size) < 0) {
-				pr_warning("Read copy cluster error");
-				qcow_free_clusters(q, clust_new_start,
-					q->cluster_size);
-				return -1;
-			}
-			mutex_lock(&q->mutex);
-		} else
-			memset(q->copy_buff, 0x00, q->cluster_size);
+		return len;
+	}
 
-		memcpy(q->copy_buff + clust_off, buf, len);
+	/*
+	 * Whatever part of new clusters isn't written comes from the backing
+	 * image, so only whole clusters skip the copy then.
+	 */
+	new_len = src_len;
+	if (q->backing)
+		new_len = clust_off ? 0 : src_len & ~(q->cluster_size - 1);
 
-		 /* Write actual data */
-		if (pwrite_in_full(q->fd, q->copy_buff, q->cluster_size,
-			clust_new_start) < 0)
-			goto free_cluster;
+	if (!clust_start && !clust_flags && new_len) {
+		ret = qcow_write_new_clusters(q, l2t, l2t_idx, clust_off,
+					buf, new_len);
+		mutex_unlock(&q->mutex);
 
-		/* update l2 table*/
-		l2t->table[l2t_idx] = cpu_to_be64(clust_new_start
-			| QCOW2_OFLAG_COPIED);
-		l2t->dirty = 1;
+		if (ret < 0)
+			return -1;
+
+		__sync_add_and_fetch(&req->done, ret);
+
+		return ret;
+	}
 
-		if (qcow_l2_cache_write(q, l2t))
+	clust_new_start	= qcow_alloc_clusters(q, q->cluster_size, 1);
+	if (clust_new_start == (u64)-1) {
+		pr_warning("Cluster alloc error");
+		goto error;
+	}
+
+	/* if clust_start is not zero, read the original data*/
+	if (clust_flags & QCOW2_OFLAG_COMPRESSED) {
+		if (qcow2_decompress_cluster(q, clust_start | clust_flags,
+					q->copy_buff) < 0) {
+			pr_warning("Read copy cluster error");
+			goto free_cluster;
+		}
+	} else if (clust_start) {
+		if (pread_in_full(q->fd, q->copy_buff, q->cluster_size,
+				  clust_start) < 0) {
+			pr_warning("Read copy cluster error");
+			goto free_cluster;
+		}
+	} else if (q->backing) {
+		if (qcow_read_backing(q, offset - clust_off, q->copy_buff,
+				      q->cluster_size) < 0) {
+			pr_warning("Read backing cluster error");
 			goto free_cluster;
+		}
+	} else
+		memset(q->copy_buff, 0x00, q->cluster_size);
 
-		/* free old cluster*/
-		if (clust_flags & QCOW2_OFLAG_COMPRESSED) {
-			int size;
-			size = ((clust_start >> q->csize_shift) &
-				q->csize_mask) + 1;
-			size *= 512;
-			clust_start &= q->cluster_offset_mask;
-			clust_start &= ~511;
+	memcpy(q->copy_buff + clust_off, buf, len);
 
-			qcow_free_clusters(q, clust_start, size);
-		} else if (clust_start)
-			qcow_free_clusters(q, clust_start, q->cluster_size);
+	 /* Write actual data */
+	if (pwrite_in_full(q->fd, q->copy_buff, q->cluster_size,
+		clust_new_start) < 0)
+		goto free_cluster;
+
+	/* update l2 table*/
+	l2t->table[l2t_idx] = cpu_to_be64(clust_new_start
+		| QCOW2_OFLAG_COPIED);
+	l2t->dirty = 1;
+
+	/* free old cluster*/
+	qcow2_free_l2_entry(q, clust_start | clust_flags);
 
-	} else {
-		/* Write actual data */
-		if (pwrite_in_full(q->fd, buf, len,
-			clust_start + clust_off) < 0)
-			goto error;
-	}
 	mutex_unlock(&q->mutex);
+
+	__sync_add_and_fetch(&req->done, len);
+
 	return len;
 
 free_cluster:
@@ -1070,9 +1550,9 @@ error:
 	return -1;
 }
 
-static ssize_t qcow_write_sector_single(struct disk_image *disk, u64 sector, void *src, u32 src_len)
+static ssize_t qcow_write_sector_single(struct qcow *q, struct qcow_aio_req *req,
+				u64 sector, void *src, u32 src_len)
 {
-	struct qcow *q = disk->priv;
 	struct qcow_header *header = q->header;
 	u32 nr_written;
 	char *buf;
@@ -1087,7 +1567,7 @@ static ssize_t qcow_write_sector_single(struct disk_image *disk, u64 sector, voi
 		if (offset >= header->size)
 			return -1;
 
-		nr = qcow_write_cluster(q, offset, buf, src_len - nr_written);
+		nr = qcow_write_cluster(q, req, offset, buf, src_len - nr_written);
 		if (nr < 0)
 			return -1;
 
@@ -1102,13 +1582,23 @@ static ssize_t qcow_write_sector_single(struct disk_image *disk, u64 sector, voi
 static ssize_t qcow_write_sector(struct disk_image *disk, u64 sector,
 				const struct iovec *iov, int iovcount, void *param)
 {
+	struct qcow *q = disk->priv;
+	struct qcow_aio_req *req;
 	ssize_t nr, total = 0;
 
+	req = qcow_aio_req_new(disk, param);
+	if (!req)
+		return -1;
+
 	while (iovcount--) {
-		nr = qcow_write_sector_single(disk, sector, iov->iov_base, iov->iov_len);
+		req->total += iov->iov_len;
+
+		nr = qcow_write_sector_single(q, req, sector, iov->iov_base, iov->iov_len);
 		if (nr != (ssize_t)iov->iov_len) {
 			pr_info("qcow_write_sector error: nr=%ld iov_len=%ld\n", (long)nr, (long)iov->iov_len);
-			return -1;
+			req->error = true;
+			total = -1;
+			break;
 		}
 
 		sector	+= iov->iov_len >> SECTOR_SHIFT;
@@ -1116,45 +1606,98 @@ static ssize_t qcow_write_sector(struct disk_image *disk, u64 sector,
 		total	+= nr;
 	}
 
+	qcow_aio_req_put(req);
+
 	return total;
 }
 
-static int qcow_disk_flush(struct disk_image *disk)
+/*
+ * Deallocate the clusters entirely covered by the range, which then read
+ * back as zeroes, or from the backing image. Discard is only a hint, so partial clusters and L2
+ * tables shared with a snapshot are left alone.
+ */
+static int qcow2_discard_sector(struct disk_image *disk, u64 sector, u64 nr_sectors)
 {
 	struct qcow *q = disk->priv;
-	struct qcow_refcount_table *rft;
-	struct list_head *pos, *n;
-	struct qcow_l1_table *l1t;
+	struct qcow_header *header = q->header;
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_l2_table *l2t;
+	u64 offset, end, l2t_end, l2t_offset, l1t_idx, l2t_idx, l2t_size;
+	u64 *old;
+	int ret = 0;
 
-	l1t = &q->table;
-	rft = &q->refcount_table;
+	l2t_size = 1 << header->l2_bits;
+
+	old = malloc(l2t_size * sizeof(u64));
+	if (!old)
+		return -1;
+
+	offset	= ((sector << SECTOR_SHIFT) + q->cluster_size - 1) & ~(q->cluster_size - 1);
+	end	= ((sector + nr_sectors) << SECTOR_SHIFT) & ~(q->cluster_size - 1);
 
 	mutex_lock(&q->mutex);
 
-	list_for_each_safe(pos, n, &rft->lru_list) {
-		struct qcow_refcount_block *c = list_entry(pos, struct qcow_refcount_block, list);
+	while (offset < end) {
+		l1t_idx = get_l1_index(q, offset);
+		if (l1t_idx >= l1t->table_size)
+			break;
 
-		if (write_refcount_block(q, c) < 0)
-			goto error_unlock;
-	}
+		l2t_end = (l1t_idx + 1) << (header->l2_bits + header->cluster_bits);
+		if (l2t_end > end)
+			l2t_end = end;
 
-	list_for_each_safe(pos, n, &l1t->lru_list) {
-		struct qcow_l2_table *c = list_entry(pos, struct qcow_l2_table, list);
+		l2t_offset = be64_to_cpu(l1t->l1_table[l1t_idx]);
+		if (!(l2t_offset & QCOW2_OFLAG_COPIED)) {
+			offset = l2t_end;
+			continue;
+		}
 
-		if (qcow_l2_cache_write(q, c) < 0)
-			goto error_unlock;
-	}
+		l2t = qcow_read_l2_table(q, l1t_idx, l2t_offset & ~QCOW2_OFLAG_COPIED);
+		if (!l2t) {
+			ret = -1;
+			break;
+		}
 
-	if (qcow_write_l1_table < 0)
-		goto error_unlock;
+		/* Only drop the references once the table no longer has them */
+		memcpy(old, l2t->table, l2t_size * sizeof(u64));
+
+		for (; offset < l2t_end; offset += q->cluster_size) {
+			l2t_idx = get_l2_index(q, offset);
+			if (l2t->table[l2t_idx]) {
+				l2t->table[l2t_idx] = 0;
+				l2t->dirty = 1;
+			}
+		}
+
+		if (!l2t->dirty)
+			continue;
+
+		/* This writes the table back before the first reference goes */
+		for (l2t_idx = 0; l2t_idx < l2t_size; l2t_idx++)
+			if (old[l2t_idx] && !l2t->table[l2t_idx])
+				qcow2_free_l2_entry(q, be64_to_cpu(old[l2t_idx]));
+	}
 
 	mutex_unlock(&q->mutex);
 
-	return fsync(disk->fd);
+	free(old);
+
+	return ret;
+}
+
+static int qcow_disk_flush(struct disk_image *disk)
+{
+	struct qcow *q = disk->priv;
+	int ret;
 
-error_unlock:
+	mutex_lock(&q->mutex);
+	ret = qcow_write_metadata(q);
 	mutex_unlock(&q->mutex);
-	return -1;
+
+	if (ret < 0)
+		return -1;
+
+	return fsync(disk->fd);
 }
 
 static int qcow_disk_close(struct disk_image *disk)
@@ -1166,8 +1709,13 @@ static int qcow_disk_close(struct disk_image *disk)
 
 	q = disk->priv;
 
+	if (qcow_write_metadata(q) < 0)
+		pr_warning("error writing back qcow metadata");
+
+	disk_image__close(q->backing);
 	refcount_table_free_cache(&q->refcount_table);
 	l1_table_free_cache(&q->table);
+	free(q->zero_buff);
 	free(q->copy_buff);
 	free(q->cluster_data);
 	free(q->cluster_cache);
@@ -1179,18 +1727,84 @@ static int qcow_disk_close(struct disk_image *disk)
 	return 0;
 }
 
+static void qcow_cache_stats(struct disk_image *disk,
+	struct disk_image_cache_stats *stats)
+{
+	struct qcow *q = disk->priv;
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_refcount_table *rft = &q->refcount_table;
+
+	mutex_lock(&q->mutex);
+
+	stats->l2_max			= l1t->max_cached;
+	stats->l2_cached		= l1t->nr_cached;
+	stats->l2_hits			= l1t->hits;
+	stats->l2_misses		= l1t->misses;
+	stats->l2_evictions		= l1t->evictions;
+	stats->l2_readahead_reads	= l1t->readahead_reads;
+	stats->l2_readahead_hits	= l1t->readahead_hits;
+	stats->refcount_max		= rft->max_cached;
+	stats->refcount_cached		= rft->nr_cached;
+	stats->refcount_hits		= rft->hits;
+	stats->refcount_misses		= rft->misses;
+	stats->refcount_evictions	= rft->evictions;
+
+	mutex_unlock(&q->mutex);
+}
+
 static struct disk_image_operations qcow_disk_readonly_ops = {
 	.read_sector		= qcow_read_sector,
+	.aio_complete		= qcow_aio_complete,
 	.close			= qcow_disk_close,
+	.cache_stats		= qcow_cache_stats,
 };
 
-static struct disk_image_operations qcow_disk_ops = {
+static struct disk_image_operations qcow2_disk_ops = {
 	.read_sector		= qcow_read_sector,
 	.write_sector		= qcow_write_sector,
+	.aio_complete		= qcow_aio_complete,
 	.flush			= qcow_disk_flush,
+	.discard		= qcow2_discard_sector,
 	.close			= qcow_disk_close,
+	.cache_stats		= qcow_cache_stats,
 };
 
+/*
+ * Size the L2 table and refcount block caches as the disk asks. Either is
+ * kept from outgrowing what the image can have, and a refcount block
+ * covers 1 << (cluster_bits - 1) clusters to an L2 table's 1 << l2_bits,
+ * so that many fewer of them cover as much of the image.
+ */
+static void qcow_set_cache_size(struct qcow *q, struct disk_image_params *params)
+{
+	struct qcow_header *header = q->header;
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_refcount_table *rft = &q->refcount_table;
+	u64 l2t_bytes = sizeof(u64) << header->l2_bits;
+	int ratio;
+	u64 nr;
+
+	if (params->cache_size == DISK_IMAGE_CACHE_ALL) {
+		l1t->max_cached = l1t->table_size;
+		rft->max_cached = rft->rf_size;
+	} else if (params->cache_size) {
+		nr = min(params->cache_size / l2t_bytes, (u64)l1t->table_size);
+		ratio = 1 << max(header->cluster_bits - 1 - header->l2_bits, 0);
+
+		l1t->max_cached = nr;
+		rft->max_cached = min(DIV_ROUND_UP(nr, ratio), (u64)rft->rf_size);
+	} else {
+		l1t->max_cached = QCOW_DEFAULT_CACHE_NODES;
+		rft->max_cached = QCOW_DEFAULT_CACHE_NODES;
+	}
+
+	l1t->max_cached = max(l1t->max_cached, QCOW_MIN_CACHE_NODES);
+	rft->max_cached = max(rft->max_cached, QCOW_MIN_CACHE_NODES);
+
+	l1t->readahead = min(params->readahead, (u32)QCOW_MAX_READAHEAD);
+	l1t->readahead = min(l1t->readahead, (u32)l1t->max_cached - 1);
+}
+
 static int qcow_read_refcount_table(struct qcow *q)
 {
 	struct qcow_header *header = q->header;
@@ -1232,6 +1846,64 @@ static int qcow_read_l1_table(struct qcow *q)
 	return pread_in_full(q->fd, table->l1_table, sizeof(u64) * table->table_size, header->l1_table_offset);
 }
 
+/* Backing images a chain can go through, which also stops it looping */
+#define QCOW_BACKING_DEPTH_MAX	16
+
+/*
+ * Open the backing image the header names, if any: read-only, with the
+ * default settings, and synchronous, so that its data is there once
+ * disk_image__read() returns. A relative name is relative to the directory
+ * of the image.
+ */
+static int qcow_open_backing(struct qcow *q, struct disk_image_params *params)
+{
+	struct qcow_header *header = q->header;
+	struct disk_image_params backing_params = { };
+	char name[QCOW_BACKING_FILE_MAX + 1];
+	char path[PATH_MAX];
+	const char *slash;
+	u32 len;
+
+	if (!header->backing_file_offset || !header->backing_file_size)
+		return 0;
+
+	len = header->backing_file_size;
+	if (len > QCOW_BACKING_FILE_MAX) {
+		pr_warning("qcow backing file name too long");
+		return -1;
+	}
+
+	if (params->backing_depth >= QCOW_BACKING_DEPTH_MAX) {
+		pr_warning("qcow backing files nested too deep");
+		return -1;
+	}
+
+	if (pread_in_full(q->fd, name, len, header->backing_file_offset) < 0)
+		return -1;
+	name[len] = 0;
+
+	slash = strrchr(params->filename, '/');
+	if (name[0] != '/' && slash)
+		snprintf(path, sizeof(path), "%.*s/%s",
+			(int)(slash - params->filename), params->filename, name);
+	else
+		snprintf(path, sizeof(path), "%s", name);
+
+	backing_params.filename		= path;
+	backing_params.readonly		= true;
+	backing_params.backing_depth	= params->backing_depth + 1;
+
+	q->backing = disk_image__open(&backing_params);
+	if (!q->backing) {
+		pr_warning("Unable to open qcow backing file '%s'", path);
+		return -1;
+	}
+
+	q->backing->async = 0;
+
+	return 0;
+}
+
 static void *qcow2_read_header(int fd)
 {
 	struct qcow2_header_disk f_header;
@@ -1268,12 +1940,14 @@ static void *qcow2_read_header(int fd)
 		.l2_bits		= f_header.cluster_bits - 3,
 		.refcount_table_offset	= f_header.refcount_table_offset,
 		.refcount_table_size	= f_header.refcount_table_clusters,
+		.backing_file_offset	= f_header.backing_file_offset,
+		.backing_file_size	= f_header.backing_file_size,
 	};
 
 	return header;
 }
 
-static struct disk_image *qcow2_probe(int fd, bool readonly)
+static struct disk_image *qcow2_probe(int fd, struct disk_image_params *params)
 {
 	struct disk_image *disk_image;
 	struct qcow_l1_table *l1t;
@@ -1285,6 +1959,8 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 		return NULL;
 
 	mutex_init(&q->mutex);
+	mutex_init(&q->data_io_mutex);
+	pthread_cond_init(&q->data_io_cond, NULL);
 	q->fd = fd;
 
 	l1t = &q->table;
@@ -1320,34 +1996,53 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 		goto free_cluster_data;
 	}
 
-	if (qcow_read_l1_table(q) < 0)
+	q->zero_buff = calloc(1, q->cluster_size);
+	if (!q->zero_buff) {
+		pr_warning("zero buff malloc error");
 		goto free_cluster_cache;
+	}
+
+	if (qcow_read_l1_table(q) < 0)
+		goto free_zero_buff;
 
 	if (qcow_read_refcount_table(q) < 0)
 		goto free_l1_table;
 
+	qcow_set_cache_size(q, params);
+
+	if (qcow_open_backing(q, params) < 0)
+		goto free_refcount_table;
+
 	/*
 	 * Do not use mmap use read/write instead
 	 */
-	if (readonly)
+	if (params->readonly)
 		disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
 	else
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_ops, DISK_IMAGE_REGULAR);
+		disk_image = disk_image__new(fd, h->size, &qcow2_disk_ops, DISK_IMAGE_REGULAR);
 
 	if (!disk_image)
-		goto free_refcount_table;
+		goto close_backing;
 
+#ifdef CONFIG_HAS_AIO
+	disk_image->async = 1;
+#else
 	disk_image->async = 0;
+#endif
 	disk_image->priv = q;
 
 	return disk_image;
 
+close_backing:
+	disk_image__close(q->backing);
 free_refcount_table:
 	if (q->refcount_table.rf_table)
 		free(q->refcount_table.rf_table);
 free_l1_table:
 	if (q->table.l1_table)
 		free(q->table.l1_table);
+free_zero_buff:
+	free(q->zero_buff);
 free_cluster_cache:
 	if (q->cluster_cache)
 		free(q->cluster_cache);
@@ -1415,12 +2110,14 @@ static void *qcow1_read_header(int fd)
 		.l1_size		= f_header.size / ((1 << f_header.l2_bits) * (1 << f_header.cluster_bits)),
 		.cluster_bits		= f_header.cluster_bits,
 		.l2_bits		= f_header.l2_bits,
+		.backing_file_offset	= f_header.backing_file_offset,
+		.backing_file_size	= f_header.backing_file_size,
 	};
 
 	return header;
 }
 
-static struct disk_image *qcow1_probe(int fd, bool readonly)
+static struct disk_image *qcow1_probe(int fd, struct disk_image_params *params)
 {
 	struct disk_image *disk_image;
 	struct qcow_l1_table *l1t;
@@ -1432,6 +2129,8 @@ static struct disk_image *qcow1_probe(int fd, bool readonly)
 		return NULL;
 
 	mutex_init(&q->mutex);
+	mutex_init(&q->data_io_mutex);
+	pthread_cond_init(&q->data_io_cond, NULL);
 	q->fd = fd;
 
 	l1t = &q->table;
@@ -1463,22 +2162,33 @@ static struct disk_image *qcow1_probe(int fd, bool readonly)
 	if (qcow_read_l1_table(q) < 0)
 		goto free_cluster_cache;
 
+	qcow_set_cache_size(q, params);
+
+	if (qcow_open_backing(q, params) < 0)
+		goto free_l1_table;
+
+	/* Writes only know about the QCOW2 layout */
+	if (!params->readonly)
+		pr_warning("Forcing read-only support for QCOW1");
+
 	/*
 	 * Do not use mmap use read/write instead
 	 */
-	if (readonly)
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
-	else
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_ops, DISK_IMAGE_REGULAR);
-
+	disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
 	if (!disk_image)
-		goto free_l1_table;
+		goto close_backing;
 
+#ifdef CONFIG_HAS_AIO
 	disk_image->async = 1;
+#else
+	disk_image->async = 0;
+#endif
 	disk_image->priv = q;
 
 	return disk_image;
 
+close_backing:
+	disk_image__close(q->backing);
 free_l1_table:
 	if (q->table.l1_table)
 		free(q->table.l1_table);
@@ -1517,13 +2227,188 @@ static bool qcow1_check_image(int fd)
 	return true;
 }
 
-struct disk_image *qcow_probe(int fd, bool readonly)
+struct disk_image *qcow_probe(int fd, struct disk_image_params *params)
 {
 	if (qcow1_check_image(fd))
-		return qcow1_probe(fd, readonly);
+		return qcow1_probe(fd, params);
 
 	if (qcow2_check_image(fd))
-		return qcow2_probe(fd, readonly);
+		return qcow2_probe(fd, params);
 
 	return NULL;
 }
+
+static int qcow2_write_cluster_table(int fd, u64 offset, u64 *table,
+	u64 nr, u64 first, u64 cluster_size)
+{
+	u64 entries = cluster_size / sizeof(u64);
+	u64 i;
+
+	for (i = 0; i < entries; i++)
+		table[i] = i < nr ? cpu_to_be64((first + i * cluster_size) |
+					QCOW2_OFLAG_COPIED) : 0;
+
+	return pwrite_in_full(fd, table, cluster_size, offset);
+}
+
+/*
+ * Create a QCOW2 image of the given size. It is laid out as the header,
+ * the L1 table, the refcount table and the refcount blocks, followed with
+ * preallocate by all the L2 tables and the data clusters they point to,
+ * in guest order. The data clusters are left as a hole in the file, that
+ * reads as zeroes until the guest writes to it.
+ *
+ * The refcount table is never grown, so it is made large enough for the
+ * image to be fully allocated.
+ *
+ * With a backing file, its name follows the header, and the image starts
+ * out reading as the backing image does, which rules out preallocation.
+ */
+int qcow2_create(const char *filename, u64 size, bool preallocate,
+		const char *backing_file)
+{
+	u64 cluster_size = 1ULL << QCOW2_DEFAULT_CLUSTER_BITS;
+	u64 l2_entries = cluster_size / sizeof(u64);
+	u64 rfb_entries = cluster_size / sizeof(u16);
+	u64 l1_clusters, rft_clusters, prev;
+	u64 nr_data, l1_size, nr_rfb, nr_max;
+	u64 l1_offset, rft_offset, rfb_offset;
+	u64 l2_offset, data_offset, end;
+	struct qcow2_header_disk header;
+	u64 i, j, nr;
+	void *buf;
+	u32 backing_len = 0;
+	int err = -1;
+	int fd;
+
+	if (backing_file) {
+		backing_len = strlen(backing_file);
+		if (preallocate || !backing_len ||
+		    backing_len > QCOW_BACKING_FILE_MAX) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	nr_data = DIV_ROUND_UP(size, cluster_size);
+	l1_size = DIV_ROUND_UP(nr_data, l2_entries);
+	l1_clusters = DIV_ROUND_UP(l1_size * sizeof(u64), cluster_size);
+
+	/* Refcount blocks also count themselves, and the table them */
+	rft_clusters = 1;
+	do {
+		prev = rft_clusters;
+		nr_max = 1 + l1_clusters + rft_clusters + l1_size + nr_data;
+		nr_rfb = DIV_ROUND_UP(nr_max, rfb_entries - 1);
+		rft_clusters = DIV_ROUND_UP(nr_rfb * sizeof(u64), cluster_size);
+	} while (rft_clusters != prev);
+
+	l1_offset = cluster_size;
+	rft_offset = l1_offset + l1_clusters * cluster_size;
+	rfb_offset = rft_offset + rft_clusters * cluster_size;
+
+	/* Without preallocation, only cover what is there for now */
+	if (!preallocate)
+		nr_rfb = DIV_ROUND_UP(1 + l1_clusters + rft_clusters,
+				rfb_entries - 1);
+
+	l2_offset = rfb_offset + nr_rfb * cluster_size;
+	data_offset = l2_offset;
+	if (preallocate)
+		data_offset += l1_size * cluster_size;
+	end = data_offset;
+	if (preallocate)
+		end += nr_data * cluster_size;
+
+	buf = malloc(cluster_size);
+	if (!buf)
+		return -1;
+
+	fd = open(filename, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		goto free_buf;
+
+	header = (struct qcow2_header_disk) {
+		.magic			= cpu_to_be32(QCOW_MAGIC),
+		.version		= cpu_to_be32(QCOW2_VERSION),
+		.cluster_bits		= cpu_to_be32(QCOW2_DEFAULT_CLUSTER_BITS),
+		.size			= cpu_to_be64(size),
+		.l1_size		= cpu_to_be32(l1_size),
+		.l1_table_offset	= cpu_to_be64(l1_offset),
+		.refcount_table_offset	= cpu_to_be64(rft_offset),
+		.refcount_table_clusters = cpu_to_be32(rft_clusters),
+	};
+
+	if (backing_file) {
+		header.backing_file_offset = cpu_to_be64(sizeof(header));
+		header.backing_file_size = cpu_to_be32(backing_len);
+	}
+
+	memset(buf, 0, cluster_size);
+	memcpy(buf, &header, sizeof(header));
+	if (backing_file)
+		memcpy(buf + sizeof(header), backing_file, backing_len);
+	if (pwrite_in_full(fd, buf, cluster_size, 0) < 0)
+		goto close_fd;
+
+	/* L1 table */
+	for (i = 0; i < l1_clusters; i++) {
+		nr = preallocate ? min(l1_size - i * l2_entries, l2_entries) : 0;
+		if (qcow2_write_cluster_table(fd, l1_offset + i * cluster_size,
+				buf, nr, l2_offset + i * l2_entries * cluster_size,
+				cluster_size) < 0)
+			goto close_fd;
+	}
+
+	/* Refcount table: the blocks are contiguous, without the flag */
+	for (i = 0; i < rft_clusters; i++) {
+		u64 *table = buf;
+
+		for (j = 0; j < l2_entries; j++) {
+			nr = i * l2_entries + j;
+			table[j] = nr < nr_rfb ?
+				cpu_to_be64(rfb_offset + nr * cluster_size) : 0;
+		}
+
+		if (pwrite_in_full(fd, buf, cluster_size,
+				rft_offset + i * cluster_size) < 0)
+			goto close_fd;
+	}
+
+	/* Refcount blocks: everything up to the end is used once */
+	for (i = 0; i < nr_rfb; i++) {
+		u16 *block = buf;
+
+		for (j = 0; j < rfb_entries; j++) {
+			nr = i * rfb_entries + j;
+			block[j] = nr < end / cluster_size ? cpu_to_be16(1) : 0;
+		}
+
+		if (pwrite_in_full(fd, buf, cluster_size,
+				rfb_offset + i * cluster_size) < 0)
+			goto close_fd;
+	}
+
+	/* L2 tables */
+	for (i = 0; preallocate && i < l1_size; i++) {
+		nr = min(nr_data - i * l2_entries, l2_entries);
+		if (qcow2_write_cluster_table(fd, l2_offset + i * cluster_size,
+				buf, nr, data_offset + i * l2_entries * cluster_size,
+				cluster_size) < 0)
+			goto close_fd;
+	}
+
+	if (ftruncate(fd, end) < 0 || fsync(fd) < 0)
+		goto close_fd;
+
+	err = 0;
+
+close_fd:
+	close(fd);
+	if (err)
+		unlink(filename);
+free_buf:
+	free(buf);
+
+	return err;
+}
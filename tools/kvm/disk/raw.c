@@ -1,36 +1,87 @@
 #include "kvm/disk-image.h"
+#include "kvm/kvm.h"
+
+#include <linux/kernel.h>
+#include <linux/bitops.h>
 
 #ifdef CONFIG_HAS_AIO
 #include <libaio.h>
 #endif
 
+/*
+ * Requests aligned for O_DIRECT go straight between the guest's memory and
+ * the disk. Others, which guests seldom make, go through the page cache;
+ * the kernel keeps the two coherent.
+ */
+static int raw_image__fd(struct disk_image *disk, u64 offset, const struct iovec *iov,
+				int iovcount)
+{
+	int i;
+
+	if (disk->direct_fd < 0 || offset % DISK_IMAGE_DIRECT_ALIGN)
+		return disk->fd;
+
+	for (i = 0; i < iovcount; i++)
+		if ((unsigned long)iov[i].iov_base % DISK_IMAGE_DIRECT_ALIGN ||
+		    iov[i].iov_len % DISK_IMAGE_DIRECT_ALIGN)
+			return disk->fd;
+
+	return disk->direct_fd;
+}
+
 ssize_t raw_image__read_sector(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param)
 {
 	u64 offset = sector << SECTOR_SHIFT;
+	int fd = raw_image__fd(disk, offset, iov, iovcount);
 
 #ifdef CONFIG_HAS_AIO
 	struct iocb iocb;
 
-	return aio_preadv(disk->ctx, &iocb, disk->fd, iov, iovcount, offset,
-				disk->evt, param);
-#else
-	return preadv_in_full(disk->fd, iov, iovcount, offset);
+	if (disk->async)
+		return aio_preadv(disk->ctx, &iocb, fd, iov, iovcount,
+				offset, disk->evt, param);
 #endif
+	return preadv_in_full(fd, iov, iovcount, offset);
 }
 
 ssize_t raw_image__write_sector(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param)
 {
 	u64 offset = sector << SECTOR_SHIFT;
+	int fd = raw_image__fd(disk, offset, iov, iovcount);
 
 #ifdef CONFIG_HAS_AIO
 	struct iocb iocb;
 
-	return aio_pwritev(disk->ctx, &iocb, disk->fd, iov, iovcount, offset,
-				disk->evt, param);
+	if (disk->async)
+		return aio_pwritev(disk->ctx, &iocb, fd, iov, iovcount,
+				offset, disk->evt, param);
+#endif
+	return pwritev_in_full(fd, iov, iovcount, offset);
+}
+
+int raw_image__queue_sector(struct disk_image *disk, struct disk_image_batch *batch,
+				bool write, u64 sector, const struct iovec *iov,
+				int iovcount, void *param)
+{
+#ifdef CONFIG_HAS_AIO
+	struct iocb *iocb = &batch->iocb[batch->nr];
+	u64 offset = sector << SECTOR_SHIFT;
+	int fd = raw_image__fd(disk, offset, iov, iovcount);
+
+	if (write)
+		io_prep_pwritev(iocb, fd, iov, iovcount, offset);
+	else
+		io_prep_preadv(iocb, fd, iov, iovcount, offset);
+	io_set_eventfd(iocb, disk->evt);
+	iocb->data = param;
+
+	batch->ios[batch->nr++] = iocb;
+
+	return 0;
 #else
-	return pwritev_in_full(disk->fd, iov, iovcount, offset);
+	return -1;
 #endif
 }
 
@@ -57,8 +108,16 @@ ssize_t raw_image__write_sector_mmap(struct disk_image *disk, u64 sector, const
 {
 	u64 offset = sector << SECTOR_SHIFT;
 	ssize_t total = 0;
+	u64 page;
 
 	while (iovcount--) {
+		if (disk->map_written) {
+			for (page = offset / PAGE_SIZE;
+			     page < DIV_ROUND_UP(offset + iov->iov_len, PAGE_SIZE); page++)
+				__sync_fetch_and_or(&disk->map_written[page / BITS_PER_LONG],
+						1UL << (page % BITS_PER_LONG));
+		}
+
 		memcpy(disk->priv + offset, iov->iov_base, iov->iov_len);
 
 		sector	+= iov->iov_len >> SECTOR_SHIFT;
@@ -70,6 +129,90 @@ ssize_t raw_image__write_sector_mmap(struct disk_image *disk, u64 sector, const
 	return total;
 }
 
+/*
+ * Replace the guest's pages with a private mapping of the image's: they
+ * are shared with the page cache, and with other guests using the image,
+ * until the guest writes to them. Pages the guest has written to on the
+ * disk are only in our own mapping, and have to be copied.
+ *
+ * Each mapping is a VMA of its own, and splits up huge pages backing the
+ * guest's memory: only whole DISK_IMAGE_MAP_ALIGN extents are mapped, and
+ * no more than DISK_IMAGE_MAP_MAX of them, so that we stay well clear of
+ * vm.max_map_count. Anything else is copied.
+ */
+static bool raw_image__map_iov(struct disk_image *disk, u64 offset, const struct iovec *iov)
+{
+	u64 page;
+
+	if (((unsigned long)iov->iov_base | offset | iov->iov_len) % DISK_IMAGE_MAP_ALIGN)
+		return false;
+
+	if (disk->map_nr >= DISK_IMAGE_MAP_MAX)
+		return false;
+
+	for (page = offset / PAGE_SIZE; page < (offset + iov->iov_len) / PAGE_SIZE; page++)
+		if (test_bit(page, disk->map_written))
+			return false;
+
+	if (__sync_add_and_fetch(&disk->map_nr, 1) > DISK_IMAGE_MAP_MAX)
+		return false;
+
+	return mmap(iov->iov_base, iov->iov_len, PROT_RW, MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE,
+			disk->fd, offset) != MAP_FAILED;
+}
+
+ssize_t raw_image__read_sector_map(struct disk_image *disk, u64 sector, const struct iovec *iov,
+				int iovcount, void *param)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	ssize_t total = 0;
+
+	while (iovcount--) {
+		if (!raw_image__map_iov(disk, offset, iov))
+			memcpy(iov->iov_base, disk->priv + offset, iov->iov_len);
+
+		sector	+= iov->iov_len >> SECTOR_SHIFT;
+		offset	+= iov->iov_len;
+		total	+= iov->iov_len;
+		iov++;
+	}
+
+	return total;
+}
+
+/*
+ * Punch a hole: the file system frees the blocks and they read back as
+ * zeroes.
+ */
+int raw_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors)
+{
+	return fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			sector << SECTOR_SHIFT, nr_sectors << SECTOR_SHIFT);
+}
+
+int raw_image__write_zeroes(struct disk_image *disk, u64 sector, u64 nr_sectors,
+				bool unmap)
+{
+	static const u8 zeroes[64 * 1024];
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 len = nr_sectors << SECTOR_SHIFT;
+	size_t n;
+
+	if (unmap && raw_image__discard(disk, sector, nr_sectors) == 0)
+		return 0;
+
+	while (len) {
+		n = min(len, (u64)sizeof(zeroes));
+		if (pwrite_in_full(disk->fd, zeroes, n, offset) < 0)
+			return -1;
+
+		offset	+= n;
+		len	-= n;
+	}
+
+	return 0;
+}
+
 int raw_image__close(struct disk_image *disk)
 {
 	int ret = 0;
@@ -77,11 +220,14 @@ int raw_image__close(struct disk_image *disk)
 	if (disk->priv != MAP_FAILED)
 		ret = munmap(disk->priv, disk->size);
 
-	close(disk->evt);
+	free(disk->map_written);
 
-#ifdef CONFIG_HAS_VIRTIO
-	io_destroy(disk->ctx);
+	if (disk->evt >= 0) {
+		close(disk->evt);
+#ifdef CONFIG_HAS_AIO
+		io_destroy(disk->ctx);
 #endif
+	}
 
 	return ret;
 }
@@ -92,6 +238,9 @@ int raw_image__close(struct disk_image *disk)
 static struct disk_image_operations raw_image_regular_ops = {
 	.read_sector	= raw_image__read_sector,
 	.write_sector	= raw_image__write_sector,
+	.queue_sector	= raw_image__queue_sector,
+	.discard	= raw_image__discard,
+	.write_zeroes	= raw_image__write_zeroes,
 };
 
 struct disk_image_operations ro_ops = {
@@ -102,20 +251,42 @@ struct disk_image_operations ro_ops = {
 
 struct disk_image_operations ro_ops_nowrite = {
 	.read_sector	= raw_image__read_sector,
+	.queue_sector	= raw_image__queue_sector,
 };
 
-struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
+static struct disk_image_operations ro_ops_map = {
+	.read_sector	= raw_image__read_sector_map,
+	.write_sector	= raw_image__write_sector_mmap,
+	.close		= raw_image__close,
+};
+
+static void raw_image__open_direct(struct disk_image *disk, struct disk_image_params *params)
+{
+	disk->direct_fd = open(params->filename, (params->readonly ? O_RDONLY : O_RDWR) | O_DIRECT);
+	if (disk->direct_fd < 0)
+		pr_warning("'%s' can't be opened with O_DIRECT, using the page cache",
+			params->filename);
+}
+
+struct disk_image *raw_image__probe(int fd, struct stat *st, struct disk_image_params *params)
 {
 	struct disk_image *disk;
 
-	if (readonly) {
+	if (params->readonly && !params->direct) {
 		/*
 		 * Use mmap's MAP_PRIVATE to implement non-persistent write
 		 * FIXME: This does not work on 32-bit host.
 		 */
 		struct disk_image *disk;
 
-		disk = disk_image__new(fd, st->st_size, &ro_ops, DISK_IMAGE_MMAP);
+		disk = disk_image__new(fd, st->st_size, params->map ? &ro_ops_map : &ro_ops,
+					DISK_IMAGE_MMAP);
+		if (disk && params->map) {
+			disk->map_written = calloc(BITS_TO_LONGS(DIV_ROUND_UP(st->st_size, PAGE_SIZE)),
+						sizeof(long));
+			if (!disk->map_written)
+				disk->ops = &ro_ops;
+		}
 		if (disk == NULL) {
 
 			disk = disk_image__new(fd, st->st_size, &ro_ops_nowrite, DISK_IMAGE_REGULAR);
@@ -126,15 +297,24 @@ struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
 		}
 
 		return disk;
+	} else if (params->readonly) {
+		/*
+		 * Bypassing the page cache, writes can't be discarded
+		 * through a private mapping: they fail.
+		 */
+		disk = disk_image__new(fd, st->st_size, &ro_ops_nowrite, DISK_IMAGE_REGULAR);
 	} else {
 		/*
 		 * Use read/write instead of mmap
 		 */
 		disk = disk_image__new(fd, st->st_size, &raw_image_regular_ops, DISK_IMAGE_REGULAR);
+	}
+
+	if (disk && params->direct)
+		raw_image__open_direct(disk, params);
 #ifdef CONFIG_HAS_AIO
-		if (disk)
-			disk->async = 1;
+	if (disk)
+		disk->async = 1;
 #endif
-		return disk;
-	}
+	return disk;
 }
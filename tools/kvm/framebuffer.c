@@ -1,10 +1,18 @@
 #include "kvm/framebuffer.h"
+#include "kvm/kvm.h"
+#include "kvm/util.h"
 
 #include <linux/kernel.h>
+#include <linux/bitops.h>
 #include <linux/list.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/mman.h>
 
+/* How often the targets are told about what the guest drew */
+#define FB_FRAME_RATE		25
+
 static LIST_HEAD(framebuffers);
 
 struct framebuffer *fb__register(struct framebuffer *fb)
@@ -43,6 +51,98 @@ static int start_targets(struct framebuffer *fb)
 	return 0;
 }
 
+static void update_targets(struct framebuffer *fb, u32 y, u32 height)
+{
+	unsigned long i;
+
+	for (i = 0; i < fb->nr_targets; i++) {
+		struct fb_target_operations *ops = fb->targets[i];
+
+		if (ops->update)
+			ops->update(fb, y, height);
+	}
+}
+
+/*
+ * Hand the targets the scanlines on the pages the guest wrote to, a range
+ * of them at a time.
+ */
+static void update_dirty(struct framebuffer *fb, unsigned long *dirty, unsigned long nr_pages)
+{
+	u64 pitch = fb->width * fb->depth / 8;
+	u64 first, last, start = 0, end = 0;
+	unsigned long i;
+
+	for (i = 0; i < nr_pages; i++) {
+		if (!test_bit(i, dirty))
+			continue;
+
+		first	= i * PAGE_SIZE / pitch;
+		last	= min(((i + 1) * PAGE_SIZE + pitch - 1) / pitch, (u64)fb->height);
+		if (first >= last)
+			break;
+
+		if (first > end) {
+			if (end > start)
+				update_targets(fb, start, end - start);
+			start = first;
+		}
+		end = last;
+	}
+
+	if (end > start)
+		update_targets(fb, start, end - start);
+}
+
+static void *fb__thread(void *p)
+{
+	struct framebuffer *fb = p;
+	unsigned long *dirty = NULL;
+	unsigned long nr_pages;
+
+	nr_pages = DIV_ROUND_UP(fb->mem_size, PAGE_SIZE);
+	if (fb->mem_slot >= 0)
+		dirty = calloc(BITS_TO_LONGS(nr_pages), sizeof(*dirty));
+
+	/* Whatever is there already is new to the targets */
+	update_targets(fb, 0, fb->height);
+
+	for (;;) {
+		usleep(1000000 / FB_FRAME_RATE);
+
+		if (dirty && kvm__get_dirty_log(fb->kvm, fb->mem_slot, dirty) < 0) {
+			pr_warning("Failed getting the framebuffer dirty log, updating all of it");
+			free(dirty);
+			dirty = NULL;
+		}
+
+		if (dirty)
+			update_dirty(fb, dirty, nr_pages);
+		else
+			update_targets(fb, 0, fb->height);
+	}
+
+	return NULL;
+}
+
+static int start_updates(struct framebuffer *fb)
+{
+	pthread_t thread;
+	unsigned long i;
+
+	for (i = 0; i < fb->nr_targets; i++)
+		if (fb->targets[i]->update)
+			break;
+
+	if (i == fb->nr_targets)
+		return 0;
+
+	if (pthread_create(&thread, NULL, fb__thread, fb) != 0)
+		return -1;
+
+	return 0;
+}
+
 int fb__start(void)
 {
 	struct framebuffer *fb;
@@ -53,6 +153,10 @@ int fb__start(void)
 		err = start_targets(fb);
 		if (err)
 			return err;
+
+		err = start_updates(fb);
+		if (err)
+			return err;
 	}
 
 	return 0;
@@ -50,6 +50,7 @@ struct framebuffer *vesa__init(struct kvm *kvm)
 	u16 vesa_base_addr;
 	u8 dev, line, pin;
 	char *mem;
+	u32 slot;
 
 	if (irq__register_device(PCI_DEVICE_ID_VESA, &dev, &pin, &line) < 0)
 		return NULL;
@@ -64,7 +65,9 @@ struct framebuffer *vesa__init(struct kvm *kvm)
 	if (mem == MAP_FAILED)
 		return NULL;
 
-	kvm__register_mem(kvm, VESA_MEM_ADDR, VESA_MEM_SIZE, mem);
+	/* Have KVM log the guest's drawing, so that only that gets redrawn */
+	slot = kvm__register_mem_flags(kvm, VESA_MEM_ADDR, VESA_MEM_SIZE, mem,
+					KVM_MEM_LOG_DIRTY_PAGES);
 
 	vesafb = (struct framebuffer) {
 		.width			= VESA_WIDTH,
@@ -73,6 +76,8 @@ struct framebuffer *vesa__init(struct kvm *kvm)
 		.mem			= mem,
 		.mem_addr		= VESA_MEM_ADDR,
 		.mem_size		= VESA_MEM_SIZE,
+		.kvm			= kvm,
+		.mem_slot		= slot,
 	};
 	return fb__register(&vesafb);
 }
@@ -28,15 +28,107 @@ enum {
 
 #define MAX_DISK_IMAGES         4
 
+/* A cache_size covering all of an image's metadata */
+#define DISK_IMAGE_CACHE_ALL	(~0ULL)
+
+/*
+ * O_DIRECT I/O has to be aligned to the logical block size of the device
+ * under the image, which is never larger than this.
+ */
+#define DISK_IMAGE_DIRECT_ALIGN	4096
+
+/*
+ * With 'map', the size and alignment of the extents mapped into the guest,
+ * a huge page's, and how many mappings a disk makes before copying instead.
+ */
+#define DISK_IMAGE_MAP_ALIGN	(2UL << 20)
+#define DISK_IMAGE_MAP_MAX	4096
+
+/* Most reads and writes a batch queues up before it has to submit them */
+#define DISK_IMAGE_BATCH_MAX	64
+
 struct disk_image;
 
+/*
+ * Reads and writes one thread queues up, to submit all at once with
+ * disk_image__batch_submit(). Disks that can't queue do them on the spot
+ * instead.
+ */
+struct disk_image_batch {
+	struct disk_image		*disk;
+	int				nr;
+#ifdef CONFIG_HAS_AIO
+	struct iocb			iocb[DISK_IMAGE_BATCH_MAX];
+	struct iocb			*ios[DISK_IMAGE_BATCH_MAX];
+#endif
+};
+
+struct disk_image_params {
+	const char			*filename;
+	bool				readonly;
+	/*
+	 * Bytes of qcow L2 tables to cache, 0 for the default. The refcount
+	 * block cache is sized to cover as much of the image.
+	 */
+	u64				cache_size;
+	/* Following L2 tables to read along with one that misses */
+	u32				readahead;
+	/* Service each virtio-blk queue with its own thread */
+	bool				iothread;
+	/* Raw images: do aligned I/O with O_DIRECT, bypassing the page cache */
+	bool				direct;
+	/*
+	 * Read-only raw images: map the image's pages into the guest's
+	 * buffers, rather than copying them
+	 */
+	bool				map;
+	/* Backing images: how far down the chain of backing images */
+	int				backing_depth;
+};
+
+/* qcow metadata cache statistics, as sent to 'kvm stat --disk' */
+struct disk_image_cache_stats {
+	/* Zero for images without a metadata cache */
+	u32				l2_max;
+	u32				l2_cached;
+	u64				l2_hits;
+	u64				l2_misses;
+	u64				l2_evictions;
+	u64				l2_readahead_reads;
+	u64				l2_readahead_hits;
+	u32				refcount_max;
+	u32				refcount_cached;
+	u64				refcount_hits;
+	u64				refcount_misses;
+	u64				refcount_evictions;
+};
+
 struct disk_image_operations {
 	ssize_t (*read_sector)(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
 	ssize_t (*write_sector)(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
+	/*
+	 * Queue a read or write in a batch that has room for it, instead of
+	 * submitting it. It completes through disk_req_cb.
+	 */
+	int (*queue_sector)(struct disk_image *disk, struct disk_image_batch *batch,
+				bool write, u64 sector, const struct iovec *iov,
+				int iovcount, void *param);
+	/*
+	 * Complete an aio submitted by read_sector or write_sector, when the
+	 * image has more to do than hand it to disk_req_cb
+	 */
+	void (*aio_complete)(struct disk_image *disk, void *param, long len);
 	int (*flush)(struct disk_image *disk);
+	/* Deallocate sectors, after which their content is unspecified */
+	int (*discard)(struct disk_image *disk, u64 sector, u64 nr_sectors);
+	/* Zero sectors, deallocating them if unmap is set and we can */
+	int (*write_zeroes)(struct disk_image *disk, u64 sector, u64 nr_sectors,
+				bool unmap);
 	int (*close)(struct disk_image *disk);
+	void (*cache_stats)(struct disk_image *disk,
+				struct disk_image_cache_stats *stats);
 };
 
 struct disk_image {
@@ -47,15 +139,26 @@ struct disk_image {
 	void				*disk_req_cb_param;
 	void				(*disk_req_cb)(void *param, long len);
 	bool				async;
+	bool				iothread;
+	/* The image opened with O_DIRECT, or -1 */
+	int				direct_fd;
+	/*
+	 * With zero-copy reads of a mapped image, the pages written to
+	 * through the mapping, which can't be mapped into the guest again.
+	 */
+	unsigned long			*map_written;
+	/* Mappings made into the guest so far, up to DISK_IMAGE_MAP_MAX */
+	unsigned int			map_nr;
 	int				evt;
 #ifdef CONFIG_HAS_AIO
 	io_context_t			ctx;
 #endif
 };
 
-struct disk_image *disk_image__open(const char *filename, bool readonly);
-struct disk_image **disk_image__open_all(const char **filenames, bool *readonly, int count);
+struct disk_image *disk_image__open(struct disk_image_params *params);
+struct disk_image **disk_image__open_all(struct disk_image_params *params, int count);
 struct disk_image *disk_image__new(int fd, u64 size, struct disk_image_operations *ops, int mmap);
+int disk_image__start_aio(struct disk_image *disk, int nr_events);
 int disk_image__close(struct disk_image *disk);
 void disk_image__close_all(struct disk_image **disks, int count);
 int disk_image__flush(struct disk_image *disk);
@@ -63,9 +166,17 @@ ssize_t disk_image__read(struct disk_image *disk, u64 sector, const struct iovec
 				int iovcount, void *param);
 ssize_t disk_image__write(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
+void disk_image__batch_init(struct disk_image_batch *batch, struct disk_image *disk);
+int disk_image__batch_read(struct disk_image_batch *batch, u64 sector,
+				const struct iovec *iov, int iovcount, void *param);
+int disk_image__batch_write(struct disk_image_batch *batch, u64 sector,
+				const struct iovec *iov, int iovcount, void *param);
+int disk_image__batch_submit(struct disk_image_batch *batch);
+int disk_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors);
+int disk_image__write_zeroes(struct disk_image *disk, u64 sector, u64 nr_sectors, bool unmap);
 ssize_t disk_image__get_serial(struct disk_image *disk, void *buffer, ssize_t *len);
 
-struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly);
+struct disk_image *raw_image__probe(int fd, struct stat *st, struct disk_image_params *params);
 struct disk_image *blkdev__probe(const char *filename, struct stat *st);
 
 ssize_t raw_image__read_sector(struct disk_image *disk, u64 sector,
@@ -76,6 +187,14 @@ ssize_t raw_image__read_sector_mmap(struct disk_image *disk, u64 sector,
 				const struct iovec *iov, int iovcount, void *param);
 ssize_t raw_image__write_sector_mmap(struct disk_image *disk, u64 sector,
 				const struct iovec *iov, int iovcount, void *param);
+ssize_t raw_image__read_sector_map(struct disk_image *disk, u64 sector,
+				const struct iovec *iov, int iovcount, void *param);
+int raw_image__queue_sector(struct disk_image *disk, struct disk_image_batch *batch,
+				bool write, u64 sector, const struct iovec *iov,
+				int iovcount, void *param);
+int raw_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors);
+int raw_image__write_zeroes(struct disk_image *disk, u64 sector, u64 nr_sectors,
+				bool unmap);
 int raw_image__close(struct disk_image *disk);
 void disk_image__set_callback(struct disk_image *disk, void (*disk_req_cb)(void *param, long len));
 #endif /* KVM__DISK_IMAGE_H */
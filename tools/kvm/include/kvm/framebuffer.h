@@ -5,9 +5,12 @@
 #include <linux/list.h>
 
 struct framebuffer;
+struct kvm;
 
 struct fb_target_operations {
 	int (*start)(struct framebuffer *fb);
+	/* Scanlines y to y + height - 1 changed since the last update */
+	void (*update)(struct framebuffer *fb, u32 y, u32 height);
 };
 
 #define FB_MAX_TARGETS			2
@@ -22,6 +25,10 @@ struct framebuffer {
 	u64				mem_addr;
 	u64				mem_size;
 
+	/* The memory slot logging the guest's writes to mem, or -1 */
+	struct kvm			*kvm;
+	int				mem_slot;
+
 	unsigned long			nr_targets;
 	struct fb_target_operations	*targets[FB_MAX_TARGETS];
 };
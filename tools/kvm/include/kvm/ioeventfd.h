@@ -3,6 +3,7 @@
 
 #include <linux/types.h>
 #include <linux/list.h>
+#include <stdbool.h>
 #include <sys/eventfd.h>
 
 struct kvm;
@@ -21,7 +22,7 @@ struct ioevent {
 
 void ioeventfd__init(struct kvm *kvm);
 void ioeventfd__start(void);
-void ioeventfd__add_event(struct ioevent *ioevent);
+void ioeventfd__add_event(struct ioevent *ioevent, bool user_poll);
 void ioeventfd__del_event(u64 addr, u64 datamatch);
 
 #endif
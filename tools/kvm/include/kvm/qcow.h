@@ -22,28 +22,59 @@
 
 #define QCOW2_OFFSET_MASK	(~QCOW2_OFLAGS_MASK)
 
-#define MAX_CACHE_NODES         32
+/* Longest backing file name we follow */
+#define QCOW_BACKING_FILE_MAX		1023
+
+/* Cluster size of the QCOW2 images we create */
+#define QCOW2_DEFAULT_CLUSTER_BITS	16
+
+/* L2 tables and refcount blocks cached when the disk doesn't set a size */
+#define QCOW_DEFAULT_CACHE_NODES	32
+/* The write path holds on to an L2 table while it reads another */
+#define QCOW_MIN_CACHE_NODES		2
+/* Most L2 tables read ahead on a miss */
+#define QCOW_MAX_READAHEAD		64
 
 struct qcow_l2_table {
 	u64				offset;
 	struct rb_node			node;
 	struct list_head		list;
 	u8				dirty;
+	/* Read ahead, and not looked up since */
+	u8				readahead;
 	u64				table[];
 };
 
 struct qcow_l1_table {
 	u32				table_size;
 	u64				*l1_table;
+	u8				dirty;
 
 	/* Level2 caching data structures */
 	struct rb_root			root;
 	struct list_head		lru_list;
 	int				nr_cached;
+	int				max_cached;
+	/* Following tables to read along with one that misses */
+	u32				readahead;
+
+	u64				hits;
+	u64				misses;
+	u64				evictions;
+	/* Tables read ahead, and how many of them were used */
+	u64				readahead_reads;
+	u64				readahead_hits;
 };
 
 #define QCOW_REFCOUNT_BLOCK_SHIFT	1
 
+/*
+ * The next refcount block is allocated once allocations are less than
+ * 1/QCOW_REFCOUNT_PREALLOC_RATIO of a block's worth of clusters away from
+ * it, which places it in clusters the current block covers.
+ */
+#define QCOW_REFCOUNT_PREALLOC_RATIO	8
+
 struct qcow_refcount_block {
 	u64				offset;
 	struct rb_node			node;
@@ -61,6 +92,11 @@ struct qcow_refcount_table {
 	struct rb_root			root;
 	struct list_head		lru_list;
 	int				nr_cached;
+	int				max_cached;
+
+	u64				hits;
+	u64				misses;
+	u64				evictions;
 };
 
 struct qcow_header {
@@ -71,6 +107,8 @@ struct qcow_header {
 	u8				l2_bits;
 	u64				refcount_table_offset;
 	u32				refcount_table_size;
+	u64				backing_file_offset;
+	u32				backing_file_size;
 };
 
 struct qcow {
@@ -88,6 +126,17 @@ struct qcow {
 	void				*cluster_cache;
 	void				*cluster_data;
 	void				*copy_buff;
+	/* A cluster of zeroes, to pad writes to new clusters */
+	void				*zero_buff;
+	/* Where clusters the image doesn't have are read from, if any */
+	struct disk_image		*backing;
+	/*
+	 * Data transfers looked up but not done yet: a cluster they may be
+	 * using is only freed once there are none.
+	 */
+	pthread_mutex_t			data_io_mutex;
+	pthread_cond_t			data_io_cond;
+	int				data_io;
 };
 
 struct qcow1_header_disk {
@@ -128,6 +177,10 @@ struct qcow2_header_disk {
 	u64				snapshots_offset;
 };
 
-struct disk_image *qcow_probe(int fd, bool readonly);
+struct disk_image_params;
+
+struct disk_image *qcow_probe(int fd, struct disk_image_params *params);
+int qcow2_create(const char *filename, u64 size, bool preallocate,
+		const char *backing_file);
 
 #endif /* KVM__QCOW_H */
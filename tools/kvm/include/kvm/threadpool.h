@@ -3,7 +3,7 @@
 
 #include "kvm/mutex.h"
 
-#include <linux/list.h>
+#include <linux/types.h>
 
 struct kvm;
 
@@ -14,10 +14,20 @@ struct thread_pool__job {
 	struct kvm			*kvm;
 	void				*data;
 
+	/* Signals not run yet; the job is queued while this is non-zero */
 	int				signalcount;
-	pthread_mutex_t			mutex;
-
-	struct list_head		queue;
+	/* Next job in a worker's inbox */
+	struct thread_pool__job		*next;
+
+	/* Statistics, as printed by 'lkvm debug --dump' */
+	bool				registered;
+	struct thread_pool__job		*all_next;
+	u64				queued_ns;
+	u64				nr_queued;
+	u64				nr_runs;
+	u64				wait_ns;
+	u64				max_wait_ns;
+	int				max_pending;
 };
 
 static inline void thread_pool__init_job(struct thread_pool__job *job, struct kvm *kvm, kvm_thread_callback_fn_t callback, void *data)
@@ -26,7 +36,6 @@ static inline void thread_pool__init_job(struct thread_pool__job *job, struct kv
 		.kvm		= kvm,
 		.callback	= callback,
 		.data		= data,
-		.mutex		= PTHREAD_MUTEX_INITIALIZER,
 	};
 }
 
@@ -34,4 +43,6 @@ int thread_pool__init(unsigned long thread_count);
 
 void thread_pool__do_job(struct thread_pool__job *job);
 
+void thread_pool__dump_stats(int fd);
+
 #endif
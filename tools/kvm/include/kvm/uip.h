@@ -7,10 +7,6 @@
 #include <netinet/in.h>
 #include <sys/uio.h>
 
-#define UIP_BUF_STATUS_FREE	0
-#define UIP_BUF_STATUS_INUSE	1
-#define UIP_BUF_STATUS_USED	2
-
 #define UIP_ETH_P_IP		0X0800
 #define UIP_ETH_P_ARP		0X0806
 
@@ -75,6 +71,9 @@
 #define UIP_MAX_TCP_PAYLOAD	(64*1024 - 20 - 20 - 1)
 #define UIP_MAX_UDP_PAYLOAD	(64*1024 - 20 -  8 - 1)
 
+/* Socket events the event loop takes at once */
+#define UIP_MAX_EVENTS		64
+
 struct uip_eth_addr {
 	u8 addr[6];
 };
@@ -193,12 +192,20 @@ struct uip_info {
 	struct uip_eth_addr host_mac;
 	pthread_cond_t buf_free_cond;
 	pthread_cond_t buf_used_cond;
-	struct list_head buf_head;
+	/*
+	 * Free buffers, and the ones waiting for the guest oldest first.
+	 * A buffer being filled or emptied is on neither.
+	 */
+	struct list_head buf_free_head;
+	struct list_head buf_used_head;
 	pthread_mutex_t buf_lock;
-	pthread_t udp_thread;
-	int udp_epollfd;
-	int buf_free_nr;
-	int buf_used_nr;
+	/*
+	 * A single thread waits for all the sockets, and reads them into
+	 * payload
+	 */
+	pthread_t event_thread;
+	int epollfd;
+	u8 *payload;
 	u32 guest_ip;
 	u32 guest_netmask;
 	u32 host_ip;
@@ -212,15 +219,20 @@ struct uip_buf {
 	struct uip_info *info;
 	int vnet_len;
 	int eth_len;
-	int status;
 	char *vnet;
 	char *eth;
 	int id;
 };
 
+/* What a socket does when the event loop finds it ready, events as from epoll */
+struct uip_event {
+	void (*handle)(struct uip_info *info, struct uip_event *ev, u32 events);
+};
+
 struct uip_udp_socket {
 	struct sockaddr_in addr;
 	struct list_head list;
+	struct uip_event event;
 	pthread_mutex_t *lock;
 	u32 dport, sport;
 	u32 dip, sip;
@@ -231,8 +243,8 @@ struct uip_tcp_socket {
 	struct sockaddr_in addr;
 	struct list_head list;
 	struct uip_info *info;
-	pthread_mutex_t *lock;
-	pthread_t thread;
+	struct uip_event event;
+	pthread_mutex_t lock;
 	u32 dport, sport;
 	u32 guest_acked;
 	/*
@@ -244,9 +256,20 @@ struct uip_tcp_socket {
 	u32 seq_server;
 	int write_done;
 	int read_done;
+	/*
+	 * What the event loop waits for, and whether it's done with the
+	 * socket altogether
+	 */
+	u32 events;
+	int detached;
 	u32 dip, sip;
-	u8 *payload;
 	int fd;
+	/*
+	 * Guest data the socket couldn't take yet, the window we advertise
+	 * is what's left of it
+	 */
+	u32 snd_len;
+	u8 snd_buf[UIP_TCP_WIN_SIZE];
 };
 
 struct uip_tx_arg {
@@ -332,6 +355,9 @@ static inline u16 uip_eth_hdrlen(struct uip_eth *eth)
 int uip_tx(struct iovec *iov, u16 out, struct uip_info *info);
 int uip_rx(struct iovec *iov, u16 in, struct uip_info *info);
 int uip_init(struct uip_info *info);
+int uip_event_add(struct uip_info *info, int fd, struct uip_event *ev, u32 events);
+int uip_event_mod(struct uip_info *info, int fd, struct uip_event *ev, u32 events);
+int uip_event_del(struct uip_info *info, int fd);
 
 int uip_tx_do_ipv4_udp_dhcp(struct uip_tx_arg *arg);
 int uip_tx_do_ipv4_icmp(struct uip_tx_arg *arg);
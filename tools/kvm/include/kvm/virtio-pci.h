@@ -6,7 +6,8 @@
 
 #include <linux/types.h>
 
-#define VIRTIO_PCI_MAX_VQ	3
+/* The MSI-X table, an entry per queue and the config one, fills a PCI_IO_SIZE BAR */
+#define VIRTIO_PCI_MAX_VQ	15
 #define VIRTIO_PCI_MAX_CONFIG	1
 
 struct kvm;
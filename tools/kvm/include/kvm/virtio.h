@@ -15,6 +15,15 @@
 #define VIRTIO_PCI_O_CONFIG	0
 #define VIRTIO_PCI_O_MSIX	1
 
+/* Largest queue that can use the packed layout */
+#define VIRTIO_PACKED_QUEUE_SIZE	256
+
+/* Where a buffer popped from a packed ring starts, and how long it is */
+struct virt_queue_packed_buf {
+	u16		pos;
+	u16		num;
+};
+
 struct virt_queue {
 	struct vring	vring;
 	u32		pfn;
@@ -22,10 +31,27 @@ struct virt_queue {
 	   It's where we assume the next request index is at.  */
 	u16		last_avail_idx;
 	u16		last_used_signalled;
+
+	/*
+	 * With VIRTIO_RING_F_PACKED, vring_packed is used instead of vring.
+	 * last_avail_idx and last_used_idx are then free running counts of
+	 * descriptors: modulo the ring size they give the ring position, and
+	 * the next bit is the inverse of the wrap counter.
+	 */
+	bool		packed;
+	struct vring_packed vring_packed;
+	u16		last_used_idx;
+	struct virt_queue_packed_buf packed_bufs[VIRTIO_PACKED_QUEUE_SIZE];
 };
 
+u16 virt_queue__pop_packed(struct virt_queue *queue);
+bool virt_queue__available_packed(struct virt_queue *vq);
+
 static inline u16 virt_queue__pop(struct virt_queue *queue)
 {
+	if (queue->packed)
+		return virt_queue__pop_packed(queue);
+
 	return queue->vring.avail->ring[queue->last_avail_idx++ % queue->vring.num];
 }
 
@@ -36,6 +62,9 @@ static inline struct vring_desc *virt_queue__get_desc(struct virt_queue *queue,
 
 static inline bool virt_queue__available(struct virt_queue *vq)
 {
+	if (vq->packed)
+		return virt_queue__available_packed(vq);
+
 	if (!vq->vring.avail)
 		return 0;
 
@@ -54,7 +83,11 @@ static inline void *guest_pfn_to_host(struct kvm *kvm, u32 pfn)
 }
 
 
+void virt_queue__init(struct virt_queue *vq, u32 num, void *p, u32 features);
 struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32 head, u32 len);
+bool virt_queue__pending(struct virt_queue *vq);
+void virt_queue__disable_notify(struct virt_queue *vq);
+bool virt_queue__enable_notify(struct virt_queue *vq);
 
 bool virtio_queue__should_signal(struct virt_queue *vq);
 u16 virt_queue__get_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, struct kvm *kvm);
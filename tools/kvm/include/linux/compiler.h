@@ -16,4 +16,6 @@
 #define __must_check
 #define unlikely
 
+#define ACCESS_ONCE(x) (*(volatile typeof(x) *)&(x))
+
 #endif
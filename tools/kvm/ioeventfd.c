@@ -31,7 +31,11 @@ void ioeventfd__init(struct kvm *kvm)
 		die("Failed creating epoll fd");
 }
 
-void ioeventfd__add_event(struct ioevent *ioevent)
+/*
+ * With user_poll, the eventfd is only registered with KVM: whoever passed
+ * it in waits on it, rather than the ioeventfd thread.
+ */
+void ioeventfd__add_event(struct ioevent *ioevent, bool user_poll)
 {
 	struct kvm_ioeventfd kvm_ioevent;
 	struct epoll_event epoll_event;
@@ -59,13 +63,15 @@ void ioeventfd__add_event(struct ioevent *ioevent)
 	if (ioctl(ioevent->fn_kvm->vm_fd, KVM_IOEVENTFD, &kvm_ioevent) != 0)
 		die("Failed creating new ioeventfd");
 
-	epoll_event = (struct epoll_event) {
-		.events			= EPOLLIN,
-		.data.ptr		= new_ioevent,
-	};
+	if (!user_poll) {
+		epoll_event = (struct epoll_event) {
+			.events		= EPOLLIN,
+			.data.ptr	= new_ioevent,
+		};
 
-	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event, &epoll_event) != 0)
-		die("Failed assigning new event to the epoll fd");
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event, &epoll_event) != 0)
+			die("Failed assigning new event to the epoll fd");
+	}
 
 	list_add_tail(&new_ioevent->list, &used_ioevents);
 }
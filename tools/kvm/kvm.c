@@ -257,13 +257,15 @@ void kvm__delete(struct kvm *kvm)
  * memory regions to it. Therefore, be careful if you use this function for
  * registering memory regions for emulating hardware.
  */
-void kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size, void *userspace_addr)
+u32 kvm__register_mem_flags(struct kvm *kvm, u64 guest_phys, u64 size, void *userspace_addr,
+				u32 flags)
 {
 	struct kvm_userspace_memory_region mem;
 	int ret;
 
 	mem = (struct kvm_userspace_memory_region) {
 		.slot			= kvm->mem_slots++,
+		.flags			= flags,
 		.guest_phys_addr	= guest_phys,
 		.memory_size		= size,
 		.userspace_addr		= (unsigned long)userspace_addr,
@@ -272,6 +274,28 @@ void kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size, void *userspac
 	ret = ioctl(kvm->vm_fd, KVM_SET_USER_MEMORY_REGION, &mem);
 	if (ret < 0)
 		die_perror("KVM_SET_USER_MEMORY_REGION ioctl");
+
+	return mem.slot;
+}
+
+void kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size, void *userspace_addr)
+{
+	kvm__register_mem_flags(kvm, guest_phys, size, userspace_addr, 0);
+}
+
+/*
+ * Fill 'bitmap' with the pages of a slot registered with
+ * KVM_MEM_LOG_DIRTY_PAGES that the guest wrote since the last call, a bit
+ * per page rounded up to a long.
+ */
+int kvm__get_dirty_log(struct kvm *kvm, u32 slot, unsigned long *bitmap)
+{
+	struct kvm_dirty_log log = {
+		.slot		= slot,
+		.dirty_bitmap	= bitmap,
+	};
+
+	return ioctl(kvm->vm_fd, KVM_GET_DIRTY_LOG, &log);
 }
 
 int kvm__recommended_cpus(struct kvm *kvm)
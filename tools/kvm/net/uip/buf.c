@@ -3,86 +3,56 @@
 #include <linux/kernel.h>
 #include <linux/list.h>
 
-struct uip_buf *uip_buf_get_used(struct uip_info *info)
+/* Take the first buffer off a list, waiting for one if it's empty */
+static struct uip_buf *uip_buf_get(struct uip_info *info, struct list_head *head,
+				   pthread_cond_t *cond)
 {
 	struct uip_buf *buf;
-	bool found = false;
 
 	mutex_lock(&info->buf_lock);
 
-	while (!(info->buf_used_nr > 0))
-		pthread_cond_wait(&info->buf_used_cond, &info->buf_lock);
-
-	list_for_each_entry(buf, &info->buf_head, list) {
-		if (buf->status == UIP_BUF_STATUS_USED) {
-			/*
-			 * Set status to INUSE immediately to prevent
-			 * someone from using this buf until we free it
-			 */
-			buf->status = UIP_BUF_STATUS_INUSE;
-			info->buf_used_nr--;
-			found = true;
-			break;
-		}
-	}
+	while (list_empty(head))
+		pthread_cond_wait(cond, &info->buf_lock);
+
+	buf = list_first_entry(head, struct uip_buf, list);
+	list_del(&buf->list);
 
 	mutex_unlock(&info->buf_lock);
 
-	return found ? buf : NULL;
+	return buf;
 }
 
-struct uip_buf *uip_buf_get_free(struct uip_info *info)
+static struct uip_buf *uip_buf_put(struct uip_info *info, struct uip_buf *buf,
+				   struct list_head *head, pthread_cond_t *cond)
 {
-	struct uip_buf *buf;
-	bool found = false;
-
 	mutex_lock(&info->buf_lock);
 
-	while (!(info->buf_free_nr > 0))
-		pthread_cond_wait(&info->buf_free_cond, &info->buf_lock);
-
-	list_for_each_entry(buf, &info->buf_head, list) {
-		if (buf->status == UIP_BUF_STATUS_FREE) {
-			/*
-			 * Set status to INUSE immediately to prevent
-			 * someone from using this buf until we free it
-			 */
-			buf->status = UIP_BUF_STATUS_INUSE;
-			info->buf_free_nr--;
-			found = true;
-			break;
-		}
-	}
+	list_add_tail(&buf->list, head);
+	pthread_cond_signal(cond);
 
 	mutex_unlock(&info->buf_lock);
 
-	return found ? buf : NULL;
+	return buf;
 }
 
-struct uip_buf *uip_buf_set_used(struct uip_info *info, struct uip_buf *buf)
+struct uip_buf *uip_buf_get_used(struct uip_info *info)
 {
-	mutex_lock(&info->buf_lock);
-
-	buf->status = UIP_BUF_STATUS_USED;
-	info->buf_used_nr++;
-	pthread_cond_signal(&info->buf_used_cond);
+	return uip_buf_get(info, &info->buf_used_head, &info->buf_used_cond);
+}
 
-	mutex_unlock(&info->buf_lock);
+struct uip_buf *uip_buf_get_free(struct uip_info *info)
+{
+	return uip_buf_get(info, &info->buf_free_head, &info->buf_free_cond);
+}
 
-	return buf;
+struct uip_buf *uip_buf_set_used(struct uip_info *info, struct uip_buf *buf)
+{
+	return uip_buf_put(info, buf, &info->buf_used_head, &info->buf_used_cond);
 }
 
 struct uip_buf *uip_buf_set_free(struct uip_info *info, struct uip_buf *buf)
 {
-	mutex_lock(&info->buf_lock);
-
-	buf->status = UIP_BUF_STATUS_FREE;
-	info->buf_free_nr++;
-	pthread_cond_signal(&info->buf_free_cond);
-
-	mutex_unlock(&info->buf_lock);
-
-	return buf;
+	return uip_buf_put(info, buf, &info->buf_free_head, &info->buf_free_cond);
 }
 
 struct uip_buf *uip_buf_clone(struct uip_tx_arg *arg)
@@ -4,6 +4,7 @@
 #include <linux/virtio_net.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
+#include <sys/epoll.h>
 
 int uip_tx(struct iovec *iov, u16 out, struct uip_info *info)
 {
@@ -135,6 +136,56 @@ out:
 	return len;
 }
 
+static int uip_event_ctl(struct uip_info *info, int op, int fd, struct uip_event *ev, u32 events)
+{
+	struct epoll_event event = {
+		.events		= events,
+		.data.ptr	= ev,
+	};
+
+	return epoll_ctl(info->epollfd, op, fd, &event);
+}
+
+int uip_event_add(struct uip_info *info, int fd, struct uip_event *ev, u32 events)
+{
+	return uip_event_ctl(info, EPOLL_CTL_ADD, fd, ev, events);
+}
+
+int uip_event_mod(struct uip_info *info, int fd, struct uip_event *ev, u32 events)
+{
+	return uip_event_ctl(info, EPOLL_CTL_MOD, fd, ev, events);
+}
+
+int uip_event_del(struct uip_info *info, int fd)
+{
+	return epoll_ctl(info->epollfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/*
+ * Data from the sockets of all the guest's connections comes through here.
+ * A socket is removed from the loop by its handler, before it is closed.
+ */
+static void *uip_event_thread(void *p)
+{
+	struct epoll_event events[UIP_MAX_EVENTS];
+	struct uip_info *info = p;
+	struct uip_event *ev;
+	int nfds;
+	int i;
+
+	while (1) {
+		nfds = epoll_wait(info->epollfd, events, UIP_MAX_EVENTS, -1);
+
+		for (i = 0; i < nfds; i++) {
+			ev = events[i].data.ptr;
+			ev->handle(info, ev, events[i].events);
+		}
+	}
+
+	pthread_exit(NULL);
+	return NULL;
+}
+
 int uip_init(struct uip_info *info)
 {
 	struct list_head *udp_socket_head;
@@ -146,12 +197,13 @@ int uip_init(struct uip_info *info)
 
 	udp_socket_head	= &info->udp_socket_head;
 	tcp_socket_head	= &info->tcp_socket_head;
-	buf_head	= &info->buf_head;
+	buf_head	= &info->buf_free_head;
 	buf_nr		= info->buf_nr;
 
 	INIT_LIST_HEAD(udp_socket_head);
 	INIT_LIST_HEAD(tcp_socket_head);
 	INIT_LIST_HEAD(buf_head);
+	INIT_LIST_HEAD(&info->buf_used_head);
 
 	pthread_mutex_init(&info->udp_socket_lock, NULL);
 	pthread_mutex_init(&info->tcp_socket_lock, NULL);
@@ -165,7 +217,6 @@ int uip_init(struct uip_info *info)
 		buf = malloc(sizeof(*buf));
 		memset(buf, 0, sizeof(*buf));
 
-		buf->status	= UIP_BUF_STATUS_FREE;
 		buf->info	= info;
 		buf->id		= i;
 		list_add_tail(&buf->list, buf_head);
@@ -174,17 +225,26 @@ int uip_init(struct uip_info *info)
 	list_for_each_entry(buf, buf_head, list) {
 		buf->vnet	= malloc(sizeof(struct virtio_net_hdr));
 		buf->vnet_len	= sizeof(struct virtio_net_hdr);
-		buf->eth	= malloc(1024*64 + sizeof(struct uip_pseudo_hdr));
-		buf->eth_len	= 1024*64 + sizeof(struct uip_pseudo_hdr);
+		/* A full IP packet, behind its ethernet header */
+		buf->eth	= malloc(1024*64 + sizeof(struct uip_eth) + sizeof(struct uip_pseudo_hdr));
+		buf->eth_len	= 1024*64 + sizeof(struct uip_eth) + sizeof(struct uip_pseudo_hdr);
 
 		memset(buf->vnet, 0, buf->vnet_len);
 		memset(buf->eth, 0, buf->eth_len);
 	}
 
-	info->buf_free_nr = buf_nr;
-	info->buf_used_nr = 0;
-
 	uip_dhcp_get_dns(info);
 
+	info->payload = malloc(max(UIP_MAX_TCP_PAYLOAD, UIP_MAX_UDP_PAYLOAD));
+	if (!info->payload)
+		return -1;
+
+	info->epollfd = epoll_create(UIP_MAX_EVENTS);
+	if (info->epollfd < 0)
+		return -1;
+
+	if (pthread_create(&info->event_thread, NULL, uip_event_thread, info) != 0)
+		return -1;
+
 	return 0;
 }
@@ -3,42 +3,55 @@
 #include <linux/virtio_net.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
-
-static int uip_tcp_socket_close(struct uip_tcp_socket *sk, int how)
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+
+/*
+ * Each socket has a lock, held while either the guest's frames or the event
+ * loop use it, and never across anything that may block: the socket is non
+ * blocking, and frames for the guest are taken beforehand. Whatever the
+ * guest sends that the socket can't take yet waits in snd_buf for the event
+ * loop to flush it.
+ *
+ * The event loop lets go of a socket once it has read all there was and
+ * flushed snd_buf, then whichever of the two is done last frees it.
+ */
+static void uip_tcp_socket_free(struct uip_tcp_socket *sk)
 {
-	shutdown(sk->fd, how);
-
-	if (sk->write_done && sk->read_done) {
-		shutdown(sk->fd, SHUT_RDWR);
-		close(sk->fd);
-
-		mutex_lock(sk->lock);
-		list_del(&sk->list);
-		mutex_unlock(sk->lock);
-
-		free(sk);
-	}
+	struct uip_info *info = sk->info;
 
-	return 0;
+	/*
+	 * The guest's frames look sockets up with the list lock held until
+	 * they have the socket's, so once we hold both nobody else has it.
+	 */
+	mutex_lock(&info->tcp_socket_lock);
+	mutex_lock(&sk->lock);
+	list_del(&sk->list);
+	mutex_unlock(&sk->lock);
+	mutex_unlock(&info->tcp_socket_lock);
+
+	close(sk->fd);
+	free(sk);
 }
 
+/* Returns the socket locked */
 static struct uip_tcp_socket *uip_tcp_socket_find(struct uip_tx_arg *arg, u32 sip, u32 dip, u16 sport, u16 dport)
 {
 	struct list_head *sk_head;
-	pthread_mutex_t *sk_lock;
 	struct uip_tcp_socket *sk;
 
 	sk_head = &arg->info->tcp_socket_head;
-	sk_lock = &arg->info->tcp_socket_lock;
 
-	mutex_lock(sk_lock);
+	mutex_lock(&arg->info->tcp_socket_lock);
 	list_for_each_entry(sk, sk_head, list) {
 		if (sk->sip == sip && sk->dip == dip && sk->sport == sport && sk->dport == dport) {
-			mutex_unlock(sk_lock);
+			mutex_lock(&sk->lock);
+			mutex_unlock(&arg->info->tcp_socket_lock);
 			return sk;
 		}
 	}
-	mutex_unlock(sk_lock);
+	mutex_unlock(&arg->info->tcp_socket_lock);
 
 	return NULL;
 }
@@ -50,6 +63,7 @@ static struct uip_tcp_socket *uip_tcp_socket_alloc(struct uip_tx_arg *arg, u32 s
 	pthread_mutex_t *sk_lock;
 	struct uip_tcp *tcp;
 	struct uip_ip *ip;
+	int flags;
 	int ret;
 
 	tcp = (struct uip_tcp *)arg->eth;
@@ -61,8 +75,9 @@ static struct uip_tcp_socket *uip_tcp_socket_alloc(struct uip_tx_arg *arg, u32 s
 	sk = malloc(sizeof(*sk));
 	memset(sk, 0, sizeof(*sk));
 
-	sk->lock			= sk_lock;
+	pthread_mutex_init(&sk->lock, NULL);
 	sk->info			= arg->info;
+	sk->detached			= 1;
 
 	sk->fd				= socket(AF_INET, SOCK_STREAM, 0);
 	sk->addr.sin_family		= AF_INET;
@@ -71,10 +86,14 @@ static struct uip_tcp_socket *uip_tcp_socket_alloc(struct uip_tx_arg *arg, u32 s
 
 	ret = connect(sk->fd, (struct sockaddr *)&sk->addr, sizeof(sk->addr));
 	if (ret) {
+		close(sk->fd);
 		free(sk);
 		return NULL;
 	}
 
+	flags = fcntl(sk->fd, F_GETFL, 0);
+	fcntl(sk->fd, F_SETFL, flags | O_NONBLOCK);
+
 	sk->sip		= ip->sip;
 	sk->dip		= ip->dip;
 	sk->sport	= tcp->sport;
@@ -87,21 +106,16 @@ static struct uip_tcp_socket *uip_tcp_socket_alloc(struct uip_tx_arg *arg, u32 s
 	return sk;
 }
 
-static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_len)
+/* Called with the socket lock held, buf is a free buffer */
+static int uip_tcp_payload_send(struct uip_tcp_socket *sk, struct uip_buf *buf, u8 flag, u8 *payload, u16 payload_len)
 {
 	struct uip_info *info;
 	struct uip_eth *eth2;
 	struct uip_tcp *tcp2;
-	struct uip_buf *buf;
 	struct uip_ip *ip2;
 
 	info		= sk->info;
 
-	/*
-	 * Get free buffer to send data to guest
-	 */
-	buf		= uip_buf_get_free(info);
-
 	/*
 	 * Cook a ethernet frame
 	 */
@@ -132,12 +146,12 @@ static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_
 	 */
 	tcp2->off	= UIP_TCP_HDR_LEN;
 	tcp2->flg	= flag;
-	tcp2->win	= htons(UIP_TCP_WIN_SIZE);
+	tcp2->win	= htons(UIP_TCP_WIN_SIZE - sk->snd_len);
 	tcp2->csum	= 0;
 	tcp2->urgent	= 0;
 
 	if (payload_len > 0)
-		memcpy(uip_tcp_payload(tcp2), sk->payload, payload_len);
+		memcpy(uip_tcp_payload(tcp2), payload, payload_len);
 
 	ip2->len	= htons(uip_tcp_hdrlen(tcp2) + payload_len + uip_ip_hdrlen(ip2));
 	ip2->csum	= uip_csum_ip(ip2);
@@ -164,91 +178,180 @@ static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_
 	return 0;
 }
 
-static void *uip_tcp_socket_thread(void *p)
+/*
+ * Have the event loop wait for what the socket needs, or let go of it if
+ * that's nothing. Called with the socket lock held.
+ */
+static void uip_tcp_socket_events(struct uip_tcp_socket *sk)
 {
-	struct uip_tcp_socket *sk;
-	u8 *payload;
-	int ret;
+	u32 events = 0;
+	int ret = 0;
+
+	if (!sk->read_done)
+		events |= EPOLLIN;
+	if (sk->snd_len)
+		events |= EPOLLOUT;
+
+	if (events == sk->events)
+		return;
+
+	if (!events) {
+		ret = uip_event_del(sk->info, sk->fd);
+		sk->detached = 1;
+	} else if (sk->detached) {
+		ret = uip_event_add(sk->info, sk->fd, &sk->event, events);
+		sk->detached = 0;
+	} else {
+		ret = uip_event_mod(sk->info, sk->fd, &sk->event, events);
+	}
 
-	sk = p;
+	if (ret < 0)
+		pr_warning("epoll_ctl error");
 
-	payload = malloc(UIP_MAX_TCP_PAYLOAD);
-	sk->payload = payload;
-	if (!sk->payload)
-		goto out;
+	sk->events = events;
+}
 
-	while (1) {
+/* Pass on what the socket can take of snd_buf, called with the socket lock held */
+static int uip_tcp_socket_flush(struct uip_tcp_socket *sk)
+{
+	int ret;
 
-		ret = read(sk->fd, payload, UIP_MAX_TCP_PAYLOAD);
+	ret = send(sk->fd, sk->snd_buf, sk->snd_len, MSG_NOSIGNAL);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		/* The connection is gone, so is what it had to send */
+		pr_warning("tcp send error");
+		sk->snd_len = 0;
+	} else {
+		sk->snd_len -= ret;
+		memmove(sk->snd_buf, sk->snd_buf + ret, sk->snd_len);
+	}
 
-		if (ret <= 0 || ret > UIP_MAX_TCP_PAYLOAD)
-			goto out;
+	if (!sk->snd_len && sk->write_done)
+		shutdown(sk->fd, SHUT_WR);
 
-		uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, ret);
+	return ret;
+}
 
+static void uip_tcp_socket_event(struct uip_info *info, struct uip_event *ev, u32 events)
+{
+	struct uip_tcp_socket *sk;
+	struct uip_buf *buf = NULL;
+	int done = 0;
+	int ret = 0;
+	int len = -1;
+
+	sk = container_of(ev, struct uip_tcp_socket, event);
+
+	/* Only we set read_done, no need for the lock to look at it */
+	if (!sk->read_done && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+		len = read(sk->fd, info->payload, UIP_MAX_TCP_PAYLOAD);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			len = -1;
+		else if (len < 0)
+			len = 0;
 	}
 
-out:
-	/*
-	 * Close server to guest TCP connection
-	 */
-	uip_tcp_socket_close(sk, SHUT_RD);
+	/* A frame for the guest, which may have to wait for one to be free */
+	if (len >= 0 || (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+		buf = uip_buf_get_free(info);
 
-	uip_tcp_payload_send(sk, UIP_TCP_FLAG_FIN | UIP_TCP_FLAG_ACK, 0);
-	sk->seq_server += 1;
+	mutex_lock(&sk->lock);
 
-	sk->read_done = 1;
+	if (sk->snd_len && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+		ret = uip_tcp_socket_flush(sk);
 
-	free(sk->payload);
-	pthread_exit(NULL);
+	if (len > 0) {
+		uip_tcp_payload_send(sk, buf, UIP_TCP_FLAG_ACK, info->payload, len);
+	} else if (len == 0) {
+		/*
+		 * Close server to guest TCP connection
+		 */
+		uip_tcp_payload_send(sk, buf, UIP_TCP_FLAG_FIN | UIP_TCP_FLAG_ACK, NULL, 0);
+		sk->seq_server += 1;
 
-	return NULL;
-}
+		sk->read_done = 1;
+		shutdown(sk->fd, SHUT_RD);
+	} else if (ret > 0) {
+		/* Let the guest know there's room again */
+		uip_tcp_payload_send(sk, buf, UIP_TCP_FLAG_ACK, NULL, 0);
+	} else if (buf) {
+		uip_buf_set_free(info, buf);
+	}
 
-static int uip_tcp_socket_receive(struct uip_tcp_socket *sk)
-{
-	if (sk->thread == 0)
-		return pthread_create(&sk->thread, NULL, uip_tcp_socket_thread, (void *)sk);
+	uip_tcp_socket_events(sk);
+	done = sk->detached && sk->write_done;
 
-	return 0;
+	mutex_unlock(&sk->lock);
+
+	if (done)
+		uip_tcp_socket_free(sk);
 }
 
-static int uip_tcp_socket_send(struct uip_tcp_socket *sk, struct uip_tcp *tcp)
+/*
+ * Take what fits in the window of the guest's data, called with the socket
+ * lock held. Returns how much that is.
+ */
+static int uip_tcp_socket_send(struct uip_tcp_socket *sk, u8 *payload, int len)
 {
-	int len;
-	int ret;
-	u8 *payload;
+	int ret = 0;
 
 	if (sk->write_done)
 		return 0;
 
-	payload = uip_tcp_payload(tcp);
-	len = uip_tcp_payloadlen(tcp);
+	len = min(len, (int)(UIP_TCP_WIN_SIZE - sk->snd_len));
+
+	/* Straight to the socket unless there's older data waiting */
+	if (!sk->snd_len) {
+		ret = send(sk->fd, payload, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				pr_warning("tcp send error");
+				return -1;
+			}
+			ret = 0;
+		}
+	}
 
-	ret = write(sk->fd, payload, len);
-	if (ret != len)
-		pr_warning("tcp send error");
+	memcpy(sk->snd_buf + sk->snd_len, payload + ret, len - ret);
+	sk->snd_len += len - ret;
+	uip_tcp_socket_events(sk);
 
-	return ret;
+	return len;
 }
 
 int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg)
 {
 	struct uip_tcp_socket *sk;
+	struct uip_buf *buf;
 	struct uip_tcp *tcp;
 	struct uip_ip *ip;
+	u32 seq, skip;
+	int done = 0;
+	int len;
 	int ret;
 
 	tcp = (struct uip_tcp *)arg->eth;
 	ip = (struct uip_ip *)arg->eth;
 
+	/*
+	 * Any answer to the guest goes in here, taken before the socket is
+	 * locked
+	 */
+	buf = uip_buf_get_free(arg->info);
+
 	/*
 	 * Guest is trying to start a TCP session, let's fake SYN-ACK to guest
 	 */
 	if (uip_tcp_is_syn(tcp)) {
 		sk = uip_tcp_socket_alloc(arg, ip->sip, ip->dip, tcp->sport, tcp->dport);
-		if (!sk)
+		if (!sk) {
+			uip_buf_set_free(arg->info, buf);
 			return -1;
+		}
+
+		mutex_lock(&sk->lock);
 
 		/*
 		 * Setup ISN number
@@ -258,60 +361,89 @@ int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg)
 
 		sk->seq_server = sk->isn_server;
 		sk->ack_server = sk->isn_guest + 1;
-		uip_tcp_payload_send(sk, UIP_TCP_FLAG_SYN | UIP_TCP_FLAG_ACK, 0);
+		uip_tcp_payload_send(sk, buf, UIP_TCP_FLAG_SYN | UIP_TCP_FLAG_ACK, NULL, 0);
 		sk->seq_server += 1;
 
 		/*
-		 * Start receive thread for data from remote to guest
+		 * Have the event loop pass on data from remote to guest
 		 */
-		uip_tcp_socket_receive(sk);
+		sk->event.handle = uip_tcp_socket_event;
+		uip_tcp_socket_events(sk);
 
-		goto out;
+		mutex_unlock(&sk->lock);
+
+		return 0;
 	}
 
 	/*
 	 * Find socket we have allocated
 	 */
 	sk = uip_tcp_socket_find(arg, ip->sip, ip->dip, tcp->sport, tcp->dport);
-	if (!sk)
+	if (!sk) {
+		uip_buf_set_free(arg->info, buf);
 		return -1;
+	}
 
+	ret = 0;
 	sk->guest_acked = ntohl(tcp->ack);
 
-	if (uip_tcp_is_fin(tcp)) {
-		if (sk->write_done)
+	/*
+	 * Only take data in order: skip what we already have, and leave
+	 * anything past a gap for the guest to send again
+	 */
+	seq = ntohl(tcp->seq);
+	len = uip_tcp_payloadlen(tcp);
+	skip = sk->ack_server - seq;
+	if ((s32)skip < 0 || skip > (u32)len) {
+		uip_tcp_payload_send(sk, buf, UIP_TCP_FLAG_ACK, NULL, 0);
+		goto out;
+	}
+
+	len -= skip;
+	if (len > 0) {
+		/*
+		 * Sent out TCP data to remote host
+		 */
+		ret = uip_tcp_socket_send(sk, uip_tcp_payload(tcp) + skip, len);
+		if (ret < 0) {
+			uip_buf_set_free(arg->info, buf);
 			goto out;
+		}
 
+		sk->ack_server += ret;
+	}
+
+	if (uip_tcp_is_fin(tcp) && !sk->write_done && ret == len) {
 		sk->write_done = 1;
 		sk->ack_server += 1;
-		uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, 0);
 
 		/*
-		 * Close guest to server TCP connection
+		 * Close guest to server TCP connection, once what's
+		 * waiting is out
 		 */
-		uip_tcp_socket_close(sk, SHUT_WR);
+		if (!sk->snd_len)
+			shutdown(sk->fd, SHUT_WR);
 
+		done = sk->detached;
+	} else if (len <= 0) {
+		/*
+		 * Ignore guest to server frames with zero tcp payload
+		 */
+		uip_buf_set_free(arg->info, buf);
 		goto out;
 	}
 
-	/*
-	 * Ignore guest to server frames with zero tcp payload
-	 */
-	if (uip_tcp_payloadlen(tcp) == 0)
-		goto out;
-
-	/*
-	 * Sent out TCP data to remote host
-	 */
-	ret = uip_tcp_socket_send(sk, tcp);
-	if (ret < 0)
-		return -1;
 	/*
 	 * Send ACK to guest imediately
 	 */
-	sk->ack_server += ret;
-	uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, 0);
+	uip_tcp_payload_send(sk, buf, UIP_TCP_FLAG_ACK, NULL, 0);
+	ret = 0;
 
 out:
-	return 0;
+	mutex_unlock(&sk->lock);
+
+	if (done)
+		uip_tcp_socket_free(sk);
+
+	return ret;
 }
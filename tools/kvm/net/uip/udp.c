@@ -7,14 +7,13 @@
 #include <sys/epoll.h>
 #include <fcntl.h>
 
-#define UIP_UDP_MAX_EVENTS 1000
+static void uip_udp_socket_event(struct uip_info *info, struct uip_event *ev, u32 events);
 
 static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, u32 sip, u32 dip, u16 sport, u16 dport)
 {
 	struct list_head *sk_head;
 	struct uip_udp_socket *sk;
 	pthread_mutex_t *sk_lock;
-	struct epoll_event ev;
 	int flags;
 	int ret;
 
@@ -53,14 +52,10 @@ static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, u32 si
 	fcntl(sk->fd, F_SETFL, flags);
 
 	/*
-	 * Add sk->fd to epoll_wait
+	 * Have the event loop pass on what comes back
 	 */
-	ev.events	= EPOLLIN;
-	ev.data.fd	= sk->fd;
-	ev.data.ptr	= sk;
-	if (arg->info->udp_epollfd <= 0)
-		arg->info->udp_epollfd = epoll_create(UIP_UDP_MAX_EVENTS);
-	ret = epoll_ctl(arg->info->udp_epollfd, EPOLL_CTL_ADD, sk->fd, &ev);
+	sk->event.handle = uip_udp_socket_event;
+	ret = uip_event_add(arg->info, sk->fd, &sk->event, EPOLLIN);
 	if (ret == -1)
 		pr_warning("epoll_ctl error");
 
@@ -149,66 +144,40 @@ int uip_udp_make_pkg(struct uip_info *info, struct uip_udp_socket *sk, struct ui
 	return 0;
 }
 
-static void *uip_udp_socket_thread(void *p)
+static void uip_udp_socket_event(struct uip_info *info, struct uip_event *ev, u32 events)
 {
-	struct epoll_event events[UIP_UDP_MAX_EVENTS];
 	struct uip_udp_socket *sk;
-	struct uip_info *info;
 	struct uip_buf *buf;
 	int payload_len;
-	u8 *payload;
-	int nfds;
-	int i;
 
-	info = p;
+	sk = container_of(ev, struct uip_udp_socket, event);
 
-	do {
-		payload = malloc(UIP_MAX_UDP_PAYLOAD);
-	} while (!payload);
+	payload_len = recvfrom(sk->fd, info->payload, UIP_MAX_UDP_PAYLOAD, 0, NULL, NULL);
+	if (payload_len < 0)
+		return;
 
-	while (1) {
-		nfds = epoll_wait(info->udp_epollfd, events, UIP_UDP_MAX_EVENTS, -1);
-
-		if (nfds == -1)
-			continue;
-
-		for (i = 0; i < nfds; i++) {
-
-			sk = events[i].data.ptr;
-			payload_len = recvfrom(sk->fd, payload, UIP_MAX_UDP_PAYLOAD, 0, NULL, NULL);
-			if (payload_len < 0)
-				continue;
-
-			/*
-			 * Get free buffer to send data to guest
-			 */
-			buf = uip_buf_get_free(info);
+	/*
+	 * Get free buffer to send data to guest
+	 */
+	buf = uip_buf_get_free(info);
 
-			uip_udp_make_pkg(info, sk, buf, payload, payload_len);
+	uip_udp_make_pkg(info, sk, buf, info->payload, payload_len);
 
-			/*
-			 * Send data received from socket to guest
-			 */
-			uip_buf_set_used(info, buf);
-		}
-	}
-
-	free(payload);
-	pthread_exit(NULL);
-	return NULL;
+	/*
+	 * Send data received from socket to guest
+	 */
+	uip_buf_set_used(info, buf);
 }
 
 int uip_tx_do_ipv4_udp(struct uip_tx_arg *arg)
 {
 	struct uip_udp_socket *sk;
-	struct uip_info *info;
 	struct uip_udp *udp;
 	struct uip_ip *ip;
 	int ret;
 
 	udp	= (struct uip_udp *)(arg->eth);
 	ip	= (struct uip_ip *)(arg->eth);
-	info	= arg->info;
 
 	if (uip_udp_is_dhcp(udp)) {
 		uip_tx_do_ipv4_udp_dhcp(arg);
@@ -229,8 +198,5 @@ int uip_tx_do_ipv4_udp(struct uip_tx_arg *arg)
 	if (ret)
 		return -1;
 
-	if (!info->udp_thread)
-		pthread_create(&info->udp_thread, NULL, uip_udp_socket_thread, (void *)info);
-
 	return 0;
 }
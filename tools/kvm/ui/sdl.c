@@ -2,10 +2,13 @@
 
 #include "kvm/framebuffer.h"
 #include "kvm/i8042.h"
+#include "kvm/mutex.h"
 #include "kvm/util.h"
 #include "kvm/kvm.h"
 #include "kvm/kvm-cpu.h"
 
+#include <linux/kernel.h>
+
 #include <SDL/SDL.h>
 #include <pthread.h>
 #include <signal.h>
@@ -138,6 +141,10 @@ static const struct set2_scancode const keymap[256] = {
 	[119]	= DEFINE_ESC(0x71),	/* <delete> */
 };
 
+/* The scanlines to redraw, none if start and end are the same */
+static DEFINE_MUTEX(update_lock);
+static u32 update_start, update_end;
+
 static const struct set2_scancode *to_code(u8 scancode)
 {
 	return &keymap[scancode];
@@ -200,8 +207,10 @@ static void *sdl__thread(void *p)
 	struct framebuffer *fb = p;
 	SDL_Surface *guest_screen;
 	SDL_Surface *screen;
+	SDL_Rect src, dst;
 	SDL_Event ev;
 	Uint32 flags;
+	u32 y, height;
 
 	if (SDL_Init(SDL_INIT_VIDEO) != 0)
 		die("Unable to initialize SDL");
@@ -215,7 +224,8 @@ static void *sdl__thread(void *p)
 	if (!guest_screen)
 		die("Unable to create SDL RBG surface");
 
-	flags = SDL_HWSURFACE | SDL_ASYNCBLIT | SDL_HWACCEL | SDL_DOUBLEBUF;
+	/* No double buffering: only what changed gets drawn */
+	flags = SDL_HWSURFACE | SDL_ASYNCBLIT | SDL_HWACCEL;
 
 	SDL_WM_SetCaption("KVM tool", "KVM tool");
 
@@ -226,8 +236,22 @@ static void *sdl__thread(void *p)
 	SDL_EnableKeyRepeat(200, 50);
 
 	for (;;) {
-		SDL_BlitSurface(guest_screen, NULL, screen, NULL);
-		SDL_Flip(screen);
+		mutex_lock(&update_lock);
+		y		= update_start;
+		height		= update_end - update_start;
+		update_start	= update_end = 0;
+		mutex_unlock(&update_lock);
+
+		if (height) {
+			src = dst = (SDL_Rect) {
+				.x	= 0,
+				.y	= y,
+				.w	= fb->width,
+				.h	= height,
+			};
+			SDL_BlitSurface(guest_screen, &src, screen, &dst);
+			SDL_UpdateRect(screen, 0, y, fb->width, height);
+		}
 
 		while (SDL_PollEvent(&ev)) {
 			switch (ev.type) {
@@ -270,8 +294,22 @@ static int sdl__start(struct framebuffer *fb)
 	return 0;
 }
 
+static void sdl__update(struct framebuffer *fb, u32 y, u32 height)
+{
+	mutex_lock(&update_lock);
+	if (update_start == update_end) {
+		update_start	= y;
+		update_end	= y + height;
+	} else {
+		update_start	= min(update_start, y);
+		update_end	= max(update_end, y + height);
+	}
+	mutex_unlock(&update_lock);
+}
+
 static struct fb_target_operations sdl_ops = {
 	.start			= sdl__start,
+	.update			= sdl__update,
 };
 
 void sdl__init(struct framebuffer *fb)
@@ -131,6 +131,8 @@ static void kbd_handle_key(rfbBool down, rfbKeySym key, rfbClientPtr cl)
 		kbd_queue(tosend);
 }
 
+static rfbScreenInfoPtr server;
+
 /* The previous X and Y coordinates of the mouse */
 static int xlast, ylast = -1;
 
@@ -174,42 +176,59 @@ static void kbd_handle_ptr(int buttonMask, int x, int y, rfbClientPtr cl)
 
 static void *vnc__thread(void *p)
 {
-	struct framebuffer *fb = p;
+	rfbScreenInfoPtr screen = p;
+
+	while (rfbIsActive(screen))
+		rfbProcessEvents(screen, screen->deferUpdateTime * VESA_UPDATE_TIME);
+
+	return NULL;
+}
+
+/*
+ * The server is set up before the framebuffer's update thread is started,
+ * which pthread_create() orders after it: vnc__update() sees it from the
+ * first dirty rectangle on.
+ */
+static int vnc__start(struct framebuffer *fb)
+{
 	/*
 	 * Make a fake argc and argv because the getscreen function
 	 * seems to want it.
 	 */
 	char argv[1][1] = {{0}};
 	int argc = 1;
+	rfbScreenInfoPtr screen;
+	pthread_t thread;
 
-	rfbScreenInfoPtr server;
-
-	server = rfbGetScreen(&argc, (char **) argv, fb->width, fb->height, 8, 3, 4);
-	server->frameBuffer		= fb->mem;
-	server->alwaysShared		= TRUE;
-	server->kbdAddEvent		= kbd_handle_key;
-	server->ptrAddEvent		= kbd_handle_ptr;
-	rfbInitServer(server);
+	screen = rfbGetScreen(&argc, (char **) argv, fb->width, fb->height, 8, 3, 4);
+	if (!screen)
+		return -1;
 
-	while (rfbIsActive(server)) {
-		rfbMarkRectAsModified(server, 0, 0, fb->width, fb->height);
-		rfbProcessEvents(server, server->deferUpdateTime * VESA_UPDATE_TIME);
-	}
-	return NULL;
-}
+	screen->frameBuffer		= fb->mem;
+	screen->alwaysShared		= TRUE;
+	screen->kbdAddEvent		= kbd_handle_key;
+	screen->ptrAddEvent		= kbd_handle_ptr;
+	rfbInitServer(screen);
 
-static int vnc__start(struct framebuffer *fb)
-{
-	pthread_t thread;
+	/* Whatever is on the framebuffer already, then what vnc__update() marks */
+	rfbMarkRectAsModified(screen, 0, 0, fb->width, fb->height);
+	server = screen;
 
-	if (pthread_create(&thread, NULL, vnc__thread, fb) != 0)
+	if (pthread_create(&thread, NULL, vnc__thread, screen) != 0)
 		return -1;
 
 	return 0;
 }
 
+static void vnc__update(struct framebuffer *fb, u32 y, u32 height)
+{
+	if (server)
+		rfbMarkRectAsModified(server, 0, y, fb->width, y + height);
+}
+
 static struct fb_target_operations vnc_ops = {
 	.start			= vnc__start,
+	.update			= vnc__update,
 };
 
 void vnc__init(struct framebuffer *fb)
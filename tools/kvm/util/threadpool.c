@@ -1,145 +1,380 @@
 #include "kvm/threadpool.h"
+#include "kvm/barrier.h"
 #include "kvm/mutex.h"
+#include "kvm/util.h"
 
 #include <linux/kernel.h>
-#include <linux/list.h>
+#include <linux/compiler.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+/*
+ * Each worker owns a deque of jobs (Chase-Lev): it pushes and pops at the
+ * bottom, while idle workers steal from the top, so the common path takes
+ * no lock at all. Threads that aren't workers, such as the VCPUs, hand
+ * jobs over through the workers' inboxes, lock-free stacks which are taken
+ * whole. A job is on at most one deque or inbox at a time: only the
+ * signal that takes its signalcount from zero queues it.
+ *
+ * The deques never have to grow, there are far fewer jobs than entries;
+ * should one fill up anyway, the job goes to its worker's inbox instead.
+ */
+#define THREAD_POOL_DEQUE_SIZE	256
+
+struct thread_pool__deque {
+	volatile long			top;
+	volatile long			bottom;
+	struct thread_pool__job		*jobs[THREAD_POOL_DEQUE_SIZE];
+};
+
+struct thread_pool__worker {
+	struct thread_pool__deque	deque;
+	struct thread_pool__job		*inbox;
+	pthread_t			thread;
+	long				id;
+	int				cpu;
+
+	u64				nr_runs;
+	u64				nr_steals;
+} __attribute__((aligned(64)));
+
+static struct thread_pool__worker	**workers;
+static int				nr_workers;
+static unsigned int			next_worker;
+
+/* Jobs signalled before there are any workers */
+static struct thread_pool__job		*early_inbox;
+
+/* Every job that was ever signalled, for the statistics */
+static struct thread_pool__job		*all_jobs;
+
+static __thread struct thread_pool__worker *current_worker;
+
+/* Idle workers sleep here; the mutex is only taken to go to sleep or wake one */
+static pthread_mutex_t	idle_mutex	= PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	idle_cond	= PTHREAD_COND_INITIALIZER;
+static int		idle_workers;
+
+static pthread_barrier_t start_barrier;
+
+static u64 thread_pool__now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-static pthread_mutex_t	job_mutex	= PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t	thread_mutex	= PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t	job_cond	= PTHREAD_COND_INITIALIZER;
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool thread_pool__deque_push(struct thread_pool__deque *deque, struct thread_pool__job *job)
+{
+	long bottom = deque->bottom;
 
-static LIST_HEAD(head);
+	if (bottom - ACCESS_ONCE(deque->top) >= THREAD_POOL_DEQUE_SIZE)
+		return false;
 
-static pthread_t	*threads;
-static long		threadcount;
+	deque->jobs[bottom % THREAD_POOL_DEQUE_SIZE] = job;
+	/* The job must be there before thieves can see it */
+	wmb();
+	deque->bottom = bottom + 1;
 
-static struct thread_pool__job *thread_pool__job_pop_locked(void)
+	return true;
+}
+
+static struct thread_pool__job *thread_pool__deque_pop(struct thread_pool__deque *deque)
 {
 	struct thread_pool__job *job;
+	long bottom, top;
 
-	if (list_empty(&head))
+	bottom = deque->bottom - 1;
+	deque->bottom = bottom;
+	/* Claim the bottom entry before looking at what thieves took */
+	mb();
+	top = deque->top;
+
+	if (top > bottom) {
+		deque->bottom = bottom + 1;
 		return NULL;
+	}
 
-	job = list_first_entry(&head, struct thread_pool__job, queue);
-	list_del(&job->queue);
+	job = deque->jobs[bottom % THREAD_POOL_DEQUE_SIZE];
+	if (top == bottom) {
+		/* The last one: race the thieves for it */
+		if (!__sync_bool_compare_and_swap(&deque->top, top, top + 1))
+			job = NULL;
+		deque->bottom = bottom + 1;
+	}
 
 	return job;
 }
 
-static void thread_pool__job_push_locked(struct thread_pool__job *job)
-{
-	list_add_tail(&job->queue, &head);
-}
-
-static struct thread_pool__job *thread_pool__job_pop(void)
+static struct thread_pool__job *thread_pool__deque_steal(struct thread_pool__deque *deque)
 {
 	struct thread_pool__job *job;
+	long bottom, top;
+
+	top = deque->top;
+	mb();
+	bottom = deque->bottom;
+
+	if (top >= bottom)
+		return NULL;
+
+	job = deque->jobs[top % THREAD_POOL_DEQUE_SIZE];
+	if (!__sync_bool_compare_and_swap(&deque->top, top, top + 1))
+		return NULL;
 
-	mutex_lock(&job_mutex);
-	job = thread_pool__job_pop_locked();
-	mutex_unlock(&job_mutex);
 	return job;
 }
 
-static void thread_pool__job_push(struct thread_pool__job *job)
+static void thread_pool__inbox_push(struct thread_pool__job **inbox, struct thread_pool__job *job)
 {
-	mutex_lock(&job_mutex);
-	thread_pool__job_push_locked(job);
-	mutex_unlock(&job_mutex);
+	struct thread_pool__job *first;
+
+	do {
+		first = ACCESS_ONCE(*inbox);
+		job->next = first;
+	} while (!__sync_bool_compare_and_swap(inbox, first, job));
 }
 
-static void thread_pool__handle_job(struct thread_pool__job *job)
+static struct thread_pool__job *thread_pool__inbox_take(struct thread_pool__job **inbox)
 {
-	while (job) {
-		job->callback(job->kvm, job->data);
+	if (!ACCESS_ONCE(*inbox))
+		return NULL;
 
-		mutex_lock(&job->mutex);
+	return __sync_lock_test_and_set(inbox, NULL);
+}
 
-		if (--job->signalcount > 0)
-			/* If the job was signaled again while we were working */
-			thread_pool__job_push(job);
+/*
+ * Move a worker's inbox to its deque, and return one job to run. The
+ * inbox is newest first, so the oldest job ends up at the bottom and is
+ * run first.
+ */
+static struct thread_pool__job *thread_pool__take_inbox(struct thread_pool__worker *worker,
+							struct thread_pool__job **inbox)
+{
+	struct thread_pool__job *job, *next;
 
-		mutex_unlock(&job->mutex);
+	job = thread_pool__inbox_take(inbox);
+	if (!job)
+		return NULL;
 
-		job = thread_pool__job_pop();
+	for (next = job->next; next; next = job->next) {
+		if (!thread_pool__deque_push(&worker->deque, job))
+			thread_pool__inbox_push(&worker->inbox, job);
+		job = next;
 	}
+
+	return job;
 }
 
-static void thread_pool__threadfunc_cleanup(void *param)
+static struct thread_pool__job *thread_pool__steal(struct thread_pool__worker *worker)
 {
-	mutex_unlock(&job_mutex);
+	struct thread_pool__worker *victim;
+	struct thread_pool__job *job;
+	int i;
+
+	for (i = 1; i < nr_workers; i++) {
+		victim = workers[(worker->id + i) % nr_workers];
+
+		job = thread_pool__deque_steal(&victim->deque);
+		if (!job)
+			job = thread_pool__take_inbox(worker, &victim->inbox);
+		if (job) {
+			worker->nr_steals++;
+			return job;
+		}
+	}
+
+	return thread_pool__take_inbox(worker, &early_inbox);
 }
 
-static void *thread_pool__threadfunc(void *param)
+static struct thread_pool__job *thread_pool__find_job(struct thread_pool__worker *worker)
 {
-	pthread_cleanup_push(thread_pool__threadfunc_cleanup, NULL);
+	struct thread_pool__job *job;
 
-	for (;;) {
-		struct thread_pool__job *curjob;
+	job = thread_pool__deque_pop(&worker->deque);
+	if (!job)
+		job = thread_pool__take_inbox(worker, &worker->inbox);
+	if (!job)
+		job = thread_pool__steal(worker);
 
-		mutex_lock(&job_mutex);
-		while ((curjob = thread_pool__job_pop_locked()) == NULL)
-			pthread_cond_wait(&job_cond, &job_mutex);
-		mutex_unlock(&job_mutex);
+	return job;
+}
 
-		thread_pool__handle_job(curjob);
-	}
+static void thread_pool__handle_job(struct thread_pool__worker *worker, struct thread_pool__job *job)
+{
+	u64 wait;
 
-	pthread_cleanup_pop(0);
+	wait = thread_pool__now() - job->queued_ns;
+	job->nr_queued++;
+	job->wait_ns += wait;
+	if (wait > job->max_wait_ns)
+		job->max_wait_ns = wait;
 
-	return NULL;
+	do {
+		job->callback(job->kvm, job->data);
+		job->nr_runs++;
+		worker->nr_runs++;
+		/* If the job was signaled again while we were working */
+	} while (__sync_sub_and_fetch(&job->signalcount, 1) > 0);
 }
 
-static int thread_pool__addthread(void)
+/* Spread the workers over the CPUs we may run on, one each */
+static int thread_pool__worker_cpu(long id)
 {
-	int res;
-	void *newthreads;
+	cpu_set_t cpuset;
+	int cpu, n;
 
-	mutex_lock(&thread_mutex);
-	newthreads = realloc(threads, (threadcount + 1) * sizeof(pthread_t));
-	if (newthreads == NULL) {
-		mutex_unlock(&thread_mutex);
+	if (sched_getaffinity(0, sizeof(cpuset), &cpuset))
 		return -1;
+
+	n = id % CPU_COUNT(&cpuset);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &cpuset) && n-- == 0)
+			return cpu;
+
+	return -1;
+}
+
+static void *thread_pool__threadfunc(void *param)
+{
+	struct thread_pool__worker *worker;
+	struct thread_pool__job *job;
+	long id = (long)param;
+	cpu_set_t cpuset;
+	int cpu;
+
+	/*
+	 * Allocate the worker's deque once it runs where it's going to stay,
+	 * so that it comes from that CPU's node.
+	 */
+	cpu = thread_pool__worker_cpu(id);
+	if (cpu >= 0) {
+		CPU_ZERO(&cpuset);
+		CPU_SET(cpu, &cpuset);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+			pr_warning("Failed binding thread pool worker %ld to CPU %d", id, cpu);
 	}
 
-	threads = newthreads;
+	if (posix_memalign((void **)&worker, __alignof__(*worker), sizeof(*worker)))
+		die("Failed allocating thread pool worker");
 
-	res = pthread_create(threads + threadcount, NULL,
-			     thread_pool__threadfunc, NULL);
+	memset(worker, 0, sizeof(*worker));
+	worker->thread	= pthread_self();
+	worker->id	= id;
+	worker->cpu	= cpu;
+	workers[id]	= worker;
+	current_worker	= worker;
 
-	if (res == 0)
-		threadcount++;
-	mutex_unlock(&thread_mutex);
+	pthread_barrier_wait(&start_barrier);
 
-	return res;
+	for (;;) {
+		job = thread_pool__find_job(worker);
+		if (job) {
+			thread_pool__handle_job(worker, job);
+			continue;
+		}
+
+		mutex_lock(&idle_mutex);
+		/* Pairs with the barrier in thread_pool__do_job() */
+		__sync_add_and_fetch(&idle_workers, 1);
+		while ((job = thread_pool__find_job(worker)) == NULL)
+			pthread_cond_wait(&idle_cond, &idle_mutex);
+		__sync_sub_and_fetch(&idle_workers, 1);
+		mutex_unlock(&idle_mutex);
+
+		thread_pool__handle_job(worker, job);
+	}
+
+	return NULL;
 }
 
 int thread_pool__init(unsigned long thread_count)
 {
-	unsigned long i;
+	pthread_t thread;
+	long i;
 
-	for (i = 0; i < thread_count; i++)
-		if (thread_pool__addthread() < 0)
-			return i;
+	if (nr_workers || !thread_count)
+		return nr_workers;
 
-	return i;
+	workers = calloc(thread_count, sizeof(*workers));
+	if (!workers)
+		return 0;
+
+	pthread_barrier_init(&start_barrier, NULL, thread_count + 1);
+
+	for (i = 0; i < (long)thread_count; i++)
+		if (pthread_create(&thread, NULL, thread_pool__threadfunc, (void *)i) != 0)
+			die("Failed starting thread pool worker");
+
+	pthread_barrier_wait(&start_barrier);
+
+	/* The workers are all set up, start handing them jobs */
+	mb();
+	nr_workers = thread_count;
+
+	return nr_workers;
 }
 
 void thread_pool__do_job(struct thread_pool__job *job)
 {
-	struct thread_pool__job *jobinfo = job;
+	struct thread_pool__worker *worker = current_worker;
+	int pending, nr = ACCESS_ONCE(nr_workers);
+
+	if (job == NULL || job->callback == NULL)
+		return;
+
+	if (!job->registered && __sync_bool_compare_and_swap(&job->registered, false, true)) {
+		do {
+			job->all_next = ACCESS_ONCE(all_jobs);
+		} while (!__sync_bool_compare_and_swap(&all_jobs, job->all_next, job));
+	}
 
-	if (jobinfo == NULL || jobinfo->callback == NULL)
+	pending = __sync_add_and_fetch(&job->signalcount, 1);
+	if (pending > job->max_pending)
+		job->max_pending = pending;
+	if (pending > 1)
 		return;
 
-	mutex_lock(&jobinfo->mutex);
-	if (jobinfo->signalcount++ == 0)
-		thread_pool__job_push(job);
-	mutex_unlock(&jobinfo->mutex);
+	job->queued_ns = thread_pool__now();
+
+	/* A job queued by a worker stays with it, unless someone steals it */
+	if (!worker || !thread_pool__deque_push(&worker->deque, job)) {
+		if (nr)
+			thread_pool__inbox_push(&workers[__sync_fetch_and_add(&next_worker, 1) % nr]->inbox, job);
+		else
+			thread_pool__inbox_push(&early_inbox, job);
+	}
+
+	/* Pairs with the idle count going up before workers look for jobs */
+	mb();
+	if (ACCESS_ONCE(idle_workers)) {
+		mutex_lock(&idle_mutex);
+		pthread_cond_signal(&idle_cond);
+		mutex_unlock(&idle_mutex);
+	}
+}
 
-	mutex_lock(&job_mutex);
-	pthread_cond_signal(&job_cond);
-	mutex_unlock(&job_mutex);
+void thread_pool__dump_stats(int fd)
+{
+	struct thread_pool__job *job;
+	long i;
+
+	dprintf(fd, "\n #\n # Thread pool:\n #\n");
+	for (i = 0; i < ACCESS_ONCE(nr_workers); i++)
+		dprintf(fd, " worker %2ld  cpu %3d  runs %10llu  steals %10llu\n",
+			i, workers[i]->cpu, (unsigned long long)workers[i]->nr_runs,
+			(unsigned long long)workers[i]->nr_steals);
+
+	for (job = ACCESS_ONCE(all_jobs); job; job = job->all_next)
+		dprintf(fd, " job %p(%p)  runs %10llu  wait avg %8llu max %8llu us  pending max %d\n",
+			job->callback, job->data, (unsigned long long)job->nr_runs,
+			job->nr_queued ? (unsigned long long)(job->wait_ns / job->nr_queued / 1000) : 0ULL,
+			(unsigned long long)job->max_wait_ns / 1000, job->max_pending);
 }
@@ -23,11 +23,12 @@
 #include <pthread.h>
 #include <sys/eventfd.h>
 
-#define NUM_VIRT_QUEUES		3
+#define NUM_VIRT_QUEUES		4
 #define VIRTIO_BLN_QUEUE_SIZE	128
 #define VIRTIO_BLN_INFLATE	0
 #define VIRTIO_BLN_DEFLATE	1
 #define VIRTIO_BLN_STATS	2
+#define VIRTIO_BLN_REPORT	3
 
 struct bln_dev {
 	struct list_head	list;
@@ -52,6 +53,96 @@ static struct bln_dev bdev;
 extern struct kvm *kvm;
 static int compat_id = -1;
 
+/*
+ * The reporting queue takes the place of the stats queue when the guest
+ * did not ask for the latter: queues are numbered by role internally.
+ */
+static u32 virtio_bln__vq_role(struct bln_dev *bdev, u32 vq)
+{
+	if (vq == VIRTIO_BLN_STATS && !(bdev->features & (1 << VIRTIO_BALLOON_F_STATS_VQ)))
+		return VIRTIO_BLN_REPORT;
+
+	return vq;
+}
+
+static u32 virtio_bln__vq_index(struct bln_dev *bdev, u32 role)
+{
+	if (role == VIRTIO_BLN_REPORT && !(bdev->features & (1 << VIRTIO_BALLOON_F_STATS_VQ)))
+		return VIRTIO_BLN_STATS;
+
+	return role;
+}
+
+/* Whether guest pages [pfn, pfn + nr_pages) are all guest RAM */
+static bool virtio_bln__pages_in_ram(struct kvm *kvm, u64 pfn, u64 nr_pages)
+{
+	u64 max_pfn = kvm->ram_size >> VIRTIO_BALLOON_PFN_SHIFT;
+	u64 start, end;
+
+	if (!nr_pages || pfn >= max_pfn || nr_pages > max_pfn - pfn)
+		return false;
+
+	start	= pfn << VIRTIO_BALLOON_PFN_SHIFT;
+	end	= (pfn + nr_pages) << VIRTIO_BALLOON_PFN_SHIFT;
+
+#ifdef KVM_32BIT_GAP_START
+	/* RAM past the PCI hole is mapped from 4GB on */
+	if (kvm->ram_size > KVM_32BIT_GAP_START &&
+	    start < KVM_32BIT_MAX_MEM_SIZE && end > KVM_32BIT_GAP_START)
+		return false;
+#endif
+
+	return true;
+}
+
+static bool virtio_bln_do_chunk_request(struct kvm *kvm, struct bln_dev *bdev, struct virt_queue *queue)
+{
+	struct iovec iov[VIRTIO_BLN_QUEUE_SIZE];
+	struct virtio_balloon_chunk *chunks;
+	unsigned int len = 0;
+	u16 out, in, head;
+	u32 i;
+
+	head	= virt_queue__get_iov(queue, iov, &out, &in, kvm);
+	if (!out) {
+		virt_queue__set_used_elem(queue, head, 0);
+		return true;
+	}
+
+	chunks	= iov[0].iov_base;
+	len	= iov[0].iov_len / sizeof(*chunks);
+
+	for (i = 0 ; i < len ; i++) {
+		void *guest_ptr;
+		u64 size;
+
+		/* Not guest memory: skip it, and leave the balloon size be */
+		if (!virtio_bln__pages_in_ram(kvm, chunks[i].pfn, chunks[i].nr_pages)) {
+			pr_warning("balloon: ignoring pages %llx+%llx outside of guest memory",
+				   (unsigned long long)chunks[i].pfn,
+				   (unsigned long long)chunks[i].nr_pages);
+			continue;
+		}
+
+		guest_ptr = guest_flat_to_host(kvm, chunks[i].pfn << VIRTIO_BALLOON_PFN_SHIFT);
+		size = chunks[i].nr_pages << VIRTIO_BALLOON_PFN_SHIFT;
+
+		if (queue == &bdev->vqs[VIRTIO_BLN_INFLATE]) {
+			madvise(guest_ptr, size, MADV_DONTNEED);
+			bdev->config.actual += chunks[i].nr_pages;
+		} else if (queue == &bdev->vqs[VIRTIO_BLN_DEFLATE]) {
+			bdev->config.actual -= chunks[i].nr_pages;
+		} else {
+			/* Free page report: the guest keeps the pages. */
+			madvise(guest_ptr, size, MADV_DONTNEED);
+		}
+	}
+
+	virt_queue__set_used_elem(queue, head, iov[0].iov_len);
+
+	return true;
+}
+
 static bool virtio_bln_do_io_request(struct kvm *kvm, struct bln_dev *bdev, struct virt_queue *queue)
 {
 	struct iovec iov[VIRTIO_BLN_QUEUE_SIZE];
@@ -59,14 +150,26 @@ static bool virtio_bln_do_io_request(struct kvm *kvm, struct bln_dev *bdev, stru
 	u16 out, in, head;
 	u32 *ptrs, i;
 
+	if (queue == &bdev->vqs[VIRTIO_BLN_REPORT] ||
+	    bdev->features & (1 << VIRTIO_BALLOON_F_CHUNKS))
+		return virtio_bln_do_chunk_request(kvm, bdev, queue);
+
 	head	= virt_queue__get_iov(queue, iov, &out, &in, kvm);
+	if (!out) {
+		virt_queue__set_used_elem(queue, head, 0);
+		return true;
+	}
+
 	ptrs	= iov[0].iov_base;
 	len	= iov[0].iov_len / sizeof(u32);
 
 	for (i = 0 ; i < len ; i++) {
 		void *guest_ptr;
 
-		guest_ptr = guest_flat_to_host(kvm, ptrs[i] << VIRTIO_BALLOON_PFN_SHIFT);
+		if (!virtio_bln__pages_in_ram(kvm, ptrs[i], 1))
+			continue;
+
+		guest_ptr = guest_flat_to_host(kvm, (u64)ptrs[i] << VIRTIO_BALLOON_PFN_SHIFT);
 		if (queue == &bdev->vqs[VIRTIO_BLN_INFLATE]) {
 			madvise(guest_ptr, 1 << VIRTIO_BALLOON_PFN_SHIFT, MADV_DONTNEED);
 			bdev->config.actual++;
@@ -122,7 +225,8 @@ static void virtio_bln_do_io(struct kvm *kvm, void *param)
 
 	while (virt_queue__available(vq)) {
 		virtio_bln_do_io_request(kvm, &bdev, vq);
-		bdev.vtrans.trans_ops->signal_vq(kvm, &bdev.vtrans, vq - bdev.vqs);
+		bdev.vtrans.trans_ops->signal_vq(kvm, &bdev.vtrans,
+						 virtio_bln__vq_index(&bdev, vq - bdev.vqs));
 	}
 }
 
@@ -192,7 +296,9 @@ static u8 get_config(struct kvm *kvm, void *dev, u32 offset)
 
 static u32 get_host_features(struct kvm *kvm, void *dev)
 {
-	return 1 << VIRTIO_BALLOON_F_STATS_VQ;
+	return 1 << VIRTIO_BALLOON_F_STATS_VQ
+		| 1 << VIRTIO_BALLOON_F_CHUNKS
+		| 1 << VIRTIO_BALLOON_F_REPORTING;
 }
 
 static void set_guest_features(struct kvm *kvm, void *dev, u32 features)
@@ -210,6 +316,7 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 pfn)
 
 	compat__remove_message(compat_id);
 
+	vq			= virtio_bln__vq_role(bdev, vq);
 	queue			= &bdev->vqs[vq];
 	queue->pfn		= pfn;
 	p			= guest_pfn_to_host(kvm, queue->pfn);
@@ -224,7 +331,7 @@ static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct bln_dev *bdev = dev;
 
-	thread_pool__do_job(&bdev->jobs[vq]);
+	thread_pool__do_job(&bdev->jobs[virtio_bln__vq_role(bdev, vq)]);
 
 	return 0;
 }
@@ -233,11 +340,22 @@ static int get_pfn_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct bln_dev *bdev = dev;
 
-	return bdev->vqs[vq].pfn;
+	return bdev->vqs[virtio_bln__vq_role(bdev, vq)].pfn;
 }
 
 static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
 {
+	struct bln_dev *bdev = dev;
+	u32 nr_vqs = VIRTIO_BLN_STATS;
+
+	/* Only as many queues as the negotiated features need. */
+	if (bdev->features & (1 << VIRTIO_BALLOON_F_STATS_VQ))
+		nr_vqs++;
+	if (bdev->features & (1 << VIRTIO_BALLOON_F_REPORTING))
+		nr_vqs++;
+	if (vq >= nr_vqs)
+		return 0;
+
 	return VIRTIO_BLN_QUEUE_SIZE;
 }
 
@@ -19,6 +19,7 @@
 #include <linux/list.h>
 #include <linux/types.h>
 #include <pthread.h>
+#include <unistd.h>
 
 #define VIRTIO_BLK_MAX_DEV		4
 
@@ -27,16 +28,45 @@
  */
 #define DISK_SEG_MAX			(VIRTIO_BLK_QUEUE_SIZE - 2)
 #define VIRTIO_BLK_QUEUE_SIZE		128
-#define NUM_VIRT_QUEUES			1
+#define VIRTIO_BLK_MAX_QUEUES		VIRTIO_PCI_MAX_VQ
+
+/*
+ * Discards are done synchronously by the queue's thread, bound how long
+ * a single one can hold it.
+ */
+#define VIRTIO_BLK_MAX_DISCARD_SECTORS	(1U << 21)
+#define VIRTIO_BLK_MAX_DISCARD_SEG	1
+
+struct blk_dev_queue;
 
 struct blk_dev_req {
-	struct virt_queue		*vq;
+	struct blk_dev_queue		*queue;
 	struct blk_dev			*bdev;
 	struct iovec			iov[VIRTIO_BLK_QUEUE_SIZE];
 	u16				out, in, head;
 	struct kvm			*kvm;
 };
 
+/*
+ * Each request queue is serviced by its own thread pool job, or with
+ * 'iothread' by a thread of its own, so requests on different queues are
+ * processed in parallel.
+ */
+struct blk_dev_queue {
+	struct virt_queue		vq;
+	/* Protects the used ring against concurrent completions */
+	pthread_mutex_t			mutex;
+	/* Completions are signalled once at the end of a pass over the ring */
+	bool				defer_signal;
+	struct thread_pool__job		job;
+	/* The queue's notification eventfd when it has its own thread, or -1 */
+	int				kick_fd;
+	pthread_t			thread;
+	/* Reads and writes popped in one pass, submitted together */
+	struct disk_image_batch		batch;
+	struct blk_dev_req		reqs[VIRTIO_BLK_QUEUE_SIZE];
+};
+
 struct blk_dev {
 	pthread_mutex_t			mutex;
 	pthread_mutex_t			req_mutex;
@@ -49,8 +79,8 @@ struct blk_dev {
 	struct disk_image		*disk;
 	u32				features;
 
-	struct virt_queue		vqs[NUM_VIRT_QUEUES];
-	struct blk_dev_req		reqs[VIRTIO_BLK_QUEUE_SIZE];
+	u16				num_queues;
+	struct blk_dev_queue		queues[VIRTIO_BLK_MAX_QUEUES];
 };
 
 static LIST_HEAD(bdevs);
@@ -60,23 +90,90 @@ void virtio_blk_complete(void *param, long len)
 {
 	struct blk_dev_req *req = param;
 	struct blk_dev *bdev = req->bdev;
-	int queueid = req->vq - bdev->vqs;
+	struct blk_dev_queue *queue = req->queue;
+	int queueid = queue - bdev->queues;
 	u8 *status;
+	bool signal;
 
 	/* status */
 	status	= req->iov[req->out + req->in - 1].iov_base;
 	*status	= (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
 
-	mutex_lock(&bdev->mutex);
-	virt_queue__set_used_elem(req->vq, req->head, len);
-	mutex_unlock(&bdev->mutex);
+	mutex_lock(&queue->mutex);
+	virt_queue__set_used_elem(&queue->vq, req->head, len);
+	signal = !queue->defer_signal && virtio_queue__should_signal(&queue->vq);
+	mutex_unlock(&queue->mutex);
 
-	if (virtio_queue__should_signal(&bdev->vqs[queueid]))
+	if (signal)
 		bdev->vtrans.trans_ops->signal_vq(req->kvm, &bdev->vtrans, queueid);
 }
 
+/*
+ * Check every range of a discard or write zeroes request against the disk
+ * and the limits we advertise, before acting on any: a request that breaks
+ * them fails as a whole. The limits are taken from the constants rather
+ * than blk_config, which the guest can write to.
+ */
+static bool virtio_blk_discard_ok(struct blk_dev *bdev, struct iovec *iov, u16 iovcount)
+{
+	struct virtio_blk_discard_write_zeroes *range;
+	u64 cap = bdev->disk->size / SECTOR_SIZE;
+	u32 nr = 0;
+	void *end;
+	u16 i;
+
+	for (i = 0; i < iovcount; i++) {
+		end = iov[i].iov_base + iov[i].iov_len;
+
+		for (range = iov[i].iov_base; (void *)(range + 1) <= end; range++) {
+			if (++nr > VIRTIO_BLK_MAX_DISCARD_SEG)
+				return false;
+
+			if (range->num_sectors > VIRTIO_BLK_MAX_DISCARD_SECTORS)
+				return false;
+
+			/* Written so that a sector near U64_MAX can't wrap */
+			if (range->sector > cap || range->num_sectors > cap - range->sector)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static ssize_t virtio_blk_discard(struct blk_dev *bdev, u32 type,
+				struct iovec *iov, u16 iovcount)
+{
+	struct virtio_blk_discard_write_zeroes *range;
+	void *end;
+	int ret;
+	u16 i;
+
+	if (!virtio_blk_discard_ok(bdev, iov, iovcount))
+		return -1;
+
+	for (i = 0; i < iovcount; i++) {
+		end = iov[i].iov_base + iov[i].iov_len;
+
+		for (range = iov[i].iov_base; (void *)(range + 1) <= end; range++) {
+			if (type == VIRTIO_BLK_T_DISCARD)
+				ret = disk_image__discard(bdev->disk, range->sector,
+							range->num_sectors);
+			else
+				ret = disk_image__write_zeroes(bdev->disk, range->sector,
+							range->num_sectors,
+							range->flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP);
+			if (ret < 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
 static void virtio_blk_do_io_request(struct kvm *kvm, struct blk_dev_req *req)
 {
+	struct disk_image_batch *batch = &req->queue->batch;
 	struct virtio_blk_outhdr *req_hdr;
 	ssize_t block_cnt;
 	struct blk_dev *bdev;
@@ -90,19 +187,28 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct blk_dev_req *req)
 	in		= req->in;
 	req_hdr		= iov[0].iov_base;
 
+	/* Anything else is done on the spot: submit what came before first */
+	if (req_hdr->type != VIRTIO_BLK_T_IN && req_hdr->type != VIRTIO_BLK_T_OUT)
+		disk_image__batch_submit(batch);
+
 	switch (req_hdr->type) {
 	case VIRTIO_BLK_T_IN:
-		block_cnt	= disk_image__read(bdev->disk, req_hdr->sector, iov + 1,
+		block_cnt	= disk_image__batch_read(batch, req_hdr->sector, iov + 1,
 					in + out - 2, req);
 		break;
 	case VIRTIO_BLK_T_OUT:
-		block_cnt	= disk_image__write(bdev->disk, req_hdr->sector, iov + 1,
+		block_cnt	= disk_image__batch_write(batch, req_hdr->sector, iov + 1,
 					in + out - 2, req);
 		break;
 	case VIRTIO_BLK_T_FLUSH:
 		block_cnt       = disk_image__flush(bdev->disk);
 		virtio_blk_complete(req, block_cnt);
 		break;
+	case VIRTIO_BLK_T_DISCARD:
+	case VIRTIO_BLK_T_WRITE_ZEROES:
+		block_cnt	= virtio_blk_discard(bdev, req_hdr->type, iov + 1, out - 1);
+		virtio_blk_complete(req, block_cnt);
+		break;
 	case VIRTIO_BLK_T_GET_ID:
 		block_cnt	= VIRTIO_BLK_ID_BYTES;
 		disk_image__get_serial(bdev->disk, (iov + 1)->iov_base, &block_cnt);
@@ -115,25 +221,67 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct blk_dev_req *req)
 	}
 }
 
-static void virtio_blk_do_io(struct kvm *kvm, struct virt_queue *vq, struct blk_dev *bdev)
+static void virtio_blk_do_io(struct kvm *kvm, void *param)
 {
+	struct blk_dev_queue *queue = param;
+	struct virt_queue *vq = &queue->vq;
+	struct blk_dev *bdev = queue->reqs[0].bdev;
 	struct blk_dev_req *req;
+	bool signal;
 	u16 head;
 
+	mutex_lock(&queue->mutex);
+	queue->defer_signal = true;
+	mutex_unlock(&queue->mutex);
+
 	while (virt_queue__available(vq)) {
 		head		= virt_queue__pop(vq);
-		req		= &bdev->reqs[head];
+		req		= &queue->reqs[head];
 		req->head	= virt_queue__get_head_iov(vq, req->iov, &req->out, &req->in, head, kvm);
-		req->vq		= vq;
 
 		virtio_blk_do_io_request(kvm, req);
 	}
+
+	disk_image__batch_submit(&queue->batch);
+
+	/*
+	 * Whatever completed while popping, synchronously or not, goes to the
+	 * guest with one interrupt.
+	 */
+	mutex_lock(&queue->mutex);
+	queue->defer_signal = false;
+	signal = virtio_queue__should_signal(vq);
+	mutex_unlock(&queue->mutex);
+
+	if (signal)
+		bdev->vtrans.trans_ops->signal_vq(kvm, &bdev->vtrans, queue - bdev->queues);
+}
+
+static void *virtio_blk_thread(void *param)
+{
+	struct blk_dev_queue *queue = param;
+	u64 data;
+
+	for (;;) {
+		if (read(queue->kick_fd, &data, sizeof(data)) < 0) {
+			if (errno == EINTR)
+				continue;
+			die_perror("virtio-blk queue read");
+		}
+
+		virtio_blk_do_io(queue->reqs[0].kvm, queue);
+	}
+
+	return NULL;
 }
 
 static void set_config(struct kvm *kvm, void *dev, u8 data, u32 offset)
 {
 	struct blk_dev *bdev = dev;
 
+	if (offset >= sizeof(bdev->blk_config))
+		return;
+
 	((u8 *)(&bdev->blk_config))[offset] = data;
 }
 
@@ -141,15 +289,30 @@ static u8 get_config(struct kvm *kvm, void *dev, u32 offset)
 {
 	struct blk_dev *bdev = dev;
 
+	if (offset >= sizeof(bdev->blk_config))
+		return 0;
+
 	return ((u8 *)(&bdev->blk_config))[offset];
 }
 
 static u32 get_host_features(struct kvm *kvm, void *dev)
 {
-	return	1UL << VIRTIO_BLK_F_SEG_MAX
+	struct blk_dev *bdev = dev;
+	u32 features;
+
+	features = 1UL << VIRTIO_BLK_F_SEG_MAX
 		| 1UL << VIRTIO_BLK_F_FLUSH
 		| 1UL << VIRTIO_RING_F_EVENT_IDX
-		| 1UL << VIRTIO_RING_F_INDIRECT_DESC;
+		| 1UL << VIRTIO_RING_F_INDIRECT_DESC
+		| 1UL << VIRTIO_RING_F_PACKED
+		| 1UL << VIRTIO_BLK_F_MQ;
+
+	if (bdev->disk->ops->discard)
+		features |= 1UL << VIRTIO_BLK_F_DISCARD;
+	if (bdev->disk->ops->write_zeroes)
+		features |= 1UL << VIRTIO_BLK_F_WRITE_ZEROES;
+
+	return features;
 }
 
 static void set_guest_features(struct kvm *kvm, void *dev, u32 features)
@@ -167,11 +330,14 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 pfn)
 
 	compat__remove_message(compat_id);
 
-	queue			= &bdev->vqs[vq];
+	if (vq >= bdev->num_queues)
+		return -EINVAL;
+
+	queue			= &bdev->queues[vq].vq;
 	queue->pfn		= pfn;
 	p			= guest_pfn_to_host(kvm, queue->pfn);
 
-	vring_init(&queue->vring, VIRTIO_BLK_QUEUE_SIZE, p, VIRTIO_PCI_VRING_ALIGN);
+	virt_queue__init(queue, VIRTIO_BLK_QUEUE_SIZE, p, bdev->features);
 
 	return 0;
 }
@@ -179,21 +345,67 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 pfn)
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct blk_dev *bdev = dev;
+	struct blk_dev_queue *queue;
+	u64 data = 1;
 
-	virtio_blk_do_io(kvm, &bdev->vqs[vq], bdev);
+	if (vq >= bdev->num_queues)
+		return -EINVAL;
+
+	queue = &bdev->queues[vq];
+	if (queue->kick_fd < 0) {
+		thread_pool__do_job(&queue->job);
+		return 0;
+	}
+
+	/* Without ioeventfd support, kicks still come this way */
+	if (write(queue->kick_fd, &data, sizeof(data)) < 0)
+		pr_warning("virtio-blk queue %u notification failed", vq);
 
 	return 0;
 }
 
+/*
+ * With 'iothread', the queue's thread is started on the first eventfd the
+ * queue gets, and waits on it directly. If the guest sets the queue up
+ * again, the new eventfd goes through notify_vq() to the same thread.
+ */
+static bool notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd)
+{
+	struct blk_dev *bdev = dev;
+	struct blk_dev_queue *queue;
+
+	if (!bdev->disk->iothread || vq >= bdev->num_queues)
+		return false;
+
+	queue = &bdev->queues[vq];
+	if (queue->kick_fd >= 0)
+		return false;
+
+	queue->kick_fd = efd;
+	if (pthread_create(&queue->thread, NULL, virtio_blk_thread, queue) != 0)
+		die("Failed starting virtio-blk queue thread");
+
+	return true;
+}
+
 static int get_pfn_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct blk_dev *bdev = dev;
 
-	return bdev->vqs[vq].pfn;
+	if (vq >= bdev->num_queues)
+		return 0;
+
+	return bdev->queues[vq].vq.pfn;
 }
 
 static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
 {
+	struct blk_dev *bdev = dev;
+
+	/* A zero size tells the guest there is no such queue */
+	if (vq >= bdev->num_queues)
+		return 0;
+
 	return VIRTIO_BLK_QUEUE_SIZE;
 }
 
@@ -206,12 +418,13 @@ static struct virtio_ops blk_dev_virtio_ops = (struct virtio_ops) {
 	.notify_vq		= notify_vq,
 	.get_pfn_vq		= get_pfn_vq,
 	.get_size_vq		= get_size_vq,
+	.notify_vq_eventfd	= notify_vq_eventfd,
 };
 
 void virtio_blk__init(struct kvm *kvm, struct disk_image *disk)
 {
 	struct blk_dev *bdev;
-	unsigned int i;
+	unsigned int i, j;
 
 	if (!disk)
 		return;
@@ -227,7 +440,15 @@ void virtio_blk__init(struct kvm *kvm, struct disk_image *disk)
 		.blk_config		= (struct virtio_blk_config) {
 			.capacity	= disk->size / SECTOR_SIZE,
 			.seg_max	= DISK_SEG_MAX,
+			.num_queues	= min(kvm->nrcpus, VIRTIO_BLK_MAX_QUEUES),
+			.max_discard_sectors		= VIRTIO_BLK_MAX_DISCARD_SECTORS,
+			.max_discard_seg		= VIRTIO_BLK_MAX_DISCARD_SEG,
+			.discard_sector_alignment	= 1,
+			.max_write_zeroes_sectors	= VIRTIO_BLK_MAX_DISCARD_SECTORS,
+			.max_write_zeroes_seg		= VIRTIO_BLK_MAX_DISCARD_SEG,
+			.write_zeroes_may_unmap		= disk->ops->discard != NULL,
 		},
+		.num_queues		= min(kvm->nrcpus, VIRTIO_BLK_MAX_QUEUES),
 	};
 
 	virtio_trans_init(&bdev->vtrans, VIRTIO_PCI);
@@ -237,13 +458,27 @@ void virtio_blk__init(struct kvm *kvm, struct disk_image *disk)
 
 	list_add_tail(&bdev->list, &bdevs);
 
-	for (i = 0; i < ARRAY_SIZE(bdev->reqs); i++) {
-		bdev->reqs[i].bdev	= bdev;
-		bdev->reqs[i].kvm	= kvm;
+	for (i = 0; i < bdev->num_queues; i++) {
+		struct blk_dev_queue *queue = &bdev->queues[i];
+
+		mutex_init(&queue->mutex);
+		queue->kick_fd = -1;
+		thread_pool__init_job(&queue->job, kvm, virtio_blk_do_io, queue);
+		disk_image__batch_init(&queue->batch, disk);
+
+		for (j = 0; j < ARRAY_SIZE(queue->reqs); j++) {
+			queue->reqs[j].queue	= queue;
+			queue->reqs[j].bdev	= bdev;
+			queue->reqs[j].kvm	= kvm;
+		}
 	}
 
 	disk_image__set_callback(bdev->disk, virtio_blk_complete);
 
+	/* Room for every request the queues can have in flight at once */
+	if (disk_image__start_aio(bdev->disk, bdev->num_queues * VIRTIO_BLK_QUEUE_SIZE) < 0)
+		die("Failed setting up aio for virtio-blk");
+
 	if (compat_id != -1)
 		compat_id = compat__add_message("virtio-blk device was not detected",
 						"While you have requested a virtio-blk device, "
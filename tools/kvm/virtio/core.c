@@ -4,13 +4,119 @@
 
 #include "kvm/barrier.h"
 
+#include "kvm/util.h"
 #include "kvm/kvm.h"
 #include "kvm/virtio.h"
 
+void virt_queue__init(struct virt_queue *vq, u32 num, void *p, u32 features)
+{
+	vq->packed		= false;
+	vq->last_avail_idx	= 0;
+	vq->last_used_signalled	= 0;
+
+	if (features & (1UL << VIRTIO_RING_F_PACKED)) {
+		/* Devices offering packed rings size them to fit */
+		BUG_ON(num > VIRTIO_PACKED_QUEUE_SIZE);
+
+		vq->packed		= true;
+		vq->last_used_idx	= 0;
+		vring_packed_init(&vq->vring_packed, num, p);
+		return;
+	}
+
+	vring_init(&vq->vring, num, p, VIRTIO_PCI_VRING_ALIGN);
+}
+
+static inline bool packed_wrap(struct virt_queue *vq, u16 idx)
+{
+	return !(idx & vq->vring_packed.num);
+}
+
+static inline struct vring_packed_desc *packed_desc(struct virt_queue *vq, u16 idx)
+{
+	return &vq->vring_packed.desc[idx & (vq->vring_packed.num - 1)];
+}
+
+bool virt_queue__available_packed(struct virt_queue *vq)
+{
+	struct vring_packed_desc_event *event = vq->vring_packed.device;
+	u16 idx = vq->last_avail_idx;
+
+	if (!vq->vring_packed.desc)
+		return false;
+
+	/* Ask to be kicked when the guest gets to the next position. */
+	event->off_wrap	= (idx & (vq->vring_packed.num - 1)) |
+			  packed_wrap(vq, idx) << VRING_PACKED_EVENT_F_WRAP_CTR;
+	event->flags	= VRING_PACKED_EVENT_FLAG_DESC;
+	mb();
+
+	return vring_packed_desc_avail(packed_desc(vq, idx)->flags,
+				       packed_wrap(vq, idx));
+}
+
+/*
+ * Take the next buffer off a packed ring and remember where its
+ * descriptors are, the buffer id is what we hand out as head.
+ */
+u16 virt_queue__pop_packed(struct virt_queue *vq)
+{
+	struct virt_queue_packed_buf buf;
+	struct vring_packed_desc *desc;
+	u16 head;
+
+	/* Only read the descriptors after seeing they are available. */
+	rmb();
+
+	buf.pos	= vq->last_avail_idx;
+	buf.num	= 0;
+	do {
+		desc = packed_desc(vq, buf.pos + buf.num++);
+	} while (desc->flags & VRING_DESC_F_NEXT &&
+		 buf.num < vq->vring_packed.num);
+
+	head			= desc->id & (vq->vring_packed.num - 1);
+	vq->packed_bufs[head]	= buf;
+	vq->last_avail_idx	+= buf.num;
+
+	return head;
+}
+
+static void set_used_elem_packed(struct virt_queue *vq, u32 head, u32 len)
+{
+	struct vring_packed_desc *desc;
+	u16 idx = vq->last_used_idx;
+
+	desc		= packed_desc(vq, idx);
+	desc->id	= head;
+	desc->len	= len;
+
+	/*
+	 * Use wmb to assure that id and len are written before the flags
+	 * hand the buffer back to the guest.
+	 */
+	wmb();
+	desc->flags	= packed_wrap(vq, idx) ?
+			  VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED : 0;
+	vq->last_used_idx += vq->packed_bufs[head].num;
+
+	/* And that they are visible before we signal the guest. */
+	wmb();
+}
+
+/*
+ * Returns the used ring element written, or NULL with the packed layout
+ * where there is no used ring.
+ */
 struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32 head, u32 len)
 {
 	struct vring_used_elem *used_elem;
 
+	if (queue->packed) {
+		set_used_elem_packed(queue, head, len);
+		return NULL;
+	}
+
 	used_elem	= &queue->vring.used->ring[queue->vring.used->idx % queue->vring.num];
 	used_elem->id	= head;
 	used_elem->len	= len;
@@ -33,6 +139,59 @@ struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32
 	return used_elem;
 }
 
+/*
+ * Whether there are buffers to pop, without asking to be kicked for the
+ * next one as virt_queue__available() does: for draining a queue with
+ * notifications disabled.
+ */
+bool virt_queue__pending(struct virt_queue *vq)
+{
+	u16 idx = vq->last_avail_idx;
+
+	if (vq->packed)
+		return vq->vring_packed.desc &&
+		       vring_packed_desc_avail(packed_desc(vq, idx)->flags,
+					       packed_wrap(vq, idx));
+
+	return vq->vring.avail && vq->vring.avail->idx != idx;
+}
+
+/*
+ * Ask the guest not to kick us. With event indexes the guest ignores the
+ * flag, but stops kicking anyway since the avail event isn't moving.
+ */
+void virt_queue__disable_notify(struct virt_queue *vq)
+{
+	if (vq->packed) {
+		if (vq->vring_packed.device)
+			vq->vring_packed.device->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+		return;
+	}
+
+	if (vq->vring.used)
+		vq->vring.used->flags |= VRING_USED_F_NO_NOTIFY;
+}
+
+/*
+ * Have the guest kick us again, and return whether it made buffers
+ * available before it could see that: those would come without a kick.
+ */
+bool virt_queue__enable_notify(struct virt_queue *vq)
+{
+	if (vq->packed)
+		return virt_queue__available_packed(vq);
+
+	if (!vq->vring.avail)
+		return false;
+
+	vq->vring.used->flags &= ~VRING_USED_F_NO_NOTIFY;
+	vring_avail_event(&vq->vring) = vq->last_avail_idx;
+	/* Publish that before looking at the avail index again */
+	mb();
+
+	return vq->vring.avail->idx != vq->last_avail_idx;
+}
+
 /*
  * Each buffer in the virtqueues is actually a chain of descriptors.  This
  * function returns the next descriptor in the chain, or vq->vring.num if we're
@@ -55,12 +214,46 @@ static unsigned next_desc(struct vring_desc *desc,
 	return next;
 }
 
+/* Walk the descriptors of a buffer popped from a packed ring */
+static u16 get_head_iov_packed(struct virt_queue *vq, struct iovec in_iov[], struct iovec out_iov[],
+			       u16 *out, u16 *in, u16 head, struct kvm *kvm)
+{
+	struct virt_queue_packed_buf *buf = &vq->packed_bufs[head];
+	struct vring_packed_desc *desc;
+	struct iovec *iov;
+	u16 i;
+
+	*out = *in = 0;
+	for (i = 0; i < buf->num; i++) {
+		desc = packed_desc(vq, buf->pos + i);
+		/* Without in_iov, everything goes to out_iov in order. */
+		if (!in_iov)
+			iov = &out_iov[*out + *in];
+		else if (desc->flags & VRING_DESC_F_WRITE)
+			iov = &in_iov[*in];
+		else
+			iov = &out_iov[*out];
+		iov->iov_len	= desc->len;
+		iov->iov_base	= guest_flat_to_host(kvm, desc->addr);
+		/* If this is an input descriptor, increment that count. */
+		if (desc->flags & VRING_DESC_F_WRITE)
+			(*in)++;
+		else
+			(*out)++;
+	}
+
+	return head;
+}
+
 u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, u16 head, struct kvm *kvm)
 {
 	struct vring_desc *desc;
 	u16 idx;
 	u16 max;
 
+	if (vq->packed)
+		return get_head_iov_packed(vq, NULL, iov, out, in, head, kvm);
+
 	idx = head;
 	*out = *in = 0;
 	max = vq->vring.num;
@@ -104,6 +297,9 @@ u16 virt_queue__get_inout_iov(struct kvm *kvm, struct virt_queue *queue,
 	u16 head, idx;
 
 	idx = head = virt_queue__pop(queue);
+	if (queue->packed)
+		return get_head_iov_packed(queue, in_iov, out_iov, out, in, head, kvm);
+
 	*out = *in = 0;
 	do {
 		desc = virt_queue__get_desc(queue, idx);
@@ -141,10 +337,54 @@ int virtio__get_dev_specific_field(int offset, bool msix, u32 *config_off)
 	return VIRTIO_PCI_O_CONFIG;
 }
 
+/*
+ * The driver event gives a position and wrap counter, find the descriptor
+ * count closest to idx that matches them.
+ */
+static u16 packed_event_idx(struct virt_queue *vq, u16 off_wrap, u16 idx)
+{
+	u16 num = vq->vring_packed.num;
+	u16 event = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	u32 d;
+
+	if (!(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR))
+		event += num;
+	d = (u16)(event - idx) & (2 * num - 1);
+
+	return d <= num ? idx + d : idx + d - 2 * num;
+}
+
+static bool should_signal_packed(struct virt_queue *vq)
+{
+	struct vring_packed_desc_event *event = vq->vring_packed.driver;
+	u16 old_idx, new_idx, event_idx;
+
+	/* Flush out used descriptors before reading the guest's wishes. */
+	mb();
+
+	switch (event->flags) {
+	case VRING_PACKED_EVENT_FLAG_DISABLE:
+		return false;
+	case VRING_PACKED_EVENT_FLAG_DESC:
+		old_idx		= vq->last_used_signalled;
+		new_idx		= vq->last_used_idx;
+		event_idx	= packed_event_idx(vq, event->off_wrap, new_idx);
+		if (!vring_need_event(event_idx, new_idx, old_idx))
+			return false;
+		break;
+	}
+	vq->last_used_signalled = vq->last_used_idx;
+
+	return true;
+}
+
 bool virtio_queue__should_signal(struct virt_queue *vq)
 {
 	u16 old_idx, new_idx, event_idx;
 
+	if (vq->packed)
+		return should_signal_packed(vq);
+
 	old_idx		= vq->last_used_signalled;
 	new_idx		= vq->vring.used->idx;
 	event_idx	= vring_used_event(&vq->vring);
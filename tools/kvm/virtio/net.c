@@ -1,4 +1,5 @@
 #include "kvm/virtio-pci-dev.h"
+#include "kvm/virtio-pci.h"
 #include "kvm/virtio-net.h"
 #include "kvm/virtio.h"
 #include "kvm/types.h"
@@ -26,19 +27,57 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/eventfd.h>
+#include <sys/poll.h>
 
 #define VIRTIO_NET_QUEUE_SIZE		128
-#define VIRTIO_NET_NUM_QUEUES		2
+/* The queues of the first pair, the only one without multiqueue */
 #define VIRTIO_NET_RX_QUEUE		0
 #define VIRTIO_NET_TX_QUEUE		1
 
+/* A queue pair for each, and the control queue */
+#define VIRTIO_NET_MAX_QUEUE_PAIRS	((VIRTIO_PCI_MAX_VQ - 1) / 2)
+
+/* Received packets used before the guest is interrupted, if more are coming */
+#define VIRTIO_NET_RX_BATCH		32
+
+/* Multiqueue tap, for the host headers which don't have it yet */
+#ifndef IFF_MULTI_QUEUE
+#define IFF_MULTI_QUEUE			0x0100
+#endif
+#ifndef IFF_ATTACH_QUEUE
+#define IFF_ATTACH_QUEUE		0x0200
+#endif
+#ifndef IFF_DETACH_QUEUE
+#define IFF_DETACH_QUEUE		0x0400
+#endif
+#ifndef TUNSETQUEUE
+#define TUNSETQUEUE			_IOW('T', 217, int)
+#endif
+
 struct net_dev;
+struct net_dev_queue;
 
 extern struct kvm *kvm;
 
 struct net_dev_operations {
-	int (*rx)(struct iovec *iov, u16 in, struct net_dev *ndev);
-	int (*tx)(struct iovec *iov, u16 in, struct net_dev *ndev);
+	int (*rx)(struct iovec *iov, u16 in, struct net_dev_queue *queue);
+	int (*tx)(struct iovec *iov, u16 out, struct net_dev_queue *queue);
+	/* Whether rx wouldn't block; if not set, it's assumed it would */
+	bool (*rx_pending)(struct net_dev_queue *queue);
+};
+
+/*
+ * Queue 2n receives and queue 2n + 1 transmits for pair n, each has its
+ * thread. Pair n uses the n-th tap queue.
+ */
+struct net_dev_queue {
+	int				id;
+	struct net_dev			*ndev;
+	struct virt_queue		vq;
+
+	pthread_t			thread;
+	pthread_mutex_t			lock;
+	pthread_cond_t			cond;
 };
 
 struct net_dev {
@@ -46,20 +85,20 @@ struct net_dev {
 	struct virtio_trans		vtrans;
 	struct list_head		list;
 
-	struct virt_queue		vqs[VIRTIO_NET_NUM_QUEUES];
+	struct net_dev_queue		queues[VIRTIO_NET_MAX_QUEUE_PAIRS * 2];
+	struct virt_queue		ctrl_vq;
 	struct virtio_net_config	config;
 	u32				features;
 
-	pthread_t			io_rx_thread;
-	pthread_mutex_t			io_rx_lock;
-	pthread_cond_t			io_rx_cond;
-
-	pthread_t			io_tx_thread;
-	pthread_mutex_t			io_tx_lock;
-	pthread_cond_t			io_tx_cond;
+	/* Queue pairs we have, and the ones the guest uses */
+	int				max_queue_pairs;
+	int				queue_pairs;
 
 	int				vhost_fd;
-	int				tap_fd;
+	/* What the host's vhost-net can do, from VHOST_GET_FEATURES */
+	u64				vhost_features;
+	bool				vhost_coalesce;
+	int				tap_fds[VIRTIO_NET_MAX_QUEUE_PAIRS];
 	char				tap_name[IFNAMSIZ];
 
 	int				mode;
@@ -72,35 +111,87 @@ struct net_dev {
 static LIST_HEAD(ndevs);
 static int compat_id = -1;
 
+/* The control queue follows the last pair, if the guest knows there are more */
+static u32 virtio_net__ctrl_vq(struct net_dev *ndev)
+{
+	if (ndev->features & (1UL << VIRTIO_NET_F_MQ))
+		return ndev->max_queue_pairs * 2;
+
+	return 2;
+}
+
+/* A packed ring can't be larger than the host side keeps track of */
+static u32 virtio_net__queue_size(struct net_dev *ndev)
+{
+	if (ndev->features & (1UL << VIRTIO_RING_F_PACKED))
+		return min(VIRTIO_NET_QUEUE_SIZE, VIRTIO_PACKED_QUEUE_SIZE);
+
+	return VIRTIO_NET_QUEUE_SIZE;
+}
+
+static struct virt_queue *virtio_net__get_vq(struct net_dev *ndev, u32 vq)
+{
+	if (vq == virtio_net__ctrl_vq(ndev))
+		return &ndev->ctrl_vq;
+
+	if (vq < (u32)ndev->max_queue_pairs * 2)
+		return &ndev->queues[vq].vq;
+
+	return NULL;
+}
+
+static inline bool virtio_net__queue_active(struct net_dev_queue *queue)
+{
+	return queue->id / 2 < ACCESS_ONCE(queue->ndev->queue_pairs);
+}
+
+static void virtio_net__queue_wake(struct net_dev_queue *queue)
+{
+	mutex_lock(&queue->lock);
+	pthread_cond_signal(&queue->cond);
+	mutex_unlock(&queue->lock);
+}
+
 static void *virtio_net_rx_thread(void *p)
 {
 	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
-	struct virt_queue *vq;
-	struct kvm *kvm;
-	struct net_dev *ndev = p;
+	struct net_dev_queue *queue = p;
+	struct net_dev *ndev = queue->ndev;
+	struct virt_queue *vq = &queue->vq;
+	struct kvm *kvm = ndev->kvm;
+	int len, batched = 0;
 	u16 out, in;
 	u16 head;
-	int len;
-
-	kvm	= ndev->kvm;
-	vq	= &ndev->vqs[VIRTIO_NET_RX_QUEUE];
 
 	while (1) {
-		mutex_lock(&ndev->io_rx_lock);
-		if (!virt_queue__available(vq))
-			pthread_cond_wait(&ndev->io_rx_cond, &ndev->io_rx_lock);
-		mutex_unlock(&ndev->io_rx_lock);
+		mutex_lock(&queue->lock);
+		while (!virtio_net__queue_active(queue) || !virt_queue__available(vq))
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		mutex_unlock(&queue->lock);
 
-		while (virt_queue__available(vq)) {
+		while (virtio_net__queue_active(queue) && virt_queue__available(vq)) {
 			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-			len = ndev->ops->rx(iov, in, ndev);
-			virt_queue__set_used_elem(vq, head, len);
-
-			/* We should interrupt guest right now, otherwise latency is huge. */
-			if (virtio_queue__should_signal(&ndev->vqs[VIRTIO_NET_RX_QUEUE]))
-				ndev->vtrans.trans_ops->signal_vq(kvm, &ndev->vtrans,
-								VIRTIO_NET_RX_QUEUE);
+			len = ndev->ops->rx(iov, in, queue);
+			virt_queue__set_used_elem(vq, head, len < 0 ? 0 : len);
+
+			/*
+			 * Interrupt the guest once there is nothing more to
+			 * receive right away, or a batch is waiting: waiting
+			 * any longer would cost latency.
+			 */
+			if (++batched < VIRTIO_NET_RX_BATCH &&
+			    ndev->ops->rx_pending && ndev->ops->rx_pending(queue))
+				continue;
+
+			if (virtio_queue__should_signal(vq))
+				ndev->vtrans.trans_ops->signal_vq(kvm, &ndev->vtrans, queue->id);
+			batched = 0;
 		}
+
+		/* Out of buffers in the middle of a batch */
+		if (batched && virtio_queue__should_signal(vq))
+			ndev->vtrans.trans_ops->signal_vq(kvm, &ndev->vtrans, queue->id);
+		batched = 0;
 	}
 
 	pthread_exit(NULL);
@@ -111,30 +202,37 @@ static void *virtio_net_rx_thread(void *p)
 static void *virtio_net_tx_thread(void *p)
 {
 	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
-	struct virt_queue *vq;
-	struct kvm *kvm;
-	struct net_dev *ndev = p;
+	struct net_dev_queue *queue = p;
+	struct net_dev *ndev = queue->ndev;
+	struct virt_queue *vq = &queue->vq;
+	struct kvm *kvm = ndev->kvm;
 	u16 out, in;
 	u16 head;
 	int len;
 
-	kvm	= ndev->kvm;
-	vq	= &ndev->vqs[VIRTIO_NET_TX_QUEUE];
-
 	while (1) {
-		mutex_lock(&ndev->io_tx_lock);
-		if (!virt_queue__available(vq))
-			pthread_cond_wait(&ndev->io_tx_cond, &ndev->io_tx_lock);
-		mutex_unlock(&ndev->io_tx_lock);
-
-		while (virt_queue__available(vq)) {
-			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-			len = ndev->ops->tx(iov, out, ndev);
-			virt_queue__set_used_elem(vq, head, len);
-		}
+		mutex_lock(&queue->lock);
+		while (!virt_queue__available(vq))
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		mutex_unlock(&queue->lock);
+
+		/*
+		 * The guest doesn't have to kick us for every packet while
+		 * we're at it: take what it queues meanwhile in the same
+		 * batch, with one interrupt for all of them.
+		 */
+		do {
+			virt_queue__disable_notify(vq);
+
+			while (virt_queue__pending(vq)) {
+				head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+				len = ndev->ops->tx(iov, out, queue);
+				virt_queue__set_used_elem(vq, head, len < 0 ? 0 : len);
+			}
 
-		if (virtio_queue__should_signal(&ndev->vqs[VIRTIO_NET_TX_QUEUE]))
-			ndev->vtrans.trans_ops->signal_vq(kvm, &ndev->vtrans, VIRTIO_NET_TX_QUEUE);
+			if (virtio_queue__should_signal(vq))
+				ndev->vtrans.trans_ops->signal_vq(kvm, &ndev->vtrans, queue->id);
+		} while (virt_queue__enable_notify(vq));
 	}
 
 	pthread_exit(NULL);
@@ -143,64 +241,208 @@ static void *virtio_net_tx_thread(void *p)
 
 }
 
-static void virtio_net_handle_callback(struct kvm *kvm, struct net_dev *ndev, int queue)
+static virtio_net_ctrl_ack virtio_net_set_coalesce(struct net_dev *ndev, u8 cmd,
+						   struct virtio_net_ctrl_coalesce *coal)
 {
-	switch (queue) {
-	case VIRTIO_NET_TX_QUEUE:
-		mutex_lock(&ndev->io_tx_lock);
-		pthread_cond_signal(&ndev->io_tx_cond);
-		mutex_unlock(&ndev->io_tx_lock);
+	struct vhost_vring_coalesce c = {
+		.usecs		= coal->usecs,
+		.max_packets	= coal->max_packets,
+	};
+	u32 queue;
+	int i;
+
+	/* Only vhost knows how to hold back interrupts */
+	if (!ndev->vhost_coalesce)
+		return VIRTIO_NET_ERR;
+
+	switch (cmd) {
+	case VIRTIO_NET_CTRL_COALESCE_RX_SET:
+		queue = VIRTIO_NET_RX_QUEUE;
 		break;
-	case VIRTIO_NET_RX_QUEUE:
-		mutex_lock(&ndev->io_rx_lock);
-		pthread_cond_signal(&ndev->io_rx_cond);
-		mutex_unlock(&ndev->io_rx_lock);
+	case VIRTIO_NET_CTRL_COALESCE_TX_SET:
+		queue = VIRTIO_NET_TX_QUEUE;
 		break;
 	default:
+		return VIRTIO_NET_ERR;
+	}
+
+	/* Every pair, so that the ones the guest turns on later have it too */
+	for (i = 0; i < ndev->max_queue_pairs; i++) {
+		c.index = i * 2 + queue;
+		if (ioctl(ndev->vhost_fd, VHOST_SET_VRING_COALESCE, &c) < 0)
+			return VIRTIO_NET_ERR;
+	}
+
+	return VIRTIO_NET_OK;
+}
+
+static int virtio_net__tap_set_queue(struct net_dev *ndev, int pair, bool attach)
+{
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = attach ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+
+	return ioctl(ndev->tap_fds[pair], TUNSETQUEUE, &ifr);
+}
+
+/*
+ * Only the tap queues of the pairs the guest uses get packets, the others
+ * are detached: the receive threads of those don't read them either.
+ */
+static virtio_net_ctrl_ack virtio_net_set_queue_pairs(struct net_dev *ndev, u8 cmd,
+						      struct virtio_net_ctrl_mq *mq)
+{
+	int i, pairs = mq->virtqueue_pairs, old = ndev->queue_pairs;
+
+	if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET ||
+	    pairs < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN || pairs > ndev->max_queue_pairs)
+		return VIRTIO_NET_ERR;
+
+	/* Stop reading the queues going away before detaching them */
+	ndev->queue_pairs = min(old, pairs);
+
+	for (i = 1; i < ndev->max_queue_pairs; i++) {
+		if ((i < pairs) == (i < old))
+			continue;
+		if (virtio_net__tap_set_queue(ndev, i, i < pairs) < 0) {
+			pr_warning("Config tap device queue %d error", i);
+			return VIRTIO_NET_ERR;
+		}
+	}
+
+	ndev->queue_pairs = pairs;
+	for (i = old; i < pairs; i++)
+		virtio_net__queue_wake(&ndev->queues[i * 2]);
+
+	return VIRTIO_NET_OK;
+}
+
+static void virtio_net_handle_ctrl(struct kvm *kvm, struct net_dev *ndev)
+{
+	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
+	struct virtio_net_ctrl_hdr *ctrl;
+	virtio_net_ctrl_ack *ack;
+	struct virt_queue *vq;
+	u16 out, in, head;
+
+	vq = &ndev->ctrl_vq;
+
+	while (virt_queue__available(vq)) {
+		head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+		if (!out || !in) {
+			virt_queue__set_used_elem(vq, head, 0);
+			continue;
+		}
+
+		ctrl	= iov[0].iov_base;
+		ack	= iov[out + in - 1].iov_base;
+		*ack	= VIRTIO_NET_ERR;
+
+		if (ctrl->class == VIRTIO_NET_CTRL_COALESCE && out == 2 &&
+		    iov[1].iov_len >= sizeof(struct virtio_net_ctrl_coalesce))
+			*ack = virtio_net_set_coalesce(ndev, ctrl->cmd, iov[1].iov_base);
+		else if (ctrl->class == VIRTIO_NET_CTRL_MQ && out == 2 &&
+			 iov[1].iov_len >= sizeof(struct virtio_net_ctrl_mq))
+			*ack = virtio_net_set_queue_pairs(ndev, ctrl->cmd, iov[1].iov_base);
+
+		virt_queue__set_used_elem(vq, head, sizeof(*ack));
+	}
+
+	if (virtio_queue__should_signal(vq))
+		ndev->vtrans.trans_ops->signal_vq(kvm, &ndev->vtrans, virtio_net__ctrl_vq(ndev));
+}
+
+static void virtio_net_handle_callback(struct kvm *kvm, struct net_dev *ndev, u32 queue)
+{
+	if (queue == virtio_net__ctrl_vq(ndev))
+		virtio_net_handle_ctrl(kvm, ndev);
+	else if (queue < (u32)ndev->max_queue_pairs * 2)
+		virtio_net__queue_wake(&ndev->queues[queue]);
+	else
 		pr_warning("Unknown queue index %u", queue);
+}
+
+/* Open a queue of the tap device, creating the device for the first one */
+static int virtio_net__tap_open(struct net_dev *ndev, short flags)
+{
+	struct ifreq ifr;
+	int fd, hdr_len, err;
+
+	fd = open("/dev/net/tun", O_RDWR);
+	if (fd < 0)
+		return -1;
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = flags;
+	strncpy(ifr.ifr_name, ndev->tap_name, sizeof(ifr.ifr_name));
+	if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
 	}
+
+	strncpy(ndev->tap_name, ifr.ifr_name, sizeof(ndev->tap_name));
+
+	hdr_len = sizeof(struct virtio_net_hdr);
+	if (ioctl(fd, TUNSETVNETHDRSZ, &hdr_len) < 0)
+		pr_warning("Config tap device TUNSETVNETHDRSZ error");
+
+	return fd;
 }
 
 static bool virtio_net__tap_init(const struct virtio_net_params *params,
 					struct net_dev *ndev)
 {
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
-	int pid, status, offload, hdr_len;
+	short flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+	int i, pid, status, offload;
 	struct sockaddr_in sin = {0};
 	struct ifreq ifr;
 
 	/* Did the user already gave us the FD? */
 	if (params->fd) {
-		ndev->tap_fd = params->fd;
+		ndev->tap_fds[0] = params->fd;
 		return 1;
 	}
 
-	ndev->tap_fd = open("/dev/net/tun", O_RDWR);
-	if (ndev->tap_fd < 0) {
-		pr_warning("Unable to open /dev/net/tun");
-		goto fail;
+	for (i = 0; i < ndev->max_queue_pairs; i++)
+		ndev->tap_fds[i] = -1;
+
+	/* A host without multiqueue tap gets a single queue pair */
+	if (ndev->max_queue_pairs > 1) {
+		ndev->tap_fds[0] = virtio_net__tap_open(ndev, flags | IFF_MULTI_QUEUE);
+		if (ndev->tap_fds[0] < 0 && errno == EINVAL)
+			ndev->max_queue_pairs = 1;
+		else
+			flags |= IFF_MULTI_QUEUE;
 	}
 
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
-	if (ioctl(ndev->tap_fd, TUNSETIFF, &ifr) < 0) {
+	if (ndev->max_queue_pairs == 1)
+		ndev->tap_fds[0] = virtio_net__tap_open(ndev, flags);
+
+	if (ndev->tap_fds[0] < 0) {
 		pr_warning("Config tap device error. Are you root?");
 		goto fail;
 	}
 
-	strncpy(ndev->tap_name, ifr.ifr_name, sizeof(ndev->tap_name));
+	/* The guest starts with the first pair, until it asks for more */
+	for (i = 1; i < ndev->max_queue_pairs; i++) {
+		ndev->tap_fds[i] = virtio_net__tap_open(ndev, flags);
+		if (ndev->tap_fds[i] < 0 || virtio_net__tap_set_queue(ndev, i, false) < 0) {
+			pr_warning("Config tap device queue %d error", i);
+			goto fail;
+		}
+	}
 
-	if (ioctl(ndev->tap_fd, TUNSETNOCSUM, 1) < 0) {
+	if (ioctl(ndev->tap_fds[0], TUNSETNOCSUM, 1) < 0) {
 		pr_warning("Config tap device TUNSETNOCSUM error");
 		goto fail;
 	}
 
-	hdr_len = sizeof(struct virtio_net_hdr);
-	if (ioctl(ndev->tap_fd, TUNSETVNETHDRSZ, &hdr_len) < 0)
-		pr_warning("Config tap device TUNSETVNETHDRSZ error");
-
 	offload = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_UFO;
-	if (ioctl(ndev->tap_fd, TUNSETOFFLOAD, offload) < 0) {
+	if (ioctl(ndev->tap_fds[0], TUNSETOFFLOAD, offload) < 0) {
 		pr_warning("Config tap device TUNSETOFFLOAD error");
 		goto fail;
 	}
@@ -243,47 +485,65 @@ static bool virtio_net__tap_init(const struct virtio_net_params *params,
 fail:
 	if (sock >= 0)
 		close(sock);
-	if (ndev->tap_fd >= 0)
-		close(ndev->tap_fd);
+	for (i = 0; i < ndev->max_queue_pairs; i++)
+		if (ndev->tap_fds[i] >= 0)
+			close(ndev->tap_fds[i]);
 
 	return 0;
 }
 
 static void virtio_net__io_thread_init(struct kvm *kvm, struct net_dev *ndev)
 {
-	pthread_mutex_init(&ndev->io_tx_lock, NULL);
-	pthread_mutex_init(&ndev->io_rx_lock, NULL);
+	struct net_dev_queue *queue;
+	int i;
 
-	pthread_cond_init(&ndev->io_tx_cond, NULL);
-	pthread_cond_init(&ndev->io_rx_cond, NULL);
+	for (i = 0; i < ndev->max_queue_pairs * 2; i++) {
+		queue = &ndev->queues[i];
+		queue->id	= i;
+		queue->ndev	= ndev;
+
+		pthread_mutex_init(&queue->lock, NULL);
+		pthread_cond_init(&queue->cond, NULL);
+
+		pthread_create(&queue->thread, NULL, i % 2 ? virtio_net_tx_thread :
+			       virtio_net_rx_thread, queue);
+	}
+}
 
-	pthread_create(&ndev->io_tx_thread, NULL, virtio_net_tx_thread, ndev);
-	pthread_create(&ndev->io_rx_thread, NULL, virtio_net_rx_thread, ndev);
+static inline int tap_ops_tx(struct iovec *iov, u16 out, struct net_dev_queue *queue)
+{
+	return writev(queue->ndev->tap_fds[queue->id / 2], iov, out);
 }
 
-static inline int tap_ops_tx(struct iovec *iov, u16 out, struct net_dev *ndev)
+static inline int tap_ops_rx(struct iovec *iov, u16 in, struct net_dev_queue *queue)
 {
-	return writev(ndev->tap_fd, iov, out);
+	return readv(queue->ndev->tap_fds[queue->id / 2], iov, in);
 }
 
-static inline int tap_ops_rx(struct iovec *iov, u16 in, struct net_dev *ndev)
+static bool tap_ops_rx_pending(struct net_dev_queue *queue)
 {
-	return readv(ndev->tap_fd, iov, in);
+	struct pollfd pfd = {
+		.fd	= queue->ndev->tap_fds[queue->id / 2],
+		.events	= POLLIN,
+	};
+
+	return poll(&pfd, 1, 0) > 0;
 }
 
-static inline int uip_ops_tx(struct iovec *iov, u16 out, struct net_dev *ndev)
+static inline int uip_ops_tx(struct iovec *iov, u16 out, struct net_dev_queue *queue)
 {
-	return uip_tx(iov, out, &ndev->info);
+	return uip_tx(iov, out, &queue->ndev->info);
 }
 
-static inline int uip_ops_rx(struct iovec *iov, u16 in, struct net_dev *ndev)
+static inline int uip_ops_rx(struct iovec *iov, u16 in, struct net_dev_queue *queue)
 {
-	return uip_rx(iov, in, &ndev->info);
+	return uip_rx(iov, in, &queue->ndev->info);
 }
 
 static struct net_dev_operations tap_ops = {
-	.rx	= tap_ops_rx,
-	.tx	= tap_ops_tx,
+	.rx		= tap_ops_rx,
+	.tx		= tap_ops_tx,
+	.rx_pending	= tap_ops_rx_pending,
 };
 
 static struct net_dev_operations uip_ops = {
@@ -307,7 +567,23 @@ static u8 get_config(struct kvm *kvm, void *dev, u32 offset)
 
 static u32 get_host_features(struct kvm *kvm, void *dev)
 {
-	return 1UL << VIRTIO_NET_F_MAC
+	struct net_dev *ndev = dev;
+	u32 ring_features;
+	u32 features = 0;
+
+	if (ndev->vhost_coalesce)
+		features |= 1UL << VIRTIO_NET_F_CTRL_COALESCE;
+	if (ndev->max_queue_pairs > 1)
+		features |= 1UL << VIRTIO_NET_F_MQ;
+
+	/* With vhost, the ring is vhost's to handle: only offer what it can */
+	ring_features = 1UL << VIRTIO_RING_F_EVENT_IDX | 1UL << VIRTIO_RING_F_PACKED;
+	if (ndev->vhost_fd)
+		ring_features &= ndev->vhost_features;
+	features |= ring_features;
+
+	return features
+		| 1UL << VIRTIO_NET_F_MAC
 		| 1UL << VIRTIO_NET_F_CSUM
 		| 1UL << VIRTIO_NET_F_HOST_UFO
 		| 1UL << VIRTIO_NET_F_HOST_TSO4
@@ -315,15 +591,26 @@ static u32 get_host_features(struct kvm *kvm, void *dev)
 		| 1UL << VIRTIO_NET_F_GUEST_UFO
 		| 1UL << VIRTIO_NET_F_GUEST_TSO4
 		| 1UL << VIRTIO_NET_F_GUEST_TSO6
-		| 1UL << VIRTIO_RING_F_EVENT_IDX
-		| 1UL << VIRTIO_RING_F_INDIRECT_DESC;
+		| 1UL << VIRTIO_RING_F_INDIRECT_DESC
+		| 1UL << VIRTIO_NET_F_CTRL_VQ;
 }
 
 static void set_guest_features(struct kvm *kvm, void *dev, u32 features)
 {
 	struct net_dev *ndev = dev;
+	u64 vhost_features;
+	int r;
 
 	ndev->features = features;
+
+	if (ndev->vhost_fd == 0)
+		return;
+
+	/* Tell vhost what the guest took of what it can do, ring layout included */
+	vhost_features = features & ndev->vhost_features;
+	r = ioctl(ndev->vhost_fd, VHOST_SET_FEATURES, &vhost_features);
+	if (r != 0)
+		die_perror("VHOST_SET_FEATURES failed");
 }
 
 static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 pfn)
@@ -337,16 +624,20 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 pfn)
 
 	compat__remove_message(compat_id);
 
-	queue		= &ndev->vqs[vq];
+	queue		= virtio_net__get_vq(ndev, vq);
+	if (!queue)
+		return -EINVAL;
+
 	queue->pfn	= pfn;
 	p		= guest_pfn_to_host(kvm, queue->pfn);
 
-	vring_init(&queue->vring, VIRTIO_NET_QUEUE_SIZE, p, VIRTIO_PCI_VRING_ALIGN);
+	virt_queue__init(queue, virtio_net__queue_size(ndev), p, ndev->features);
 
-	if (ndev->vhost_fd == 0)
+	/* The control queue is always handled here */
+	if (ndev->vhost_fd == 0 || vq == virtio_net__ctrl_vq(ndev))
 		return 0;
 
-	state.num = queue->vring.num;
+	state.num = virtio_net__queue_size(ndev);
 	r = ioctl(ndev->vhost_fd, VHOST_SET_VRING_NUM, &state);
 	if (r < 0)
 		die_perror("VHOST_SET_VRING_NUM failed");
@@ -355,12 +646,20 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 pfn)
 	if (r < 0)
 		die_perror("VHOST_SET_VRING_BASE failed");
 
-	addr = (struct vhost_vring_addr) {
-		.index = vq,
-		.desc_user_addr = (u64)(unsigned long)queue->vring.desc,
-		.avail_user_addr = (u64)(unsigned long)queue->vring.avail,
-		.used_user_addr = (u64)(unsigned long)queue->vring.used,
-	};
+	if (queue->packed)
+		addr = (struct vhost_vring_addr) {
+			.index = vq,
+			.desc_user_addr = (u64)(unsigned long)queue->vring_packed.desc,
+			.avail_user_addr = (u64)(unsigned long)queue->vring_packed.driver,
+			.used_user_addr = (u64)(unsigned long)queue->vring_packed.device,
+		};
+	else
+		addr = (struct vhost_vring_addr) {
+			.index = vq,
+			.desc_user_addr = (u64)(unsigned long)queue->vring.desc,
+			.avail_user_addr = (u64)(unsigned long)queue->vring.avail,
+			.used_user_addr = (u64)(unsigned long)queue->vring.used,
+		};
 
 	r = ioctl(ndev->vhost_fd, VHOST_SET_VRING_ADDR, &addr);
 	if (r < 0)
@@ -376,7 +675,7 @@ static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi)
 	struct vhost_vring_file file;
 	int r;
 
-	if (ndev->vhost_fd == 0)
+	if (ndev->vhost_fd == 0 || vq == virtio_net__ctrl_vq(ndev))
 		return;
 
 	irq = (struct kvm_irqfd) {
@@ -395,14 +694,14 @@ static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi)
 	r = ioctl(ndev->vhost_fd, VHOST_SET_VRING_CALL, &file);
 	if (r < 0)
 		die_perror("VHOST_SET_VRING_CALL failed");
-	file.fd = ndev->tap_fd;
+	file.fd = ndev->tap_fds[0];
 	r = ioctl(ndev->vhost_fd, VHOST_NET_SET_BACKEND, &file);
 	if (r != 0)
 		die("VHOST_NET_SET_BACKEND failed %d", errno);
 
 }
 
-static void notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd)
+static bool notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd)
 {
 	struct net_dev *ndev = dev;
 	struct vhost_vring_file file = {
@@ -411,12 +710,14 @@ static void notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd)
 	};
 	int r;
 
-	if (ndev->vhost_fd == 0)
-		return;
+	if (ndev->vhost_fd == 0 || vq == virtio_net__ctrl_vq(ndev))
+		return false;
 
 	r = ioctl(ndev->vhost_fd, VHOST_SET_VRING_KICK, &file);
 	if (r < 0)
 		die_perror("VHOST_SET_VRING_KICK failed");
+
+	return false;
 }
 
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
@@ -430,14 +731,15 @@ static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
 
 static int get_pfn_vq(struct kvm *kvm, void *dev, u32 vq)
 {
-	struct net_dev *ndev = dev;
+	struct virt_queue *queue = virtio_net__get_vq(dev, vq);
 
-	return ndev->vqs[vq].pfn;
+	return queue ? queue->pfn : 0;
 }
 
 static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
 {
-	return VIRTIO_NET_QUEUE_SIZE;
+	/* A queue the guest has no use for doesn't exist */
+	return virtio_net__get_vq(dev, vq) ? virtio_net__queue_size(dev) : 0;
 }
 
 static struct virtio_ops net_dev_virtio_ops = (struct virtio_ops) {
@@ -455,8 +757,9 @@ static struct virtio_ops net_dev_virtio_ops = (struct virtio_ops) {
 
 static void virtio_net__vhost_init(struct kvm *kvm, struct net_dev *ndev)
 {
-	u64 features = 1UL << VIRTIO_RING_F_EVENT_IDX;
+	struct vhost_vring_coalesce coal = { .index = 0 };
 	struct vhost_memory *mem;
+	u64 features = 0;
 	int r;
 
 	ndev->vhost_fd = open("/dev/vhost-net", O_RDWR);
@@ -478,6 +781,10 @@ static void virtio_net__vhost_init(struct kvm *kvm, struct net_dev *ndev)
 	if (r != 0)
 		die_perror("VHOST_SET_OWNER failed");
 
+	r = ioctl(ndev->vhost_fd, VHOST_GET_FEATURES, &ndev->vhost_features);
+	if (r != 0)
+		die_perror("VHOST_GET_FEATURES failed");
+	/* Until the guest picks its own */
 	r = ioctl(ndev->vhost_fd, VHOST_SET_FEATURES, &features);
 	if (r != 0)
 		die_perror("VHOST_SET_FEATURES failed");
@@ -485,6 +792,9 @@ static void virtio_net__vhost_init(struct kvm *kvm, struct net_dev *ndev)
 	if (r != 0)
 		die_perror("VHOST_SET_MEM_TABLE failed");
 	free(mem);
+
+	/* A vhost-net that doesn't know how to hold back interrupts says so */
+	ndev->vhost_coalesce = ioctl(ndev->vhost_fd, VHOST_SET_VRING_COALESCE, &coal) == 0;
 }
 
 void virtio_net__init(const struct virtio_net_params *params)
@@ -506,6 +816,12 @@ void virtio_net__init(const struct virtio_net_params *params)
 	mutex_init(&ndev->mutex);
 	ndev->config.status = VIRTIO_NET_S_LINK_UP;
 
+	/* A queue pair per VCPU, if we do the I/O of a tap device ourselves */
+	ndev->max_queue_pairs = 1;
+	if (params->mode == NET_MODE_TAP && !params->vhost && !params->fd)
+		ndev->max_queue_pairs = min(params->kvm->nrcpus, VIRTIO_NET_MAX_QUEUE_PAIRS);
+	ndev->queue_pairs = 1;
+
 	for (i = 0 ; i < 6 ; i++) {
 		ndev->config.mac[i]		= params->guest_mac[i];
 		ndev->info.guest_mac.addr[i]	= params->guest_mac[i];
@@ -518,12 +834,14 @@ void virtio_net__init(const struct virtio_net_params *params)
 			die_perror("You have requested a TAP device, but creation of one has"
 					"failed because:");
 		ndev->ops = &tap_ops;
+		ndev->config.max_virtqueue_pairs = ndev->max_queue_pairs;
 	} else {
 		ndev->info.host_ip		= ntohl(inet_addr(params->host_ip));
 		ndev->info.guest_ip		= ntohl(inet_addr(params->guest_ip));
 		ndev->info.guest_netmask	= ntohl(inet_addr("255.255.255.0"));
-		ndev->info.buf_nr		= 20,
-		uip_init(&ndev->info);
+		ndev->info.buf_nr		= 20;
+		if (uip_init(&ndev->info) < 0)
+			die("Failed initializing the user mode network stack");
 		ndev->ops = &uip_ops;
 	}
 
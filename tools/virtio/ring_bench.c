@@ -0,0 +1,411 @@
+/*
+ * Virtio ring microbenchmark.
+ *
+ * The guest half is drivers/virtio/virtio_ring.c itself, the host half is
+ * the vhost ring protocol from ring_bench_host.c. Each runs in its own
+ * thread, optionally pinned, and they talk through a split ring in shared
+ * memory, with eventfds standing in for kicks and interrupts. The guest
+ * keeps up to --max-outstanding buffers in flight, adding --batch at a time
+ * before kicking; the host completes up to --batch buffers before
+ * publishing them. Waiting is busy polling, or blocking on the eventfd
+ * with --sleep.
+ *
+ * To benchmark the kernel's vhost instead, see virtio_test.
+ */
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <linux/virtio.h>
+#include "ring_bench.h"
+
+static unsigned int ring_size = 256;
+static unsigned int batch = 32;
+static unsigned int max_outstanding;
+static unsigned int sgs = 1;
+static unsigned int buf_size = 64;
+static unsigned long long ops = 10000000;
+static int guest_cpu = -1, host_cpu = -1;
+static bool do_sleep;
+
+static struct virtio_device vdev;
+static struct virtqueue *vq;
+static struct host_vq hvq;
+/* The guest's view of the ring, to busy poll on */
+static struct vring gvring;
+static void *ring;
+static char *bufs;
+
+static int kick_fd, call_fd;
+static bool done;
+
+/* Notifications and wakeups, counted by whoever sends/gets them */
+static unsigned long long kicks, calls, host_wakeups, guest_wakeups;
+
+static void vq_notify(struct virtqueue *vq)
+{
+	unsigned long long v = 1;
+	int r;
+
+	kicks++;
+	r = write(kick_fd, &v, sizeof(v));
+	assert(r == sizeof(v));
+}
+
+static void vq_callback(struct virtqueue *vq)
+{
+}
+
+static void call(void)
+{
+	unsigned long long v = 1;
+	int r;
+
+	calls++;
+	r = write(call_fd, &v, sizeof(v));
+	assert(r == sizeof(v));
+}
+
+static void wait_fd(int fd)
+{
+	unsigned long long v;
+	int r;
+
+	r = read(fd, &v, sizeof(v));
+	assert(r == sizeof(v));
+}
+
+static void pin(int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+		fprintf(stderr, "can't pin to cpu %d\n", cpu);
+		exit(1);
+	}
+}
+
+static void *host_run(void *arg)
+{
+	unsigned int n, len;
+	int head;
+
+	pin(host_cpu);
+
+	for (;;) {
+		host_disable_notify(&hvq);
+		do {
+			for (n = 0; n < batch; n++) {
+				head = host_get_buf(&hvq, &len);
+				if (head < 0)
+					break;
+				host_add_used(&hvq, head, len);
+			}
+			if (host_publish_used(&hvq))
+				call();
+		} while (n == batch);
+
+		if (host_enable_notify(&hvq))
+			continue;
+
+		/* Nothing to do: wait for the next kick. */
+		host_wakeups++;
+		if (do_sleep) {
+			wait_fd(kick_fd);
+		} else {
+			while (host_avail_empty(&hvq) && !ACCESS_ONCE(done))
+				cpu_relax();
+		}
+		if (ACCESS_ONCE(done) && host_avail_empty(&hvq))
+			break;
+	}
+
+	return NULL;
+}
+
+static void guest_run(void)
+{
+	unsigned long long started = 0, completed = 0;
+	struct scatterlist sg[sgs];
+	unsigned int n, i, len, got;
+	bool full;
+	char *buf;
+
+	pin(guest_cpu);
+
+	while (completed < ops) {
+		virtqueue_disable_cb(vq);
+
+		/* Produce a batch, then kick once. */
+		full = false;
+		for (n = 0; n < batch && started < ops &&
+		     started - completed < max_outstanding; n++) {
+			buf = bufs + (started % ring_size) * buf_size * sgs;
+			sg_init_table(sg, sgs);
+			for (i = 0; i < sgs; i++)
+				sg_set_buf(&sg[i], buf + i * buf_size, buf_size);
+			if (virtqueue_add_buf(vq, sg, sgs, 0, buf) < 0) {
+				full = true;
+				break;
+			}
+			started++;
+		}
+		if (n)
+			virtqueue_kick(vq);
+
+		for (got = 0; virtqueue_get_buf(vq, &len); got++)
+			completed++;
+
+		if (completed == ops)
+			break;
+		if (got || (!full && started < ops &&
+			    started - completed < max_outstanding))
+			continue;
+
+		/* Ring full or all sent: wait for the host. */
+		if (!virtqueue_enable_cb(vq))
+			continue;
+		guest_wakeups++;
+		if (do_sleep) {
+			wait_fd(call_fd);
+		} else {
+			while (ACCESS_ONCE(gvring.used->idx) ==
+			       (unsigned short)completed)
+				cpu_relax();
+		}
+	}
+
+	ACCESS_ONCE(done) = true;
+	vq_notify(vq);
+	kicks--;
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char optstring[] = "h";
+const struct option longopts[] = {
+	{
+		.name = "help",
+		.val = 'h',
+	},
+	{
+		.name = "event-idx",
+		.val = 'E',
+	},
+	{
+		.name = "no-event-idx",
+		.val = 'e',
+	},
+	{
+		.name = "indirect",
+		.val = 'I',
+	},
+	{
+		.name = "no-indirect",
+		.val = 'i',
+	},
+	{
+		.name = "ring-size",
+		.val = 'r',
+		.has_arg = required_argument,
+	},
+	{
+		.name = "batch",
+		.val = 'b',
+		.has_arg = required_argument,
+	},
+	{
+		.name = "max-outstanding",
+		.val = 'o',
+		.has_arg = required_argument,
+	},
+	{
+		.name = "sg",
+		.val = 's',
+		.has_arg = required_argument,
+	},
+	{
+		.name = "buf-size",
+		.val = 'B',
+		.has_arg = required_argument,
+	},
+	{
+		.name = "ops",
+		.val = 'n',
+		.has_arg = required_argument,
+	},
+	{
+		.name = "guest-cpu",
+		.val = 'g',
+		.has_arg = required_argument,
+	},
+	{
+		.name = "host-cpu",
+		.val = 'H',
+		.has_arg = required_argument,
+	},
+	{
+		.name = "sleep",
+		.val = 'S',
+	},
+	{
+	}
+};
+
+static void help()
+{
+	fprintf(stderr, "Usage: ring_bench [--help]"
+		" [--no-indirect]"
+		" [--no-event-idx]"
+		" [--ring-size=N]"
+		" [--batch=N]"
+		" [--max-outstanding=N]"
+		" [--sg=N]"
+		" [--buf-size=BYTES]"
+		" [--ops=N]"
+		" [--guest-cpu=CPU]"
+		" [--host-cpu=CPU]"
+		" [--sleep]"
+		"\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long features = (1ULL << VIRTIO_RING_F_INDIRECT_DESC) |
+		(1ULL << VIRTIO_RING_F_EVENT_IDX);
+	unsigned long long start, end, tsc_start, tsc_end;
+	pthread_t host;
+	int o, r;
+
+	for (;;) {
+		o = getopt_long(argc, argv, optstring, longopts, NULL);
+		switch (o) {
+		case -1:
+			goto done;
+		case '?':
+			help();
+			exit(2);
+		case 'h':
+			help();
+			exit(0);
+		case 'E':
+			features |= 1ULL << VIRTIO_RING_F_EVENT_IDX;
+			break;
+		case 'e':
+			features &= ~(1ULL << VIRTIO_RING_F_EVENT_IDX);
+			break;
+		case 'I':
+			features |= 1ULL << VIRTIO_RING_F_INDIRECT_DESC;
+			break;
+		case 'i':
+			features &= ~(1ULL << VIRTIO_RING_F_INDIRECT_DESC);
+			break;
+		case 'r':
+			ring_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			max_outstanding = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			sgs = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			buf_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			ops = strtoull(optarg, NULL, 0);
+			break;
+		case 'g':
+			guest_cpu = strtol(optarg, NULL, 0);
+			break;
+		case 'H':
+			host_cpu = strtol(optarg, NULL, 0);
+			break;
+		case 'S':
+			do_sleep = true;
+			break;
+		default:
+			assert(0);
+			break;
+		}
+	}
+
+done:
+	/* Ring sizes must be powers of two. */
+	if (!ring_size || ring_size & (ring_size - 1) || ring_size > 32768 ||
+	    !batch || !sgs || !buf_size || !ops) {
+		help();
+		exit(2);
+	}
+	if (!max_outstanding || max_outstanding > ring_size)
+		max_outstanding = ring_size;
+
+	vdev.features[0] = features;
+
+	r = posix_memalign(&ring, 4096, vring_size(ring_size, 4096));
+	assert(!r);
+	memset(ring, 0, vring_size(ring_size, 4096));
+	bufs = malloc((size_t)ring_size * sgs * buf_size);
+	assert(bufs);
+
+	vq = vring_new_virtqueue(ring_size, 4096, &vdev, ring,
+				 vq_notify, vq_callback, "bench");
+	assert(vq);
+	vring_init(&gvring, ring_size, ring, 4096);
+	host_vq_init(&hvq, ring_size, ring,
+		     features & (1ULL << VIRTIO_RING_F_EVENT_IDX));
+
+	kick_fd = eventfd(0, 0);
+	call_fd = eventfd(0, 0);
+	assert(kick_fd >= 0 && call_fd >= 0);
+
+	r = pthread_create(&host, NULL, host_run, NULL);
+	assert(!r);
+
+	start = now_ns();
+	tsc_start = rdtsc();
+	guest_run();
+	tsc_end = rdtsc();
+	end = now_ns();
+
+	pthread_join(host, NULL);
+
+	printf("split ring: size %u, batch %u, outstanding %u, %u sg x %u bytes, "
+	       "indirect %s, event idx %s, %s\n",
+	       ring_size, batch, max_outstanding, sgs, buf_size,
+	       features & (1ULL << VIRTIO_RING_F_INDIRECT_DESC) ? "on" : "off",
+	       features & (1ULL << VIRTIO_RING_F_EVENT_IDX) ? "on" : "off",
+	       do_sleep ? "sleeping" : "polling");
+	printf("  %llu ops in %llu usec: %.0f ops/s, %.1f cycles/op\n",
+	       ops, (end - start) / 1000, ops * 1e9 / (end - start),
+	       (double)(tsc_end - tsc_start) / ops);
+	printf("  kicks/op %.4f, calls/op %.4f, "
+	       "guest waits/op %.4f, host waits/op %.4f\n",
+	       (double)kicks / ops, (double)calls / ops,
+	       (double)guest_wakeups / ops, (double)host_wakeups / ops);
+
+	return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * Shared between the guest half (ring_bench.c, driving the real
+ * drivers/virtio/virtio_ring.c) and the host half (ring_bench_host.c) of
+ * the virtio ring benchmark.
+ */
+#ifndef RING_BENCH_H
+#define RING_BENCH_H
+
+#include <stdbool.h>
+#include <linux/virtio_ring.h>
+
+#define ACCESS_ONCE(x) (*(volatile typeof(x) *)&(x))
+
+static inline unsigned long long rdtsc(void)
+{
+	unsigned int lo, hi;
+
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return (unsigned long long)hi << 32 | lo;
+}
+
+static inline void cpu_relax(void)
+{
+	asm volatile("rep; nop" ::: "memory");
+}
+
+/*
+ * The device side of a split virtqueue, following what drivers/vhost/vhost.c
+ * does with the rings: the same index tracking, barriers, notification
+ * suppression and event index rules, minus the copies from user memory.
+ * Guest addresses are host addresses here.
+ */
+struct host_vq {
+	struct vring vring;
+	bool event_idx;
+
+	/* Last available index we consumed, and the cached avail->idx */
+	unsigned short last_avail_idx;
+	unsigned short avail_idx;
+
+	/* Next used index we fill, and the one the guest has seen */
+	unsigned short last_used_idx;
+	unsigned short published_used_idx;
+
+	/* Last used index we signalled the guest on */
+	unsigned short signalled_used;
+	bool signalled_used_valid;
+};
+
+void host_vq_init(struct host_vq *hvq, unsigned int num, void *ring,
+		  bool event_idx);
+int host_get_buf(struct host_vq *hvq, unsigned int *len);
+void host_add_used(struct host_vq *hvq, unsigned int head, unsigned int len);
+bool host_publish_used(struct host_vq *hvq);
+void host_disable_notify(struct host_vq *hvq);
+bool host_enable_notify(struct host_vq *hvq);
+bool host_avail_empty(struct host_vq *hvq);
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * Host half of the virtio ring benchmark: a userspace rendition of the ring
+ * handling in drivers/vhost/vhost.c. vhost.c itself is built on copies from
+ * the guest's memory, RCU and the vhost worker, which have no place in a
+ * userspace benchmark, so the ring protocol is redone here step by step:
+ * vhost_get_vq_desc(), vhost_add_used_n(), vhost_notify() and
+ * vhost_{enable,disable}_notify().
+ */
+#include <assert.h>
+#include <string.h>
+#include <linux/virtio.h>
+#include "ring_bench.h"
+
+void host_vq_init(struct host_vq *hvq, unsigned int num, void *ring,
+		  bool event_idx)
+{
+	memset(hvq, 0, sizeof(*hvq));
+	vring_init(&hvq->vring, num, ring, 4096);
+	hvq->event_idx = event_idx;
+}
+
+bool host_avail_empty(struct host_vq *hvq)
+{
+	return ACCESS_ONCE(hvq->vring.avail->idx) == hvq->last_avail_idx;
+}
+
+/* Add the length of a descriptor chain, possibly indirect. */
+static unsigned int host_chain_len(struct vring_desc *table, unsigned int num,
+				   unsigned int i, bool indirect)
+{
+	struct vring_desc *desc;
+	unsigned int len = 0, count = 0;
+
+	for (;;) {
+		assert(i < num && ++count <= num);
+		desc = &table[i];
+
+		if (desc->flags & VRING_DESC_F_INDIRECT) {
+			/* Indirect tables can't nest. */
+			assert(!indirect);
+			len += host_chain_len(phys_to_virt(desc->addr),
+					      desc->len / sizeof(*desc), 0,
+					      true);
+		} else {
+			len += desc->len;
+		}
+
+		if (!(desc->flags & VRING_DESC_F_NEXT))
+			return len;
+		i = desc->next;
+	}
+}
+
+/* Like vhost_get_vq_desc(): returns the next head, or -1 if there is none. */
+int host_get_buf(struct host_vq *hvq, unsigned int *len)
+{
+	struct vring *vring = &hvq->vring;
+	unsigned int head;
+
+	if (hvq->avail_idx == hvq->last_avail_idx) {
+		hvq->avail_idx = ACCESS_ONCE(vring->avail->idx);
+		if (hvq->avail_idx == hvq->last_avail_idx)
+			return -1;
+		/* Only get avail ring entries after they have been exposed
+		 * by the guest. */
+		smp_rmb();
+	}
+
+	head = vring->avail->ring[hvq->last_avail_idx % vring->num];
+	hvq->last_avail_idx++;
+
+	*len = host_chain_len(vring->desc, vring->num, head, false);
+	return head;
+}
+
+/* Like vhost_add_used(), but the index is only published by
+ * host_publish_used(), as vhost_add_used_n() does for a batch. */
+void host_add_used(struct host_vq *hvq, unsigned int head, unsigned int len)
+{
+	struct vring_used_elem *used;
+
+	used = &hvq->vring.used->ring[hvq->last_used_idx % hvq->vring.num];
+	used->id = head;
+	used->len = len;
+	hvq->last_used_idx++;
+}
+
+/*
+ * Make the used entries visible to the guest, and tell whether it wants
+ * an interrupt for them (vhost_notify()).
+ */
+bool host_publish_used(struct host_vq *hvq)
+{
+	struct vring *vring = &hvq->vring;
+	unsigned short old, new;
+	bool valid;
+
+	if (hvq->published_used_idx == hvq->last_used_idx)
+		return false;
+
+	/* Make sure buffer is written before we update index. */
+	smp_wmb();
+	ACCESS_ONCE(vring->used->idx) = hvq->last_used_idx;
+	hvq->published_used_idx = hvq->last_used_idx;
+
+	/* Flush out used index updates. This is paired with the barrier
+	 * the guest does before checking whether it needs an interrupt. */
+	smp_mb();
+
+	if (!hvq->event_idx)
+		return !(ACCESS_ONCE(vring->avail->flags) &
+			 VRING_AVAIL_F_NO_INTERRUPT);
+
+	old = hvq->signalled_used;
+	valid = hvq->signalled_used_valid;
+	new = hvq->signalled_used = hvq->last_used_idx;
+	hvq->signalled_used_valid = true;
+
+	if (!valid)
+		return true;
+
+	return vring_need_event(ACCESS_ONCE(vring_used_event(vring)), new, old);
+}
+
+void host_disable_notify(struct host_vq *hvq)
+{
+	if (!hvq->event_idx)
+		hvq->vring.used->flags |= VRING_USED_F_NO_NOTIFY;
+}
+
+/* Returns true if buffers were added while notifications were off. */
+bool host_enable_notify(struct host_vq *hvq)
+{
+	/* vring_avail_event(), without punning the used ring's type */
+	volatile __u16 *avail_event = (void *)&hvq->vring.used->ring[hvq->vring.num];
+
+	if (!hvq->event_idx)
+		hvq->vring.used->flags &= ~VRING_USED_F_NO_NOTIFY;
+	else
+		*avail_event = hvq->last_avail_idx;
+
+	/* They could have slipped one in as we were doing that: make
+	 * sure it's written, then check again. */
+	smp_mb();
+	return !host_avail_empty(hvq);
+}
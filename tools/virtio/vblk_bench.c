@@ -0,0 +1,339 @@
+/*
+ * Synchronous direct I/O latency benchmark for a block device, meant to be
+ * run inside a guest to compare the virtio_blk request and bio submission
+ * paths: load the driver once with use_bio=0 and once with use_bio=1 and
+ * run the same job against the disk.
+ *
+ * Each job is a thread doing one O_DIRECT pread/pwrite at a time, like a
+ * fio job with ioengine=psync, direct=1 and iodepth=1, and the report uses
+ * the same units as fio.
+ */
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+
+#ifndef BLKGETSIZE64
+#define BLKGETSIZE64 _IOR(0x12, 114, size_t)
+#endif
+
+static const char *filename;
+static bool do_write;
+static bool do_random;
+static size_t bs = 4096;
+static unsigned long long size;
+static unsigned int runtime = 10;
+static unsigned int numjobs = 1;
+
+struct job {
+	pthread_t thread;
+	unsigned int id;
+	int fd;
+	void *buf;
+	/* Completion latencies, in nsec */
+	unsigned long long *lat;
+	size_t nr, alloc;
+	int err;
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *job_run(void *arg)
+{
+	struct job *job = arg;
+	unsigned long long blocks = size / bs;
+	unsigned long long block, start, end, deadline;
+	unsigned int seed = job->id;
+	ssize_t ret;
+
+	/* Sequential jobs each walk their own slice of the device. */
+	block = blocks / numjobs * job->id;
+	deadline = now_ns() + runtime * 1000000000ULL;
+
+	for (;;) {
+		if (do_random)
+			block = ((unsigned long long)rand_r(&seed) << 31 |
+				 rand_r(&seed)) % blocks;
+		else if (block >= blocks)
+			block = 0;
+
+		start = now_ns();
+		if (do_write)
+			ret = pwrite(job->fd, job->buf, bs, block * bs);
+		else
+			ret = pread(job->fd, job->buf, bs, block * bs);
+		end = now_ns();
+
+		if (ret != (ssize_t)bs) {
+			job->err = ret < 0 ? errno : EIO;
+			break;
+		}
+
+		if (job->nr == job->alloc) {
+			job->alloc = job->alloc ? job->alloc * 2 : 65536;
+			job->lat = realloc(job->lat, job->alloc * sizeof(*job->lat));
+			if (!job->lat) {
+				job->err = ENOMEM;
+				break;
+			}
+		}
+		job->lat[job->nr++] = end - start;
+
+		if (!do_random)
+			block++;
+		if (end >= deadline)
+			break;
+	}
+
+	return NULL;
+}
+
+static int cmp_lat(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(struct job *jobs, unsigned long long elapsed)
+{
+	static const double pct[] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+	unsigned long long *lat, min = ~0ULL, max = 0;
+	double sum = 0, sumsq = 0, avg, stdev;
+	size_t nr = 0, i;
+
+	for (i = 0; i < numjobs; i++)
+		nr += jobs[i].nr;
+	if (!nr) {
+		fprintf(stderr, "no I/O completed\n");
+		return;
+	}
+
+	lat = malloc(nr * sizeof(*lat));
+	if (!lat) {
+		perror("malloc");
+		return;
+	}
+
+	nr = 0;
+	for (i = 0; i < numjobs; i++) {
+		memcpy(lat + nr, jobs[i].lat, jobs[i].nr * sizeof(*lat));
+		nr += jobs[i].nr;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (lat[i] < min)
+			min = lat[i];
+		if (lat[i] > max)
+			max = lat[i];
+		sum += lat[i] / 1000.0;
+		sumsq += (lat[i] / 1000.0) * (lat[i] / 1000.0);
+	}
+	avg = sum / nr;
+	stdev = sqrt(sumsq / nr - avg * avg);
+
+	qsort(lat, nr, sizeof(*lat), cmp_lat);
+
+	printf("%s: bs=%zu, numjobs=%u\n",
+	       do_random ? (do_write ? "randwrite" : "randread") :
+			   (do_write ? "write" : "read"),
+	       bs, numjobs);
+	printf("  IOPS=%.0f, BW=%.0fKiB/s (%zu ios in %llu msec)\n",
+	       nr * 1e9 / elapsed, nr * 1e9 / elapsed * bs / 1024, nr,
+	       elapsed / 1000000);
+	printf("    clat (usec): min=%llu, max=%llu, avg=%.2f, stdev=%.2f\n",
+	       min / 1000, max / 1000, avg, stdev);
+	printf("    clat percentiles (usec):");
+	for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i++)
+		printf(" %.2fth=[%llu]", pct[i],
+		       lat[(size_t)((nr - 1) * pct[i] / 100)] / 1000);
+	printf("\n");
+
+	free(lat);
+}
+
+const struct option longopts[] = {
+	{
+		.name = "help",
+		.val = 'h',
+	},
+	{
+		.name = "filename",
+		.val = 'f',
+		.has_arg = required_argument,
+	},
+	{
+		.name = "rw",
+		.val = 'r',
+		.has_arg = required_argument,
+	},
+	{
+		.name = "bs",
+		.val = 'b',
+		.has_arg = required_argument,
+	},
+	{
+		.name = "size",
+		.val = 's',
+		.has_arg = required_argument,
+	},
+	{
+		.name = "runtime",
+		.val = 't',
+		.has_arg = required_argument,
+	},
+	{
+		.name = "numjobs",
+		.val = 'j',
+		.has_arg = required_argument,
+	},
+	{
+	}
+};
+
+static void help()
+{
+	fprintf(stderr, "Usage: vblk_bench [--help]"
+		" --filename=DEVICE"
+		" [--rw=read|write|randread|randwrite]"
+		" [--bs=BYTES]"
+		" [--size=BYTES]"
+		" [--runtime=SECONDS]"
+		" [--numjobs=N]"
+		"\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct job *jobs;
+	unsigned long long start;
+	unsigned int i;
+	struct stat st;
+	int o;
+
+	for (;;) {
+		o = getopt_long(argc, argv, "hf:r:b:s:t:j:", longopts, NULL);
+		switch (o) {
+		case -1:
+			goto done;
+		case '?':
+			help();
+			exit(2);
+		case 'h':
+			help();
+			exit(0);
+		case 'f':
+			filename = optarg;
+			break;
+		case 'r':
+			do_random = !strncmp(optarg, "rand", 4);
+			if (do_random)
+				optarg += 4;
+			if (!strcmp(optarg, "write"))
+				do_write = true;
+			else if (strcmp(optarg, "read")) {
+				help();
+				exit(2);
+			}
+			break;
+		case 'b':
+			bs = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			runtime = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			numjobs = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			assert(0);
+		}
+	}
+
+done:
+	if (!filename || !bs || !numjobs) {
+		help();
+		exit(2);
+	}
+
+	jobs = calloc(numjobs, sizeof(*jobs));
+	if (!jobs) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (i = 0; i < numjobs; i++) {
+		struct job *job = &jobs[i];
+
+		job->id = i;
+		job->fd = open(filename, (do_write ? O_RDWR : O_RDONLY) | O_DIRECT);
+		if (job->fd < 0) {
+			perror(filename);
+			exit(1);
+		}
+		if (posix_memalign(&job->buf, 4096, bs)) {
+			fprintf(stderr, "posix_memalign failed\n");
+			exit(1);
+		}
+		memset(job->buf, 0xa5, bs);
+	}
+
+	if (!size) {
+		if (fstat(jobs[0].fd, &st) < 0) {
+			perror("fstat");
+			exit(1);
+		}
+		if (S_ISBLK(st.st_mode)) {
+			if (ioctl(jobs[0].fd, BLKGETSIZE64, &size) < 0) {
+				perror("BLKGETSIZE64");
+				exit(1);
+			}
+		} else {
+			size = st.st_size;
+		}
+	}
+	if (size < bs * numjobs) {
+		fprintf(stderr, "%s: too small for %u jobs of %zu byte blocks\n",
+			filename, numjobs, bs);
+		exit(2);
+	}
+
+	start = now_ns();
+	for (i = 0; i < numjobs; i++)
+		if (pthread_create(&jobs[i].thread, NULL, job_run, &jobs[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+
+	for (i = 0; i < numjobs; i++) {
+		pthread_join(jobs[i].thread, NULL);
+		if (jobs[i].err)
+			fprintf(stderr, "job %u: %s\n", i, strerror(jobs[i].err));
+	}
+
+	report(jobs, now_ns() - start);
+
+	return 0;
+}
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <poll.h>
 #include <sys/eventfd.h>
+#include <sys/time.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
@@ -23,6 +24,7 @@ struct vq_info {
 	void *ring;
 	/* copy used for control */
 	struct vring vring;
+	struct vring_packed vring_packed;
 	struct virtqueue *vq;
 };
 
@@ -63,6 +65,14 @@ void vhost_vq_setup(struct vdev_info *dev, struct vq_info *info)
 		.used_user_addr = (uint64_t)(unsigned long)info->vring.used,
 	};
 	int r;
+	if (features & (1ULL << VIRTIO_RING_F_PACKED)) {
+		addr.desc_user_addr = (uint64_t)(unsigned long)
+			info->vring_packed.desc;
+		addr.avail_user_addr = (uint64_t)(unsigned long)
+			info->vring_packed.driver;
+		addr.used_user_addr = (uint64_t)(unsigned long)
+			info->vring_packed.device;
+	}
 	r = ioctl(dev->control, VHOST_SET_FEATURES, &features);
 	assert(r >= 0);
 	state.num = info->vring.num;
@@ -92,6 +102,7 @@ static void vq_info_add(struct vdev_info *dev, int num)
 	assert(r >= 0);
 	memset(info->ring, 0, vring_size(num, 4096));
 	vring_init(&info->vring, num, info->ring, 4096);
+	vring_packed_init(&info->vring_packed, num, info->ring);
 	info->vq = vring_new_virtqueue(info->vring.num, 4096, &dev->vdev, info->ring,
 				       vq_notify, vq_callback, "test");
 	assert(info->vq);
@@ -151,6 +162,8 @@ static void run_test(struct vdev_info *dev, struct vq_info *vq, int bufs)
 	int r, test = 1;
 	unsigned len;
 	long long spurious = 0;
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
 	r = ioctl(dev->control, VHOST_TEST_RUN, &test);
 	assert(r >= 0);
 	for (;;) {
@@ -188,7 +201,13 @@ static void run_test(struct vdev_info *dev, struct vq_info *vq, int bufs)
 	test = 0;
 	r = ioctl(dev->control, VHOST_TEST_RUN, &test);
 	assert(r >= 0);
+	gettimeofday(&end, NULL);
 	fprintf(stderr, "spurious wakeus: 0x%llx\n", spurious);
+	fprintf(stderr, "%s ring: %d bufs in %ld usec\n",
+		virtio_has_feature(&dev->vdev, VIRTIO_RING_F_PACKED) ?
+		"packed" : "split", bufs,
+		(end.tv_sec - start.tv_sec) * 1000000L +
+		end.tv_usec - start.tv_usec);
 }
 
 const char optstring[] = "h";
@@ -213,6 +232,10 @@ const struct option longopts[] = {
 		.name = "no-indirect",
 		.val = 'i',
 	},
+	{
+		.name = "packed",
+		.val = 'P',
+	},
 	{
 	}
 };
@@ -222,6 +245,7 @@ static void help()
 	fprintf(stderr, "Usage: virtio_test [--help]"
 		" [--no-indirect]"
 		" [--no-event-idx]"
+		" [--packed]"
 		"\n");
 }
 
@@ -249,6 +273,9 @@ int main(int argc, char **argv)
 		case 'i':
 			features &= ~(1ULL << VIRTIO_RING_F_INDIRECT_DESC);
 			break;
+		case 'P':
+			features |= 1ULL << VIRTIO_RING_F_PACKED;
+			break;
 		default:
 			assert(0);
 			break;